@@ -0,0 +1,363 @@
+
+/*========================================================================
+
+   BinLog.c
+
+   Compact binary version of the csv sensor logs.  A csv log entry with the
+   "binary" option also gets each line appended to <name>.bin as a fixed
+   width record: a 16 bit timestamp delta followed by the 16 logged values as
+   16 bit integers scaled to the precision the csv file uses.  A record is 34
+   bytes instead of ~90 characters of text, and reading one back needs no
+   number parsing.
+
+   File layout (all fields little endian):
+     header  "RWXB", u16 version, u16 number of values, u16 record size, 6 bytes unused
+     record  u16 seconds since the previous record, i16 values[BIN_LOG_NUM_VALUES]
+
+   A record with a delta of BIN_LOG_TIME_SYNC carries an absolute unix time
+   in its first two values (low 16 bits, high 16 bits) instead of data.  One
+   is written each time the file is opened for appending, and whenever the
+   gap since the last record won't fit in 16 bits, so the writer never has
+   to read the file back.  Values that are missing or out of range are
+   stored as BIN_LOG_NO_DATA.
+
+   WX_BinLogToCsv() and WX_CsvToBinLog() convert between the two formats
+   (rtl-wx -b runs them from the command line).
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS
+   OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS
+   OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+   OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF OR INABILITY TO USE THIS SOFTWARE, EVEN IF
+   THE COPYRIGHT HOLDERS OR CONTRIBUTORS ARE AWARE OF THE POSSIBILITY OF SUCH DAMAGE.
+
+========================================================================*/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "rtl-wx.h"
+#include "CsvParse.h"
+
+#define BIN_LOG_VERSION 1
+#define BIN_LOG_HEADER_SIZE 16
+#define BIN_LOG_RECORD_SIZE (2 + 2*BIN_LOG_NUM_VALUES)
+#define BIN_LOG_TIME_SYNC 0xffff
+#define BIN_LOG_NO_DATA (-32768)
+
+// The logged values, in the same order as the columns after Time in the csv sensor logs.  Each value is stored
+// multiplied by 10^decimals, where decimals is the number of places the csv file shows.
+static const struct {
+  char *name;
+  int decimals;
+} binLogColumns[BIN_LOG_NUM_VALUES] = {
+  { "efergyWatts", 0 },       { "owlWatts", 0 },          { "fuelGallonsBurned", 2 },
+  { "oduTemp", 1 },           { "oduDewpoint", 1 },       { "iduTemp", 1 },           { "iduDewpoint", 1 },
+  { "ext1Temp", 1 },          { "ext1Dewpoint", 1 },      { "ext2Temp", 1 },          { "ext2Dewpoint", 1 },
+  { "ext3Temp", 1 },          { "ext3Dewpoint", 1 },      { "ext4Temp", 1 },          { "ext4Dewpoint", 1 },
+  { "iduSealevelPressure", 2 }
+};
+static const double binLogScale[] = { 1, 10, 100 };
+
+typedef struct _WX_BinLogFile {
+  char fname[MAX_CONFIG_NAME_SIZE];
+  int fd;                            // -1 when not open
+  unsigned int lastTime;             // Time of the last record written, 0 if a sync record is needed first
+  BOOL errorLogged;
+} WX_BinLogFile;
+
+static WX_BinLogFile binLogFiles[MAX_CONFIG_LIST_SIZE];
+static int numBinLogFiles=0;
+
+static void putU16(unsigned char *p, unsigned int value)
+{
+  p[0] = value & 0xff;
+  p[1] = (value >> 8) & 0xff;
+}
+
+static unsigned int getU16(const unsigned char *p)
+{
+  return(p[0] | (p[1] << 8));
+}
+
+static int scaleValue(double value, int decimals)
+{
+  double scaled = value * binLogScale[decimals];
+
+  if ((scaled != scaled) || (scaled > 32767.0) || (scaled < -32767.0)) // NaN or won't fit
+    return(BIN_LOG_NO_DATA);
+  return((int) ((scaled < 0) ? scaled - 0.5 : scaled + 0.5));
+}
+
+static void buildSyncRecord(unsigned char *rec, unsigned int timet)
+{
+  memset(rec, 0, BIN_LOG_RECORD_SIZE);
+  putU16(rec, BIN_LOG_TIME_SYNC);
+  putU16(rec+2, timet & 0xffff);
+  putU16(rec+4, timet >> 16);
+}
+
+static void buildDataRecord(unsigned char *rec, unsigned int delta, double *values)
+{
+  int i;
+
+  putU16(rec, delta);
+  for (i=0;i<BIN_LOG_NUM_VALUES;i++)
+    putU16(rec + 2 + 2*i, scaleValue(values[i], binLogColumns[i].decimals) & 0xffff);
+}
+
+static int writeAll(int fd, unsigned char *p, int len)
+{
+  int n;
+
+  while (len > 0) {
+    if ((n = write(fd, p, len)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return(-1);
+    }
+    p += n;
+    len -= n;
+  }
+  return(0);
+}
+
+// Build the record(s) for one line: a time sync record first if needed, then the data.  Returns the number of bytes.
+static int buildRecords(unsigned char *rec, unsigned int *lastTimep, unsigned int timet, double *values)
+{
+  int len = 0;
+
+  if ((*lastTimep == 0) || (timet < *lastTimep) || (timet - *lastTimep >= BIN_LOG_TIME_SYNC)) {
+    buildSyncRecord(rec, timet);
+    *lastTimep = timet;
+    len = BIN_LOG_RECORD_SIZE;
+  }
+  buildDataRecord(rec + len, timet - *lastTimep, values);
+  *lastTimep = timet;
+  return(len + BIN_LOG_RECORD_SIZE);
+}
+
+static int writeHeader(int fd)
+{
+  unsigned char header[BIN_LOG_HEADER_SIZE];
+
+  memset(header, 0, sizeof(header));
+  memcpy(header, "RWXB", 4);
+  putU16(header+4, BIN_LOG_VERSION);
+  putU16(header+6, BIN_LOG_NUM_VALUES);
+  putU16(header+8, BIN_LOG_RECORD_SIZE);
+  return(writeAll(fd, header, sizeof(header)));
+}
+
+static WX_BinLogFile *findBinLogFile(char *fname)
+{
+  WX_BinLogFile *bfp;
+  int i;
+
+  for (i=0;i<numBinLogFiles;i++)
+    if (strcmp(binLogFiles[i].fname, fname) == 0)
+      return(&binLogFiles[i]);
+  if (numBinLogFiles >= MAX_CONFIG_LIST_SIZE)
+    return((WX_BinLogFile *) 0);
+  bfp = &binLogFiles[numBinLogFiles++];
+  memset(bfp, 0, sizeof(WX_BinLogFile));
+  strncpy(bfp->fname, fname, MAX_CONFIG_NAME_SIZE-1);
+  bfp->fd = -1;
+  return(bfp);
+}
+
+static void logBinLogError(WX_BinLogFile *bfp, char *what)
+{
+  if (!bfp->errorLogged)
+    DPRINTF("Binary Log: Unable to %s %s (%s)\n", what, bfp->fname, strerror(errno));
+  bfp->errorLogged = TRUE;
+}
+
+// Csv column name of value idx in a record
+char *WX_GetBinLogColumnName(int idx)
+{
+  return(binLogColumns[idx].name);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Name of the binary log kept alongside a csv log: "name.csv" -> "name.bin"
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_GetBinLogName(char *csvName, char *binName)
+{
+  int len = strlen(csvName);
+
+  if ((len > 4) && (strcmp(csvName+len-4, ".csv") == 0))
+    len -= 4;
+  snprintf(binName, MAX_CONFIG_NAME_SIZE, "%.*s.bin", len, csvName);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Append one line of values (BIN_LOG_NUM_VALUES of them, in csv column order) to a binary log.  The file stays
+// open between calls.  Errors are logged once and the record is dropped - the csv log still has it.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_BinLogAppend(char *fname, time_t timet, double *values)
+{
+  unsigned char rec[2*BIN_LOG_RECORD_SIZE];
+  WX_BinLogFile *bfp;
+  struct stat st;
+  int len;
+
+  if ((bfp = findBinLogFile(fname)) == (WX_BinLogFile *) 0)
+    return;
+  if (bfp->fd < 0) {
+    if ((bfp->fd = open(fname, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0) {
+      logBinLogError(bfp, "open");
+      return;
+    }
+    if ((fstat(bfp->fd, &st) != 0) || ((st.st_size == 0) && (writeHeader(bfp->fd) != 0))) {
+      logBinLogError(bfp, "write header to");
+      close(bfp->fd);
+      bfp->fd = -1;
+      return;
+    }
+    bfp->lastTime = 0; // Don't know the time of the last record in the file, so start with a sync record
+  }
+  len = buildRecords(rec, &bfp->lastTime, timet, values);
+  if (writeAll(bfp->fd, rec, len) != 0) {
+    logBinLogError(bfp, "write to");
+    close(bfp->fd);
+    bfp->fd = -1;
+    return;
+  }
+  bfp->errorLogged = FALSE;
+}
+
+void WX_BinLogCloseAll(void)
+{
+  int i;
+
+  for (i=0;i<numBinLogFiles;i++)
+    if (binLogFiles[i].fd >= 0) {
+      fdatasync(binLogFiles[i].fd);
+      close(binLogFiles[i].fd);
+    }
+  numBinLogFiles = 0;
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Write a binary log out as csv text (the same header and number formats as the csv sensor logs, missing values
+// as -99).  Returns 0 on success.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+int WX_BinLogToCsv(char *binName, FILE *out)
+{
+  const unsigned char *data, *rec;
+  unsigned int timet = 0;
+  struct stat st;
+  char line[BIN_LOG_NUM_VALUES*12 + 20];
+  char *p;
+  int fd, i;
+
+  if (((fd = open(binName, O_RDONLY)) < 0) || (fstat(fd, &st) != 0)) {
+    fprintf(stderr, "RTL-Wx: Unable to open %s (%s)\n", binName, strerror(errno));
+    return(-1);
+  }
+  if ((st.st_size < BIN_LOG_HEADER_SIZE) ||
+      ((data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)) {
+    fprintf(stderr, "RTL-Wx: %s is not a binary log\n", binName);
+    close(fd);
+    return(-1);
+  }
+  close(fd);
+  if ((memcmp(data, "RWXB", 4) != 0) || (getU16(data+4) != BIN_LOG_VERSION) ||
+      (getU16(data+6) != BIN_LOG_NUM_VALUES) || (getU16(data+8) != BIN_LOG_RECORD_SIZE)) {
+    fprintf(stderr, "RTL-Wx: %s is not a version %d binary log\n", binName, BIN_LOG_VERSION);
+    munmap((void *) data, st.st_size);
+    return(-1);
+  }
+
+  fprintf(out, "Time");
+  for (i=0;i<BIN_LOG_NUM_VALUES;i++)
+    fprintf(out, ",%s", binLogColumns[i].name);
+  fprintf(out, "\n");
+
+  for (rec = data + BIN_LOG_HEADER_SIZE; rec + BIN_LOG_RECORD_SIZE <= data + st.st_size; rec += BIN_LOG_RECORD_SIZE) {
+    if (getU16(rec) == BIN_LOG_TIME_SYNC) {
+      timet = getU16(rec+2) | (getU16(rec+4) << 16);
+      continue;
+    }
+    timet += getU16(rec);
+    p = WX_CsvPutInt(line, timet, ',');
+    for (i=0;i<BIN_LOG_NUM_VALUES;i++) {
+      int value = (short) getU16(rec + 2 + 2*i);
+      char sep = (i == BIN_LOG_NUM_VALUES-1) ? '\n' : ',';
+      if (value == BIN_LOG_NO_DATA)
+        p = WX_CsvPutInt(p, CSV_NO_DATA_VALUE, sep);
+      else
+        p = WX_CsvPutFixed(p, value / binLogScale[binLogColumns[i].decimals], binLogColumns[i].decimals, sep);
+    }
+    fwrite(line, 1, p - line, out);
+  }
+  munmap((void *) data, st.st_size);
+  return(0);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Build a binary log from a csv sensor log.  Columns are matched by header name, so extra or reordered columns
+// are fine; columns that aren't in the csv file are stored as missing.  Returns 0 on success.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+int WX_CsvToBinLog(char *csvName, char *binName)
+{
+  unsigned char rec[2*BIN_LOG_RECORD_SIZE];
+  const char *data, *p, *end;
+  int columnIdx[BIN_LOG_NUM_VALUES];
+  double values[BIN_LOG_NUM_VALUES];
+  unsigned int lastTime = 0;
+  CSV_Line line;
+  struct stat st;
+  int fd, outfd, i, len, retVal = 0;
+
+  if (((fd = open(csvName, O_RDONLY)) < 0) || (fstat(fd, &st) != 0) || (st.st_size == 0) ||
+      ((data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)) {
+    fprintf(stderr, "RTL-Wx: Unable to read %s\n", csvName);
+    if (fd >= 0)
+      close(fd);
+    return(-1);
+  }
+  close(fd);
+  if (((outfd = open(binName, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) || (writeHeader(outfd) != 0)) {
+    fprintf(stderr, "RTL-Wx: Unable to create %s (%s)\n", binName, strerror(errno));
+    munmap((void *) data, st.st_size);
+    return(-1);
+  }
+
+  end = data + st.st_size;
+  p = CSV_SplitLine(data, end, &line);
+  for (i=0;i<BIN_LOG_NUM_VALUES;i++)
+    columnIdx[i] = CSV_FindField(&line, binLogColumns[i].name);
+  if (columnIdx[BIN_LOG_NUM_VALUES-1] < 0)
+    columnIdx[BIN_LOG_NUM_VALUES-1] = CSV_FindField(&line, "Pressure"); // Name used by older logs
+
+  while ((p < end) && (retVal == 0)) {
+    double timet;
+    p = CSV_SplitLine(p, end, &line);
+    if (!CSV_GetFieldNumber(&line, 0, &timet))
+      continue;
+    for (i=0;i<BIN_LOG_NUM_VALUES;i++)
+      if ((columnIdx[i] < 0) || !CSV_GetFieldNumber(&line, columnIdx[i], &values[i]) ||
+          (values[i] == CSV_NO_DATA_VALUE))
+        values[i] = 0.0/0.0; // NaN is stored as missing
+    len = buildRecords(rec, &lastTime, (unsigned int) timet, values);
+    if (writeAll(outfd, rec, len) != 0) {
+      fprintf(stderr, "RTL-Wx: Unable to write %s (%s)\n", binName, strerror(errno));
+      retVal = -1;
+    }
+  }
+  munmap((void *) data, st.st_size);
+  if (close(outfd) != 0)
+    retVal = -1;
+  return(retVal);
+}
@@ -0,0 +1,689 @@
+
+/*========================================================================
+
+   CmdSocket.c
+
+   Carries commands from the client (rtl-wx -c) and remote command (rtl-wx -r) modes to the server over a
+   Unix domain socket.  This replaces the pair of named pipes in /tmp that were read and written one
+   character at a time.  With the pipes there was no way to tell when the output of a command was
+   complete, so a remote command hung around for a second collecting whatever turned up (every web page
+   hit took at least that long), and only one client could use them at a time.
+
+   Everything sent either way is a frame: a 4 byte length (network byte order) followed by that many
+   bytes.  A request frame holds the command character followed by its argument if it has one (eg. the
+   tag file name for 'p').  The server answers each request with one frame holding all of the output of
+   the command, so a remote command can return as soon as that frame has arrived.  An empty request frame
+   attaches the connection to the server's console output (raw message dumps and the like, see
+   WX_StartCommandServer), which arrives in frames of its own whenever there is some.  Client mode does
+   this so it sees the same output a standalone tty would.
+
+   The server side is run from the main loop.  The listening socket, the connections and the console
+   pipe are kept in an epoll set of their own, whose descriptor the main loop waits on along with
+   everything else.  Output that can't be sent straight away is kept for the connection and sent as the
+   client reads it, so a slow or stuck client never holds up the server.  Nothing more is read from a
+   connection until its output has gone, so a client that sends requests without reading the answers
+   can't make the server keep more than one answer for it.
+
+   Requests are run one at a time for each connection, and each answer goes back to the connection the
+   request came from.  Connections carry a serial number along with their slot, so an answer for a client
+   that has gone away is dropped rather than going to a new client that's been given the same slot.
+   Commands that only show information (see WX_QueueRemoteCommand) are handed to a small pool of worker
+   threads, so a slow one (eg. a render waiting for a tag file pass to finish) doesn't hold up the main
+   loop or the other clients.  The workers hand their output back to the main loop through a pipe in the
+   epoll set, and the main loop sends it, so the connections are only ever touched by the main loop.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS
+   OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS
+   OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+   OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF OR INABILITY TO USE THIS SOFTWARE, EVEN IF
+   THE COPYRIGHT HOLDERS OR CONTRIBUTORS ARE AWARE OF THE POSSIBILITY OF SUCH DAMAGE.
+
+========================================================================*/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include "rtl-wx.h"
+
+#define CMD_MAX_CONNECTIONS    16
+#define CMD_MAX_REQUEST_SIZE   MAX_CONFIG_NAME_SIZE   // Command character and argument (which must fit in WX_RemoteCommand.arg)
+#define CMD_MAX_CONSOLE_BACKLOG (256*1024)                  // Console output is dropped for a client this far behind
+#define CMD_FRAME_HEADER_SIZE  4
+#define CMD_NUM_WORKERS        3
+#define CMD_MAX_QUEUED         CMD_MAX_CONNECTIONS   // Requests handed to the workers and not yet answered
+
+typedef struct _WX_CmdConnection {
+  int fd;                                  // -1 when the slot is free
+  unsigned int serial;                     // Tells this client apart from earlier ones in the same slot
+  BOOL console;                            // Attached to the console output
+  BOOL busy;                               // A request is being run, don't take another one yet
+  uint32_t events;                         // What epoll is watching for on fd
+  char in[CMD_FRAME_HEADER_SIZE + CMD_MAX_REQUEST_SIZE];
+  int inLen;
+  char *out;                               // Output waiting to be sent
+  size_t outLen, outSent;
+} WX_CmdConnection;
+
+static int listenFd = -1;
+static int serverEpollFd = -1;
+static int consoleReadFd = -1;
+static WX_CmdConnection connections[CMD_MAX_CONNECTIONS];
+static int nextConnection = 0;   // Where to start looking for a request, so every connection gets a turn
+static unsigned int nextSerial = 1;
+
+// Worker pool.  Requests wait in workQueue, and the output comes back through doneQueue and a write to the wake pipe.
+typedef struct _WX_CmdResult {
+  WX_RemoteCommand cmd;
+  char *output;
+  size_t len;
+} WX_CmdResult;
+
+static WX_CommandFunc commandFunc = NULL;
+static pthread_t workerThreads[CMD_NUM_WORKERS];
+static int numWorkers = 0;
+static WX_RemoteCommand workQueue[CMD_MAX_QUEUED];
+static int workHead = 0, workCount = 0;
+static WX_CmdResult doneQueue[CMD_MAX_QUEUED];
+static int doneCount = 0;
+static int inFlight = 0;           // Queued, running or done but not yet collected
+static int workersBusy = 0;
+static BOOL stopWorkers = FALSE;
+static pthread_mutex_t workLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workCond = PTHREAD_COND_INITIALIZER;
+static int wakeFds[2] = { -1, -1 };
+
+static unsigned int connectionsAccepted;
+static unsigned int connectionsRefused;
+static unsigned int requestsReceived;
+static unsigned int requestsToWorkers;
+static int mostInFlight;
+
+static void stopCommandWorkers(void);
+
+static void closeConnection(WX_CmdConnection *cp)
+{
+  epoll_ctl(serverEpollFd, EPOLL_CTL_DEL, cp->fd, NULL);
+  close(cp->fd);
+  free(cp->out);
+  memset(cp, 0, sizeof(*cp));
+  cp->fd = -1;
+}
+
+// Watch for output room while there's output waiting, and for input only while there's room for it and no request is
+// being run (otherwise a client that keeps sending would wake the main loop over and over with nothing to do).  Hangups
+// and errors are always reported.
+static void updateConnectionEvents(WX_CmdConnection *cp)
+{
+  struct epoll_event ev;
+  uint32_t events = 0;
+
+  if (cp->outLen != 0)
+    events |= EPOLLOUT;
+  if (!cp->busy && (cp->inLen < (int) sizeof(cp->in)))
+    events |= EPOLLIN;
+  if (events == cp->events)
+    return;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.fd = cp->fd;
+  epoll_ctl(serverEpollFd, EPOLL_CTL_MOD, cp->fd, &ev);
+  cp->events = events;
+}
+
+// Send what's waiting for a connection.  Returns FALSE if the connection had to be closed.
+static BOOL sendPendingOutput(WX_CmdConnection *cp)
+{
+  ssize_t sent;
+
+  while (cp->outSent < cp->outLen) {
+    if ((sent = send(cp->fd, cp->out + cp->outSent, cp->outLen - cp->outSent, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        return(TRUE);   // Still waiting for EPOLLOUT
+      if (errno == EINTR)
+        continue;
+      closeConnection(cp);
+      return(FALSE);
+    }
+    cp->outSent += sent;
+  }
+  free(cp->out);
+  cp->out = NULL;
+  cp->outLen = cp->outSent = 0;
+  updateConnectionEvents(cp);
+  return(TRUE);
+}
+
+// Queue a frame for a connection and send as much of it as the socket will take now
+static void queueFrame(WX_CmdConnection *cp, char *data, size_t len)
+{
+  unsigned char header[CMD_FRAME_HEADER_SIZE];
+  BOOL wasIdle = (cp->outLen == 0);
+  char *newOut;
+
+  header[0] = (len >> 24) & 0xff;
+  header[1] = (len >> 16) & 0xff;
+  header[2] = (len >> 8) & 0xff;
+  header[3] = len & 0xff;
+  if ((newOut = realloc(cp->out, cp->outLen + sizeof(header) + len)) == NULL) {
+    DPRINTF("Command Socket: Out of memory for a %lu byte response, closing the connection\n", (unsigned long) len);
+    closeConnection(cp);
+    return;
+  }
+  cp->out = newOut;
+  memcpy(cp->out + cp->outLen, header, sizeof(header));
+  if (len != 0)
+    memcpy(cp->out + cp->outLen + sizeof(header), data, len);
+  cp->outLen += sizeof(header) + len;
+  if (wasIdle && sendPendingOutput(cp) && (cp->outLen != 0))
+    updateConnectionEvents(cp);
+}
+
+static void acceptConnections(void)
+{
+  int fd, i;
+
+  while ((fd = accept(listenFd, NULL, NULL)) >= 0) {
+    struct epoll_event ev;
+
+    for (i=0;i<CMD_MAX_CONNECTIONS;i++)
+      if (connections[i].fd < 0)
+        break;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if ((i == CMD_MAX_CONNECTIONS) || (epoll_ctl(serverEpollFd, EPOLL_CTL_ADD, fd, &ev) != 0)) {
+      connectionsRefused++;
+      close(fd);
+      continue;
+    }
+    memset(&connections[i], 0, sizeof(connections[i]));
+    connections[i].fd = fd;
+    connections[i].serial = nextSerial++;
+    connections[i].events = EPOLLIN;
+    connectionsAccepted++;
+  }
+}
+
+// Pass the console output on to the attached connections
+static void sendConsoleOutput(void)
+{
+  char buf[4096];
+  ssize_t len;
+  int i;
+
+  while ((len = read(consoleReadFd, buf, sizeof(buf))) > 0)
+    for (i=0;i<CMD_MAX_CONNECTIONS;i++)
+      if ((connections[i].fd >= 0) && connections[i].console &&
+          (connections[i].outLen - connections[i].outSent < CMD_MAX_CONSOLE_BACKLOG))
+        queueFrame(&connections[i], buf, len);
+}
+
+static WX_CmdConnection *findConnection(int fd)
+{
+  int i;
+
+  for (i=0;i<CMD_MAX_CONNECTIONS;i++)
+    if (connections[i].fd == fd)
+      return(&connections[i]);
+  return(NULL);
+}
+
+// Read what's arrived on a connection into its request buffer
+static void readConnection(WX_CmdConnection *cp)
+{
+  ssize_t len;
+
+  if (cp->inLen == sizeof(cp->in))
+    return;   // A whole request is already waiting to be run
+  if ((len = read(cp->fd, cp->in + cp->inLen, sizeof(cp->in) - cp->inLen)) > 0) {
+    cp->inLen += len;
+    updateConnectionEvents(cp);
+  }
+  else if ((len == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)))
+    closeConnection(cp);   // Client has gone
+}
+
+// Take the next whole request out of a connection's buffer.  Returns FALSE if there isn't one yet.
+static BOOL takeRequest(int conn, WX_RemoteCommand *cmdp)
+{
+  WX_CmdConnection *cp = &connections[conn];
+  unsigned char *hp = (unsigned char *) cp->in;
+  uint32_t len;
+
+  while (cp->inLen >= CMD_FRAME_HEADER_SIZE) {
+    len = ((uint32_t) hp[0] << 24) | ((uint32_t) hp[1] << 16) | ((uint32_t) hp[2] << 8) | hp[3];
+    if (len > CMD_MAX_REQUEST_SIZE) {
+      DPRINTF("Command Socket: Request of %u bytes is too long, closing the connection\n", len);
+      closeConnection(cp);
+      return(FALSE);
+    }
+    if ((uint32_t) cp->inLen < CMD_FRAME_HEADER_SIZE + len)
+      return(FALSE);
+    if (len == 0)
+      cp->console = TRUE;
+    else {
+      cmdp->conn = conn;
+      cmdp->serial = cp->serial;
+      cp->busy = TRUE;
+      cmdp->command = cp->in[CMD_FRAME_HEADER_SIZE];
+      memcpy(cmdp->arg, cp->in + CMD_FRAME_HEADER_SIZE + 1, len-1);
+      cmdp->arg[len-1] = 0;
+      requestsReceived++;
+    }
+    cp->inLen -= CMD_FRAME_HEADER_SIZE + len;
+    memmove(cp->in, cp->in + CMD_FRAME_HEADER_SIZE + len, cp->inLen);
+    updateConnectionEvents(cp);
+    if (len != 0)
+      return(TRUE);
+  }
+  return(FALSE);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Start listening for clients on WX_COMMAND_SOCKET_PATH.  Returns the stream to use for the server's console output
+// (outputfd), which is passed on to any clients attached to it, or NULL if the server can't be started.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+FILE *WX_StartCommandServer(void)
+{
+  struct sockaddr_un addr;
+  struct epoll_event ev;
+  int consoleFds[2], i;
+  FILE *consolefd;
+
+  for (i=0;i<CMD_MAX_CONNECTIONS;i++)
+    connections[i].fd = -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, WX_COMMAND_SOCKET_PATH, sizeof(addr.sun_path)-1);
+  remove(WX_COMMAND_SOCKET_PATH);   // Left behind by a server that didn't shut down cleanly
+  if (((listenFd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) ||
+      (bind(listenFd, (struct sockaddr *) &addr, sizeof(addr)) != 0) ||
+      (listen(listenFd, CMD_MAX_CONNECTIONS) != 0)) {
+    DPRINTF("Command Socket: Unable to listen on %s (%s)\n", WX_COMMAND_SOCKET_PATH, strerror(errno));
+    return(NULL);
+  }
+  fcntl(listenFd, F_SETFD, FD_CLOEXEC);
+  fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+
+  // Console output is written to a pipe so it can come from any thread (the receiver thread writes the raw message
+  // dumps).  It's line buffered so each line is passed on as soon as it's written.  If nobody reads it fast enough
+  // the writes fail and the output is lost, just as it was when nobody was reading the old server pipe.
+  if ((pipe(consoleFds) != 0) || ((consolefd = fdopen(consoleFds[1], "w")) == NULL)) {
+    DPRINTF("Command Socket: Unable to create the console pipe (%s)\n", strerror(errno));
+    return(NULL);
+  }
+  consoleReadFd = consoleFds[0];
+  for (i=0;i<2;i++) {
+    fcntl(consoleFds[i], F_SETFD, FD_CLOEXEC);
+    fcntl(consoleFds[i], F_SETFL, fcntl(consoleFds[i], F_GETFL) | O_NONBLOCK);
+  }
+  setvbuf(consolefd, NULL, _IOLBF, 0);
+
+  if ((serverEpollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    DPRINTF("Command Socket: Unable to create epoll set (%s)\n", strerror(errno));
+    return(NULL);
+  }
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = listenFd;
+  epoll_ctl(serverEpollFd, EPOLL_CTL_ADD, listenFd, &ev);
+  ev.data.fd = consoleReadFd;
+  epoll_ctl(serverEpollFd, EPOLL_CTL_ADD, consoleReadFd, &ev);
+  return(consolefd);
+}
+
+void WX_StopCommandServer(void)
+{
+  int i;
+
+  stopCommandWorkers();
+  for (i=0;i<CMD_MAX_CONNECTIONS;i++)
+    if (connections[i].fd >= 0)
+      closeConnection(&connections[i]);
+  if (listenFd >= 0) {
+    close(listenFd);
+    remove(WX_COMMAND_SOCKET_PATH);
+  }
+  if (serverEpollFd >= 0)
+    close(serverEpollFd);
+  if (consoleReadFd >= 0)
+    close(consoleReadFd);
+  listenFd = serverEpollFd = consoleReadFd = -1;
+}
+
+// Send the output the workers have finished with back to the clients
+static void collectWorkerOutput(void)
+{
+  WX_CmdResult results[CMD_MAX_QUEUED];
+  char buf[64];
+  int i, n;
+
+  while (read(wakeFds[0], buf, sizeof(buf)) > 0)
+    ;
+  pthread_mutex_lock(&workLock);
+  n = doneCount;
+  memcpy(results, doneQueue, n * sizeof(results[0]));
+  doneCount = 0;
+  inFlight -= n;
+  pthread_mutex_unlock(&workLock);
+  for (i=0;i<n;i++) {
+    WX_SendRemoteResponse(&results[i].cmd, results[i].output, results[i].len);
+    free(results[i].output);
+  }
+}
+
+static void *commandWorkerThread(void *param)
+{
+  WX_RemoteCommand cmd;
+  char *output;
+  size_t len;
+  FILE *fd;
+
+  pthread_mutex_lock(&workLock);
+  for (;;) {
+    while ((workCount == 0) && !stopWorkers)
+      pthread_cond_wait(&workCond, &workLock);
+    if (workCount == 0)
+      break;
+    cmd = workQueue[workHead];
+    workHead = (workHead + 1) % CMD_MAX_QUEUED;
+    workCount--;
+    workersBusy++;
+    pthread_mutex_unlock(&workLock);
+
+    output = NULL;
+    len = 0;
+    if ((fd = open_memstream(&output, &len)) != NULL) {
+      commandFunc(&cmd, fd);
+      fclose(fd);
+    }
+
+    pthread_mutex_lock(&workLock);
+    workersBusy--;
+    doneQueue[doneCount].cmd = cmd;
+    doneQueue[doneCount].output = output;
+    doneQueue[doneCount].len = len;
+    doneCount++;
+    write(wakeFds[1], "", 1);
+  }
+  pthread_mutex_unlock(&workLock);
+  return NULL;
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Start the worker threads that run requests given to WX_QueueRemoteCommand(), using func to run them.  If they can't be
+// started, every request is run by the main loop.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_StartCommandWorkers(WX_CommandFunc func)
+{
+  struct epoll_event ev;
+  int i;
+
+  if ((numWorkers > 0) || (serverEpollFd < 0))
+    return;
+  if (pipe(wakeFds) != 0) {
+    DPRINTF("Command Socket: Unable to create worker pipe (%s), commands will be run by the main loop\n", strerror(errno));
+    return;
+  }
+  for (i=0;i<2;i++) {
+    fcntl(wakeFds[i], F_SETFD, FD_CLOEXEC);
+    fcntl(wakeFds[i], F_SETFL, fcntl(wakeFds[i], F_GETFL) | O_NONBLOCK);
+  }
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = wakeFds[0];
+  epoll_ctl(serverEpollFd, EPOLL_CTL_ADD, wakeFds[0], &ev);
+
+  commandFunc = func;
+  stopWorkers = FALSE;
+  for (i=0;i<CMD_NUM_WORKERS;i++) {
+    if (pthread_create(&workerThreads[numWorkers], NULL, commandWorkerThread, NULL) != 0) {
+      DPRINTF("Command Socket: Unable to create worker thread (%s)\n", strerror(errno));
+      break;
+    }
+    numWorkers++;
+  }
+}
+
+// Finish the requests the workers have been given and stop them (used at shutdown)
+static void stopCommandWorkers(void)
+{
+  int i;
+
+  if (numWorkers == 0)
+    return;
+  pthread_mutex_lock(&workLock);
+  stopWorkers = TRUE;
+  pthread_cond_broadcast(&workCond);
+  pthread_mutex_unlock(&workLock);
+  for (i=0;i<numWorkers;i++)
+    pthread_join(workerThreads[i], NULL);
+  numWorkers = 0;
+  for (i=0;i<doneCount;i++)
+    free(doneQueue[i].output);
+  doneCount = inFlight = 0;
+  close(wakeFds[0]);
+  close(wakeFds[1]);
+  wakeFds[0] = wakeFds[1] = -1;
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Hand a request from WX_GetRemoteCommand() to the workers instead of running it.  Only for commands that just show
+// information, the ones that change things are run by the main loop.  Returns FALSE if there are no workers or too
+// many requests are already waiting for them, in which case the caller runs it.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+BOOL WX_QueueRemoteCommand(WX_RemoteCommand *cmdp)
+{
+  if (numWorkers == 0)
+    return(FALSE);
+  pthread_mutex_lock(&workLock);
+  if (inFlight >= CMD_MAX_QUEUED) {
+    pthread_mutex_unlock(&workLock);
+    return(FALSE);
+  }
+  workQueue[(workHead + workCount) % CMD_MAX_QUEUED] = *cmdp;
+  workCount++;
+  inFlight++;
+  if (inFlight > mostInFlight)
+    mostInFlight = inFlight;
+  requestsToWorkers++;
+  pthread_cond_signal(&workCond);
+  pthread_mutex_unlock(&workLock);
+  return(TRUE);
+}
+
+// Descriptor that becomes readable when there's something for WX_GetRemoteCommand() to do
+int WX_GetCommandServerFd(void)
+{
+  return(serverEpollFd);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Deal with new connections, arriving requests, waiting output and console output, then return the next request to run.
+// Returns FALSE when there isn't one.  Doesn't wait.  The request must be given to WX_QueueRemoteCommand(), or run and its
+// output given to WX_SendRemoteResponse(), before the connection it came from gets another turn.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+BOOL WX_GetRemoteCommand(WX_RemoteCommand *cmdp)
+{
+  struct epoll_event events[CMD_MAX_CONNECTIONS + 3];
+  WX_CmdConnection *cp;
+  int i, n, conn;
+
+  if (serverEpollFd < 0)
+    return(FALSE);
+  n = epoll_wait(serverEpollFd, events, CMD_MAX_CONNECTIONS + 3, 0);
+  for (i=0;i<n;i++) {
+    if (events[i].data.fd == listenFd)
+      acceptConnections();
+    else if (events[i].data.fd == consoleReadFd)
+      sendConsoleOutput();
+    else if (events[i].data.fd == wakeFds[0])
+      collectWorkerOutput();
+    else if ((cp = findConnection(events[i].data.fd)) != NULL) {
+      if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+        closeConnection(cp);   // Client has gone, there's nobody to send a response to
+        continue;
+      }
+      if ((events[i].events & EPOLLOUT) && !sendPendingOutput(cp))
+        continue;
+      if (events[i].events & EPOLLIN)
+        readConnection(cp);
+    }
+  }
+
+  for (i=0;i<CMD_MAX_CONNECTIONS;i++) {
+    conn = (nextConnection + i) % CMD_MAX_CONNECTIONS;
+    if ((connections[conn].fd >= 0) && !connections[conn].busy && (connections[conn].outLen == 0) && takeRequest(conn, cmdp)) {
+      nextConnection = (conn + 1) % CMD_MAX_CONNECTIONS;
+      return(TRUE);
+    }
+  }
+  return(FALSE);
+}
+
+// Send the output of a command back to the connection it came from (if it's still there)
+void WX_SendRemoteResponse(WX_RemoteCommand *cmdp, char *output, size_t len)
+{
+  WX_CmdConnection *cp = &connections[cmdp->conn];
+
+  if ((cp->fd >= 0) && (cp->serial == cmdp->serial)) {
+    cp->busy = FALSE;
+    queueFrame(cp, output, len);
+    if (cp->fd >= 0)
+      updateConnectionEvents(cp);  // Input is watched again
+  }
+}
+
+void WX_DumpCommandServerInfo(FILE *fd)
+{
+  int i, open = 0, console = 0;
+
+  if (listenFd < 0) {
+    fprintf(fd, "\nCommand Socket: not running\n");
+    return;
+  }
+  for (i=0;i<CMD_MAX_CONNECTIONS;i++)
+    if (connections[i].fd >= 0) {
+      open++;
+      if (connections[i].console)
+        console++;
+    }
+  fprintf(fd, "\nCommand Socket: %d connection(s) open (%d attached to the console), %u accepted, %u refused, %u request(s)\n",
+          open, console, connectionsAccepted, connectionsRefused, requestsReceived);
+  pthread_mutex_lock(&workLock);
+  fprintf(fd, "                %d worker(s), %d busy, %d request(s) waiting (most %d of %d), %u run by the workers\n",
+          numWorkers, workersBusy, workCount, mostInFlight, CMD_MAX_QUEUED, requestsToWorkers);
+  pthread_mutex_unlock(&workLock);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Client side.  Connect to the server, returning the socket or -1.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+int WX_ConnectToServer(void)
+{
+  struct sockaddr_un addr;
+  int sock;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, WX_COMMAND_SOCKET_PATH, sizeof(addr.sun_path)-1);
+  if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return(-1);
+  if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    close(sock);
+    return(-1);
+  }
+  return(sock);
+}
+
+static int writeAll(int sock, char *data, size_t len)
+{
+  ssize_t sent;
+
+  while (len > 0) {
+    if ((sent = send(sock, data, len, MSG_NOSIGNAL)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return(-1);
+    }
+    data += sent;
+    len -= sent;
+  }
+  return(0);
+}
+
+static int readAll(int sock, char *data, size_t len)
+{
+  ssize_t got;
+
+  while (len > 0) {
+    if ((got = read(sock, data, len)) <= 0) {
+      if ((got < 0) && (errno == EINTR))
+        continue;
+      return(-1);
+    }
+    data += got;
+    len -= got;
+  }
+  return(0);
+}
+
+// Send a request.  A command of 0 attaches the connection to the server's console output.  Returns 0, or -1 on error.
+int WX_SendCommandRequest(int sock, char command, char *arg)
+{
+  char frame[CMD_FRAME_HEADER_SIZE + CMD_MAX_REQUEST_SIZE];
+  size_t len = 0;
+
+  if (command != 0) {
+    frame[CMD_FRAME_HEADER_SIZE] = command;
+    len = 1;
+    if (arg != NULL) {
+      if (strlen(arg) > CMD_MAX_REQUEST_SIZE - 1)
+        return(-1);
+      memcpy(frame + CMD_FRAME_HEADER_SIZE + 1, arg, strlen(arg));
+      len += strlen(arg);
+    }
+  }
+  frame[0] = frame[1] = 0;   // Requests are never longer than 64K
+  frame[2] = (len >> 8) & 0xff;
+  frame[3] = len & 0xff;
+  return(writeAll(sock, frame, CMD_FRAME_HEADER_SIZE + len));
+}
+
+// Read one frame from the server and write what's in it to out.  Returns 0, or -1 if the server has gone away (or
+// the socket's receive timeout ran out).
+int WX_ReadCommandResponse(int sock, FILE *out)
+{
+  unsigned char header[CMD_FRAME_HEADER_SIZE];
+  char buf[4096];
+  uint32_t len, chunk;
+
+  if (readAll(sock, (char *) header, sizeof(header)) != 0)
+    return(-1);
+  len = ((uint32_t) header[0] << 24) | ((uint32_t) header[1] << 16) | ((uint32_t) header[2] << 8) | header[3];
+  while (len > 0) {
+    chunk = (len < sizeof(buf)) ? len : sizeof(buf);
+    if (readAll(sock, buf, chunk) != 0)
+      return(-1);
+    fwrite(buf, 1, chunk, out);
+    len -= chunk;
+  }
+  fflush(out);
+  return(0);
+}
@@ -23,6 +23,8 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include "rtl-wx.h"
 
 // define global configuration settings structure
@@ -33,18 +35,164 @@ WX_ConfigSettings WxConfig;
 static int processNumericVar(char *buf,char *matchStr, int *varp);
 static int processFloatVar(char *buf,char *matchStr, float *varp);
 static int processStringVar(char *buf,char *matchStr, char *destStr);
-static int processExtSensorNames(char *buf, WX_ConfigSettings *cVarp);
 static int processftpFilename(char *buf, WX_ConfigSettings *cVarp);
 static int processTagProcFilename(char *buf, WX_ConfigSettings *cVarp);
 static int processMailMsgConfig(char *buf, WX_ConfigSettings *cVarp);
 static int processRealtimeCsvFileInfo(char *buf, WX_ConfigSettings *cVarp);
 static int processCsvFileInfo(char *buf, WX_ConfigSettings *cVarp);
+static int processCsvColumnLine(char *buf, WX_ConfigSettings *cVarp);
+static int processRealtimeCsvColumnLine(char *buf, WX_ConfigSettings *cVarp);
+static int processCsvColumn(char *buf, char *varName, WX_CsvColumn *columns, int *numColumnsp);
+
+//-----------------------------------------------------------------------------------------------------------------------------------------------------
+// Table of the settings that can be used in the configuration file, looked up with a binary search on the name at
+// the start of each line (up to the '=' or the first space).  KEEP IT SORTED BY NAME (strcmp order).
+// List settings (tagFile, csvFile...) are handled by their own routine, after checking there's room for another entry.
+//-----------------------------------------------------------------------------------------------------------------------------------------------------
+typedef enum _ConfVarType {
+ CONF_INT = 0,
+ CONF_FLOAT,
+ CONF_STRING,
+ CONF_LINE
+} ConfVarType;
+
+typedef int (*ConfLineFunc)(char *buf, WX_ConfigSettings *cVarp);
+
+typedef struct _ConfVarDef {
+ char *name;
+ ConfVarType type;
+ size_t offset;               // Where the setting is in WX_ConfigSettings (for CONF_LINE, the entry count or 0)
+ ConfLineFunc process;        // CONF_LINE only
+ int maxCount;                // CONF_LINE lists only
+} ConfVarDef;
+
+#define CONF_VAR(name, type, member)       { name, type, offsetof(WX_ConfigSettings, member), NULL, 0 }
+#define CONF_LIST(name, func, count, max)  { name, CONF_LINE, offsetof(WX_ConfigSettings, count), func, max }
+
+static const ConfVarDef confVarDefs[] = {
+ CONF_VAR("altitudeInFeet",               CONF_INT,    altitudeInFeet),
+ CONF_VAR("configFileReadFrequency",      CONF_INT,    configFileReadFrequency),
+ CONF_VAR("csvBatchLines",                CONF_INT,    csvBatchLines),
+ { "csvColumn",                           CONF_LINE,   0, processCsvColumnLine, 0 },
+ CONF_LIST("csvFile",                     processCsvFileInfo, numCsvFilesToUpdate, MAX_CONFIG_LIST_SIZE),
+ CONF_VAR("csvSyncLines",                 CONF_INT,    csvSyncLines),
+ CONF_VAR("csvSyncMinutes",               CONF_INT,    csvSyncMinutes),
+ CONF_VAR("dataSnapshotFrequency",        CONF_INT,    dataSnapshotFrequency),
+ CONF_VAR("ext10SensorName",              CONF_STRING, extNameStrings[9]),
+ CONF_VAR("ext1SensorName",               CONF_STRING, extNameStrings[0]),
+ CONF_VAR("ext2SensorName",               CONF_STRING, extNameStrings[1]),
+ CONF_VAR("ext3SensorName",               CONF_STRING, extNameStrings[2]),
+ CONF_VAR("ext4SensorName",               CONF_STRING, extNameStrings[3]),
+ CONF_VAR("ext5SensorName",               CONF_STRING, extNameStrings[4]),
+ CONF_VAR("ext6SensorName",               CONF_STRING, extNameStrings[5]),
+ CONF_VAR("ext7SensorName",               CONF_STRING, extNameStrings[6]),
+ CONF_VAR("ext8SensorName",               CONF_STRING, extNameStrings[7]),
+ CONF_VAR("ext9SensorName",               CONF_STRING, extNameStrings[8]),
+ CONF_LIST("ftpFile",                     processftpFilename, numFilesToFtp, MAX_CONFIG_LIST_SIZE),
+ CONF_VAR("ftpServerHostname",            CONF_STRING, ftpServerHostname),
+ CONF_VAR("ftpServerPassword",            CONF_STRING, ftpServerPassword),
+ CONF_VAR("ftpServerUsername",            CONF_STRING, ftpServerUsername),
+ CONF_VAR("ftpUploadFrequency",           CONF_INT,    ftpUploadFrequency),
+ CONF_VAR("fuelBurnerGallonsPerHour",     CONF_FLOAT,  fuelBurnerGallonsPerHour),
+ CONF_VAR("fuelBurnerOnWattageThreshold", CONF_INT,    fuelBurnerOnWattageThreshold),
+ CONF_VAR("historyFile",                  CONF_STRING, historyFile),
+ CONF_VAR("historyRecords",               CONF_INT,    historyRecords),
+ CONF_VAR("iduSensorName",                CONF_STRING, iduNameString),
+ CONF_LIST("mailMessage",                 processMailMsgConfig, numMailMsgsToSend, MAX_CONFIG_LIST_SIZE),
+ CONF_VAR("mailServerHostname",           CONF_STRING, mailServerHostname),
+ CONF_VAR("mailServerPassword",           CONF_STRING, mailServerPassword),
+ CONF_VAR("mailServerUsername",           CONF_STRING, mailServerUsername),
+ CONF_VAR("oduSensorName",                CONF_STRING, oduNameString),
+ CONF_VAR("rainDataSnapshotFrequency",    CONF_INT,    rainDataSnapshotFrequency),
+ { "realtimeCsvColumn",                   CONF_LINE,   0, processRealtimeCsvColumnLine, 0 },
+ { "realtimeCsvFile",                     CONF_LINE,   0, processRealtimeCsvFileInfo, 0 },
+ CONF_VAR("sensorLockingEnabled",         CONF_INT,    sensorLockingEnabled),
+ CONF_LIST("tagFile",                     processTagProcFilename, NumTagFilesToParse, MAX_CONFIG_LIST_SIZE),
+ CONF_VAR("tagFileParseFrequency",        CONF_INT,    tagFileParseFrequency),
+ CONF_VAR("tagFileSkipUnchanged",         CONF_INT,    tagFileSkipUnchanged),
+ CONF_VAR("webcamSnapshotFrequency",      CONF_INT,    webcamSnapshotFrequency)
+};
+#define NUM_CONF_VAR_DEFS ((int) (sizeof(confVarDefs)/sizeof(confVarDefs[0])))
+
+static const ConfVarDef *lookupConfVar(char *name)
+{
+  int low = 0, high = NUM_CONF_VAR_DEFS-1, mid, cmp;
+
+  while (low <= high) {
+    mid = (low + high)/2;
+    if ((cmp = strcmp(name, confVarDefs[mid].name)) == 0)
+      return(&confVarDefs[mid]);
+    if (cmp < 0)
+      high = mid - 1;
+    else
+      low = mid + 1;
+  }
+  return(NULL);
+}
+
+// Look up the name at the start of the line and hand the line to the routine for that kind of setting
+static void processConfigLine(char *buf, WX_ConfigSettings *cVarp)
+{
+  char name[MAX_CONFIG_NAME_SIZE];
+  const ConfVarDef *defp;
+  char *setting;
+  int len = strcspn(buf, "= \t\r\n");
+
+  if ((len == 0) || (len >= MAX_CONFIG_NAME_SIZE))
+    return;
+  memcpy(name, buf, len);
+  name[len] = 0;
+  if ((defp = lookupConfVar(name)) == NULL)
+    return;
+
+  setting = (char *) cVarp + defp->offset;
+  switch (defp->type) {
+    case CONF_INT:    processNumericVar(buf, defp->name, (int *) setting); break;
+    case CONF_FLOAT:  processFloatVar(buf, defp->name, (float *) setting); break;
+    case CONF_STRING: processStringVar(buf, defp->name, setting); break;
+    case CONF_LINE:
+      if ((defp->maxCount > 0) && (*(int *) setting >= defp->maxCount)) {
+        DPRINTF("Config file: Too many %s lines, ignoring: %s", defp->name, buf);
+      }
+      else
+        defp->process(buf, cVarp);
+      break;
+  }
+}
+
+// Negative intervals are logged and turned off rather than left for the scheduler to trip over
+static void validateConfigSettings(WX_ConfigSettings *cVarp)
+{
+  static const struct { char *name; size_t offset; } intervals[] = {
+    { "configFileReadFrequency",   offsetof(WX_ConfigSettings, configFileReadFrequency) },
+    { "dataSnapshotFrequency",     offsetof(WX_ConfigSettings, dataSnapshotFrequency) },
+    { "rainDataSnapshotFrequency", offsetof(WX_ConfigSettings, rainDataSnapshotFrequency) },
+    { "tagFileParseFrequency",     offsetof(WX_ConfigSettings, tagFileParseFrequency) },
+    { "webcamSnapshotFrequency",   offsetof(WX_ConfigSettings, webcamSnapshotFrequency) },
+    { "ftpUploadFrequency",        offsetof(WX_ConfigSettings, ftpUploadFrequency) },
+    { "csvSyncLines",              offsetof(WX_ConfigSettings, csvSyncLines) },
+    { "csvSyncMinutes",            offsetof(WX_ConfigSettings, csvSyncMinutes) }
+  };
+  int i, *valuep;
+
+  for (i=0;i<(int) (sizeof(intervals)/sizeof(intervals[0]));i++) {
+    valuep = (int *) ((char *) cVarp + intervals[i].offset);
+    if (*valuep < 0) {
+      DPRINTF("Config file: %s=%d is negative, using 0\n", intervals[i].name, *valuep);
+      *valuep = 0;
+    }
+  }
+}
 
 /*-----------------------------------------------------------------------------------------------------------------------------------------------------
   WX_ProcessConfFile()
  
   This function reads program configuration data from a text file.
   See the file SlugWx.conf for a complete listing of supported configuration options.
+
+  Every setting in *cVarp is set, either from the file or to its default, so a re-read should be done into a separate
+  struct and copied over the live settings (under the shared data lock) once it's done.  Returns 1 if the file
+  couldn't be opened, leaving *cVarp with the defaults.
 ------------------------------------------------------------------------------------------------------------------------------------------------------*/
 
 int WX_processConfigSettingsFile(char *inFname, WX_ConfigSettings *cVarp)
@@ -52,92 +200,28 @@ int WX_processConfigSettingsFile(char *inFname, WX_ConfigSettings *cVarp)
  FILE *infd;
  char rdBuf[READ_BUFSIZE];
 
- // These settings are reset before each read of the configuration file.
- cVarp->tagFileParseFrequency=0; 
- cVarp->configFileReadFrequency=0; // 15 minutes
+ // Settings that aren't in the file are 0 apart from these
+ memset(cVarp, 0, sizeof(WX_ConfigSettings));
  cVarp->dataSnapshotFrequency=15;
- cVarp->rainDataSnapshotFrequency=0;
-
- cVarp->fuelBurnerOnWattageThreshold=0;
  cVarp->fuelBurnerGallonsPerHour=1;
- 
- cVarp->webcamSnapshotFrequency=0;
- 
- cVarp->realtimeCsvWriteFrequency=0;
- cVarp->realtimeCsvFile[0]=0;
- 
- cVarp->numCsvFilesToUpdate=0;
- cVarp->NumTagFilesToParse=0;
- cVarp->ftpUploadFrequency=0;
- cVarp->ftpServerHostname[0]=0;
- cVarp->ftpServerUsername[0]=0;
- cVarp->ftpServerPassword[0]=0;
- cVarp->numFilesToFtp = 0;
- cVarp->mailServerHostname[0]=0;
- cVarp->mailServerUsername[0]=0;
- cVarp->mailServerPassword[0]=0;
- cVarp->numMailMsgsToSend = 0; 
- cVarp->mailSendFrequency = 0; 
-
- cVarp->iduNameString[0]=0;
- cVarp->oduNameString[0]=0;
- { 
-   int i; for (i=0;i<=MAX_SENSOR_CHANNEL_INDEX;i++) cVarp->extNameStrings[i][0]=0; 
- }
+ cVarp->historyRecords=WX_NUM_RECORDS_TO_STORE;
+ cVarp->csvBatchLines=1;
   
  if ((infd = fopen(inFname, "r")) == NULL) {
   DPRINTF("Config Processor was unable to open %s for reading.\n",inFname);
   return(1);
  }
 
- // Read each line in the file and process the tags on that line.
+ // Read each line in the file and process the setting on that line.
  while (fgets(rdBuf, READ_BUFSIZE, infd) != NULL)
-  {
-  if ((rdBuf[0] != ';') && (rdBuf[0] != '[')) { 
-   if (processNumericVar(rdBuf,"sensorLockingEnabled", &cVarp->sensorLockingEnabled)) {}
-   else if (processNumericVar(rdBuf,"altitudeInFeet", &cVarp->altitudeInFeet)) {}
-   else if (processNumericVar(rdBuf,"fuelBurnerOnWattageThreshold", &cVarp->fuelBurnerOnWattageThreshold)) {}
-   else if (processFloatVar(rdBuf,"fuelBurnerGallonsPerHour", &cVarp->fuelBurnerGallonsPerHour)) {}
-   else if (processNumericVar(rdBuf,"dataSnapshotFrequency", &cVarp->dataSnapshotFrequency)) {}
-   else if (processNumericVar(rdBuf,"ftpUploadFrequency", &cVarp->ftpUploadFrequency)) {}
-   else if (processNumericVar(rdBuf,"tagFileParseFrequency", &cVarp->tagFileParseFrequency)) {}
-   else if (processNumericVar(rdBuf,"webcamSnapshotFrequency", &cVarp->webcamSnapshotFrequency)) {}
-   else if (processNumericVar(rdBuf,"configFileReadFrequency", &cVarp->configFileReadFrequency)) {}
-   else if (processNumericVar(rdBuf,"dataSnapshotFrequency", &cVarp->dataSnapshotFrequency)) {}
-   else if (processNumericVar(rdBuf,"rainDataSnapshotFrequency", &cVarp->rainDataSnapshotFrequency)) {}
-   else if (processStringVar(rdBuf,"ftpServerHostname", cVarp->ftpServerHostname)) {}
-   else if (processStringVar(rdBuf,"ftpServerUsername", cVarp->ftpServerUsername)) {}
-   else if (processStringVar(rdBuf,"ftpServerPassword", cVarp->ftpServerPassword)) {}
-   else if (processStringVar(rdBuf,"mailServerHostname", cVarp->mailServerHostname)) {}
-   else if (processStringVar(rdBuf,"mailServerUsername", cVarp->mailServerUsername)) {}
-   else if (processStringVar(rdBuf,"mailServerPassword", cVarp->mailServerPassword)) {}
-   else if (processStringVar(rdBuf,"iduSensorName", cVarp->iduNameString)) {}
-   else if (processStringVar(rdBuf,"oduSensorName", cVarp->oduNameString)) {}
-   else if (processExtSensorNames(rdBuf, cVarp)) {}
-   else if (processMailMsgConfig(rdBuf,cVarp)) {}
-   else if (processftpFilename(rdBuf,cVarp)) {}
-   else if (processTagProcFilename(rdBuf,cVarp)) {}
-   else if (processRealtimeCsvFileInfo(rdBuf,cVarp)) {}
-   else if (processCsvFileInfo(rdBuf,cVarp)) {}
-  }
- }
+  if ((rdBuf[0] != ';') && (rdBuf[0] != '['))
+   processConfigLine(rdBuf, cVarp);
  fclose(infd);
 
+ validateConfigSettings(cVarp);
  return(0);
 }
 
-int processExtSensorNames(char *buf, WX_ConfigSettings *cVarp) {
-  char tagSearchName[80];
-  int sensorIdx;
-  
-  for (sensorIdx=0;sensorIdx<=MAX_SENSOR_CHANNEL_INDEX;sensorIdx++) {
-   sprintf(tagSearchName, "ext%dSensorName", sensorIdx+1);
-   if (processStringVar(buf, tagSearchName, cVarp->extNameStrings[sensorIdx]))
-     return 1;
-  }
-  return 0;
-}
-   
 // Process a config file line with a single string var  on it
 // Must be of the form 'StringVar=str' with no spaces or special characters before the '='.  After the = whitespace is treated
 // as part of the string. 
@@ -302,12 +386,19 @@ int processRealtimeCsvFileInfo(char *buf, WX_ConfigSettings *cVarp)
      minutesStr[j++] = buf[i++];
    minutesStr[j] = 0;
    
+   // A trailing 's' (eg. "30s") gives the interval in seconds rather than minutes
+   int secondsBetweenUpdates = 0;
    int minutesBetweenUpdates = atoi(minutesStr);
    if (minutesBetweenUpdates < 0)
       minutesBetweenUpdates = 0;
+   if ((j > 0) && ((minutesStr[j-1] == 's') || (minutesStr[j-1] == 'S'))) {
+      secondsBetweenUpdates = minutesBetweenUpdates;
+      minutesBetweenUpdates = 0;
+   }
    
-   if ((fname[0] != 0) && (minutesBetweenUpdates != 0)) {
+   if ((fname[0] != 0) && ((minutesBetweenUpdates != 0) || (secondsBetweenUpdates != 0))) {
     cVarp->realtimeCsvWriteFrequency = minutesBetweenUpdates;
+    cVarp->realtimeCsvWriteSeconds = secondsBetweenUpdates;
     retVal = 1;
    }
    else
@@ -344,6 +435,23 @@ int processCsvFileInfo(char *buf, WX_ConfigSettings *cVarp)
           (buf[i] != '\n') && (buf[i] != 0) && (i < READ_BUFSIZE))
      snapshotStr[j++] = buf[i++];
    snapshotStr[j] = 0;
+   
+   // Options may follow the snapshot count: "monthly" splits the file into monthly segments and "binary" also
+   // keeps a binary copy of the log
+   cVarp->csvFiles[cVarp->numCsvFilesToUpdate].rotateMonthly = FALSE;
+   cVarp->csvFiles[cVarp->numCsvFilesToUpdate].binaryLog = FALSE;
+   while ((buf[i] != '\r') && (buf[i] != '\n') && (buf[i] != 0) && (i < READ_BUFSIZE)) {
+     if (strncmp("monthly", &buf[i], 7) == 0)
+       cVarp->csvFiles[cVarp->numCsvFilesToUpdate].rotateMonthly = TRUE;
+     else if (strncmp("binary", &buf[i], 6) == 0)
+       cVarp->csvFiles[cVarp->numCsvFilesToUpdate].binaryLog = TRUE;
+     // skip over this word and any whitespace after it
+     while ((buf[i] != ' ') && (buf[i] != '\t') && (buf[i] != '\r') &&
+            (buf[i] != '\n') && (buf[i] != 0) && (i < READ_BUFSIZE))
+       i++;
+     while (((buf[i] == ' ') || (buf[i] == '\t')) && (i < READ_BUFSIZE))
+       i++;
+   }
    int snapshotsBetweenUpdates = atoi(snapshotStr);
    if (snapshotsBetweenUpdates > 96)
       snapshotsBetweenUpdates = 0;
@@ -360,6 +468,31 @@ int processCsvFileInfo(char *buf, WX_ConfigSettings *cVarp)
   }
   return(retVal);
 }
+static int processCsvColumnLine(char *buf, WX_ConfigSettings *cVarp)
+{
+  return(processCsvColumn(buf, "csvColumn", cVarp->csvColumns, &cVarp->numCsvColumns));
+}
+static int processRealtimeCsvColumnLine(char *buf, WX_ConfigSettings *cVarp)
+{
+  return(processCsvColumn(buf, "realtimeCsvColumn", cVarp->realtimeCsvColumns, &cVarp->numRealtimeCsvColumns));
+}
+// Compile a "<varName> <name> <source> [options]" line into the next column of the list
+int processCsvColumn(char *buf, char *varName, WX_CsvColumn *columns, int *numColumnsp)
+{
+  int len = strlen(varName);
+
+  if ((strncmp(varName, buf, len) != 0) || ((buf[len] != ' ') && (buf[len] != '\t')))
+    return(0);
+  if (*numColumnsp >= WX_MAX_CSV_COLUMNS) {
+    DPRINTF("Config file: Too many %s lines, ignoring: %s", varName, buf);
+    return(1);
+  }
+  if (WX_CompileCsvColumn(&buf[len], &columns[*numColumnsp]))
+    (*numColumnsp)++;
+  else
+    DPRINTF("Config file: Unrecognized column, ignoring: %s", buf);
+  return(1);
+}
 static int extractQuotedString(char *buf, int *iptr, char *destString)
 {
    int j;
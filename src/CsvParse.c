@@ -0,0 +1,142 @@
+
+/*========================================================================
+
+   CsvParse.c
+
+   Helpers for reading rtl-wx CSV log files.  The files are mapped or read into
+   memory by the caller and everything here works on (pointer, end) ranges in
+   that buffer, so lines are split and numbers converted without copying or
+   allocating anything.  Numbers are converted by hand rather than with
+   sscanf/strtod since log files can be tens of thousands of lines long and
+   rtl-wx often runs on slow router class cpus.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS
+   OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS
+   OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+   OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF OR INABILITY TO USE THIS SOFTWARE, EVEN IF
+   THE COPYRIGHT HOLDERS OR CONTRIBUTORS ARE AWARE OF THE POSSIBILITY OF SUCH DAMAGE.   
+========================================================================*/
+#include <string.h>
+#include "CsvParse.h"
+
+static const double fractionScale[] = { 1.0, 0.1, 0.01, 0.001, 0.0001, 0.00001, 0.000001, 0.0000001, 0.00000001 };
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Parse a decimal number.  Only the formats rtl-wx writes are supported (no exponents).
+//--------------------------------------------------------------------------------------------------------------------------------------------
+const char *CSV_ParseNumber(const char *p, const char *end, double *valuep)
+{
+  int negative = 0, digits = 0, fractionDigits = 0;
+  unsigned long long whole = 0, fraction = 0;
+
+  while ((p < end) && (*p == ' '))
+    p++;
+  if ((p < end) && ((*p == '-') || (*p == '+'))) {
+    negative = (*p == '-');
+    p++;
+  }
+  while ((p < end) && (*p >= '0') && (*p <= '9')) {
+    whole = (whole * 10) + (*p++ - '0');
+    digits++;
+  }
+  if ((p < end) && (*p == '.')) {
+    p++;
+    while ((p < end) && (*p >= '0') && (*p <= '9')) {
+      if (fractionDigits < (int) (sizeof(fractionScale)/sizeof(fractionScale[0])) - 1) {
+        fraction = (fraction * 10) + (*p - '0');
+        fractionDigits++;
+      }
+      p++;
+      digits++;
+    }
+  }
+  if (digits == 0)
+    return((const char *) 0);
+
+  *valuep = (double) whole + ((double) fraction * fractionScale[fractionDigits]);
+  if (negative)
+    *valuep = -*valuep;
+  return(p);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Split one line on commas
+//--------------------------------------------------------------------------------------------------------------------------------------------
+const char *CSV_SplitLine(const char *p, const char *end, CSV_Line *linep)
+{
+  const char *fieldStart = p;
+
+  linep->numFields = 0;
+  while ((p < end) && (*p != '\n')) {
+    if (*p == ',') {
+      if (linep->numFields < CSV_MAX_FIELDS) {
+        linep->field[linep->numFields] = fieldStart;
+        linep->length[linep->numFields++] = p - fieldStart;
+      }
+      fieldStart = p + 1;
+    }
+    p++;
+  }
+  if (linep->numFields < CSV_MAX_FIELDS) {
+    int length = p - fieldStart;
+    if ((length > 0) && (fieldStart[length-1] == '\r'))
+      length--;
+    if ((length > 0) || (linep->numFields > 0)) {
+      linep->field[linep->numFields] = fieldStart;
+      linep->length[linep->numFields++] = length;
+    }
+  }
+  if (p < end)
+    p++; // Skip the newline
+  return(p);
+}
+
+int CSV_GetFieldNumber(CSV_Line *linep, int idx, double *valuep)
+{
+  if ((idx < 0) || (idx >= linep->numFields))
+    return(0);
+  return(CSV_ParseNumber(linep->field[idx], linep->field[idx] + linep->length[idx], valuep) != (const char *) 0);
+}
+
+int CSV_FindField(CSV_Line *linep, const char *name)
+{
+  int i, nameLength = strlen(name);
+
+  for (i=0;i<linep->numFields;i++)
+    if ((linep->length[i] == nameLength) && (memcmp(linep->field[i], name, nameLength) == 0))
+      return(i);
+  return(-1);
+}
+
+int CSV_IsMissingTempPair(double temp, double dewpoint)
+{
+  return((temp == CSV_NO_DATA_VALUE) || (dewpoint == CSV_NO_DATA_VALUE) || ((temp == 0) && (dewpoint == 0)));
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Find where the last numLines lines start by counting newlines back from the end of the buffer
+//--------------------------------------------------------------------------------------------------------------------------------------------
+const char *CSV_FindLastLines(const char *data, size_t size, int numLines)
+{
+  const char *firstLineEnd = memchr(data, '\n', size);
+  const char *p = data + size;
+
+  if (firstLineEnd == (const char *) 0)
+    return(data + size); // Header only (or empty)
+
+  // Ignore a newline at the very end of the file so it doesn't count as a line
+  if ((p > firstLineEnd + 1) && (p[-1] == '\n'))
+    p--;
+  while (p > firstLineEnd + 1) {
+    if (p[-1] == '\n') {
+      if (--numLines == 0)
+        return(p);
+    }
+    p--;
+  }
+  return(firstLineEnd + 1);
+}
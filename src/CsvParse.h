@@ -0,0 +1,59 @@
+
+/*========================================================================
+    
+   CsvParse.h
+
+   Small, allocation free helpers for reading rtl-wx CSV log files.  Used by
+   the startup warm start loader and by csv-utility.  Nothing here depends on
+   rtl-wx.h so the helpers can be linked into stand alone tools.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS
+   OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS
+   OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+   OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF OR INABILITY TO USE THIS SOFTWARE, EVEN IF
+   THE COPYRIGHT HOLDERS OR CONTRIBUTORS ARE AWARE OF THE POSSIBILITY OF SUCH DAMAGE.   
+========================================================================*/
+#ifndef __CSV_PARSE_h
+#define __CSV_PARSE_h
+
+#include <stddef.h>
+
+#define CSV_MAX_FIELDS 64
+
+// Value written to csv files when a sensor has no data
+#define CSV_NO_DATA_VALUE -99
+
+// A line split into fields.  Fields point into the caller's buffer (no copies, no terminating 0s).
+typedef struct _CSV_Line {
+  int numFields;
+  const char *field[CSV_MAX_FIELDS];
+  int length[CSV_MAX_FIELDS];
+} CSV_Line;
+
+// Parse a decimal number (optional sign, digits, optional fraction) from p..end.  Returns a pointer just past
+// the number, or NULL if p doesn't start with a number.
+extern const char *CSV_ParseNumber(const char *p, const char *end, double *valuep);
+
+// Split the line starting at p on commas, stopping at end or the first newline.  Returns a pointer to the
+// start of the next line (or end).
+extern const char *CSV_SplitLine(const char *p, const char *end, CSV_Line *linep);
+
+// Numeric value of field idx.  Returns 0 if the field is missing or isn't a number.
+extern int CSV_GetFieldNumber(CSV_Line *linep, int idx, double *valuep);
+
+// Index of the field whose text matches name exactly, or -1
+extern int CSV_FindField(CSV_Line *linep, const char *name);
+
+// Non zero if a sensor's temperature and dewpoint (in either order) mean it had no data: either one is
+// CSV_NO_DATA_VALUE, or both are 0 (history columns with no samples are logged as 0)
+extern int CSV_IsMissingTempPair(double temp, double dewpoint);
+
+// Walk back from the end of data..data+size to the start of the numLines'th last line.  The header line
+// (the first line in the buffer) is never included.
+extern const char *CSV_FindLastLines(const char *data, size_t size, int numLines);
+
+#endif
@@ -0,0 +1,328 @@
+
+/*========================================================================
+
+   CsvSchema.c
+
+   Column layouts for the csv sensor logs and the realtime csv file.  The
+   columns come from csvColumn / realtimeCsvColumn lines in rtl-wx.conf:
+
+     csvColumn <name> <source> [options]
+
+   where <source> is <sensor>.<field> (eg. odu.temp, ext7.dewpoint,
+   rg.rainRate, wg.windAvgSpeed), "fuel" (gallons of fuel burned) or
+   "fuelTotal" (gallons burned since the totals were last reset), and the
+   options are any of:
+
+     F / inHg / in   convert from C, mbar or mm
+     sum / avg       total or average the values covered by the line
+     0..4            decimal places written
+
+   Realtime columns are the live value unless the source ends in @<n>, in
+   which case they cover the last n snapshots (eg. efergy.wattsAvg@4 for the
+   last hour).  Logged columns always cover the snapshots since the last
+   line in that file.
+
+   Each line is compiled once, when the configuration file is read, into a
+   WX_CsvColumn that names the history column to read and how to convert
+   and format it, so writing a csv line is just a walk down the list.  When
+   no columns are configured the built in layouts below (the columns
+   rtl-wx has always written) are used.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS
+   OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS
+   OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+   OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF OR INABILITY TO USE THIS SOFTWARE, EVEN IF
+   THE COPYRIGHT HOLDERS OR CONTRIBUTORS ARE AWARE OF THE POSSIBILITY OF SUCH DAMAGE.
+
+========================================================================*/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "rtl-wx.h"
+
+#define CSV_LIVE_DATA_SECONDS 300   // Live values older than this are written as no data
+#define CSV_NO_DATA (-99)
+
+static char *sensorNames[] = { "idu", "odu", "rg", "wg", "efergy", "owl" };   // then ext1..ext10
+static char *fieldNames[WX_NUM_FIELDS] = {
+  "temp", "relhum", "dewpoint", "pressure", "sealevelPressure", "watts", "wattsAvg", "burnerSeconds",
+  "rainRate", "rainTotal", "windSpeed", "windAvgSpeed", "windBearing", "windChill"
+};
+static char *conversionNames[] = { "", " F", " inHg", " in" };
+static int defaultDecimals[WX_NUM_FIELDS] = { 1, 0, 1, 1, 1, 0, 0, 0, 1, 1, 1, 1, 0, 1 };
+
+// The columns written before they could be configured
+static char *defaultLogColumns[] = {
+  "efergyWatts efergy.wattsAvg", "owlWatts owl.wattsAvg", "fuelGallonsBurned fuel",
+  "oduTemp odu.temp F", "oduDewpoint odu.dewpoint F", "iduTemp idu.temp F", "iduDewpoint idu.dewpoint F",
+  "ext1Temp ext1.temp F", "ext1Dewpoint ext1.dewpoint F", "ext2Temp ext2.temp F", "ext2Dewpoint ext2.dewpoint F",
+  "ext3Temp ext3.temp F", "ext3Dewpoint ext3.dewpoint F", "ext4Temp ext4.temp F", "ext4Dewpoint ext4.dewpoint F",
+  "iduSealevelPressure idu.sealevelPressure inHg"
+};
+static char *defaultRealtimeColumns[] = {
+  "efergyWatts efergy.watts", "efergyLastHr efergy.wattsAvg@4", "efergyLastDay efergy.wattsAvg@96",
+  "owlWatts owl.watts", "owlLastHr owl.wattsAvg@4", "owlLastDay owl.wattsAvg@96",
+  "fuelGallonsLastHr fuel@4", "fuelLastDay fuel@96", "fuelTotal fuelTotal",
+  "oduTemp odu.temp F", "oduDewpoint odu.dewpoint F", "iduTemp idu.temp F", "iduDewpoint idu.dewpoint F",
+  "ext1Temp ext1.temp F", "ext1Dewpoint ext1.dewpoint F", "ext2Temp ext2.temp F", "ext2Dewpoint ext2.dewpoint F",
+  "ext3Temp ext3.temp F", "ext3Dewpoint ext3.dewpoint F", "ext4Temp ext4.temp F", "ext4Dewpoint ext4.dewpoint F",
+  "iduSealevelPressure idu.sealevelPressure inHg"
+};
+#define NUM_DEFAULT_LOG_COLUMNS (sizeof(defaultLogColumns)/sizeof(defaultLogColumns[0]))
+#define NUM_DEFAULT_REALTIME_COLUMNS (sizeof(defaultRealtimeColumns)/sizeof(defaultRealtimeColumns[0]))
+
+static WX_CsvColumn defaultLogSchema[NUM_DEFAULT_LOG_COLUMNS];
+static WX_CsvColumn defaultRealtimeSchema[NUM_DEFAULT_REALTIME_COLUMNS];
+static pthread_once_t defaultSchemasOnce = PTHREAD_ONCE_INIT;  // The main loop and the command workers can both ask first
+
+// Copy the next whitespace separated word at *pp into word (at most size-1 chars) and advance *pp past it
+static int getWord(char **pp, char *word, int size)
+{
+  char *p = *pp;
+  int len = 0;
+
+  while ((*p == ' ') || (*p == '\t'))
+    p++;
+  while ((*p != ' ') && (*p != '\t') && (*p != '\r') && (*p != '\n') && (*p != 0)) {
+    if (len < size-1)
+      word[len++] = *p;
+    p++;
+  }
+  word[len] = 0;
+  *pp = p;
+  return(len);
+}
+
+static BOOL compileSource(char *source, WX_CsvColumn *colp)
+{
+  char *at = strchr(source, '@');
+  char *dot;
+  int i;
+
+  if (at != NULL) {
+    *at = 0;
+    if ((colp->span = atoi(at+1)) <= 0)
+      return(FALSE);
+  }
+  if (strcmp(source, "fuel") == 0) {
+    colp->source = WX_CSV_SOURCE_FUEL;
+    colp->sum = TRUE;
+    colp->decimals = 2;
+    return(TRUE);
+  }
+  if (strcmp(source, "fuelTotal") == 0) {
+    colp->source = WX_CSV_SOURCE_FUEL_TOTAL;
+    colp->decimals = 2;
+    return(TRUE);
+  }
+
+  if ((dot = strchr(source, '.')) == NULL)
+    return(FALSE);
+  *dot = 0;
+  colp->source = WX_CSV_SOURCE_FIELD;
+  colp->sensor = -1;
+  for (i=0;i<(int) (sizeof(sensorNames)/sizeof(sensorNames[0]));i++)
+    if (strcmp(source, sensorNames[i]) == 0)
+      colp->sensor = i;
+  if ((strncmp(source, "ext", 3) == 0) && (atoi(source+3) >= 1) && (atoi(source+3) <= EXTRA_SENSOR_ARRAY_SIZE))
+    colp->sensor = WX_SENSOR_EXT1 + atoi(source+3) - 1;
+  colp->field = -1;
+  for (i=0;i<WX_NUM_FIELDS;i++)
+    if (strcmp(dot+1, fieldNames[i]) == 0)
+      colp->field = i;
+  if ((colp->sensor < 0) || (colp->field < 0))
+    return(FALSE);
+  colp->sum = (colp->field == WX_FIELD_BURNER_SECONDS);
+  colp->decimals = defaultDecimals[colp->field];
+  return(TRUE);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Compile a column description ("<name> <source> [options]") into *colp.  Returns FALSE if it can't be understood.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+BOOL WX_CompileCsvColumn(char *spec, WX_CsvColumn *colp)
+{
+  char source[MAX_CONFIG_NAME_SIZE];
+  char option[MAX_CONFIG_NAME_SIZE];
+  char *p = spec;
+
+  memset(colp, 0, sizeof(WX_CsvColumn));
+  if ((getWord(&p, colp->name, WX_CSV_COLUMN_NAME_SIZE) == 0) || (getWord(&p, source, sizeof(source)) == 0) ||
+      !compileSource(source, colp))
+    return(FALSE);
+
+  while (getWord(&p, option, sizeof(option)) != 0) {
+    if (strcmp(option, "F") == 0)
+      colp->conversion = WX_CSV_CONVERT_FAHRENHEIT;
+    else if (strcmp(option, "inHg") == 0) {
+      colp->conversion = WX_CSV_CONVERT_INHG;
+      colp->decimals = 2;
+    }
+    else if (strcmp(option, "in") == 0) {
+      colp->conversion = WX_CSV_CONVERT_INCHES;
+      colp->decimals = 2;
+    }
+    else if (strcmp(option, "sum") == 0)
+      colp->sum = TRUE;
+    else if (strcmp(option, "avg") == 0)
+      colp->sum = FALSE;
+    else if ((option[0] >= '0') && (option[0] <= '4') && (option[1] == 0))
+      colp->decimals = option[0] - '0';
+    else
+      return(FALSE);
+  }
+  return(TRUE);
+}
+
+static void compileDefaultSchemas(void)
+{
+  char spec[MAX_CONFIG_NAME_SIZE];
+  int i;
+
+  for (i=0;i<(int) NUM_DEFAULT_LOG_COLUMNS;i++) {
+    strcpy(spec, defaultLogColumns[i]);
+    WX_CompileCsvColumn(spec, &defaultLogSchema[i]);
+  }
+  for (i=0;i<(int) NUM_DEFAULT_REALTIME_COLUMNS;i++) {
+    strcpy(spec, defaultRealtimeColumns[i]);
+    WX_CompileCsvColumn(spec, &defaultRealtimeSchema[i]);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Get the columns to write for the sensor logs (realtime FALSE) or the realtime file.  Returns the number of columns.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+int WX_GetCsvSchema(BOOL realtime, WX_CsvColumn **columnsp)
+{
+  if (realtime && (WxConfig.numRealtimeCsvColumns > 0)) {
+    *columnsp = WxConfig.realtimeCsvColumns;
+    return(WxConfig.numRealtimeCsvColumns);
+  }
+  if (!realtime && (WxConfig.numCsvColumns > 0)) {
+    *columnsp = WxConfig.csvColumns;
+    return(WxConfig.numCsvColumns);
+  }
+
+  pthread_once(&defaultSchemasOnce, compileDefaultSchemas);
+  *columnsp = realtime ? defaultRealtimeSchema : defaultLogSchema;
+  return(realtime ? NUM_DEFAULT_REALTIME_COLUMNS : NUM_DEFAULT_LOG_COLUMNS);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Work out the value of a column.  numSnapshots is how many snapshots the line covers (used when the column doesn't
+// give its own span), or 0 for the live value.  Live values with no recent data are CSV_NO_DATA; history values
+// with no data are 0 (as they always have been in the logs).
+//--------------------------------------------------------------------------------------------------------------------------------------------
+double WX_GetCsvColumnValue(WX_CsvColumn *colp, int numSnapshots)
+{
+  int span = (colp->span > 0) ? colp->span : numSnapshots;
+  double value = 0, sum;
+  int count = 0;
+  float live;
+
+  switch (colp->source) {
+    case WX_CSV_SOURCE_FUEL_TOTAL:
+      return((double) WX_totalBurnerRunSeconds/(60*60) * WxConfig.fuelBurnerGallonsPerHour);
+    case WX_CSV_SOURCE_FUEL:
+      // Only one of the energy sensors will have burner data
+      count  = WX_SumHistoryValues(WX_SENSOR_EFERGY, WX_FIELD_BURNER_SECONDS, (span > 0) ? span : 1, &value);
+      count += WX_SumHistoryValues(WX_SENSOR_OWL, WX_FIELD_BURNER_SECONDS, (span > 0) ? span : 1, &sum);
+      return((value + sum)/(60*60) * WxConfig.fuelBurnerGallonsPerHour);
+    default:
+      if (span == 0) {
+        WX_Timestamp *ts = WX_GetSensorTimestamp(&wxData, colp->sensor);
+        if ((ts == (WX_Timestamp *) 0) || !isTimestampPresent(ts) ||
+            (difftime(wxData.currentTime.timet, ts->timet) > CSV_LIVE_DATA_SECONDS) ||
+            !WX_GetFieldValue(&wxData, colp->sensor, colp->field, &live))
+          return(CSV_NO_DATA);
+        value = live;
+      }
+      else {
+        if ((count = WX_SumHistoryValues(colp->sensor, colp->field, span, &value)) == 0)
+          return(0);
+        if (!colp->sum)
+          value /= count;
+      }
+      break;
+  }
+
+  switch (colp->conversion) {
+    case WX_CSV_CONVERT_FAHRENHEIT: return(value*1.8 + 32);
+    case WX_CSV_CONVERT_INHG:       return(value/33.8638866667);
+    case WX_CSV_CONVERT_INCHES:     return(value/25.4);
+    default:                        break;
+  }
+  return(value);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Write the header line ("Time,<column names>\n") for a schema at p.  Returns a pointer past the newline.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+char *WX_PutCsvSchemaHeader(char *p, WX_CsvColumn *columns, int numColumns)
+{
+  int i, len;
+
+  memcpy(p, "Time", 4);
+  p += 4;
+  for (i=0;i<numColumns;i++) {
+    *p++ = ',';
+    len = strlen(columns[i].name);
+    memcpy(p, columns[i].name, len);
+    p += len;
+  }
+  *p++ = '\n';
+  return(p);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Write a data line (timestamp then each column) at p.  Column values are also stored in values[] if it's not NULL.
+// Returns a pointer past the newline.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+char *WX_PutCsvSchemaLine(char *p, WX_CsvColumn *columns, int numColumns, time_t timet, int numSnapshots, double *values)
+{
+  double value;
+  int i;
+
+  p = WX_CsvPutInt(p, (long) timet, (numColumns > 0) ? ',' : '\n');
+  for (i=0;i<numColumns;i++) {
+    value = WX_GetCsvColumnValue(&columns[i], numSnapshots);
+    if (values != NULL)
+      values[i] = value;
+    p = WX_CsvPutFixed(p, value, columns[i].decimals, (i == numColumns-1) ? '\n' : ',');
+  }
+  return(p);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Print the columns in use for the config dump
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_DumpCsvSchema(FILE *fd, char *label, BOOL realtime)
+{
+  WX_CsvColumn *columns;
+  int i, n = WX_GetCsvSchema(realtime, &columns);
+
+  fprintf(fd, "%24s: %d column(s)%s\n", label, n,
+          ((realtime ? WxConfig.numRealtimeCsvColumns : WxConfig.numCsvColumns) == 0) ? " (built in)" : "");
+  for (i=0;i<n;i++) {
+    WX_CsvColumn *colp = &columns[i];
+    char source[40];
+    if (colp->source == WX_CSV_SOURCE_FUEL)
+      strcpy(source, "fuel");
+    else if (colp->source == WX_CSV_SOURCE_FUEL_TOTAL)
+      strcpy(source, "fuelTotal");
+    else if (colp->sensor >= WX_SENSOR_EXT1)
+      sprintf(source, "ext%d.%s", colp->sensor - WX_SENSOR_EXT1 + 1, fieldNames[colp->field]);
+    else
+      sprintf(source, "%s.%s", sensorNames[colp->sensor], fieldNames[colp->field]);
+    fprintf(fd, "                    %-20s %s", colp->name, source);
+    if (colp->span > 0)
+      fprintf(fd, "@%d", colp->span);
+    fprintf(fd, "%s%s, %d decimal(s)\n", conversionNames[colp->conversion], colp->sum ? " total" : "", colp->decimals);
+  }
+}
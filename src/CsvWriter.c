@@ -0,0 +1,686 @@
+
+/*========================================================================
+
+   CsvWriter.c
+
+   Appends lines to the csv log files.  Each log file is opened once and the
+   descriptor kept open between updates, so logging a line doesn't cost a
+   directory lookup and an open/close (which is slow on usb flash drives).
+   Lines can be held in memory and written several at a time, and files are
+   fsynced on a configurable policy rather than never (or on every line).
+
+   If a file has been renamed or removed (eg. by a log rotation script) it is
+   noticed before the next write and a new file is started.  Errors opening or
+   writing a file are logged and the lines are kept for another try later;
+   they never stop the server.
+
+   Single record files that are rewritten as a whole (the realtime csv file)
+   are published by writing a temp file and renaming it over the old one, so
+   anything reading the file sees either the old or the new contents.  The
+   number formatters below are used to build those lines without going
+   through the printf float conversion code.
+
+   A log file configured with the "monthly" option is written as one segment
+   per month (rtl-wx-15min.csv goes to rtl-wx-15min-2014-06.csv and so on)
+   and the configured name is kept as a symlink to the current segment.  Each
+   segment has a small .idx sidecar of (timestamp, byte offset) pairs, one
+   per line, so WX_CsvReadRange() can pull just the lines for a time range
+   out of the right segments with pread() instead of reading whole files.
+   A log written before "monthly" was turned on becomes the segment
+   rtl-wx-15min-0000-00.csv, which sorts first and can hold any month.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS
+   OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS
+   OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+   OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF OR INABILITY TO USE THIS SOFTWARE, EVEN IF
+   THE COPYRIGHT HOLDERS OR CONTRIBUTORS ARE AWARE OF THE POSSIBILITY OF SUCH DAMAGE.
+
+========================================================================*/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <glob.h>
+#include "rtl-wx.h"
+#include "CsvParse.h"
+
+#define CSV_WRITER_BUFSIZE 4096
+#define CSV_WRITER_MAX_HEADER_SIZE (WX_MAX_CSV_COLUMNS*(WX_CSV_COLUMN_NAME_SIZE+1) + 8)  // Room for the widest configured header
+#define CSV_WRITER_MAX_LINES 256           // Most lines held in buf at once (one index entry is kept for each)
+#define CSV_SEGMENT_NAME_SIZE (MAX_CONFIG_NAME_SIZE+16)
+
+// One entry in a segment's .idx file.  offset is the byte offset of the line with that timestamp in the segment.
+typedef struct _WX_CsvIndexEntry {
+  unsigned int timet;
+  unsigned int offset;
+} WX_CsvIndexEntry;
+
+typedef struct _WX_CsvWriterFile {
+  char fname[MAX_CONFIG_NAME_SIZE];
+  char header[CSV_WRITER_MAX_HEADER_SIZE];
+  BOOL rotateMonthly;
+  char path[CSV_SEGMENT_NAME_SIZE];  // File being written - fname, or the current monthly segment
+  char idxPath[CSV_SEGMENT_NAME_SIZE];
+  int segmentMonth;                  // year*12+month of the current segment, -1 if none yet
+  int fd;                            // -1 when not open
+  int idxFd;                         // -1 when not open (or not rotating)
+  dev_t dev;                         // Identity of the open file, used to notice renames/removal
+  ino_t ino;
+  char buf[CSV_WRITER_BUFSIZE];      // Lines waiting to be written
+  int bufLen;
+  int bufLines;
+  WX_CsvIndexEntry bufIndex[CSV_WRITER_MAX_LINES]; // Offsets here are relative to the start of buf
+  int linesSinceSync;
+  int droppedLines;
+  BOOL errorLogged;                  // Only log the first of a run of errors
+} WX_CsvWriterFile;
+
+static WX_CsvWriterFile csvWriterFiles[MAX_CONFIG_LIST_SIZE];
+static int numCsvWriterFiles=0;
+static time_t lastCsvSyncTime=0;
+static WX_CsvWriterOptions csvOptions;   // Batch and sync settings that came with the latest line
+
+static void flushCsvFile(WX_CsvWriterFile *cfp);
+
+static void logCsvWriterError(WX_CsvWriterFile *cfp, char *what)
+{
+  if (!cfp->errorLogged)
+    DPRINTF("CSV Writer: Unable to %s %s (%s), will try again later\n", what, cfp->path, strerror(errno));
+  cfp->errorLogged = TRUE;
+}
+
+static int writeAll(int fd, char *p, int len)
+{
+  int n;
+
+  while (len > 0) {
+    if ((n = write(fd, p, len)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return(-1);
+    }
+    p += n;
+    len -= n;
+  }
+  return(0);
+}
+
+static void closeCsvFile(WX_CsvWriterFile *cfp)
+{
+  if (cfp->fd >= 0)
+    close(cfp->fd);
+  if (cfp->idxFd >= 0)
+    close(cfp->idxFd);
+  cfp->fd = -1;
+  cfp->idxFd = -1;
+}
+
+// Name of the segment (with extension ext) holding lines from the given year/month: "dir/name.csv" -> "dir/name-yyyy-mm.ext"
+static void getSegmentName(char *fname, int year, int month, char *ext, char *segName)
+{
+  int len = strlen(fname);
+
+  if ((len > 4) && (strcmp(fname+len-4, ".csv") == 0))
+    len -= 4;
+  snprintf(segName, CSV_SEGMENT_NAME_SIZE, "%.*s-%04d-%02d%s", len, fname, year, month, ext);
+}
+
+// Build the index for a csv file that was written without one.  A partial last line isn't indexed.
+static void indexCsvFile(char *csvName, char *idxName)
+{
+  WX_CsvIndexEntry entries[CSV_WRITER_MAX_LINES];
+  const char *data, *p, *eol;
+  struct stat st;
+  int fd, idxFd, n = 0, retVal = 0;
+
+  if ((fd = open(csvName, O_RDONLY)) < 0)
+    return;
+  if ((fstat(fd, &st) != 0) || (st.st_size == 0) ||
+      ((data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)) {
+    close(fd);
+    return;
+  }
+  close(fd);
+  if ((idxFd = open(idxName, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    DPRINTF("CSV Writer: Unable to create index %s (%s)\n", idxName, strerror(errno));
+    munmap((void *) data, st.st_size);
+    return;
+  }
+  for (p=data; (retVal == 0) && ((eol = memchr(p, '\n', data + st.st_size - p)) != NULL); p = eol + 1) {
+    if ((p[0] < '0') || (p[0] > '9')) // Header line
+      continue;
+    entries[n].timet = strtoul(p, NULL, 10);
+    entries[n].offset = p - data;
+    if (++n == CSV_WRITER_MAX_LINES) {
+      retVal = writeAll(idxFd, (char *) entries, n*sizeof(WX_CsvIndexEntry));
+      n = 0;
+    }
+  }
+  if ((retVal == 0) && (n > 0))
+    retVal = writeAll(idxFd, (char *) entries, n*sizeof(WX_CsvIndexEntry));
+  close(idxFd);
+  munmap((void *) data, st.st_size);
+  if (retVal != 0) { // Range reads scan the whole segment when there's no index
+    DPRINTF("CSV Writer: Unable to write index %s (%s)\n", idxName, strerror(errno));
+    unlink(idxName);
+  }
+}
+
+// Point the configured file name at the current segment so anything reading the whole file still works.  A log
+// written before monthly segments were turned on becomes segment 0000-00, and an index is built for it.
+static void linkCsvSegment(WX_CsvWriterFile *cfp)
+{
+  char linkName[CSV_SEGMENT_NAME_SIZE];
+  char idxName[CSV_SEGMENT_NAME_SIZE];
+  char *target = strrchr(cfp->path, '/');
+  struct stat st;
+
+  target = (target == NULL) ? cfp->path : target+1;
+  if ((lstat(cfp->fname, &st) == 0) && !S_ISLNK(st.st_mode)) {
+    getSegmentName(cfp->fname, 0, 0, ".csv", linkName);
+    if (lstat(linkName, &st) == 0) {
+      DPRINTF("CSV Writer: %s already holds lines from before monthly segments, leaving %s alone\n", linkName, cfp->fname);
+      return;
+    }
+    if (rename(cfp->fname, linkName) != 0) {
+      DPRINTF("CSV Writer: Unable to move %s aside for monthly segments (%s)\n", cfp->fname, strerror(errno));
+      return;
+    }
+    getSegmentName(cfp->fname, 0, 0, ".idx", idxName);
+    indexCsvFile(linkName, idxName);
+    DPRINTF("CSV Writer: Starting monthly segments for %s, earlier lines are in %s\n", cfp->fname, linkName);
+  }
+  snprintf(linkName, sizeof(linkName), "%s.lnk", cfp->fname);
+  unlink(linkName);
+  if ((symlink(target, linkName) != 0) || (rename(linkName, cfp->fname) != 0)) {
+    DPRINTF("CSV Writer: Unable to link %s to %s (%s)\n", cfp->fname, target, strerror(errno));
+    unlink(linkName);
+  }
+}
+
+// Switch a monthly file to the segment for the given timestamp.  Lines still waiting go out to the old segment first.
+static void selectCsvSegment(WX_CsvWriterFile *cfp, time_t timet)
+{
+  struct tm tmBuf;
+  int month;
+
+  localtime_r(&timet, &tmBuf);
+  month = (tmBuf.tm_year+1900)*12 + tmBuf.tm_mon;
+  if (month == cfp->segmentMonth)
+    return;
+  if (cfp->segmentMonth >= 0)
+    flushCsvFile(cfp);
+  closeCsvFile(cfp);
+  cfp->segmentMonth = month;
+  getSegmentName(cfp->fname, tmBuf.tm_year+1900, tmBuf.tm_mon+1, ".csv", cfp->path);
+  getSegmentName(cfp->fname, tmBuf.tm_year+1900, tmBuf.tm_mon+1, ".idx", cfp->idxPath);
+  linkCsvSegment(cfp);
+}
+
+// Open (or create) the file for appending, writing the header line if the file is empty
+static int openCsvFile(WX_CsvWriterFile *cfp)
+{
+  struct stat st;
+
+  if ((cfp->fd = open(cfp->path, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0) {
+    logCsvWriterError(cfp, "open");
+    return(-1);
+  }
+  if (fstat(cfp->fd, &st) != 0) {
+    logCsvWriterError(cfp, "check");
+    closeCsvFile(cfp);
+    return(-1);
+  }
+  cfp->dev = st.st_dev;
+  cfp->ino = st.st_ino;
+  if ((st.st_size == 0) && (writeAll(cfp->fd, cfp->header, strlen(cfp->header)) != 0)) {
+    logCsvWriterError(cfp, "write header to");
+    closeCsvFile(cfp);
+    return(-1);
+  }
+  // The index isn't needed to write the segment, so a problem with it is only logged
+  if (cfp->rotateMonthly) {
+    if ((cfp->idxFd = open(cfp->idxPath, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0) {
+      DPRINTF("CSV Writer: Unable to open index %s (%s)\n", cfp->idxPath, strerror(errno));
+    }
+    else if (st.st_size == 0)
+      ftruncate(cfp->idxFd, 0); // A new segment must not inherit entries from an old one
+  }
+  return(0);
+}
+
+// Make sure the open descriptor still refers to the file by that name (log rotation may have moved it)
+static int checkCsvFile(WX_CsvWriterFile *cfp)
+{
+  struct stat st;
+
+  if ((cfp->fd >= 0) && ((stat(cfp->path, &st) != 0) || (st.st_dev != cfp->dev) || (st.st_ino != cfp->ino))) {
+    DPRINTF("CSV Writer: %s was moved or removed, starting a new file\n", cfp->path);
+    closeCsvFile(cfp);
+  }
+  if (cfp->fd < 0)
+    return(openCsvFile(cfp));
+  return(0);
+}
+
+static void syncCsvFile(WX_CsvWriterFile *cfp)
+{
+  if ((cfp->fd >= 0) && (cfp->linesSinceSync > 0)) {
+    fdatasync(cfp->fd);
+    cfp->linesSinceSync = 0;
+  }
+}
+
+// Write out any lines waiting in memory.  On failure they stay in the buffer for the next try.
+static void flushCsvFile(WX_CsvWriterFile *cfp)
+{
+  struct stat st;
+  int i;
+
+  if (cfp->bufLen == 0)
+    return;
+  if (checkCsvFile(cfp) != 0)
+    return;
+  if ((fstat(cfp->fd, &st) != 0) || (writeAll(cfp->fd, cfp->buf, cfp->bufLen) != 0)) {
+    logCsvWriterError(cfp, "write to");
+    closeCsvFile(cfp); // Reopen next time in case the file system was remounted
+    return;
+  }
+  if (cfp->idxFd >= 0) {
+    for (i=0;i<cfp->bufLines;i++)
+      cfp->bufIndex[i].offset += st.st_size;
+    if (writeAll(cfp->idxFd, (char *) cfp->bufIndex, cfp->bufLines*sizeof(WX_CsvIndexEntry)) != 0) {
+      DPRINTF("CSV Writer: Unable to write index %s (%s)\n", cfp->idxPath, strerror(errno));
+      close(cfp->idxFd);
+      cfp->idxFd = -1;
+    }
+  }
+  if (cfp->errorLogged)
+    DPRINTF("CSV Writer: %s is being written again\n", cfp->path);
+  cfp->errorLogged = FALSE;
+  cfp->linesSinceSync += cfp->bufLines;
+  cfp->bufLen = 0;
+  cfp->bufLines = 0;
+  if ((csvOptions.syncLines > 0) && (cfp->linesSinceSync >= csvOptions.syncLines))
+    syncCsvFile(cfp);
+}
+
+static WX_CsvWriterFile *findCsvFile(char *fname, BOOL rotateMonthly)
+{
+  WX_CsvWriterFile *cfp;
+  int i;
+
+  for (i=0;i<numCsvWriterFiles;i++)
+    if (strcmp(csvWriterFiles[i].fname, fname) == 0)
+      return(&csvWriterFiles[i]);
+  if (numCsvWriterFiles >= MAX_CONFIG_LIST_SIZE)
+    return((WX_CsvWriterFile *) 0);
+  cfp = &csvWriterFiles[numCsvWriterFiles++];
+  memset(cfp, 0, sizeof(WX_CsvWriterFile));
+  strncpy(cfp->fname, fname, MAX_CONFIG_NAME_SIZE-1);
+  strncpy(cfp->path, fname, MAX_CONFIG_NAME_SIZE-1);
+  cfp->fd = -1;
+  cfp->idxFd = -1;
+  cfp->segmentMonth = -1;
+  cfp->rotateMonthly = rotateMonthly;
+  return(cfp);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Look up the settings for appending to a csv file.  Called by the main loop when a line is queued, so the I/O worker
+// never has to read the configuration (which can be replaced while it's writing).
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_GetCsvWriterOptions(WX_ConfigSettings *cVarp, char *fname, WX_CsvWriterOptions *optionsp)
+{
+  int i;
+
+  memset(optionsp, 0, sizeof(WX_CsvWriterOptions));
+  for (i=0;i<cVarp->numCsvFilesToUpdate;i++)
+    if (strcmp(cVarp->csvFiles[i].fname, fname) == 0)
+      optionsp->rotateMonthly = cVarp->csvFiles[i].rotateMonthly;
+  optionsp->batchLines = cVarp->csvBatchLines;
+  optionsp->syncLines = cVarp->csvSyncLines;
+  optionsp->syncMinutes = cVarp->csvSyncMinutes;
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Append a line to a csv file.  The header line is written first if the file is new or empty.  The line is
+// written right away unless csvBatchLines is more than 1, in which case it's held until that many are waiting.
+// Lines start with their unix timestamp, which picks the segment for monthly files.  optionsp comes from
+// WX_GetCsvWriterOptions(), and its batch and sync settings are used for all the files from here on.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_CsvAppendLine(char *fname, char *headerLine, char *line, WX_CsvWriterOptions *optionsp)
+{
+  WX_CsvWriterFile *cfp;
+  int len = strlen(line);
+  time_t timet = strtoul(line, NULL, 10);
+
+  csvOptions = *optionsp;
+  if ((cfp = findCsvFile(fname, optionsp->rotateMonthly)) == (WX_CsvWriterFile *) 0) {
+    DPRINTF("CSV Writer: Too many csv files, not logging to %s\n", fname);
+    return;
+  }
+  strncpy(cfp->header, headerLine, CSV_WRITER_MAX_HEADER_SIZE-1);
+  if (cfp->rotateMonthly)
+    selectCsvSegment(cfp, timet);
+
+  if ((cfp->bufLen + len > CSV_WRITER_BUFSIZE) || (cfp->bufLines >= CSV_WRITER_MAX_LINES))
+    flushCsvFile(cfp);
+  if ((cfp->bufLen + len > CSV_WRITER_BUFSIZE) || (cfp->bufLines >= CSV_WRITER_MAX_LINES)) { // Still can't write, so this line is lost
+    if ((cfp->droppedLines++ % 100) == 0)
+      DPRINTF("CSV Writer: %s isn't writable, %d line(s) dropped\n", fname, cfp->droppedLines);
+    return;
+  }
+  cfp->bufIndex[cfp->bufLines].timet = timet;
+  cfp->bufIndex[cfp->bufLines].offset = cfp->bufLen;
+  memcpy(cfp->buf + cfp->bufLen, line, len);
+  cfp->bufLen += len;
+  cfp->bufLines++;
+
+  if (cfp->bufLines >= csvOptions.batchLines)
+    flushCsvFile(cfp);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Called periodically by the scheduler.  Every csvSyncMinutes, lines still waiting are written and all the open
+// csv files are synced to disk.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_CsvWriterService(time_t now)
+{
+  int i;
+
+  if (lastCsvSyncTime == 0)
+    lastCsvSyncTime = now;
+  if ((csvOptions.syncMinutes <= 0) || (difftime(now, lastCsvSyncTime) < csvOptions.syncMinutes*60))
+    return;
+  lastCsvSyncTime = now;
+  for (i=0;i<numCsvWriterFiles;i++) {
+    flushCsvFile(&csvWriterFiles[i]);
+    syncCsvFile(&csvWriterFiles[i]);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Time WX_CsvWriterService() next has something to do, or 0 if it never will (csvSyncMinutes is 0).  The I/O worker
+// sleeps until then rather than waking up to check.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+time_t WX_CsvWriterNextServiceTime(void)
+{
+  if (csvOptions.syncMinutes <= 0)
+    return(0);
+  if (lastCsvSyncTime == 0)
+    return(time(NULL));
+  return(lastCsvSyncTime + csvOptions.syncMinutes*60);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Write out and close all csv files (at shutdown, or when the configuration is re-read since the list of files may
+// have changed).  Files are reopened the next time a line is appended.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_CsvWriterCloseAll(void)
+{
+  int i, n;
+
+  for (i=0;i<numCsvWriterFiles;i++) {
+    flushCsvFile(&csvWriterFiles[i]);
+    syncCsvFile(&csvWriterFiles[i]);
+    closeCsvFile(&csvWriterFiles[i]);
+  }
+
+  // Forget about the files, except ones with lines that still haven't made it out
+  for (i=0,n=0;i<numCsvWriterFiles;i++)
+    if (csvWriterFiles[i].bufLen > 0) {
+      if (n != i)
+        csvWriterFiles[n] = csvWriterFiles[i];
+      n++;
+    }
+  numCsvWriterFiles = n;
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Number formatting.  Each routine writes the value followed by sep at p and returns a pointer past the separator.
+// WX_CsvPutFixed() matches printf("%.<decimals>f") (up to 4 decimal places) apart from the last digit of values
+// that sit right on a rounding boundary, and values that round to 0 never get a minus sign.  NaN, infinity and
+// values too large to scale are written as CSV_NO_DATA_VALUE.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+static const long fixedScale[] = { 1, 10, 100, 1000, 10000 };
+
+static char *putDigits(char *p, unsigned long value, int minDigits)
+{
+  char digits[24];
+  int n = 0;
+
+  do {
+    digits[n++] = '0' + (value % 10);
+    value /= 10;
+  } while ((value != 0) || (n < minDigits));
+  while (n > 0)
+    *p++ = digits[--n];
+  return(p);
+}
+
+char *WX_CsvPutInt(char *p, long value, char sep)
+{
+  if (value < 0) {
+    *p++ = '-';
+    p = putDigits(p, (unsigned long) -value, 1);
+  } else
+    p = putDigits(p, (unsigned long) value, 1);
+  *p++ = sep;
+  return(p);
+}
+
+char *WX_CsvPutFixed(char *p, double value, int decimals, char sep)
+{
+  unsigned long scaled;
+  BOOL negative = (value < 0);
+
+  if (decimals < 0) decimals = 0;
+  if (decimals > 4) decimals = 4;
+  if (negative)
+    value = -value;
+  value = value * fixedScale[decimals] + 0.5;
+  if (!(value < (double) LONG_MAX)) // Also catches NaN
+    return(WX_CsvPutInt(p, CSV_NO_DATA_VALUE, sep));
+  scaled = (unsigned long) value;
+  if (negative && (scaled != 0))
+    *p++ = '-';
+  p = putDigits(p, scaled / fixedScale[decimals], 1);
+  if (decimals > 0) {
+    *p++ = '.';
+    p = putDigits(p, scaled % fixedScale[decimals], decimals);
+  }
+  *p++ = sep;
+  return(p);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Replace the contents of fname with data.  The data goes to fname.tmp first and is then renamed over fname, which
+// atomically swaps in the new file.  Returns 0 on success.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+int WX_CsvPublishFile(char *fname, char *data, int len)
+{
+  static BOOL errorLogged = FALSE;
+  char tmpName[MAX_CONFIG_NAME_SIZE+8];
+  int fd;
+
+  snprintf(tmpName, sizeof(tmpName), "%s.tmp", fname);
+  if ((fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    if (!errorLogged)
+      DPRINTF("CSV Writer: Unable to create %s (%s)\n", tmpName, strerror(errno));
+    errorLogged = TRUE;
+    return(-1);
+  }
+  if ((writeAll(fd, data, len) != 0) || (close(fd) != 0) || (rename(tmpName, fname) != 0)) {
+    if (!errorLogged)
+      DPRINTF("CSV Writer: Unable to write %s (%s)\n", fname, strerror(errno));
+    errorLogged = TRUE;
+    unlink(tmpName);
+    return(-1);
+  }
+  errorLogged = FALSE;
+  return(0);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Time range reads.  These run from the command line (rtl-wx -x, used by csvrange.cgi) rather than in the server, so
+// errors go to stderr.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+
+// Byte offset of the first line with a timestamp >= timet, or -1 if every indexed line is older
+static long findIndexOffset(WX_CsvIndexEntry *idx, int numEntries, time_t timet)
+{
+  int lo = 0, hi = numEntries;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (idx[mid].timet < timet)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return((lo < numEntries) ? (long) idx[lo].offset : -1);
+}
+
+// Write the lines of one file that fall in [start,end) to out, using its index (if idxName is given and the index
+// looks sane) to read only that part of the file.  The file's header line is written first if *needHeader is set.
+static int readCsvRange(FILE *out, char *csvName, char *idxName, time_t start, time_t end, BOOL *needHeader)
+{
+  WX_CsvIndexEntry *idx = MAP_FAILED;
+  int numEntries = 0;
+  struct stat st, idxSt;
+  long lo = 0, hi, offset;
+  char *buf, *p, *eol;
+  int fd, idxFd;
+
+  if ((fd = open(csvName, O_RDONLY)) < 0) {
+    fprintf(stderr, "RTL-Wx: Unable to open %s (%s)\n", csvName, strerror(errno));
+    return(-1);
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return(-1);
+  }
+  hi = st.st_size;
+
+  if ((idxName != NULL) && ((idxFd = open(idxName, O_RDONLY)) >= 0)) {
+    if ((fstat(idxFd, &idxSt) == 0) && (idxSt.st_size >= (off_t) sizeof(WX_CsvIndexEntry))) {
+      numEntries = idxSt.st_size / sizeof(WX_CsvIndexEntry);
+      idx = mmap(NULL, numEntries*sizeof(WX_CsvIndexEntry), PROT_READ, MAP_SHARED, idxFd, 0);
+    }
+    close(idxFd);
+  }
+  // An index that points past the end of the file doesn't belong to it, so fall back to reading everything
+  if ((idx != MAP_FAILED) && (idx[numEntries-1].offset < st.st_size)) {
+    if ((offset = findIndexOffset(idx, numEntries, start)) >= 0)
+      lo = offset;
+    else
+      lo = idx[numEntries-1].offset; // Only lines added after the last index write could be in range
+    if ((end != 0) && ((offset = findIndexOffset(idx, numEntries, end)) >= 0))
+      hi = offset;
+  }
+  if (idx != MAP_FAILED)
+    munmap(idx, numEntries*sizeof(WX_CsvIndexEntry));
+
+  if ((buf = malloc(hi - lo + CSV_WRITER_MAX_HEADER_SIZE + 1)) == NULL) {
+    close(fd);
+    return(-1);
+  }
+  if (*needHeader) {
+    int n = pread(fd, buf, CSV_WRITER_MAX_HEADER_SIZE, 0);
+    if ((n > 0) && !((buf[0] >= '0') && (buf[0] <= '9')) && ((eol = memchr(buf, '\n', n)) != NULL)) {
+      fwrite(buf, 1, eol - buf + 1, out);
+      *needHeader = FALSE;
+    }
+  }
+  if ((hi > lo) && (pread(fd, buf, hi - lo, lo) != hi - lo)) {
+    fprintf(stderr, "RTL-Wx: Unable to read %s (%s)\n", csvName, strerror(errno));
+    free(buf);
+    close(fd);
+    return(-1);
+  }
+  close(fd);
+
+  // The index narrows the read down, but each line is still checked so a file without one gives the same result
+  buf[hi - lo] = '\n';
+  for (p=buf; p < buf + (hi - lo); p = eol + 1) {
+    time_t timet = strtoul(p, NULL, 10);
+    eol = memchr(p, '\n', buf + (hi - lo) + 1 - p);
+    if ((p[0] >= '0') && (p[0] <= '9') && (timet >= start) && ((end == 0) || (timet < end)))
+      fwrite(p, 1, eol - p + 1, out);
+  }
+  free(buf);
+  return(0);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Write the header and the lines of csv log fname with timestamps in [start,end) to out (end of 0 means no limit).
+// For a monthly log only the segments for months in the range are read, otherwise the whole file is scanned.
+// Returns 0 on success.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+int WX_CsvReadRange(FILE *out, char *fname, time_t start, time_t end)
+{
+  char pattern[CSV_SEGMENT_NAME_SIZE+32];
+  char idxName[CSV_SEGMENT_NAME_SIZE];
+  BOOL needHeader = TRUE;
+  glob_t segments;
+  int i, retVal = 0;
+
+  getSegmentName(fname, 0, 0, ".csv", pattern); // Turn "name-0000-00.csv" into a pattern matching all the segments
+  strcpy(pattern + strlen(pattern) - strlen("0000-00.csv"), "[0-9][0-9][0-9][0-9]-[0-9][0-9].csv");
+  if (glob(pattern, 0, NULL, &segments) != 0) {
+    globfree(&segments);
+    return(readCsvRange(out, fname, NULL, start, end, &needHeader));
+  }
+
+  for (i=0;i<(int) segments.gl_pathc;i++) {   // glob() sorts the names, which puts the segments in time order
+    char *seg = segments.gl_pathv[i];
+    int len = strlen(seg);
+    int year = atoi(seg + len - 11);
+    struct tm tmBuf;
+    time_t monthStart, monthEnd;
+
+    // Segment 0000-00 is the log from before segments were turned on, it can hold any month
+    if (year != 0) {
+      memset(&tmBuf, 0, sizeof(tmBuf));
+      tmBuf.tm_year = year - 1900;
+      tmBuf.tm_mon = atoi(seg + len - 6) - 1;
+      tmBuf.tm_mday = 1;
+      tmBuf.tm_isdst = -1;
+      monthStart = mktime(&tmBuf);
+      tmBuf.tm_mon++;
+      tmBuf.tm_isdst = -1;
+      monthEnd = mktime(&tmBuf);
+      if ((monthEnd <= start) || ((end != 0) && (monthStart >= end)))
+        continue;
+    }
+
+    snprintf(idxName, sizeof(idxName), "%.*s.idx", len-4, seg);
+    if (readCsvRange(out, seg, idxName, start, end, &needHeader) != 0)
+      retVal = -1;
+  }
+  globfree(&segments);
+  return(retVal);
+}
+
+void WX_DumpCsvWriterInfo(FILE *fd)
+{
+  int i;
+
+  fprintf(fd, "\n   CSV Writer:  Batch %d line(s)  Sync every %d line(s) / %d minute(s)\n",
+          WxConfig.csvBatchLines, WxConfig.csvSyncLines, WxConfig.csvSyncMinutes);
+  for (i=0;i<numCsvWriterFiles;i++)
+    fprintf(fd, "     %-30s %s  %d line(s) waiting  %d dropped\n", csvWriterFiles[i].path,
+            (csvWriterFiles[i].fd >= 0) ? "open  " : "closed", csvWriterFiles[i].bufLines, csvWriterFiles[i].droppedLines);
+}
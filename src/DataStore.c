@@ -4,8 +4,9 @@
    DataStore.c
    
    This module contains routines to support storage of historical weather station data
-   The functionality includes saving a preset number of complete weather station records
-   as well as support for saving min and max values for selected data fields
+   The functionality includes saving a preset number of weather station records (kept in a
+   compact column per field format, see below) as well as support for saving min and max
+   values for selected data fields
 
    Data records are saved using a first in never out ring buffer.  Once the max number of
    records to store is reached, saving additional records causes the oldest record to be 
@@ -20,6 +21,10 @@
    which represents the rainfall (in mm) since the last record was captured.  This data
    is stored seperately to support different save frequency and storage amounts for
    this data (eg. able to store 1 week of data instead of just 1 day).
+
+   Each saved record is also added into rollup buckets (15 minute, hourly, daily and monthly)
+   which keep the sum, count, min and max of every historical field.  These reach back much
+   further than the record ring does.
    
    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS
    OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
@@ -37,7 +42,13 @@
 #include <stdio.h>
 #include <malloc.h>
 #include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "rtl-wx.h"
+#include "CsvParse.h"
 
 // This ring buffer is a bit strange since the insert operation behaves exactly like a ring buffer, but there is no remove
 // operation.  Once data goes in it stays, or is over-written when the ring fills around again.  Any data in the ring can be
@@ -47,15 +58,181 @@
 // there's no need to keep track of how much data is in the buffer.   Because of the unique records being stored, 
 // all code processing those records must be able to deal with NULL or empty records already, so this ring buffer
 // code doesn't need to check for data underflow or a reference to uninitialized data (all buffer data is preset to 0).
+//
+// The ring doesn't hold copies of WX_Data.  Each field kept in history has its own packed column of scaled 16 bit
+// values (eg. temperature in tenths of a degree), sensor timestamps are kept as offsets from the record time, and a
+// bitmap per sensor marks which records actually have data from that sensor.  All columns are carved out of a
+// single allocation.  A full WX_Data record is only rebuilt when someone asks for one, while code that only needs
+// one field across many records (csv logging, energy averages) walks that field's column directly.
+
+typedef struct _WX_HistoryChannel {
+  WX_SensorId sensor;
+  WX_FieldId  field;
+  short       scale;       // Column holds (value * scale), rounded
+  short       isUnsigned;  // Column holds 0..65535 instead of -32768..32767
+} WX_HistoryChannel;
+
+#define EXT_HISTORY_CHANNELS(idx) \
+  { WX_SENSOR_EXT1+(idx), WX_FIELD_TEMP,     10, 0 }, \
+  { WX_SENSOR_EXT1+(idx), WX_FIELD_RELHUM,    1, 0 }, \
+  { WX_SENSOR_EXT1+(idx), WX_FIELD_DEWPOINT, 10, 0 }
+
+static const WX_HistoryChannel historyChannels[] = {
+  { WX_SENSOR_IDU,    WX_FIELD_TEMP,               10, 0 },
+  { WX_SENSOR_IDU,    WX_FIELD_RELHUM,              1, 0 },
+  { WX_SENSOR_IDU,    WX_FIELD_DEWPOINT,           10, 0 },
+  { WX_SENSOR_IDU,    WX_FIELD_PRESSURE,            1, 0 },
+  { WX_SENSOR_IDU,    WX_FIELD_SEALEVEL_PRESSURE,   1, 0 }, // Must follow WX_FIELD_PRESSURE (offset is rebuilt from both)
+  { WX_SENSOR_ODU,    WX_FIELD_TEMP,               10, 0 },
+  { WX_SENSOR_ODU,    WX_FIELD_RELHUM,              1, 0 },
+  { WX_SENSOR_ODU,    WX_FIELD_DEWPOINT,           10, 0 },
+  { WX_SENSOR_RG,     WX_FIELD_RAIN_RATE,           1, 1 },
+  { WX_SENSOR_RG,     WX_FIELD_RAIN_TOTAL,          1, 1 },
+  { WX_SENSOR_WG,     WX_FIELD_WIND_SPEED,         10, 1 },
+  { WX_SENSOR_WG,     WX_FIELD_WIND_AVG_SPEED,     10, 1 },
+  { WX_SENSOR_WG,     WX_FIELD_WIND_BEARING,        1, 1 },
+  { WX_SENSOR_WG,     WX_FIELD_WIND_CHILL,          1, 0 },
+  { WX_SENSOR_EFERGY, WX_FIELD_WATTS,               1, 1 },
+  { WX_SENSOR_EFERGY, WX_FIELD_WATTS_AVG,           1, 1 },
+  { WX_SENSOR_EFERGY, WX_FIELD_BURNER_SECONDS,      1, 1 },
+  { WX_SENSOR_OWL,    WX_FIELD_WATTS,               1, 1 },
+  { WX_SENSOR_OWL,    WX_FIELD_WATTS_AVG,           1, 1 },
+  { WX_SENSOR_OWL,    WX_FIELD_BURNER_SECONDS,      1, 1 },
+  EXT_HISTORY_CHANNELS(0), EXT_HISTORY_CHANNELS(1), EXT_HISTORY_CHANNELS(2), EXT_HISTORY_CHANNELS(3),
+  EXT_HISTORY_CHANNELS(4), EXT_HISTORY_CHANNELS(5), EXT_HISTORY_CHANNELS(6), EXT_HISTORY_CHANNELS(7),
+  EXT_HISTORY_CHANNELS(8), EXT_HISTORY_CHANNELS(9)
+};
+#define WX_NUM_HISTORY_CHANNELS ((int) (sizeof(historyChannels)/sizeof(historyChannels[0])))
+
+// Index into historyChannels[] for each sensor/field pair, -1 if that field isn't kept in history
+static int historyChannelIndex[WX_NUM_SENSORS][WX_NUM_FIELDS];
+
+// The indoor unit only ever reports one of a handful of forecast strings, so history keeps a small code instead of the pointer
+static char *forecastStrings[] = { (char *) 0, "Cloudy", "Rainy", "Partly Cloudy", "Sunny" };
+#define WX_NUM_FORECAST_STRINGS ((int) (sizeof(forecastStrings)/sizeof(forecastStrings[0])))
+
+static char *historyBlock = (char *) 0;             // Single allocation (or part of the history file mapping) holding every column below
+static char *historyFileMap = (char *) 0;           // Mapping of the history file, if one is in use
+static size_t historyFileSize = 0;
+static time_t *recordTime;                          // currentTime.timet of each record
+static unsigned int *recordPktCnt;                  // currentTime.PktCnt of each record
+static int *recordBadPktCnt;
+static int *recordUnsupportedPktCnt;
+static int *sensorAge[WX_NUM_SENSORS];              // Seconds between sensor timestamp and record time
+static unsigned short *sensorPktAge[WX_NUM_SENSORS];// Packets between sensor timestamp and record (clamped)
+static unsigned char *sensorValidMap[WX_NUM_SENSORS];   // Bit set if sensor had data when record was saved
+static unsigned char *sensorBatteryMap[WX_NUM_SENSORS]; // Bit set if sensor battery was low
+static unsigned char *chillValidMap;
+static unsigned char *forecastCode;
+static short *historyColumn[WX_NUM_HISTORY_CHANNELS];
+
+// Only the newest record's raw energy samples are kept (they're only looked at by the energy history dump)
+static int lastEfergyWattsHistory[LARGEST_ENERGY_HISTORY_SAMPLES_PER_SNAPSHOT];
+static int lastOwlWattsHistory[LARGEST_ENERGY_HISTORY_SAMPLES_PER_SNAPSHOT];
+
+// Rollup tiers.  Every saved snapshot is added into the current bucket of each tier, so hourly, daily and monthly
+// sum/count/min/max values are always available without going back over raw records.  Unlike the snapshot history,
+// all fields of a bucket are kept together so a snapshot only touches one small area of each tier (this keeps the
+// number of pages written per snapshot down when history is kept in a file).  Min and max are kept in the same
+// scaled form as the snapshot columns.
+typedef struct _WX_RollupCell {
+  int sum;
+  unsigned short count;
+  short min;
+  short max;
+} WX_RollupCell;
+
+typedef struct _WX_RollupTier {
+  char *name;
+  int numBuckets;
+  int stepSeconds;                   // Adding this to a bucket start always lands inside the next bucket
+  int currentBucket;
+  time_t *bucketStart;
+  WX_RollupCell *cells;              // numBuckets * WX_NUM_HISTORY_CHANNELS, bucket by bucket
+} WX_RollupTier;
+
+#define ROLLUP_CELL(tierp, bucket, chIdx) (&(tierp)->cells[((bucket) * WX_NUM_HISTORY_CHANNELS) + (chIdx)])
+
+static WX_RollupTier rollupTiers[WX_NUM_ROLLUP_TIERS] = {
+  { "15 Minute", WX_NUM_15MIN_ROLLUPS_TO_STORE,   15*60,       0, NULL, NULL },
+  { "Hourly",    WX_NUM_HOURLY_ROLLUPS_TO_STORE,  60*60,       0, NULL, NULL },
+  { "Daily",     WX_NUM_DAILY_ROLLUPS_TO_STORE,   36*60*60,    0, NULL, NULL },
+  { "Monthly",   WX_NUM_MONTHLY_ROLLUPS_TO_STORE, 32*24*60*60, 0, NULL, NULL }
+};
+
+// Sliding windows.  For a few commonly used record counts (last hour, last day, each csv file's interval) a running
+// sum and count of every historical field is kept up to date as snapshots are saved, so summing the newest N records
+// doesn't require walking N records.  Sums are kept in the raw scaled form so they match a column scan exactly.
+#define WX_MAX_HISTORY_WINDOWS 8
+typedef struct _WX_HistoryWindow {
+  int numRecords;
+  long long rawSum[WX_NUM_HISTORY_CHANNELS];
+  int count[WX_NUM_HISTORY_CHANNELS];
+} WX_HistoryWindow;
+
+static WX_HistoryWindow historyWindows[WX_MAX_HISTORY_WINDOWS];
+static int numHistoryWindows=0;
+
+// Rolling extremes.  Every accepted packet is pushed into a pair of monotonic deques (one for min, one for max) per
+// history channel for each window, so the oldest entry of a deque is always the window's extreme and nothing has
+// to be rescanned when the min or max drops out.  Samples are grouped into buckets and a sample that can't beat one
+// already in its bucket is dropped, which keeps each deque to at most one entry per bucket.  Entries expire a
+// whole bucket at a time, so a window covers its span to within one bucket.
+typedef struct _WX_ExtremeSample {
+  unsigned int timet;
+  int raw;                           // Same scaled form as the snapshot columns
+} WX_ExtremeSample;
+
+typedef struct _WX_ExtremeDeque {
+  int head;
+  int count;
+  WX_ExtremeSample *samples;         // numBuckets entries, used as a ring
+} WX_ExtremeDeque;
+
+typedef struct _WX_ExtremeWindow {
+  char *name;
+  int bucketSeconds;
+  int numBuckets;
+  WX_ExtremeDeque minDeque[WX_NUM_HISTORY_CHANNELS];
+  WX_ExtremeDeque maxDeque[WX_NUM_HISTORY_CHANNELS];
+} WX_ExtremeWindow;
+
+#define WX_EXTREME_24H_BUCKETS (24*30)   // 2 minute buckets
+#define WX_EXTREME_7D_BUCKETS  (7*24*4)  // 15 minute buckets
+
+static WX_ExtremeSample extreme24hSamples[2][WX_NUM_HISTORY_CHANNELS][WX_EXTREME_24H_BUCKETS];
+static WX_ExtremeSample extreme7dSamples[2][WX_NUM_HISTORY_CHANNELS][WX_EXTREME_7D_BUCKETS];
+
+static WX_ExtremeWindow extremeWindows[WX_NUM_EXTREME_WINDOWS] = {
+  { "Last 24 Hours", 2*60,  WX_EXTREME_24H_BUCKETS, {{0}}, {{0}} },
+  { "Last 7 Days",   15*60, WX_EXTREME_7D_BUCKETS,  {{0}}, {{0}} }
+};
+
+// Packets are handled on the receive thread while snapshots and tag processing run on the main thread
+static pthread_mutex_t extremesLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Scratch record returned by WX_GetExtremeDataRecord()
+static WX_Data extremeRecord;
+
+// Scratch record returned by WX_GetWeatherDataRecord()
+static WX_Data materializedRecord;
 
-static WX_Data *ringBuffer = (WX_Data *) 0;
 static WX_Data minData, maxData;
 static unsigned int maxRecordCount=0;
 static unsigned int inIndex=0;
 static unsigned int pktCntAtLastSnapshot=0;
+static unsigned int historyEpoch=0;    // Counts changes to the history store (see WX_GetHistoryEpoch())
+static BOOL historyAllDirty = FALSE;   // Set when more of the history file changed than the ring indices can describe
 
 static void updateMinData(WX_Data *weatherDatap);
 static void updateMaxData(WX_Data *weatherDatap);
+static void primeHistoryWindows(void);
+static void primeExtremeWindows(void);
+static void clearExtremeWindows(void);
+static void addSensorExtremes(WX_Data *weatherDatap, WX_SensorId sensor, BOOL snapshotFields);
+int isNewFloatLower(float newxData, WX_Timestamp *newTs, float minData, WX_Timestamp *minTs);
+int isNewFloatHigher(float newxData, WX_Timestamp *newTs, float maxData, WX_Timestamp *maxTs);
+static void syncHistoryFile(void);
 
 // A separate ring buffer is used for Rain Data storage  may be done at different frequency and
 // have different record count than other weather data storage
@@ -65,34 +242,138 @@ static unsigned int rainTotalAtLastSave=0;
 static unsigned int rainInitComplete=0;
 static unsigned int rainInIndex=0;
 
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Work out where each column lives inside the history block.  Called with base == NULL to just get the size.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+static size_t layoutHistoryBlock(char *base, int numRecords)
+{
+  size_t offset = 0;
+  size_t bitmapSize = (numRecords+7)/8;
+  int i, t;
+
+#define CARVE(ptr, type, size) { if (base != (char *) 0) ptr = (type) (base + offset); offset += ((size) + 7) & ~((size_t) 7); }
+  CARVE(recordTime, time_t *, numRecords * sizeof(time_t));
+  CARVE(recordPktCnt, unsigned int *, numRecords * sizeof(unsigned int));
+  CARVE(recordBadPktCnt, int *, numRecords * sizeof(int));
+  CARVE(recordUnsupportedPktCnt, int *, numRecords * sizeof(int));
+  for (i=0;i<WX_NUM_SENSORS;i++) {
+    CARVE(sensorAge[i], int *, numRecords * sizeof(int));
+    CARVE(sensorPktAge[i], unsigned short *, numRecords * sizeof(unsigned short));
+    CARVE(sensorValidMap[i], unsigned char *, bitmapSize);
+    CARVE(sensorBatteryMap[i], unsigned char *, bitmapSize);
+  }
+  CARVE(chillValidMap, unsigned char *, bitmapSize);
+  CARVE(forecastCode, unsigned char *, numRecords);
+  for (i=0;i<WX_NUM_HISTORY_CHANNELS;i++)
+    CARVE(historyColumn[i], short *, numRecords * sizeof(short));
+  for (t=0;t<WX_NUM_ROLLUP_TIERS;t++) {
+    WX_RollupTier *tierp = &rollupTiers[t];
+    CARVE(tierp->bucketStart, time_t *, tierp->numBuckets * sizeof(time_t));
+    CARVE(tierp->cells, WX_RollupCell *, tierp->numBuckets * WX_NUM_HISTORY_CHANNELS * sizeof(WX_RollupCell));
+  }
+#undef CARVE
+
+  return(offset);
+}
+
+static void setMapBit(unsigned char *map, int idx, int val)
+{
+  if (val)
+    map[idx/8] |= (1 << (idx%8));
+  else
+    map[idx/8] &= ~(1 << (idx%8));
+}
+
+static int getMapBit(unsigned char *map, int idx)
+{
+  return((map[idx/8] >> (idx%8)) & 1);
+}
+
+static short encodeHistoryValue(const WX_HistoryChannel *chp, float value)
+{
+  double scaled = (double) value * chp->scale;
+  double lo = chp->isUnsigned ? 0 : SHRT_MIN;
+  double hi = chp->isUnsigned ? USHRT_MAX : SHRT_MAX;
+
+  if (scaled != scaled) // NaN
+    return(0);
+  scaled = (scaled < 0) ? (scaled - 0.5) : (scaled + 0.5);
+  if (scaled < lo) scaled = lo;
+  if (scaled > hi) scaled = hi;
+  if (chp->isUnsigned)
+    return((short) (unsigned short) scaled);
+  return((short) scaled);
+}
+
+static int decodeHistoryRaw(const WX_HistoryChannel *chp, short raw)
+{
+  return(chp->isUnsigned ? (int) (unsigned short) raw : (int) raw);
+}
+
+static float decodeHistoryValue(const WX_HistoryChannel *chp, short raw)
+{
+  return(decodeHistoryRaw(chp, raw) / (float) chp->scale);
+}
+
 //--------------------------------------------------------------------------------------------------------------------------------------------
 // Init vars used to track historical weather station information.
 //--------------------------------------------------------------------------------------------------------------------------------------------
 void WX_InitHistoricalWeatherData(int numberOfRecordsToStore)
 {
-  char *str;
-  if (ringBuffer != (WX_Data *) 0) // free up any old storage
-     free(ringBuffer);
+  size_t blockSize;
+  int i, s, f;
+
+  if (historyFileMap != (char *) 0)
+     WX_CloseHistoryFile();
+  if (historyBlock != (char *) 0) // free up any old storage
+     free(historyBlock);
 
-  ringBuffer = (WX_Data *)  malloc(numberOfRecordsToStore * sizeof(WX_Data));
+  for (s=0;s<WX_NUM_SENSORS;s++)
+    for (f=0;f<WX_NUM_FIELDS;f++)
+      historyChannelIndex[s][f] = -1;
+  for (i=0;i<WX_NUM_HISTORY_CHANNELS;i++)
+    historyChannelIndex[historyChannels[i].sensor][historyChannels[i].field] = i;
+  pthread_mutex_lock(&extremesLock);
+  clearExtremeWindows();
+  pthread_mutex_unlock(&extremesLock);
+
+  blockSize = layoutHistoryBlock((char *) 0, numberOfRecordsToStore);
+  historyBlock = (char *) malloc(blockSize);
+  if (historyBlock == (char *) 0) {
+    DPRINTF("Unable to allocate %lu bytes for historical data\n", (unsigned long) blockSize);
+    maxRecordCount = 0;
+    return;
+  }
+  memset(historyBlock, 0, blockSize);
+  layoutHistoryBlock(historyBlock, numberOfRecordsToStore);
+  for (i=0;i<WX_NUM_ROLLUP_TIERS;i++)
+    rollupTiers[i].currentBucket = 0;
+  maxRecordCount = numberOfRecordsToStore;
+  inIndex=0;
 
-  memset(ringBuffer,0, numberOfRecordsToStore * sizeof(WX_Data));
+  // Last hour and last day windows are always kept (energy averages and the realtime csv file use them)
+  numHistoryWindows = 0;
+  WX_AddHistoryWindow(4);
+  WX_AddHistoryWindow(24*4);
+
+  memset(lastEfergyWattsHistory, 0, sizeof(lastEfergyWattsHistory));
+  memset(lastOwlWattsHistory, 0, sizeof(lastOwlWattsHistory));
   memset(&minData, 0, sizeof(WX_Data));
   memset(&maxData, 0, sizeof(WX_Data));
   
   pktCntAtLastSnapshot = 0;
-
-  maxRecordCount = numberOfRecordsToStore;
-  inIndex=0;
 }
 
 void WX_InitHistoricalMaxMinData(void)
 {
+  pthread_mutex_lock(&extremesLock);
   memset(&minData, 0, sizeof(WX_Data));
   memset(&maxData, 0, sizeof(WX_Data));
+  pthread_mutex_unlock(&extremesLock);
   
   // This is a bit of a kludge, but reset max/min also resets the cumulative burner time time counter
   WX_totalBurnerRunSeconds=0;
+  syncHistoryFile();
 }
 
 //--------------------------------------------------------------------------------------------------------------------------------------------
@@ -100,6 +381,8 @@ void WX_InitHistoricalMaxMinData(void)
 //--------------------------------------------------------------------------------------------------------------------------------------------
 void WX_InitHistoricalRainData(int numberOfRainRecordsToStore)
 {
+  if (historyFileMap != (char *) 0)
+     WX_CloseHistoryFile();
   if (rainRingBuffer != (unsigned int *) 0) // free up any old storage
      free(rainRingBuffer);
 
@@ -113,6 +396,201 @@ void WX_InitHistoricalRainData(int numberOfRainRecordsToStore)
   rainInIndex=0;
 }
 
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Accessors that map a sensor id / field id pair onto the WX_Data struct
+//--------------------------------------------------------------------------------------------------------------------------------------------
+WX_Timestamp *WX_GetSensorTimestamp(WX_Data *weatherDatap, WX_SensorId sensor)
+{
+  switch (sensor) {
+    case WX_SENSOR_IDU:    return(&weatherDatap->idu.Timestamp);
+    case WX_SENSOR_ODU:    return(&weatherDatap->odu.Timestamp);
+    case WX_SENSOR_RG:     return(&weatherDatap->rg.Timestamp);
+    case WX_SENSOR_WG:     return(&weatherDatap->wg.Timestamp);
+    case WX_SENSOR_EFERGY: return(&weatherDatap->energy.Timestamp);
+    case WX_SENSOR_OWL:    return(&weatherDatap->owl.Timestamp);
+    default:
+      if ((sensor >= WX_SENSOR_EXT1) && (sensor < WX_NUM_SENSORS))
+        return(&weatherDatap->ext[sensor-WX_SENSOR_EXT1].Timestamp);
+  }
+  return((WX_Timestamp *) 0);
+}
+
+static BOOL *getSensorBatteryLow(WX_Data *weatherDatap, WX_SensorId sensor)
+{
+  switch (sensor) {
+    case WX_SENSOR_IDU:    return(&weatherDatap->idu.BatteryLow);
+    case WX_SENSOR_ODU:    return(&weatherDatap->odu.BatteryLow);
+    case WX_SENSOR_RG:     return(&weatherDatap->rg.BatteryLow);
+    case WX_SENSOR_WG:     return(&weatherDatap->wg.BatteryLow);
+    case WX_SENSOR_EFERGY:
+    case WX_SENSOR_OWL:    return((BOOL *) 0);
+    default:
+      if ((sensor >= WX_SENSOR_EXT1) && (sensor < WX_NUM_SENSORS))
+        return(&weatherDatap->ext[sensor-WX_SENSOR_EXT1].BatteryLow);
+  }
+  return((BOOL *) 0);
+}
+
+// Copy a sensor level timestamp into the per-field timestamps as well when rebuilding a record
+static void setSensorTimestamps(WX_Data *weatherDatap, WX_SensorId sensor, WX_Timestamp *ts)
+{
+  switch (sensor) {
+    case WX_SENSOR_IDU:
+      weatherDatap->idu.Timestamp = weatherDatap->idu.TempTimestamp = weatherDatap->idu.RelHumTimestamp = *ts;
+      weatherDatap->idu.DewpointTimestamp = weatherDatap->idu.PressureTimestamp = *ts;
+      break;
+    case WX_SENSOR_ODU:
+      weatherDatap->odu.Timestamp = weatherDatap->odu.TempTimestamp = *ts;
+      weatherDatap->odu.RelHumTimestamp = weatherDatap->odu.DewpointTimestamp = *ts;
+      break;
+    case WX_SENSOR_RG:
+      weatherDatap->rg.Timestamp = weatherDatap->rg.RateTimestamp = *ts;
+      break;
+    case WX_SENSOR_WG:
+      weatherDatap->wg.Timestamp = weatherDatap->wg.SpeedTimestamp = weatherDatap->wg.AvgSpeedTimestamp = *ts;
+      break;
+    case WX_SENSOR_EFERGY:
+      weatherDatap->energy.Timestamp = *ts;
+      break;
+    case WX_SENSOR_OWL:
+      weatherDatap->owl.Timestamp = *ts;
+      break;
+    default:
+      if ((sensor >= WX_SENSOR_EXT1) && (sensor < WX_NUM_SENSORS)) {
+        WX_ExtraSensorData *extp = &weatherDatap->ext[sensor-WX_SENSOR_EXT1];
+        extp->Timestamp = extp->TempTimestamp = extp->RelHumTimestamp = extp->DewpointTimestamp = *ts;
+      }
+  }
+}
+
+static WX_EnergySensorData *getEnergySensor(WX_Data *weatherDatap, WX_SensorId sensor)
+{
+  return((sensor == WX_SENSOR_EFERGY) ? &weatherDatap->energy : &weatherDatap->owl);
+}
+
+BOOL WX_GetFieldValue(WX_Data *weatherDatap, WX_SensorId sensor, WX_FieldId field, float *valuep)
+{
+  WX_ExtraSensorData *extp;
+
+  switch (sensor) {
+    case WX_SENSOR_IDU:
+      switch (field) {
+        case WX_FIELD_TEMP:              *valuep = weatherDatap->idu.Temp; return(TRUE);
+        case WX_FIELD_RELHUM:            *valuep = weatherDatap->idu.RelHum; return(TRUE);
+        case WX_FIELD_DEWPOINT:          *valuep = weatherDatap->idu.Dewpoint; return(TRUE);
+        case WX_FIELD_PRESSURE:          *valuep = weatherDatap->idu.Pressure; return(TRUE);
+        case WX_FIELD_SEALEVEL_PRESSURE: *valuep = weatherDatap->idu.Pressure + weatherDatap->idu.SeaLevelOffset; return(TRUE);
+        default: break;
+      }
+      break;
+    case WX_SENSOR_ODU:
+      switch (field) {
+        case WX_FIELD_TEMP:     *valuep = weatherDatap->odu.Temp; return(TRUE);
+        case WX_FIELD_RELHUM:   *valuep = weatherDatap->odu.RelHum; return(TRUE);
+        case WX_FIELD_DEWPOINT: *valuep = weatherDatap->odu.Dewpoint; return(TRUE);
+        default: break;
+      }
+      break;
+    case WX_SENSOR_RG:
+      switch (field) {
+        case WX_FIELD_RAIN_RATE:  *valuep = weatherDatap->rg.Rate; return(TRUE);
+        case WX_FIELD_RAIN_TOTAL: *valuep = weatherDatap->rg.Total; return(TRUE);
+        default: break;
+      }
+      break;
+    case WX_SENSOR_WG:
+      switch (field) {
+        case WX_FIELD_WIND_SPEED:     *valuep = weatherDatap->wg.Speed; return(TRUE);
+        case WX_FIELD_WIND_AVG_SPEED: *valuep = weatherDatap->wg.AvgSpeed; return(TRUE);
+        case WX_FIELD_WIND_BEARING:   *valuep = weatherDatap->wg.Bearing; return(TRUE);
+        case WX_FIELD_WIND_CHILL:     *valuep = weatherDatap->wg.WindChill; return(TRUE);
+        default: break;
+      }
+      break;
+    case WX_SENSOR_EFERGY:
+    case WX_SENSOR_OWL:
+      switch (field) {
+        case WX_FIELD_WATTS:          *valuep = getEnergySensor(weatherDatap, sensor)->Watts; return(TRUE);
+        case WX_FIELD_WATTS_AVG:      *valuep = getEnergySensor(weatherDatap, sensor)->WattsAvg; return(TRUE);
+        case WX_FIELD_BURNER_SECONDS: *valuep = getEnergySensor(weatherDatap, sensor)->BurnerRuntimeSeconds; return(TRUE);
+        default: break;
+      }
+      break;
+    default:
+      if ((sensor < WX_SENSOR_EXT1) || (sensor >= WX_NUM_SENSORS))
+        break;
+      extp = &weatherDatap->ext[sensor-WX_SENSOR_EXT1];
+      switch (field) {
+        case WX_FIELD_TEMP:     *valuep = extp->Temp; return(TRUE);
+        case WX_FIELD_RELHUM:   *valuep = extp->RelHum; return(TRUE);
+        case WX_FIELD_DEWPOINT: *valuep = extp->Dewpoint; return(TRUE);
+        default: break;
+      }
+  }
+  return(FALSE);
+}
+
+static void setFieldValue(WX_Data *weatherDatap, WX_SensorId sensor, WX_FieldId field, float value)
+{
+  WX_ExtraSensorData *extp;
+
+  switch (sensor) {
+    case WX_SENSOR_IDU:
+      switch (field) {
+        case WX_FIELD_TEMP:              weatherDatap->idu.Temp = value; break;
+        case WX_FIELD_RELHUM:            weatherDatap->idu.RelHum = (int) value; break;
+        case WX_FIELD_DEWPOINT:          weatherDatap->idu.Dewpoint = value; break;
+        case WX_FIELD_PRESSURE:          weatherDatap->idu.Pressure = (int) value; break;
+        case WX_FIELD_SEALEVEL_PRESSURE: weatherDatap->idu.SeaLevelOffset = (int) value - weatherDatap->idu.Pressure; break;
+        default: break;
+      }
+      break;
+    case WX_SENSOR_ODU:
+      switch (field) {
+        case WX_FIELD_TEMP:     weatherDatap->odu.Temp = value; break;
+        case WX_FIELD_RELHUM:   weatherDatap->odu.RelHum = (int) value; break;
+        case WX_FIELD_DEWPOINT: weatherDatap->odu.Dewpoint = value; break;
+        default: break;
+      }
+      break;
+    case WX_SENSOR_RG:
+      switch (field) {
+        case WX_FIELD_RAIN_RATE:  weatherDatap->rg.Rate = (int) value; break;
+        case WX_FIELD_RAIN_TOTAL: weatherDatap->rg.Total = (int) value; break;
+        default: break;
+      }
+      break;
+    case WX_SENSOR_WG:
+      switch (field) {
+        case WX_FIELD_WIND_SPEED:     weatherDatap->wg.Speed = value; break;
+        case WX_FIELD_WIND_AVG_SPEED: weatherDatap->wg.AvgSpeed = value; break;
+        case WX_FIELD_WIND_BEARING:   weatherDatap->wg.Bearing = (int) value; break;
+        case WX_FIELD_WIND_CHILL:     weatherDatap->wg.WindChill = (int) value; break;
+        default: break;
+      }
+      break;
+    case WX_SENSOR_EFERGY:
+    case WX_SENSOR_OWL:
+      switch (field) {
+        case WX_FIELD_WATTS:          getEnergySensor(weatherDatap, sensor)->Watts = (int) value; break;
+        case WX_FIELD_WATTS_AVG:      getEnergySensor(weatherDatap, sensor)->WattsAvg = (int) value; break;
+        case WX_FIELD_BURNER_SECONDS: getEnergySensor(weatherDatap, sensor)->BurnerRuntimeSeconds = (int) value; break;
+        default: break;
+      }
+      break;
+    default:
+      if ((sensor < WX_SENSOR_EXT1) || (sensor >= WX_NUM_SENSORS))
+        break;
+      extp = &weatherDatap->ext[sensor-WX_SENSOR_EXT1];
+      switch (field) {
+        case WX_FIELD_TEMP:     extp->Temp = value; break;
+        case WX_FIELD_RELHUM:   extp->RelHum = (int) value; break;
+        case WX_FIELD_DEWPOINT: extp->Dewpoint = value; break;
+        default: break;
+      }
+  }
+}
+
 static int checkSensorForSnaphotTimeout(WX_Data *weatherDatap, WX_Timestamp *ts, int minutesPerSnapshot) {
   long secondsSinceLastMessage = difftime(weatherDatap->currentTime.timet, ts->timet);
   
@@ -123,18 +601,263 @@ static int checkSensorForSnaphotTimeout(WX_Data *weatherDatap, WX_Timestamp *ts,
      return 0;
 }
 
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Sliding window maintenance
+//--------------------------------------------------------------------------------------------------------------------------------------------
+static WX_HistoryWindow *findHistoryWindow(int numRecords)
+{
+  int w;
+
+  if (numRecords > (int) maxRecordCount)
+    numRecords = maxRecordCount;
+  for (w=0;w<numHistoryWindows;w++)
+    if (historyWindows[w].numRecords == numRecords)
+      return(&historyWindows[w]);
+  return((WX_HistoryWindow *) 0);
+}
+
+static void updateHistoryWindows(int slot, int addingRecord)
+{
+  int w, i, windowSlot;
+  int numSlots = (int) maxRecordCount;
+
+  for (w=0;w<numHistoryWindows;w++) {
+    WX_HistoryWindow *winp = &historyWindows[w];
+    // When adding, slot is the new record.  When removing, it's the record that's about to drop out of the window.
+    windowSlot = addingRecord ? slot : (slot - winp->numRecords + numSlots) % numSlots;
+    for (i=0;i<WX_NUM_HISTORY_CHANNELS;i++) {
+      const WX_HistoryChannel *chp = &historyChannels[i];
+      if (!getMapBit(sensorValidMap[chp->sensor], windowSlot))
+        continue;
+      if (addingRecord) {
+        winp->rawSum[i] += decodeHistoryRaw(chp, historyColumn[i][windowSlot]);
+        winp->count[i]++;
+      } else {
+        winp->rawSum[i] -= decodeHistoryRaw(chp, historyColumn[i][windowSlot]);
+        winp->count[i]--;
+      }
+    }
+  }
+}
+
+// Recompute a window's sums from the ring
+static void primeHistoryWindow(WX_HistoryWindow *winp)
+{
+  int i, n, slot;
+  int numSlots = (int) maxRecordCount;
+
+  memset(winp->rawSum, 0, sizeof(winp->rawSum));
+  memset(winp->count, 0, sizeof(winp->count));
+  slot = (inIndex == 0) ? numSlots-1 : (int) inIndex-1;
+  for (n=0;n<winp->numRecords;n++) {
+    for (i=0;i<WX_NUM_HISTORY_CHANNELS;i++) {
+      const WX_HistoryChannel *chp = &historyChannels[i];
+      if (getMapBit(sensorValidMap[chp->sensor], slot)) {
+        winp->rawSum[i] += decodeHistoryRaw(chp, historyColumn[i][slot]);
+        winp->count[i]++;
+      }
+    }
+    slot = (slot == 0) ? numSlots-1 : slot-1;
+  }
+}
+
+static void primeHistoryWindows(void)
+{
+  int w;
+  for (w=0;w<numHistoryWindows;w++)
+    primeHistoryWindow(&historyWindows[w]);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Start keeping a running sum of the newest numRecords records.  Requests past the size of the ring are clamped,
+// and asking for a window that already exists does nothing.  The new window is primed with one pass over the ring.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_AddHistoryWindow(int numRecords)
+{
+  WX_HistoryWindow *winp;
+
+  if ((historyBlock == (char *) 0) || (numRecords <= 0) || (findHistoryWindow(numRecords) != (WX_HistoryWindow *) 0))
+    return;
+  if (numHistoryWindows >= WX_MAX_HISTORY_WINDOWS) {
+    DPRINTF("Too many history windows, sums over %d records will be computed the slow way\n", numRecords);
+    return;
+  }
+  if (numRecords > (int) maxRecordCount)
+    numRecords = maxRecordCount;
+  if (numRecords <= 0)
+    return;
+
+  winp = &historyWindows[numHistoryWindows++];
+  winp->numRecords = numRecords;
+  primeHistoryWindow(winp);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Rollup bucket maintenance
+//--------------------------------------------------------------------------------------------------------------------------------------------
+static time_t getRollupBucketStart(int tier, time_t t)
+{
+  struct tm tm = *localtime(&t);
+
+  tm.tm_sec = 0;
+  switch (tier) {
+    case WX_ROLLUP_15MIN:   tm.tm_min -= (tm.tm_min % 15); break;
+    case WX_ROLLUP_HOURLY:  tm.tm_min = 0; break;
+    case WX_ROLLUP_DAILY:   tm.tm_min = 0; tm.tm_hour = 0; break;
+    case WX_ROLLUP_MONTHLY: tm.tm_min = 0; tm.tm_hour = 0; tm.tm_mday = 1; break;
+  }
+  tm.tm_isdst = -1;
+  return(mktime(&tm));
+}
+
+static void clearRollupBucket(WX_RollupTier *tierp, int bucket, time_t start)
+{
+  tierp->bucketStart[bucket] = start;
+  memset(ROLLUP_CELL(tierp, bucket, 0), 0, WX_NUM_HISTORY_CHANNELS * sizeof(WX_RollupCell));
+}
+
+// Move the tier's current bucket forward to the one starting at "start", leaving empty buckets for any gap
+static void advanceRollupTier(int tier, time_t start)
+{
+  WX_RollupTier *tierp = &rollupTiers[tier];
+  time_t current = tierp->bucketStart[tierp->currentBucket];
+  time_t next;
+  int steps = 0;
+
+  if (current == 0) {
+    clearRollupBucket(tierp, tierp->currentBucket, start);
+    return;
+  }
+  while ((current < start) && (steps < tierp->numBuckets)) {
+    next = getRollupBucketStart(tier, current + tierp->stepSeconds);
+    if (next <= current) // Repeated hour at end of daylight savings
+      next = current + tierp->stepSeconds;
+    if (next > start)
+      next = start;
+    tierp->currentBucket = (tierp->currentBucket + 1) % tierp->numBuckets;
+    clearRollupBucket(tierp, tierp->currentBucket, next);
+    current = next;
+    steps++;
+  }
+  if (current < start) // Gap was longer than the whole tier
+    tierp->bucketStart[tierp->currentBucket] = start;
+  if (steps >= tierp->numBuckets) // Every bucket was rewritten
+    historyAllDirty = TRUE;
+}
+
+static void addRecordToRollups(int slot)
+{
+  WX_RollupCell *cellp;
+  int t, i, bucket, raw;
+
+  for (t=0;t<WX_NUM_ROLLUP_TIERS;t++) {
+    WX_RollupTier *tierp = &rollupTiers[t];
+    advanceRollupTier(t, getRollupBucketStart(t, recordTime[slot]));
+    bucket = tierp->currentBucket;
+    for (i=0;i<WX_NUM_HISTORY_CHANNELS;i++) {
+      const WX_HistoryChannel *chp = &historyChannels[i];
+      if (!getMapBit(sensorValidMap[chp->sensor], slot))
+        continue;
+      cellp = ROLLUP_CELL(tierp, bucket, i);
+      raw = decodeHistoryRaw(chp, historyColumn[i][slot]);
+      if (cellp->count == 0) {
+        cellp->min = cellp->max = historyColumn[i][slot];
+      } else {
+        if (raw < decodeHistoryRaw(chp, cellp->min))
+          cellp->min = historyColumn[i][slot];
+        if (raw > decodeHistoryRaw(chp, cellp->max))
+          cellp->max = historyColumn[i][slot];
+      }
+      cellp->sum += raw;
+      if (cellp->count < USHRT_MAX)
+        cellp->count++;
+    }
+  }
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Pack a weather data record into ring slot "slot".  recordTimestamp is the (possibly adjusted) time to save for the record.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+static void storeEmptyRecord(int slot, WX_Timestamp *recordTimestamp)
+{
+  int s, i;
+
+  recordTime[slot] = recordTimestamp->timet;
+  recordPktCnt[slot] = recordTimestamp->PktCnt;
+  recordBadPktCnt[slot] = 0;
+  recordUnsupportedPktCnt[slot] = 0;
+  for (s=0;s<WX_NUM_SENSORS;s++) {
+    sensorAge[s][slot] = 0;
+    sensorPktAge[s][slot] = 0;
+    setMapBit(sensorValidMap[s], slot, 0);
+    setMapBit(sensorBatteryMap[s], slot, 0);
+  }
+  setMapBit(chillValidMap, slot, 0);
+  forecastCode[slot] = 0;
+  for (i=0;i<WX_NUM_HISTORY_CHANNELS;i++)
+    historyColumn[i][slot] = 0;
+  memset(lastEfergyWattsHistory, 0, sizeof(lastEfergyWattsHistory));
+  memset(lastOwlWattsHistory, 0, sizeof(lastOwlWattsHistory));
+}
+
+static void storeRecord(int slot, WX_Data *weatherDatap, WX_Timestamp *recordTimestamp)
+{
+  int s, i;
+  BOOL *batteryp;
+  float value;
+
+  recordTime[slot] = recordTimestamp->timet;
+  recordPktCnt[slot] = recordTimestamp->PktCnt;
+  recordBadPktCnt[slot] = weatherDatap->BadPktCnt;
+  recordUnsupportedPktCnt[slot] = weatherDatap->UnsupportedPktCnt;
+
+  for (s=0;s<WX_NUM_SENSORS;s++) {
+    WX_Timestamp *ts = WX_GetSensorTimestamp(weatherDatap, s);
+    int valid = isTimestampPresent(ts);
+    unsigned int pktAge = (valid && (ts->PktCnt <= recordTimestamp->PktCnt)) ? (recordTimestamp->PktCnt - ts->PktCnt) : 0;
+
+    setMapBit(sensorValidMap[s], slot, valid);
+    sensorAge[s][slot] = valid ? (int) (recordTimestamp->timet - ts->timet) : 0;
+    sensorPktAge[s][slot] = (pktAge > USHRT_MAX) ? USHRT_MAX : pktAge;
+    batteryp = getSensorBatteryLow(weatherDatap, s);
+    setMapBit(sensorBatteryMap[s], slot, (batteryp != (BOOL *) 0) && *batteryp);
+  }
+
+  for (i=0;i<WX_NUM_HISTORY_CHANNELS;i++) {
+    const WX_HistoryChannel *chp = &historyChannels[i];
+    if (getMapBit(sensorValidMap[chp->sensor], slot) && WX_GetFieldValue(weatherDatap, chp->sensor, chp->field, &value))
+      historyColumn[i][slot] = encodeHistoryValue(chp, value);
+    else
+      historyColumn[i][slot] = 0;
+  }
+
+  setMapBit(chillValidMap, slot, weatherDatap->wg.ChillValid);
+  forecastCode[slot] = 0;
+  if (weatherDatap->idu.ForecastStr != (char *) 0)
+    for (i=1;i<WX_NUM_FORECAST_STRINGS;i++)
+      if (strcmp(weatherDatap->idu.ForecastStr, forecastStrings[i]) == 0)
+        forecastCode[slot] = i;
+
+  memcpy(lastEfergyWattsHistory, weatherDatap->energy.WattsHistory, sizeof(lastEfergyWattsHistory));
+  memcpy(lastOwlWattsHistory, weatherDatap->owl.WattsHistory, sizeof(lastOwlWattsHistory));
+}
+
 //--------------------------------------------------------------------------------------------------------------------------------------------
 // Save a weather station dataset to the datastore by copying the contents into the ring buffer
 //--------------------------------------------------------------------------------------------------------------------------------------------
 void WX_SaveWeatherDataRecord(WX_Data *weatherDatap, WX_ConfigSettings *cVarp, int minutesPerSnapshot)
 {
-  if (ringBuffer == (WX_Data *) 0) {
+  if (historyBlock == (char *) 0) {
    DPRINTF("WX_SaveWeatherData called before initialization\n");
    return;
   }
 
+  pthread_mutex_lock(&extremesLock);
   updateMinData(weatherDatap);
   updateMaxData(weatherDatap);
+  addSensorExtremes(weatherDatap, WX_SENSOR_EFERGY, TRUE);
+  addSensorExtremes(weatherDatap, WX_SENSOR_OWL, TRUE);
+  pthread_mutex_unlock(&extremesLock);
   
   if (checkSensorForSnaphotTimeout(weatherDatap, &weatherDatap->idu.Timestamp, minutesPerSnapshot))
       weatherDatap->idu.noDataBetweenSnapshots++;
@@ -221,29 +944,34 @@ void WX_SaveWeatherDataRecord(WX_Data *weatherDatap, WX_ConfigSettings *cVarp, i
       }
   }
   
+  updateHistoryWindows(inIndex, 0);
+
   // If current record has no new data at all (no pkts from any sensor), save an empty data record instead
   if (weatherDatap->currentTime.PktCnt == pktCntAtLastSnapshot) {
-    memset(&ringBuffer[inIndex], 0, sizeof(WX_Data));
-    ringBuffer[inIndex].currentTime = weatherDatap->currentTime;
+    storeEmptyRecord(inIndex, &weatherDatap->currentTime);
     DPRINTF("Warning: No sensor messages were received between data snapshots\n");
     weatherDatap->noDataBetweenSnapshots++;
   }
   else {
-	ringBuffer[inIndex] = *weatherDatap; // Copy the entire weather data structure into the buffer
+	WX_Timestamp recordTimestamp = weatherDatap->currentTime;
 	// Check if timestamp  wrapped into the next 15 minute interval before getting saved and if so, back it into the previous time interval
 	// This allows the sample start time to be reliably determined by using (localTime->tm_min % 15)
-	if (isTimestampPresent(&ringBuffer[inIndex].currentTime)) {
-		struct tm *localTime = localtime(&ringBuffer[inIndex].currentTime.timet);
+	if (isTimestampPresent(&recordTimestamp)) {
+		struct tm *localTime = localtime(&recordTimestamp.timet);
 		if ((localTime->tm_min % 15) == 0) // If min is 00, 15, 30, or 45 
-			ringBuffer[inIndex].currentTime.timet -= 60; // subtract 60 seconds from timestamp
+			recordTimestamp.timet -= 60; // subtract 60 seconds from timestamp
 	}
+	storeRecord(inIndex, weatherDatap, &recordTimestamp);
   }
+  updateHistoryWindows(inIndex, 1);
+  addRecordToRollups(inIndex);
   inIndex++;
   if ( inIndex >= maxRecordCount )
      inIndex = 0;
 
   // Keep track of packet counter at time of snapshot
   pktCntAtLastSnapshot = weatherDatap->currentTime.PktCnt;
+  syncHistoryFile();
   
   // Clear out energy sensor data after snapshot is saved...
   if (weatherDatap->energy.Timestamp.PktCnt != 0) {
@@ -263,40 +991,294 @@ void WX_SaveWeatherDataRecord(WX_Data *weatherDatap, WX_ConfigSettings *cVarp, i
 }
 
 //--------------------------------------------------------------------------------------------------------------------------------------------
-// Get a historical weather station data set.
-// HowFarBackToGo specifies which historical record to retrieve, counting backwards starting at 1 for most recent
+// Map a historical record number (1 == newest) onto a ring slot.  Record numbers past the end of the ring wrap around.
 //--------------------------------------------------------------------------------------------------------------------------------------------
-WX_Data *WX_GetWeatherDataRecord(int howFarBackToGo)
+static int getRecordSlot(int howFarBackToGo)
 {
   int currentPosition;
 
-  if (ringBuffer == (WX_Data *) 0) {
-    DPRINTF("WX_GetWeatherDataRecord() called before initialization\n");
-    return(( WX_Data *) 0);
-  }
-
-  // if howFarBackToGo is 0, return current record.
-  if (howFarBackToGo == 0)
-     return(&wxData);
-
   // Make howFarBackToGO  be 0 based instead of 1 based (but watch for out of bounds error)
   if (howFarBackToGo >= 1) 
      howFarBackToGo -= 1;
-
-  if (ringBuffer == (WX_Data *) 0) // Not initialized
-      return((WX_Data *) 0);
+  else
+     howFarBackToGo = 0;
+  howFarBackToGo %= maxRecordCount;
 
   // If next record goes in at index 0, last record in (record #1) can be found at index (maxRecordCount-1)
-  // Don't worry about empty ring buffer case, since caller must be able to handle empty buffer being returned.
   if (inIndex == 0)
      currentPosition = maxRecordCount-1;
   else
      currentPosition = inIndex-1;
 
   if (howFarBackToGo <= currentPosition)
-     return(&ringBuffer[currentPosition-howFarBackToGo]);
+     return(currentPosition-howFarBackToGo);
   else
-     return(&ringBuffer[maxRecordCount - (howFarBackToGo-currentPosition)]);
+     return(maxRecordCount - (howFarBackToGo-currentPosition));
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Rebuild a historical weather station data set into the caller's buffer.
+// HowFarBackToGo specifies which historical record to retrieve, counting backwards starting at 1 for most recent.
+// Fields that aren't kept in history (lock codes, per sensor counters) come back as 0.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_LoadWeatherDataRecord(int howFarBackToGo, WX_Data *destp)
+{
+  int slot, s, i;
+  WX_Timestamp ts;
+
+  memset(destp, 0, sizeof(WX_Data));
+  if (historyBlock == (char *) 0) {
+    DPRINTF("WX_LoadWeatherDataRecord() called before initialization\n");
+    return;
+  }
+
+  // if howFarBackToGo is 0, return current record.
+  if (howFarBackToGo == 0) {
+    *destp = wxData;
+    return;
+  }
+
+  slot = getRecordSlot(howFarBackToGo);
+  destp->currentTime.timet = recordTime[slot];
+  destp->currentTime.PktCnt = recordPktCnt[slot];
+  destp->BadPktCnt = recordBadPktCnt[slot];
+  destp->UnsupportedPktCnt = recordUnsupportedPktCnt[slot];
+
+  for (s=0;s<WX_NUM_SENSORS;s++) {
+    BOOL *batteryp;
+    if (!getMapBit(sensorValidMap[s], slot))
+      continue;
+    ts.timet = recordTime[slot] - sensorAge[s][slot];
+    ts.PktCnt = recordPktCnt[slot] - sensorPktAge[s][slot];
+    if (ts.PktCnt == 0)
+      ts.PktCnt = 1; // Still has to look like a present timestamp
+    setSensorTimestamps(destp, s, &ts);
+    batteryp = getSensorBatteryLow(destp, s);
+    if (batteryp != (BOOL *) 0)
+      *batteryp = getMapBit(sensorBatteryMap[s], slot) ? TRUE : FALSE;
+  }
+
+  for (i=0;i<WX_NUM_HISTORY_CHANNELS;i++) {
+    const WX_HistoryChannel *chp = &historyChannels[i];
+    if (getMapBit(sensorValidMap[chp->sensor], slot))
+      setFieldValue(destp, chp->sensor, chp->field, decodeHistoryValue(chp, historyColumn[i][slot]));
+  }
+
+  destp->wg.ChillValid = getMapBit(chillValidMap, slot) ? TRUE : FALSE;
+  if (forecastCode[slot] < WX_NUM_FORECAST_STRINGS)
+    destp->idu.ForecastStr = forecastStrings[forecastCode[slot]];
+
+  if (slot == getRecordSlot(1)) {
+    memcpy(destp->energy.WattsHistory, lastEfergyWattsHistory, sizeof(lastEfergyWattsHistory));
+    memcpy(destp->owl.WattsHistory, lastOwlWattsHistory, sizeof(lastOwlWattsHistory));
+  }
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Load just one sensor's part of a historical record, plus the record's time and packet counts, into the caller's
+// buffer.  The rest of *destp is left alone.  Only that sensor's columns are read, so going through a range of
+// records for one tag costs a few column reads per record rather than rebuilding every record.  A sensor of -1 loads
+// just the record's time and packet counts.  HowFarBackToGo of 0 loads the current data.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_LoadHistorySensor(int howFarBackToGo, int sensor, WX_Data *destp)
+{
+  WX_Timestamp ts;
+  BOOL *batteryp;
+  int slot, f, chIdx;
+
+  if (howFarBackToGo == 0) {
+    *destp = wxData;
+    return;
+  }
+  if (historyBlock == (char *) 0) {
+    DPRINTF("WX_LoadHistorySensor() called before initialization\n");
+    return;
+  }
+
+  slot = getRecordSlot(howFarBackToGo);
+  destp->currentTime.timet = recordTime[slot];
+  destp->currentTime.PktCnt = recordPktCnt[slot];
+  destp->BadPktCnt = recordBadPktCnt[slot];
+  destp->UnsupportedPktCnt = recordUnsupportedPktCnt[slot];
+  if ((sensor < 0) || (sensor >= WX_NUM_SENSORS))
+    return;
+
+  // No data from the sensor in this record, clearing the timestamps is enough to show that
+  memset(&ts, 0, sizeof(ts));
+  if (getMapBit(sensorValidMap[sensor], slot)) {
+    ts.timet = recordTime[slot] - sensorAge[sensor][slot];
+    ts.PktCnt = recordPktCnt[slot] - sensorPktAge[sensor][slot];
+    if (ts.PktCnt == 0)
+      ts.PktCnt = 1; // Still has to look like a present timestamp
+  }
+  setSensorTimestamps(destp, sensor, &ts);
+  if (ts.PktCnt == 0)
+    return;
+
+  batteryp = getSensorBatteryLow(destp, sensor);
+  if (batteryp != (BOOL *) 0)
+    *batteryp = getMapBit(sensorBatteryMap[sensor], slot) ? TRUE : FALSE;
+  for (f=0;f<WX_NUM_FIELDS;f++)  // In field order, so pressure is set before the sea level offset is rebuilt from it
+    if ((chIdx = historyChannelIndex[sensor][f]) >= 0)
+      setFieldValue(destp, sensor, f, decodeHistoryValue(&historyChannels[chIdx], historyColumn[chIdx][slot]));
+  if (sensor == WX_SENSOR_WG)
+    destp->wg.ChillValid = getMapBit(chillValidMap, slot) ? TRUE : FALSE;
+  if (sensor == WX_SENSOR_IDU)
+    destp->idu.ForecastStr = (forecastCode[slot] < WX_NUM_FORECAST_STRINGS) ? forecastStrings[forecastCode[slot]] : (char *) 0;
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Get a historical weather station data set.
+// HowFarBackToGo specifies which historical record to retrieve, counting backwards starting at 1 for most recent
+// The returned record is rebuilt into a scratch buffer that's reused by the next call, so callers that need to
+// hold onto more than one record at a time should use WX_LoadWeatherDataRecord() instead.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+WX_Data *WX_GetWeatherDataRecord(int howFarBackToGo)
+{
+  if (historyBlock == (char *) 0) {
+    DPRINTF("WX_GetWeatherDataRecord() called before initialization\n");
+    return(( WX_Data *) 0);
+  }
+
+  // if howFarBackToGo is 0, return current record.
+  if (howFarBackToGo == 0)
+     return(&wxData);
+
+  WX_LoadWeatherDataRecord(howFarBackToGo, &materializedRecord);
+  return(&materializedRecord);
+}
+
+int WX_GetHistoryRecordCount(void)
+{
+  return(maxRecordCount);
+}
+
+// Changes whenever a snapshot or rain record is saved, the max/min data is reset or history is loaded, so a caller can
+// tell whether anything it worked out from the history store is still current.
+unsigned int WX_GetHistoryEpoch(void)
+{
+  return(historyEpoch);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Read a single field from history without rebuilding the whole record.  Returns FALSE if the sensor had no data
+// in that record or the field isn't kept in history.  howFarBackToGo of 0 reads the current (live) data.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+BOOL WX_GetHistoryValue(WX_SensorId sensor, WX_FieldId field, int howFarBackToGo, float *valuep)
+{
+  int chIdx, slot;
+
+  if ((historyBlock == (char *) 0) || (sensor < 0) || (sensor >= WX_NUM_SENSORS) || (field < 0) || (field >= WX_NUM_FIELDS))
+    return(FALSE);
+
+  if (howFarBackToGo == 0) {
+    if (!isTimestampPresent(WX_GetSensorTimestamp(&wxData, sensor)))
+      return(FALSE);
+    return(WX_GetFieldValue(&wxData, sensor, field, valuep));
+  }
+
+  chIdx = historyChannelIndex[sensor][field];
+  if (chIdx < 0)
+    return(FALSE);
+  slot = getRecordSlot(howFarBackToGo);
+  if (!getMapBit(sensorValidMap[sensor], slot))
+    return(FALSE);
+  *valuep = decodeHistoryValue(&historyChannels[chIdx], historyColumn[chIdx][slot]);
+  return(TRUE);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Sum one field over the newest numRecords records.  Uses a sliding window's running sum when one exists for
+// numRecords, otherwise walks the field's column.  Records where the sensor had no data are skipped.
+// Returns the number of records that were added into *sump.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+int WX_SumHistoryValues(WX_SensorId sensor, WX_FieldId field, int numRecords, double *sump)
+{
+  const WX_HistoryChannel *chp;
+  WX_HistoryWindow *winp;
+  unsigned char *validMap;
+  short *column;
+  long long rawSum = 0;
+  int chIdx, slot, count = 0, n;
+  int numSlots = (int) maxRecordCount;
+
+  *sump = 0;
+  if ((historyBlock == (char *) 0) || (sensor < 0) || (sensor >= WX_NUM_SENSORS) || (field < 0) || (field >= WX_NUM_FIELDS))
+    return(0);
+  chIdx = historyChannelIndex[sensor][field];
+  if (chIdx < 0)
+    return(0);
+  if (numRecords > (int) maxRecordCount)
+    numRecords = maxRecordCount;
+
+  chp = &historyChannels[chIdx];
+  winp = findHistoryWindow(numRecords);
+  if (winp != (WX_HistoryWindow *) 0) {
+    *sump = (double) winp->rawSum[chIdx] / chp->scale;
+    return(winp->count[chIdx]);
+  }
+
+  column = historyColumn[chIdx];
+  validMap = sensorValidMap[sensor];
+  slot = (inIndex == 0) ? numSlots-1 : (int) inIndex-1;
+  for (n=0;n<numRecords;n++) {
+    if (getMapBit(validMap, slot)) {
+      rawSum += decodeHistoryRaw(chp, column[slot]);
+      count++;
+    }
+    slot = (slot == 0) ? numSlots-1 : slot-1;
+  }
+  *sump = (double) rawSum / chp->scale;
+  return(count);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Get the rollup of one field for a bucket.  howFarBackToGo of 1 is the bucket currently being filled, 2 the one
+// before it, etc.  Returns FALSE if the bucket has no data for the field (startTime and count are still filled in).
+//--------------------------------------------------------------------------------------------------------------------------------------------
+BOOL WX_GetRollupValue(WX_RollupTierId tier, WX_SensorId sensor, WX_FieldId field, int howFarBackToGo, WX_RollupValue *valuep)
+{
+  const WX_HistoryChannel *chp;
+  WX_RollupTier *tierp;
+  WX_RollupCell *cellp;
+  int chIdx, bucket;
+
+  memset(valuep, 0, sizeof(WX_RollupValue));
+  if ((historyBlock == (char *) 0) || (tier < 0) || (tier >= WX_NUM_ROLLUP_TIERS) ||
+      (sensor < 0) || (sensor >= WX_NUM_SENSORS) || (field < 0) || (field >= WX_NUM_FIELDS))
+    return(FALSE);
+  tierp = &rollupTiers[tier];
+  if ((howFarBackToGo < 1) || (howFarBackToGo > tierp->numBuckets))
+    return(FALSE);
+
+  bucket = (tierp->currentBucket - (howFarBackToGo-1) + tierp->numBuckets) % tierp->numBuckets;
+  valuep->startTime = tierp->bucketStart[bucket];
+  chIdx = historyChannelIndex[sensor][field];
+  if ((chIdx < 0) || (ROLLUP_CELL(tierp, bucket, chIdx)->count == 0))
+    return(FALSE);
+
+  chp = &historyChannels[chIdx];
+  cellp = ROLLUP_CELL(tierp, bucket, chIdx);
+  valuep->count = cellp->count;
+  valuep->sum = (double) cellp->sum / chp->scale;
+  valuep->avg = valuep->sum / valuep->count;
+  valuep->min = decodeHistoryValue(chp, cellp->min);
+  valuep->max = decodeHistoryValue(chp, cellp->max);
+  return(TRUE);
+}
+
+int WX_GetRollupBucketCount(WX_RollupTierId tier)
+{
+  if ((tier < 0) || (tier >= WX_NUM_ROLLUP_TIERS))
+    return(0);
+  return(rollupTiers[tier].numBuckets);
+}
+
+char *WX_GetRollupTierName(WX_RollupTierId tier)
+{
+  if ((tier < 0) || (tier >= WX_NUM_ROLLUP_TIERS))
+    return("");
+  return(rollupTiers[tier].name);
 }
 
 //--------------------------------------------------------------------------------------------------------------------------------------------
@@ -327,6 +1309,7 @@ void WX_SaveRainDataRecord(WX_Data *weatherDatap)
   if ( rainInIndex >= maxRainRecordCount )
      rainInIndex = 0;
 
+  syncHistoryFile();
 }
 
 //--------------------------------------------------------------------------------------------------------------------------------------------
@@ -367,19 +1350,828 @@ unsigned int WX_GetRainDataRecord(int howFarBackToGo)
 }
 
 //--------------------------------------------------------------------------------------------------------------------------------------------
-// Get a data set that contains all the minimum values for each data field (along with timestamps of when it happened)
+// History file support.
+//
+// When a history file is configured, the history block (snapshot columns and rollups) and the rain ring are moved
+// into a shared memory mapping of that file so they survive a restart.  The file is laid out as
+//
+//    header 0 | header 1 | history block | rain ring | min record | max record
+//
+// Each header holds a magic string, version, the sizes the file was built with, the ring indices, a generation
+// count and checksums of itself and of the newest snapshot record.  A sync first flushes the data pages dirtied
+// since the last sync, then writes the next generation into the other header slot and flushes that, so there is
+// always one complete header on disk that matches the data.  At startup the valid header with the highest
+// generation is used.  A record whose checksum doesn't match (the newest one, or the slot the next snapshot was
+// going to overwrite) is dropped on its own instead of throwing away the whole file.  Anything that doesn't match
+// the running build (different version, record counts or channel table) still causes the file to be started over.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+#define WX_HISTORY_FILE_MAGIC   "RTLWXHST"
+#define WX_HISTORY_FILE_VERSION 2
+#define WX_HISTORY_HEADER_SLOT_SIZE 512  // One disk sector per header, so a torn write can't reach the other copy
+
+typedef struct _WX_HistoryFileHeader {
+  char magic[8];
+  unsigned int version;
+  unsigned int checksum;              // Covers this header with this field set to 0
+  unsigned long long generation;      // Bumped by every sync, the slot used is generation % 2
+  unsigned int fileSize;
+  unsigned int historyBlockSize;
+  unsigned int numRecords;
+  unsigned int numRainRecords;
+  unsigned int numChannels;
+  unsigned int dataRecordSize;        // sizeof(WX_Data) for the min/max records
+  unsigned int inIndex;
+  unsigned int rainInIndex;
+  unsigned int rainTotalAtLastSave;
+  unsigned int newestRecordChecksum;  // Record at inIndex-1
+  unsigned int nextRecordChecksum;    // Record at inIndex (oldest, or empty until the ring fills)
+  int rollupCurrentBucket[WX_NUM_ROLLUP_TIERS];
+  long long totalBurnerRunSeconds;
+  long long lastSyncTime;
+} WX_HistoryFileHeader;
+
+#define HISTORY_FILE_ALIGN(size) (((size) + 7) & ~((size_t) 7))
+
+static WX_HistoryFileHeader historyHeader;  // Copy of the newest header written to (or read from) the file
+static size_t historyDirtyStart, historyDirtyEnd; // Byte range of the file to flush at the next sync
+
+// Adler-32, continued from "adler" (start with 1)
+static unsigned int updateHistoryChecksum(unsigned int adler, const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *) data;
+  unsigned long a = adler & 0xffff, b = (adler >> 16) & 0xffff;
+  size_t chunk;
+
+  while (len > 0) {
+    chunk = (len > 5552) ? 5552 : len;
+    len -= chunk;
+    while (chunk--) {
+      a += *p++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return((unsigned int) ((b << 16) | a));
+}
+
+// Checksum of every column of one snapshot record.  Bitmaps are fed a bit at a time since their bytes are shared
+// with neighbouring records.
+static unsigned int computeRecordChecksum(int slot)
+{
+  unsigned int adler = 1;
+  unsigned char bits[3];
+  int s, i;
+
+  adler = updateHistoryChecksum(adler, &recordTime[slot], sizeof(time_t));
+  adler = updateHistoryChecksum(adler, &recordPktCnt[slot], sizeof(unsigned int));
+  adler = updateHistoryChecksum(adler, &recordBadPktCnt[slot], sizeof(int));
+  adler = updateHistoryChecksum(adler, &recordUnsupportedPktCnt[slot], sizeof(int));
+  for (s=0;s<WX_NUM_SENSORS;s++) {
+    adler = updateHistoryChecksum(adler, &sensorAge[s][slot], sizeof(int));
+    adler = updateHistoryChecksum(adler, &sensorPktAge[s][slot], sizeof(unsigned short));
+    bits[0] = getMapBit(sensorValidMap[s], slot);
+    bits[1] = getMapBit(sensorBatteryMap[s], slot);
+    adler = updateHistoryChecksum(adler, bits, 2);
+  }
+  bits[0] = getMapBit(chillValidMap, slot);
+  bits[1] = forecastCode[slot];
+  adler = updateHistoryChecksum(adler, bits, 2);
+  for (i=0;i<WX_NUM_HISTORY_CHANNELS;i++)
+    adler = updateHistoryChecksum(adler, &historyColumn[i][slot], sizeof(short));
+  return(adler);
+}
+
+static unsigned int computeHeaderChecksum(WX_HistoryFileHeader *hdrp)
+{
+  WX_HistoryFileHeader hdr;
+
+  memcpy(&hdr, hdrp, sizeof(hdr));  // Not an assignment, padding has to come along too
+  hdr.checksum = 0;
+  return(updateHistoryChecksum(1, &hdr, sizeof(hdr)));
+}
+
+static void getHistoryFileLayout(size_t *historyOffsetp, size_t *rainOffsetp, size_t *minOffsetp, size_t *maxOffsetp, size_t *sizep)
+{
+  *historyOffsetp = 2 * WX_HISTORY_HEADER_SLOT_SIZE;
+  *rainOffsetp = *historyOffsetp + HISTORY_FILE_ALIGN(layoutHistoryBlock((char *) 0, maxRecordCount));
+  *minOffsetp = *rainOffsetp + HISTORY_FILE_ALIGN(maxRainRecordCount * sizeof(unsigned int));
+  *maxOffsetp = *minOffsetp + HISTORY_FILE_ALIGN(sizeof(WX_Data));
+  *sizep = *maxOffsetp + HISTORY_FILE_ALIGN(sizeof(WX_Data));
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Dirty range tracking.  Only the span between the lowest and highest byte changed since the last sync is flushed.
+// The kernel only writes the pages in that span that are actually dirty, and one call keeps it to a single flush
+// of the device.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+static void markHistoryFileDirty(const void *p, size_t len)
+{
+  size_t start = (const char *) p - historyFileMap;
+
+  if (historyDirtyEnd == 0) {
+    historyDirtyStart = start;
+    historyDirtyEnd = start + len;
+    return;
+  }
+  if (start < historyDirtyStart)
+    historyDirtyStart = start;
+  if (start + len > historyDirtyEnd)
+    historyDirtyEnd = start + len;
+}
+
+// Records "from" up to (not including) "to" were written.  Columns are laid out one after another, so the first
+// and last column of each record bound everything it touched.
+static void markHistoryRecordsDirty(int from, int to)
+{
+  int numSlots = (int) maxRecordCount;
+
+  while (from != to) {
+    markHistoryFileDirty(&recordTime[from], sizeof(time_t));
+    markHistoryFileDirty(&historyColumn[WX_NUM_HISTORY_CHANNELS-1][from], sizeof(short));
+    from = (from + 1) % numSlots;
+  }
+}
+
+// Buckets "from" through "to" of a rollup tier may have been written
+static void markRollupBucketsDirty(WX_RollupTier *tierp, int from, int to)
+{
+  while (1) {
+    markHistoryFileDirty(&tierp->bucketStart[from], sizeof(time_t));
+    markHistoryFileDirty(ROLLUP_CELL(tierp, from, 0), WX_NUM_HISTORY_CHANNELS * sizeof(WX_RollupCell));
+    if (from == to)
+      break;
+    from = (from + 1) % tierp->numBuckets;
+  }
+}
+
+static void flushHistoryFile(size_t start, size_t end)
+{
+  size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+
+  start -= start % pageSize;
+  if (msync(historyFileMap + start, end - start, MS_SYNC) != 0)
+    DPRINTF("Unable to sync history file (%s)\n", strerror(errno));
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Copy the state that doesn't live in the mapping into the file, flush what changed and then write a new header.
+// This is called after every change to the history store, so it's where the changes are counted too.
 //--------------------------------------------------------------------------------------------------------------------------------------------
-WX_Data *WX_GetMinDataRecord()
+static void syncHistoryFile(void)
+{
+  size_t historyOffset, rainOffset, minOffset, maxOffset, size;
+  size_t headerOffset;
+  int t, newest;
+
+  historyEpoch++;
+  if (historyFileMap == (char *) 0)
+    return;
+
+  getHistoryFileLayout(&historyOffset, &rainOffset, &minOffset, &maxOffset, &size);
+  pthread_mutex_lock(&extremesLock);  // The receive thread updates these for every packet
+  memcpy(historyFileMap + minOffset, &minData, sizeof(WX_Data));
+  memcpy(historyFileMap + maxOffset, &maxData, sizeof(WX_Data));
+  pthread_mutex_unlock(&extremesLock);
+  markHistoryFileDirty(historyFileMap + minOffset, maxOffset + sizeof(WX_Data) - minOffset);
+
+  // Everything that moved since the previous header was written
+  if (historyAllDirty) {
+    markHistoryFileDirty(historyFileMap + historyOffset, minOffset - historyOffset);
+    historyAllDirty = FALSE;
+  } else {
+    markHistoryRecordsDirty(historyHeader.inIndex, inIndex);
+    if (historyHeader.rainInIndex != rainInIndex) {
+      markHistoryFileDirty(&rainRingBuffer[historyHeader.rainInIndex], sizeof(unsigned int));
+      markHistoryFileDirty(&rainRingBuffer[(rainInIndex == 0) ? maxRainRecordCount-1 : rainInIndex-1], sizeof(unsigned int));
+    }
+    for (t=0;t<WX_NUM_ROLLUP_TIERS;t++)
+      markRollupBucketsDirty(&rollupTiers[t], historyHeader.rollupCurrentBucket[t], rollupTiers[t].currentBucket);
+  }
+  flushHistoryFile(historyDirtyStart, historyDirtyEnd);
+  historyDirtyStart = historyDirtyEnd = 0;
+
+  // Data is on disk, now the header that describes it goes into the slot the previous one isn't using
+  newest = (inIndex == 0) ? (int) maxRecordCount-1 : (int) inIndex-1;
+  historyHeader.generation++;
+  historyHeader.inIndex = inIndex;
+  historyHeader.rainInIndex = rainInIndex;
+  historyHeader.rainTotalAtLastSave = rainTotalAtLastSave;
+  historyHeader.newestRecordChecksum = computeRecordChecksum(newest);
+  historyHeader.nextRecordChecksum = computeRecordChecksum(inIndex);
+  for (t=0;t<WX_NUM_ROLLUP_TIERS;t++)
+    historyHeader.rollupCurrentBucket[t] = rollupTiers[t].currentBucket;
+  historyHeader.totalBurnerRunSeconds = WX_totalBurnerRunSeconds;
+  historyHeader.lastSyncTime = time(NULL);
+  historyHeader.checksum = computeHeaderChecksum(&historyHeader);
+
+  headerOffset = (historyHeader.generation % 2) * WX_HISTORY_HEADER_SLOT_SIZE;
+  memcpy(historyFileMap + headerOffset, &historyHeader, sizeof(historyHeader));
+  flushHistoryFile(headerOffset, headerOffset + sizeof(historyHeader));
+}
+
+static BOOL isHistoryHeaderValid(WX_HistoryFileHeader *hdrp, size_t size)
+{
+  if ((memcmp(hdrp->magic, WX_HISTORY_FILE_MAGIC, sizeof(hdrp->magic)) != 0) ||
+      (hdrp->version != WX_HISTORY_FILE_VERSION) ||
+      (hdrp->fileSize != size) ||
+      (hdrp->historyBlockSize != layoutHistoryBlock((char *) 0, maxRecordCount)) ||
+      (hdrp->numRecords != maxRecordCount) ||
+      (hdrp->numRainRecords != maxRainRecordCount) ||
+      (hdrp->numChannels != WX_NUM_HISTORY_CHANNELS) ||
+      (hdrp->dataRecordSize != sizeof(WX_Data)) ||
+      (hdrp->inIndex >= maxRecordCount) ||
+      (hdrp->rainInIndex >= maxRainRecordCount))
+    return(FALSE);
+  return(computeHeaderChecksum(hdrp) == hdrp->checksum);
+}
+
+// Empty out a record that can't be trusted.  An all zero record looks the same as one that was never written.
+static void dropHistoryRecord(int slot, char *which)
 {
-  return (&minData);
+  WX_Timestamp noTime;
+
+  DPRINTF("History file %s record doesn't match its checksum, dropping it\n", which);
+  memset(&noTime, 0, sizeof(noTime));
+  storeEmptyRecord(slot, &noTime);
 }
 
 //--------------------------------------------------------------------------------------------------------------------------------------------
-// Get a data set that contains all the minimum values for each data field (along with timestamps of when it happened)
+// Move historical data into the file "fname".  If the file holds valid history from a previous run, that history
+// replaces what's in memory, otherwise the file is (re)initialized from what's in memory.  Must be called after
+// WX_InitHistoricalWeatherData() and WX_InitHistoricalRainData().  Returns 0 on success.
 //--------------------------------------------------------------------------------------------------------------------------------------------
-WX_Data *WX_GetMaxDataRecord()
+int WX_OpenHistoryFile(char *fname)
 {
-  return (&maxData);
+  WX_HistoryFileHeader *hdrp = (WX_HistoryFileHeader *) 0;
+  WX_HistoryFileHeader *slotp;
+  size_t historyOffset, rainOffset, minOffset, maxOffset, size;
+  struct stat st;
+  char *map;
+  int fd, t, h, newest;
+
+  if ((historyBlock == (char *) 0) || (rainRingBuffer == (unsigned int *) 0)) {
+    DPRINTF("WX_OpenHistoryFile() called before initialization\n");
+    return(1);
+  }
+  if (historyFileMap != (char *) 0)
+    WX_CloseHistoryFile();
+
+  getHistoryFileLayout(&historyOffset, &rainOffset, &minOffset, &maxOffset, &size);
+
+  if ((fd = open(fname, O_RDWR | O_CREAT, 0644)) < 0) {
+    DPRINTF("Unable to open history file %s (%s), history will not be saved\n", fname, strerror(errno));
+    return(1);
+  }
+  if ((fstat(fd, &st) != 0) || ((st.st_size != (off_t) size) && (ftruncate(fd, size) != 0))) {
+    DPRINTF("Unable to size history file %s (%s), history will not be saved\n", fname, strerror(errno));
+    close(fd);
+    return(1);
+  }
+  map = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == (char *) MAP_FAILED) {
+    DPRINTF("Unable to map history file %s (%s), history will not be saved\n", fname, strerror(errno));
+    return(1);
+  }
+
+  // Use the newest header that's intact
+  if (st.st_size == (off_t) size) {
+    for (h=0;h<2;h++) {
+      slotp = (WX_HistoryFileHeader *) (map + h * WX_HISTORY_HEADER_SLOT_SIZE);
+      if (isHistoryHeaderValid(slotp, size) && ((hdrp == (WX_HistoryFileHeader *) 0) || (slotp->generation > hdrp->generation)))
+        hdrp = slotp;
+    }
+  }
+
+  if (hdrp != (WX_HistoryFileHeader *) 0) {
+    memcpy(&historyHeader, hdrp, sizeof(historyHeader));
+    inIndex = hdrp->inIndex;
+    rainInIndex = hdrp->rainInIndex;
+    rainTotalAtLastSave = hdrp->rainTotalAtLastSave;
+    rainInitComplete = 0; // Gauge total may have moved on while we were down, so re-baseline at the next rain save
+    for (t=0;t<WX_NUM_ROLLUP_TIERS;t++)
+      rollupTiers[t].currentBucket = hdrp->rollupCurrentBucket[t] % rollupTiers[t].numBuckets;
+    WX_totalBurnerRunSeconds = hdrp->totalBurnerRunSeconds;
+    memcpy(&minData, map + minOffset, sizeof(WX_Data));
+    memcpy(&maxData, map + maxOffset, sizeof(WX_Data));
+    minData.idu.ForecastStr = maxData.idu.ForecastStr = (char *) 0;
+  } else {
+    if (st.st_size != 0)
+      DPRINTF("History file %s doesn't match this version or is damaged, starting it over\n", fname);
+    memset(map, 0, size);
+    memset(&historyHeader, 0, sizeof(historyHeader));
+    memcpy(historyHeader.magic, WX_HISTORY_FILE_MAGIC, sizeof(historyHeader.magic));
+    historyHeader.version = WX_HISTORY_FILE_VERSION;
+    historyHeader.fileSize = size;
+    historyHeader.historyBlockSize = layoutHistoryBlock((char *) 0, maxRecordCount);
+    historyHeader.numRecords = maxRecordCount;
+    historyHeader.numRainRecords = maxRainRecordCount;
+    historyHeader.numChannels = WX_NUM_HISTORY_CHANNELS;
+    historyHeader.dataRecordSize = sizeof(WX_Data);
+    memcpy(map + historyOffset, historyBlock, historyHeader.historyBlockSize);
+    memcpy(map + rainOffset, rainRingBuffer, maxRainRecordCount * sizeof(unsigned int));
+  }
+
+  // From here on the history lives in the mapping
+  free(historyBlock);
+  free(rainRingBuffer);
+  historyBlock = map + historyOffset;
+  layoutHistoryBlock(historyBlock, maxRecordCount);
+  rainRingBuffer = (unsigned int *) (map + rainOffset);
+  historyFileMap = map;
+  historyFileSize = size;
+  historyDirtyStart = historyDirtyEnd = 0;
+
+  if (hdrp != (WX_HistoryFileHeader *) 0) {
+    // Pages of the snapshot after the header was written may have reached the disk before a crash
+    newest = (inIndex == 0) ? (int) maxRecordCount-1 : (int) inIndex-1;
+    if (computeRecordChecksum(newest) != historyHeader.newestRecordChecksum)
+      dropHistoryRecord(newest, "newest");
+    if (computeRecordChecksum(inIndex) != historyHeader.nextRecordChecksum)
+      dropHistoryRecord(inIndex, "oldest");
+    primeHistoryWindows();
+    primeExtremeWindows();
+    DPRINTF("Restored historical data from %s\n", fname);
+  }
+  historyAllDirty = TRUE;
+  syncHistoryFile();
+  return(0);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Flush and unmap the history file.  Historical data is no longer available afterwards until the datastore is
+// initialized again.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_CloseHistoryFile(void)
+{
+  if (historyFileMap == (char *) 0)
+    return;
+  syncHistoryFile();
+  munmap(historyFileMap, historyFileSize);
+  historyFileMap = (char *) 0;
+  historyFileSize = 0;
+  historyBlock = (char *) 0;
+  rainRingBuffer = (unsigned int *) 0;
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Warm start from a csv log file.
+//
+// When there's no saved history (no history file, or a new one), the newest lines of an existing csv log (written by
+// WX_WriteSensorDataToCSVFile with one snapshot per line) are loaded back into the ring, the rollups and the max/min
+// records so the web pages don't start out empty after a restart.  Columns are found by name from the header line.
+// Values of -99 (and temp/dewpoint pairs that are both 0, which is what's logged when a sensor had no samples) are
+// treated as missing.  Csv files only hold temps/dewpoints, pressure and energy, so humidity, wind and rain start
+// out empty.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+static BOOL isHistoryEmpty(void)
+{
+  int s, i;
+  size_t bitmapSize = (maxRecordCount+7)/8;
+
+  for (s=0;s<WX_NUM_SENSORS;s++)
+    for (i=0;i<(int) bitmapSize;i++)
+      if (sensorValidMap[s][i] != 0)
+        return(FALSE);
+  return(TRUE);
+}
+
+// Read a temp/dewpoint pair (logged in F) for one sensor.  Returns FALSE if the sensor had no data on this line.
+static BOOL getCsvTempPair(CSV_Line *linep, int tempCol, int dewCol, float *tempp, float *dewp)
+{
+  double temp, dew;
+
+  if (!CSV_GetFieldNumber(linep, tempCol, &temp) || !CSV_GetFieldNumber(linep, dewCol, &dew))
+    return(FALSE);
+  if (CSV_IsMissingTempPair(temp, dew))
+    return(FALSE);
+  *tempp = (temp-32)/1.8;
+  *dewp = (dew-32)/1.8;
+  return(TRUE);
+}
+
+// Add one record to the history the same way a snapshot would, but without any of the live packet processing
+static void importRecord(WX_Data *weatherDatap)
+{
+  pthread_mutex_lock(&extremesLock);
+  updateMinData(weatherDatap);
+  updateMaxData(weatherDatap);
+  pthread_mutex_unlock(&extremesLock);
+  updateHistoryWindows(inIndex, 0);
+  storeRecord(inIndex, weatherDatap, &weatherDatap->currentTime);
+  updateHistoryWindows(inIndex, 1);
+  addRecordToRollups(inIndex);
+  inIndex++;
+  if ( inIndex >= maxRecordCount )
+     inIndex = 0;
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Load up to maxLines of the newest lines from csv file fname into history.  Nothing is done if history already
+// holds data.  Returns the number of records loaded.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+int WX_LoadHistoryFromCsvFile(char *fname, int maxLines)
+{
+  int timeCol, efergyCol, owlCol, fuelCol, pressureCol, iduTempCol, iduDewCol, oduTempCol, oduDewCol;
+  int extTempCol[EXTRA_SENSOR_ARRAY_SIZE], extDewCol[EXTRA_SENSOR_ARRAY_SIZE];
+  const char *data, *end, *p;
+  CSV_Line line;
+  WX_Data d;
+  WX_Timestamp ts;
+  struct stat st;
+  double value, fuel;
+  char colName[40];
+  int fd, i, numLoaded = 0;
+  unsigned int pktCnt = 0;
+
+  if ((historyBlock == (char *) 0) || !isHistoryEmpty())
+    return(0);
+
+  if ((fd = open(fname, O_RDONLY)) < 0)
+    return(0);
+  if ((fstat(fd, &st) != 0) || (st.st_size == 0)) {
+    close(fd);
+    return(0);
+  }
+  data = (const char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == (const char *) MAP_FAILED) {
+    DPRINTF("Unable to map %s for warm start (%s)\n", fname, strerror(errno));
+    return(0);
+  }
+  end = data + st.st_size;
+
+  CSV_SplitLine(data, end, &line);
+  timeCol = CSV_FindField(&line, "Time");
+  efergyCol = CSV_FindField(&line, "efergyWatts");
+  owlCol = CSV_FindField(&line, "owlWatts");
+  fuelCol = CSV_FindField(&line, "fuelGallonsBurned");
+  pressureCol = CSV_FindField(&line, "iduSealevelPressure");
+  iduTempCol = CSV_FindField(&line, "iduTemp");
+  iduDewCol = CSV_FindField(&line, "iduDewpoint");
+  oduTempCol = CSV_FindField(&line, "oduTemp");
+  oduDewCol = CSV_FindField(&line, "oduDewpoint");
+  for (i=0;i<EXTRA_SENSOR_ARRAY_SIZE;i++) {
+    sprintf(colName, "ext%dTemp", i+1);
+    extTempCol[i] = CSV_FindField(&line, colName);
+    sprintf(colName, "ext%dDewpoint", i+1);
+    extDewCol[i] = CSV_FindField(&line, colName);
+  }
+  if (timeCol < 0) {
+    DPRINTF("No Time column in %s, skipping warm start\n", fname);
+    munmap((void *) data, st.st_size);
+    return(0);
+  }
+
+  p = CSV_FindLastLines(data, st.st_size, maxLines);
+  while (p < end) {
+    p = CSV_SplitLine(p, end, &line);
+    if (!CSV_GetFieldNumber(&line, timeCol, &value) || (value <= 0))
+      continue;
+
+    memset(&d, 0, sizeof(WX_Data));
+    d.currentTime.timet = (time_t) value;
+    // Same adjustment as a live snapshot so records line up with their 15 minute interval
+    if ((localtime(&d.currentTime.timet)->tm_min % 15) == 0)
+      d.currentTime.timet -= 60;
+    d.currentTime.PktCnt = ++pktCnt;
+    ts = d.currentTime;
+
+    if (getCsvTempPair(&line, iduTempCol, iduDewCol, &d.idu.Temp, &d.idu.Dewpoint)) {
+      setSensorTimestamps(&d, WX_SENSOR_IDU, &ts);
+      if (CSV_GetFieldNumber(&line, pressureCol, &value) && (value > 0))
+        d.idu.Pressure = (int) (value * 33.8638866667 + 0.5); // Logged as sealevel pressure, so offset stays 0
+    }
+    if (getCsvTempPair(&line, oduTempCol, oduDewCol, &d.odu.Temp, &d.odu.Dewpoint))
+      setSensorTimestamps(&d, WX_SENSOR_ODU, &ts);
+    for (i=0;i<EXTRA_SENSOR_ARRAY_SIZE;i++)
+      if (getCsvTempPair(&line, extTempCol[i], extDewCol[i], &d.ext[i].Temp, &d.ext[i].Dewpoint))
+        setSensorTimestamps(&d, WX_SENSOR_EXT1+i, &ts);
+    if (CSV_GetFieldNumber(&line, efergyCol, &value) && (value > 0)) {
+      d.energy.Watts = d.energy.WattsAvg = d.energy.WattsHistory[0] = (int) value;
+      setSensorTimestamps(&d, WX_SENSOR_EFERGY, &ts);
+    }
+    if (CSV_GetFieldNumber(&line, owlCol, &value) && (value > 0)) {
+      d.owl.Watts = d.owl.WattsAvg = d.owl.WattsHistory[0] = (int) value;
+      if (CSV_GetFieldNumber(&line, fuelCol, &fuel) && (fuel > 0) && (WxConfig.fuelBurnerGallonsPerHour > 0))
+        d.owl.BurnerRuntimeSeconds = (int) (fuel / WxConfig.fuelBurnerGallonsPerHour * 3600 + 0.5);
+      setSensorTimestamps(&d, WX_SENSOR_OWL, &ts);
+    }
+    importRecord(&d);
+    numLoaded++;
+  }
+  munmap((void *) data, st.st_size);
+
+  if (numLoaded > 0) {
+    DPRINTF("Loaded %d historical records from %s\n", numLoaded, fname);
+    primeExtremeWindows();
+    historyAllDirty = TRUE;
+    syncHistoryFile();
+  }
+  return(numLoaded);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Rolling 24 hour / 7 day extremes
+//--------------------------------------------------------------------------------------------------------------------------------------------
+static WX_Timestamp *getFieldTimestamp(WX_Data *weatherDatap, WX_SensorId sensor, WX_FieldId field)
+{
+  WX_ExtraSensorData *extp;
+
+  switch (sensor) {
+    case WX_SENSOR_IDU:
+      switch (field) {
+        case WX_FIELD_TEMP:              return(&weatherDatap->idu.TempTimestamp);
+        case WX_FIELD_RELHUM:            return(&weatherDatap->idu.RelHumTimestamp);
+        case WX_FIELD_DEWPOINT:          return(&weatherDatap->idu.DewpointTimestamp);
+        case WX_FIELD_PRESSURE:
+        case WX_FIELD_SEALEVEL_PRESSURE: return(&weatherDatap->idu.PressureTimestamp);
+        default: break;
+      }
+      break;
+    case WX_SENSOR_ODU:
+      switch (field) {
+        case WX_FIELD_TEMP:     return(&weatherDatap->odu.TempTimestamp);
+        case WX_FIELD_RELHUM:   return(&weatherDatap->odu.RelHumTimestamp);
+        case WX_FIELD_DEWPOINT: return(&weatherDatap->odu.DewpointTimestamp);
+        default: break;
+      }
+      break;
+    case WX_SENSOR_RG:
+      return((field == WX_FIELD_RAIN_RATE) ? &weatherDatap->rg.RateTimestamp : &weatherDatap->rg.Timestamp);
+    case WX_SENSOR_WG:
+      switch (field) {
+        case WX_FIELD_WIND_SPEED:     return(&weatherDatap->wg.SpeedTimestamp);
+        case WX_FIELD_WIND_AVG_SPEED: return(&weatherDatap->wg.AvgSpeedTimestamp);
+        default:                      return(&weatherDatap->wg.Timestamp);
+      }
+    case WX_SENSOR_EFERGY:
+    case WX_SENSOR_OWL:
+      return(&getEnergySensor(weatherDatap, sensor)->Timestamp);
+    default:
+      if ((sensor < WX_SENSOR_EXT1) || (sensor >= WX_NUM_SENSORS))
+        break;
+      extp = &weatherDatap->ext[sensor-WX_SENSOR_EXT1];
+      switch (field) {
+        case WX_FIELD_TEMP:     return(&extp->TempTimestamp);
+        case WX_FIELD_RELHUM:   return(&extp->RelHumTimestamp);
+        case WX_FIELD_DEWPOINT: return(&extp->DewpointTimestamp);
+        default: break;
+      }
+  }
+  return((WX_Timestamp *) 0);
+}
+
+// Fields that are worked out when a snapshot is taken rather than sent by the sensor
+static BOOL isSnapshotField(WX_FieldId field)
+{
+  return((field == WX_FIELD_WATTS_AVG) || (field == WX_FIELD_BURNER_SECONDS));
+}
+
+// Fields tracked in the all time min/max records as each packet comes in (the rest are handled by updateMinData()
+// and updateMaxData() at snapshot time)
+static BOOL isPacketMaxMinField(WX_FieldId field)
+{
+  switch (field) {
+    case WX_FIELD_TEMP:
+    case WX_FIELD_RELHUM:
+    case WX_FIELD_DEWPOINT:
+    case WX_FIELD_PRESSURE:
+    case WX_FIELD_RAIN_RATE:
+    case WX_FIELD_WIND_SPEED:
+    case WX_FIELD_WIND_AVG_SPEED:
+    case WX_FIELD_WATTS:
+      return(TRUE);
+    default:
+      return(FALSE);
+  }
+}
+
+static void clearExtremeWindows(void)
+{
+  int w, i;
+
+  for (w=0;w<WX_NUM_EXTREME_WINDOWS;w++)
+    for (i=0;i<WX_NUM_HISTORY_CHANNELS;i++) {
+      WX_ExtremeWindow *winp = &extremeWindows[w];
+      winp->minDeque[i].head = winp->minDeque[i].count = 0;
+      winp->maxDeque[i].head = winp->maxDeque[i].count = 0;
+      winp->minDeque[i].samples = (w == WX_EXTREME_24H) ? extreme24hSamples[0][i] : extreme7dSamples[0][i];
+      winp->maxDeque[i].samples = (w == WX_EXTREME_24H) ? extreme24hSamples[1][i] : extreme7dSamples[1][i];
+    }
+}
+
+// Drop samples from the front of a deque once their bucket has left the window
+static void expireExtremeSamples(WX_ExtremeWindow *winp, WX_ExtremeDeque *dq, unsigned int now)
+{
+  unsigned int bucket = now / winp->bucketSeconds;
+
+  while ((dq->count > 0) && ((dq->samples[dq->head].timet / winp->bucketSeconds) + winp->numBuckets <= bucket)) {
+    dq->head = (dq->head + 1) % winp->numBuckets;
+    dq->count--;
+  }
+}
+
+static void pushExtremeSample(WX_ExtremeWindow *winp, WX_ExtremeDeque *dq, WX_ExtremeSample *sp, BOOL wantMax)
+{
+  WX_ExtremeSample *backp;
+
+  expireExtremeSamples(winp, dq, sp->timet);
+  // Anything at the back that the new sample beats (or ties, the new one lasts longer) can never be the extreme again
+  while (dq->count > 0) {
+    backp = &dq->samples[(dq->head + dq->count - 1) % winp->numBuckets];
+    if (wantMax ? (backp->raw > sp->raw) : (backp->raw < sp->raw))
+      break;
+    dq->count--;
+  }
+  if (dq->count > 0) {
+    backp = &dq->samples[(dq->head + dq->count - 1) % winp->numBuckets];
+    if ((backp->timet / winp->bucketSeconds) >= (sp->timet / winp->bucketSeconds))
+      return; // Already have a better sample for this bucket (or the clock went backwards)
+  }
+  if (dq->count == winp->numBuckets) { // Only possible if the clock jumps, drop the oldest
+    dq->head = (dq->head + 1) % winp->numBuckets;
+    dq->count--;
+  }
+  dq->samples[(dq->head + dq->count) % winp->numBuckets] = *sp;
+  dq->count++;
+}
+
+static void addExtremeSample(int chIdx, int raw, time_t t)
+{
+  WX_ExtremeSample sample;
+  int w;
+
+  sample.timet = (unsigned int) t;
+  sample.raw = raw;
+  for (w=0;w<WX_NUM_EXTREME_WINDOWS;w++) {
+    pushExtremeSample(&extremeWindows[w], &extremeWindows[w].minDeque[chIdx], &sample, FALSE);
+    pushExtremeSample(&extremeWindows[w], &extremeWindows[w].maxDeque[chIdx], &sample, TRUE);
+  }
+}
+
+// Push a sensor's current values into the windows.  snapshotFields selects the fields worked out at snapshot
+// time instead of the ones sent in each packet.
+static void addSensorExtremes(WX_Data *weatherDatap, WX_SensorId sensor, BOOL snapshotFields)
+{
+  WX_Timestamp *ts = WX_GetSensorTimestamp(weatherDatap, sensor);
+  int f, chIdx;
+  float value;
+
+  if ((ts == (WX_Timestamp *) 0) || !isTimestampPresent(ts))
+    return;
+  for (f=0;f<WX_NUM_FIELDS;f++) {
+    chIdx = historyChannelIndex[sensor][f];
+    if ((chIdx < 0) || (isSnapshotField(f) != snapshotFields) || !WX_GetFieldValue(weatherDatap, sensor, f, &value))
+      continue;
+    addExtremeSample(chIdx, decodeHistoryRaw(&historyChannels[chIdx], encodeHistoryValue(&historyChannels[chIdx], value)), ts->timet);
+  }
+}
+
+// Rebuild the windows from the snapshot ring (used after history has been restored at startup)
+static void primeExtremeWindows(void)
+{
+  int n, s, i, slot;
+
+  pthread_mutex_lock(&extremesLock);
+  clearExtremeWindows();
+  for (n=maxRecordCount;n>=1;n--) {
+    slot = getRecordSlot(n);
+    for (i=0;i<WX_NUM_HISTORY_CHANNELS;i++) {
+      const WX_HistoryChannel *chp = &historyChannels[i];
+      s = chp->sensor;
+      if (getMapBit(sensorValidMap[s], slot))
+        addExtremeSample(i, decodeHistoryRaw(chp, historyColumn[i][slot]), recordTime[slot] - sensorAge[s][slot]);
+    }
+  }
+  pthread_mutex_unlock(&extremesLock);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Called for each packet accepted from a sensor.  Updates the all time min/max records for the fields sent in the
+// packet and pushes them into the rolling windows.  Constant time per packet.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_UpdatePacketExtremes(WX_Data *weatherDatap, WX_SensorId sensor)
+{
+  WX_Timestamp *ts, *minTs, *maxTs;
+  float value, minValue, maxValue;
+  int f;
+
+  if ((historyBlock == (char *) 0) || (sensor < 0) || (sensor >= WX_NUM_SENSORS))
+    return;
+
+  pthread_mutex_lock(&extremesLock);
+  for (f=0;f<WX_NUM_FIELDS;f++) {
+    if ((historyChannelIndex[sensor][f] < 0) || !isPacketMaxMinField(f) ||
+        !WX_GetFieldValue(weatherDatap, sensor, f, &value) || ((ts = getFieldTimestamp(weatherDatap, sensor, f)) == (WX_Timestamp *) 0))
+      continue;
+    minTs = getFieldTimestamp(&minData, sensor, f);
+    maxTs = getFieldTimestamp(&maxData, sensor, f);
+    WX_GetFieldValue(&minData, sensor, f, &minValue);
+    WX_GetFieldValue(&maxData, sensor, f, &maxValue);
+    if (isNewFloatLower(value, ts, minValue, minTs) == TRUE) {
+      setFieldValue(&minData, sensor, f, value);
+      *minTs = *ts;
+    }
+    if (isNewFloatHigher(value, ts, maxValue, maxTs) == TRUE) {
+      setFieldValue(&maxData, sensor, f, value);
+      *maxTs = *ts;
+    }
+  }
+  addSensorExtremes(weatherDatap, sensor, FALSE);
+  pthread_mutex_unlock(&extremesLock);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Get the min or max of a field over one of the rolling windows, along with when it happened.  Returns FALSE if
+// there was no data for the field in the window.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+BOOL WX_GetExtremeValue(WX_ExtremeWindowId window, WX_SensorId sensor, WX_FieldId field, BOOL wantMax, float *valuep, time_t *timep)
+{
+  WX_ExtremeWindow *winp;
+  WX_ExtremeDeque *dq;
+  int chIdx;
+  BOOL found = FALSE;
+
+  if ((window < 0) || (window >= WX_NUM_EXTREME_WINDOWS) || (sensor < 0) || (sensor >= WX_NUM_SENSORS) ||
+      (field < 0) || (field >= WX_NUM_FIELDS) || ((chIdx = historyChannelIndex[sensor][field]) < 0))
+    return(FALSE);
+
+  winp = &extremeWindows[window];
+  pthread_mutex_lock(&extremesLock);
+  dq = wantMax ? &winp->maxDeque[chIdx] : &winp->minDeque[chIdx];
+  expireExtremeSamples(winp, dq, (unsigned int) time(NULL));
+  if (dq->count > 0) {
+    *valuep = dq->samples[dq->head].raw / (float) historyChannels[chIdx].scale;
+    if (timep != (time_t *) 0)
+      *timep = dq->samples[dq->head].timet;
+    found = TRUE;
+  }
+  pthread_mutex_unlock(&extremesLock);
+  return(found);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Fill in a data set holding the min (or max) of every field over one of the rolling windows, laid out like the all
+// time min/max records.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_LoadExtremeDataRecord(WX_ExtremeWindowId window, BOOL wantMax, WX_Data *destp)
+{
+  WX_Timestamp ts, *fieldTs, *sensorTs;
+  time_t t;
+  float value;
+  int i;
+
+  memset(destp, 0, sizeof(WX_Data));
+  ts.PktCnt = (wxData.currentTime.PktCnt != 0) ? wxData.currentTime.PktCnt : 1;
+  for (i=0;i<WX_NUM_HISTORY_CHANNELS;i++) {
+    const WX_HistoryChannel *chp = &historyChannels[i];
+    if (!WX_GetExtremeValue(window, chp->sensor, chp->field, wantMax, &value, &t))
+      continue;
+    ts.timet = t;
+    setFieldValue(destp, chp->sensor, chp->field, value);
+    if ((fieldTs = getFieldTimestamp(destp, chp->sensor, chp->field)) != (WX_Timestamp *) 0)
+      *fieldTs = ts;
+    sensorTs = WX_GetSensorTimestamp(destp, chp->sensor);
+    if ((sensorTs != (WX_Timestamp *) 0) && !isTimestampPresent(sensorTs))
+      *sensorTs = ts;
+  }
+}
+
+// Same, in a record that's overwritten by the next call
+WX_Data *WX_GetExtremeDataRecord(WX_ExtremeWindowId window, BOOL wantMax)
+{
+  WX_LoadExtremeDataRecord(window, wantMax, &extremeRecord);
+  return(&extremeRecord);
+}
+
+char *WX_GetExtremeWindowName(WX_ExtremeWindowId window)
+{
+  if ((window < 0) || (window >= WX_NUM_EXTREME_WINDOWS))
+    return("");
+  return(extremeWindows[window].name);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Copy the data set that contains all the minimum values for each data field (along with timestamps of when it happened)
+// into the caller's buffer.  The receive thread keeps updating the record, so it's copied under the lock.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_LoadMinDataRecord(WX_Data *destp)
+{
+  pthread_mutex_lock(&extremesLock);
+  *destp = minData;
+  pthread_mutex_unlock(&extremesLock);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Same for the data set that contains all the maximum values
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_LoadMaxDataRecord(WX_Data *destp)
+{
+  pthread_mutex_lock(&extremesLock);
+  *destp = maxData;
+  pthread_mutex_unlock(&extremesLock);
 }
 
 int isNewFloatLower(float newxData, WX_Timestamp *newTs, float minData, WX_Timestamp *minTs)
@@ -631,171 +2423,89 @@ void updateMaxData(WX_Data *datap)
  }
 }
 
-void appendLineToCsvFile(char *fname, char *header_line, char *lineToAppend) {
-   FILE *fd;
-   
-   // First test if file exists.  If it doesn't, create file and write header
-   if ((fd = fopen(fname, "r")) == NULL) {
-     if ((fd = fopen(fname, "w")) == NULL) {
-      fprintf(stderr,"RTL-Wx: Unable to open %s file for writing.  Exiting...\n\n", fname);
-      exit(1);     
-     } else {
-      fprintf(fd, header_line);
-      fclose(fd);
-     }
-   }
-   else
-      fclose(fd);
-      
-   if ((fd = fopen(fname, "a")) == NULL) {
-      fprintf(stderr,"RTL-Wx: Unable to open %s file for appending.  Exiting...\n\n", fname);
-      exit(1);     
-     } 
-     
-   fprintf(fd, lineToAppend);
-   fclose(fd);  
+// A csv log line (and binary log record) waiting for the I/O worker to write it
+typedef struct _CsvLineJob {
+   char fname[MAX_CONFIG_NAME_SIZE];
+   char binName[MAX_CONFIG_NAME_SIZE];   // Empty if the file has no binary log
+   WX_CsvWriterOptions options;          // Copied from the configuration when the line is queued
+   time_t timestamp;
+   double binValues[BIN_LOG_NUM_VALUES];
+   char header[WX_MAX_CSV_COLUMNS*(WX_CSV_COLUMN_NAME_SIZE+1) + 8];
+   char line[WX_MAX_CSV_COLUMNS*24 + 24];
+} CsvLineJob;
+
+static void appendCsvLineJob(void *arg) {
+   CsvLineJob *jobp = (CsvLineJob *) arg;
+
+   WX_CsvAppendLine(jobp->fname, jobp->header, jobp->line, &jobp->options);
+   if (jobp->binName[0] != 0)
+     WX_BinLogAppend(jobp->binName, jobp->timestamp, jobp->binValues);
 }
 
 // Append a line of sensor data to a CSV file by combining info from one or more saved data records
 // numSamplesToInclude determines the time interval represented by each csv line.  (eg num samples of 1=15minutes, 4=1 hour, 16=4 hours, 96=1 day --> assuming 15 minutes per sample snapshot)
+// The line is built here and handed to the I/O worker to be written.
 void WX_WriteSensorDataToCSVFile(char *csvFilename, WX_Data *weatherDatap, WX_ConfigSettings *cVarp, int numSamplesToInclude) {
-   int efergySamples=0; int efergyWattsAvg=0; 
-   int owlSamples=0; int owlWattsAvg=0; int burnerRuntimeSeconds=0; 
-   int iduSamples=0; float iduTemp=0; float iduDewpoint=0; float iduSealevelPressure=0;
-   int oduSamples=0; float oduTemp=0; float oduDewpoint=0;
-   int extraSensorSamples[EXTRA_SENSOR_ARRAY_SIZE]; float extraSensorTemp[EXTRA_SENSOR_ARRAY_SIZE]; float extraSensorDewpoint[EXTRA_SENSOR_ARRAY_SIZE];
-   
-   int sensor, sample;
-   for(sensor=0; sensor < EXTRA_SENSOR_ARRAY_SIZE; sensor++) {
-      extraSensorSamples[sensor] = 0;
-      extraSensorTemp[sensor] = 0;
-      extraSensorDewpoint[sensor] = 0;      
-   }
-  
-   for (sample=1;sample<=numSamplesToInclude;sample++) {
-      WX_Data *wxDatap = WX_GetWeatherDataRecord(sample);
-      if (wxDatap != NULL) {
-         if (isTimestampPresent(&wxDatap->energy.Timestamp)) {
-	   efergyWattsAvg += wxDatap->energy.WattsAvg;
-	   burnerRuntimeSeconds += wxDatap->energy.BurnerRuntimeSeconds; // Update this for either sensor (only one will have data)
-	   efergySamples++;
-	 }
-         if (isTimestampPresent(&wxDatap->owl.Timestamp)) {
-	   owlWattsAvg += wxDatap->owl.WattsAvg;
-	   burnerRuntimeSeconds += wxDatap->owl.BurnerRuntimeSeconds; 
-	   owlSamples++;
-	 }
-         if (isTimestampPresent(&wxDatap->idu.Timestamp)) {
-	   iduTemp += wxDatap->idu.Temp;
-	   iduDewpoint += wxDatap->idu.Dewpoint;
-	   iduSealevelPressure += ((wxDatap->idu.Pressure+wxDatap->idu.SeaLevelOffset)/33.8638866667);
-	   iduSamples++;
-	 }
-         if (isTimestampPresent(&wxDatap->odu.Timestamp)) {
-	   oduTemp += wxDatap->odu.Temp;
-	   oduDewpoint += wxDatap->odu.Dewpoint;
-	   oduSamples++;
-	 }	 
-         for(sensor=0; sensor < EXTRA_SENSOR_ARRAY_SIZE; sensor++)
-            if (isTimestampPresent(&wxDatap->ext[sensor].Timestamp)) {
-               extraSensorTemp[sensor] += wxDatap->ext[sensor].Temp;
-               extraSensorDewpoint[sensor] += wxDatap->ext[sensor].Dewpoint;      
-               extraSensorSamples[sensor] ++;      
-            }
-	}
-   }
-   
-   if (efergySamples > 1)
-     efergyWattsAvg /= efergySamples;
-   if (owlSamples > 1)
-     owlWattsAvg /= owlSamples;	 
-   if (iduSamples > 0) {
-      iduTemp = (iduTemp/iduSamples)*1.8+32;
-      iduDewpoint = (iduDewpoint/iduSamples)*1.8+32;
-      iduSealevelPressure /= iduSamples;
-   }
-   if (oduSamples > 0) {
-      oduTemp = (oduTemp/oduSamples)*1.8+32;
-      oduDewpoint = (oduDewpoint/oduSamples)*1.8+32;
-   }
-   for(sensor=0; sensor < EXTRA_SENSOR_ARRAY_SIZE; sensor++)
-     if (extraSensorSamples[sensor] > 0) {
-      extraSensorTemp[sensor] = (extraSensorTemp[sensor]/extraSensorSamples[sensor])*1.8+32;
-      extraSensorDewpoint[sensor] = (extraSensorDewpoint[sensor]/extraSensorSamples[sensor])*1.8+32;
+   WX_CsvColumn *columns;
+   int numColumns = WX_GetCsvSchema(FALSE, &columns);
+   double values[WX_MAX_CSV_COLUMNS];
+   CsvLineJob job;
+   int i, j, k;
+
+   strcpy(job.fname, csvFilename);
+   WX_GetCsvWriterOptions(cVarp, csvFilename, &job.options);
+   job.binName[0] = 0;
+   job.timestamp = time(NULL);
+
+   // Walk the column list compiled from the configuration (or the built in one)
+   *WX_PutCsvSchemaHeader(job.header, columns, numColumns) = 0;
+   *WX_PutCsvSchemaLine(job.line, columns, numColumns, job.timestamp, numSamplesToInclude, values) = 0;
+
+   for (i=0;i<cVarp->numCsvFilesToUpdate;i++)
+     if (cVarp->csvFiles[i].binaryLog && (strcmp(cVarp->csvFiles[i].fname, csvFilename) == 0)) {
+       // The binary log has a fixed set of columns, picked out of this line by name
+       for (j=0;j<BIN_LOG_NUM_VALUES;j++) {
+         job.binValues[j] = 0.0/0.0; // NaN is stored as missing
+         for (k=0;k<numColumns;k++)
+           if (strcmp(columns[k].name, WX_GetBinLogColumnName(j)) == 0)
+             job.binValues[j] = values[k];
+       }
+       WX_GetBinLogName(csvFilename, job.binName);
+       break;
      }
-     
-   char lineToAppend[500];
-   time_t timestamp = time(NULL);
-   //                                                     time efergy owl  fuel       odu                          idu                          ext1                        ext2                         ext3                       ext4                         pressure
-   sprintf(lineToAppend,"%lu,%d,%d,%4.2f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%5.2f\n", 
-      timestamp,efergyWattsAvg,owlWattsAvg,(float) burnerRuntimeSeconds/3600 * cVarp->fuelBurnerGallonsPerHour,
-      oduTemp,oduDewpoint,iduTemp,iduDewpoint,
-      extraSensorTemp[0],extraSensorDewpoint[0],extraSensorTemp[1],extraSensorDewpoint[1],
-      extraSensorTemp[2],extraSensorDewpoint[2],extraSensorTemp[3],extraSensorDewpoint[3],
-      iduSealevelPressure);
-   
-   appendLineToCsvFile(csvFilename, 
-     "Time,efergyWatts,owlWatts,fuelGallonsBurned,oduTemp,oduDewpoint,iduTemp,iduDewpoint,ext1Temp,ext1Dewpoint,ext2Temp,ext2Dewpoint,ext3Temp,ext3Dewpoint,ext4Temp,ext4Dewpoint,iduSealevelPressure\n",
-     lineToAppend);
+
+   WX_QueueIoJob("csv log line", appendCsvLineJob, &job, sizeof(job), FALSE);
+}
+
+// The realtime csv file contents waiting for the I/O worker to publish them
+typedef struct _PublishFileJob {
+   char fname[MAX_CONFIG_NAME_SIZE];
+   int len;
+   char data[WX_MAX_CSV_COLUMNS*(WX_CSV_COLUMN_NAME_SIZE+24) + 32];
+} PublishFileJob;
+
+static void publishFileJob(void *arg) {
+   PublishFileJob *jobp = (PublishFileJob *) arg;
+   WX_CsvPublishFile(jobp->fname, jobp->data, jobp->len);
 }
 
 // Create a single record CSV file with the latest sensor data
 void WX_WriteRealTimeCSVFile() {
-   int noDataSeconds = 300;
-   int noDataValue = -99;
-   
-   int efergyWatts = wxData.energy.Watts;
-   int efergyWattsLastHour = getWattsAvgAvg(1, 4);
-   int efergyWattsLastDay  = getWattsAvgAvg(1, 24*4);
-   if (difftime(wxData.currentTime.timet, wxData.energy.Timestamp.timet)>noDataSeconds)
-      efergyWatts = noDataValue;
-      
-   int owlWatts = wxData.owl.Watts;
-   int owlWattsLastHour = getWattsAvgAvg(0, 4);
-   int owlWattsLastDay = getWattsAvgAvg(0, 24*4);	 
-   if (difftime(wxData.currentTime.timet, wxData.owl.Timestamp.timet)>noDataSeconds)
-      owlWatts = noDataValue;
-         
-   float fuelBurnedLastHour = (float) getBurnerRunSecondsTotal(0, 4) /(60*60) * WxConfig.fuelBurnerGallonsPerHour;
-   float fuelBurnedLastDay = (float) getBurnerRunSecondsTotal(0, 24*4) /(60*60) * WxConfig.fuelBurnerGallonsPerHour;
-   float fuelBurnedTotal = (float) WX_totalBurnerRunSeconds/(60*60) * WxConfig.fuelBurnerGallonsPerHour;
-	if (owlWatts == noDataValue)
-      fuelBurnedLastHour = noDataValue;
-      
-	float odu_temp = (difftime(wxData.currentTime.timet, wxData.odu.Timestamp.timet)>noDataSeconds)? noDataValue : wxData.odu.Temp*1.8+32;	
-	float odu_dew  = (difftime(wxData.currentTime.timet, wxData.odu.Timestamp.timet)>noDataSeconds)? noDataValue : wxData.odu.Dewpoint*1.8+32;
-	float idu_temp = (difftime(wxData.currentTime.timet, wxData.idu.Timestamp.timet)>noDataSeconds)? noDataValue : wxData.idu.Temp*1.8+32;	
-	float idu_dew  = (difftime(wxData.currentTime.timet, wxData.idu.Timestamp.timet)>noDataSeconds)? noDataValue : wxData.idu.Dewpoint*1.8+32;
-	float ext0_temp = (difftime(wxData.currentTime.timet, wxData.ext[0].Timestamp.timet)>noDataSeconds)? noDataValue : wxData.ext[0].Temp*1.8+32;	
-	float ext0_dew  = (difftime(wxData.currentTime.timet, wxData.ext[0].Timestamp.timet)>noDataSeconds)? noDataValue : wxData.ext[0].Dewpoint*1.8+32;
-	float ext1_temp = (difftime(wxData.currentTime.timet, wxData.ext[1].Timestamp.timet)>noDataSeconds)? noDataValue : wxData.ext[1].Temp*1.8+32;	
-	float ext1_dew  = (difftime(wxData.currentTime.timet, wxData.ext[1].Timestamp.timet)>noDataSeconds)? noDataValue : wxData.ext[1].Dewpoint*1.8+32;
-	float ext2_temp = (difftime(wxData.currentTime.timet, wxData.ext[2].Timestamp.timet)>noDataSeconds)? noDataValue : wxData.ext[2].Temp*1.8+32;	
-	float ext2_dew  = (difftime(wxData.currentTime.timet, wxData.ext[2].Timestamp.timet)>noDataSeconds)? noDataValue : wxData.ext[2].Dewpoint*1.8+32;
-	float ext3_temp = (difftime(wxData.currentTime.timet, wxData.ext[3].Timestamp.timet)>noDataSeconds)? noDataValue : wxData.ext[3].Temp*1.8+32;	
-	float ext3_dew  = (difftime(wxData.currentTime.timet, wxData.ext[3].Timestamp.timet)>noDataSeconds)? noDataValue : wxData.ext[3].Dewpoint*1.8+32;
-			
-   char csvString[500];
-   time_t timestamp = time(NULL);
-   //                                             time  efergy               owl                   fuel                                         odu                          idu                          ext1                        ext2                         ext3                       ext4                         pressure
-   sprintf(csvString,"%lu,%d,%d,%d,%d,%d,%d,%4.2f,%4.2f,%4.2f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%5.2f\n", 
-      timestamp,
-      efergyWatts,efergyWattsLastHour,efergyWattsLastDay,
-      owlWatts,owlWattsLastHour,owlWattsLastDay, 
-      fuelBurnedLastHour,fuelBurnedLastDay,fuelBurnedTotal,
-      odu_temp, odu_dew, idu_temp, idu_dew, 
-      ext0_temp, ext0_dew, ext1_temp, ext1_dew, ext2_temp, ext2_dew, ext3_temp, ext3_dew, 
-      (wxData.idu.Pressure + wxData.idu.SeaLevelOffset)/33.8638866667);
-     
-   FILE *fd; 
-   char *fname = WxConfig.realtimeCsvFile;   
-   if ((fd = fopen(fname, "w+")) == NULL) {
-      fprintf(stderr,"RTL-Wx: Unable to open %s file for writing.  Exiting...\n\n", fname);
-      exit(1);     
-     } 
-   fprintf(fd,"Time,efergyWatts,efergyLastHr,efergyLastDay,owlWatts,owlLastHr,owlLastDay,fuelGallonsLastHr,fuelLastDay,fuelTotal,oduTemp,oduDewpoint,iduTemp,iduDewpoint,ext1Temp,ext1Dewpoint,ext2Temp,ext2Dewpoint,ext3Temp,ext3Dewpoint,ext4Temp,ext4Dewpoint,iduSealevelPressure\n");
-   fprintf(fd,csvString);
-   fclose(fd); 
+   WX_CsvColumn *columns;
+   int numColumns = WX_GetCsvSchema(TRUE, &columns);
+   PublishFileJob job;
+   char *p;
+
+   // The header and data line are built together in one buffer and published with a single write (the file is
+   // written under a temp name and renamed into place so the web page never sees a partly written file)
+   strcpy(job.fname, WxConfig.realtimeCsvFile);
+   p = WX_PutCsvSchemaHeader(job.data, columns, numColumns);
+   p = WX_PutCsvSchemaLine(p, columns, numColumns, time(NULL), 0, NULL);
+   job.len = p - job.data;
+
+   // Only the used part of the buffer is copied into the queue.  If the last update hasn't been written yet it is
+   // replaced by this one.
+   WX_QueueIoJob("realtime csv", publishFileJob, &job, sizeof(job) - sizeof(job.data) + job.len, TRUE);
 }
 
 
@@ -0,0 +1,271 @@
+
+/*========================================================================
+
+   FileWatch.c
+
+   Keeps track of changes to rtl-wx.conf and the tag file templates with
+   inotify, so they only have to be looked at again when they've actually
+   changed.  Before this the configuration was re-read every
+   configFileReadFrequency minutes whether it had changed or not (and an
+   edit took up to that long to be noticed), and every tag file pass did a
+   stat() of each template to see if it needed recompiling.
+
+   A file is registered with WX_WatchFile(), which adds a watch on the
+   directory it's in (editors usually save by writing a new file and
+   renaming it over the old one, so watching the file itself would lose
+   track of it).  Each registered file has a change count that goes up
+   whenever the file is written, replaced or removed.  A caller that keeps
+   something worked out from a file (the compiled template, the parsed
+   settings) remembers the count it saw before reading the file, and only
+   needs to look at the file again once the count is different.
+
+   WX_GetFileChangeCount() returns FALSE for a file that isn't being
+   watched (inotify not available, too many files, the directory couldn't
+   be watched or has gone away), and the caller goes back to checking the
+   file itself.  Counts are never reset, so a file registered again after a
+   configuration re-read carries on from where it was.
+
+   The events are read by the main loop (WX_ProcessFileWatchEvents), which
+   also waits on the inotify descriptor along with the command input.  The
+   counts are read by the tag file threads, so they're kept under a lock.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS
+   OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS
+   OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+   OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF OR INABILITY TO USE THIS SOFTWARE, EVEN IF
+   THE COPYRIGHT HOLDERS OR CONTRIBUTORS ARE AWARE OF THE POSSIBILITY OF SUCH DAMAGE.
+
+========================================================================*/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "rtl-wx.h"
+
+#define WATCH_MAX_FILES (MAX_CONFIG_LIST_SIZE + 8)
+#define WATCH_MAX_DIRS  WATCH_MAX_FILES
+#define WATCH_EVENTS    (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE)
+
+typedef struct _WX_WatchedDir {
+  char path[MAX_CONFIG_NAME_SIZE];
+  int wd;                  // -1 once the watch has gone away (directory removed or renamed)
+} WX_WatchedDir;
+
+typedef struct _WX_WatchedFile {
+  char fname[MAX_CONFIG_NAME_SIZE];   // As registered (and as looked up)
+  char *baseName;                     // Part of fname after the directory
+  int dir;                            // Index in watchedDirs
+  unsigned int changeCount;
+} WX_WatchedFile;
+
+static int inotifyFd = -1;
+static WX_WatchedDir watchedDirs[WATCH_MAX_DIRS];
+static int numWatchedDirs = 0;
+static WX_WatchedFile watchedFiles[WATCH_MAX_FILES];
+static int numWatchedFiles = 0;
+static pthread_mutex_t watchLock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int eventsSeen;
+static unsigned int overflows;
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Start watching.  If inotify can't be used, nothing is watched and everything carries on checking files itself.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_StartFileWatch(void)
+{
+  if (inotifyFd >= 0)
+    return;
+  if ((inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+    DPRINTF("File Watch: Unable to start inotify (%s), files will be checked for changes when they're used\n", strerror(errno));
+}
+
+int WX_GetFileWatchFd(void)
+{
+  return(inotifyFd);
+}
+
+// Find or add the watch for a directory.  Returns the index in watchedDirs, or -1.
+static int watchDir(char *path)
+{
+  int i, wd;
+
+  for (i=0;i<numWatchedDirs;i++)
+    if (strcmp(watchedDirs[i].path, path) == 0)
+      break;
+  if ((i < numWatchedDirs) && (watchedDirs[i].wd >= 0))
+    return(i);
+  if ((i == numWatchedDirs) && (numWatchedDirs >= WATCH_MAX_DIRS))
+    return(-1);
+
+  if ((wd = inotify_add_watch(inotifyFd, path, WATCH_EVENTS | IN_ONLYDIR)) < 0) {
+    DPRINTF("File Watch: Unable to watch %s (%s)\n", path, strerror(errno));
+    return(-1);
+  }
+  if (i == numWatchedDirs) {
+    strcpy(watchedDirs[i].path, path);
+    numWatchedDirs++;
+  }
+  watchedDirs[i].wd = wd;
+  return(i);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Start keeping track of changes to fname.  Registering a file that's already watched does nothing.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_WatchFile(char *fname)
+{
+  char dirPath[MAX_CONFIG_NAME_SIZE];
+  WX_WatchedFile *wfp;
+  char *slash;
+  int i, dir;
+
+  if ((inotifyFd < 0) || (fname[0] == 0) || (strlen(fname) >= MAX_CONFIG_NAME_SIZE))
+    return;
+
+  pthread_mutex_lock(&watchLock);
+  for (i=0;i<numWatchedFiles;i++)
+    if (strcmp(watchedFiles[i].fname, fname) == 0)
+      break;
+  if ((i < numWatchedFiles) && (watchedDirs[watchedFiles[i].dir].wd >= 0)) {
+    pthread_mutex_unlock(&watchLock);
+    return;
+  }
+  if ((i == numWatchedFiles) && (numWatchedFiles >= WATCH_MAX_FILES)) {
+    pthread_mutex_unlock(&watchLock);
+    DPRINTF("File Watch: Too many files, %s will be checked for changes when it's used\n", fname);
+    return;
+  }
+
+  strcpy(dirPath, fname);
+  if ((slash = strrchr(dirPath, '/')) == NULL)
+    strcpy(dirPath, ".");
+  else if (slash == dirPath)
+    dirPath[1] = 0;   // A file in /
+  else
+    *slash = 0;
+  if ((dir = watchDir(dirPath)) >= 0) {
+    wfp = &watchedFiles[i];
+    if (i == numWatchedFiles) {
+      strcpy(wfp->fname, fname);
+      slash = strrchr(wfp->fname, '/');
+      wfp->baseName = (slash == NULL) ? wfp->fname : slash+1;
+      wfp->changeCount = 0;
+      numWatchedFiles++;
+    }
+    else
+      wfp->changeCount++;   // Wasn't watched for a while, so it may have changed
+    wfp->dir = dir;
+  }
+  pthread_mutex_unlock(&watchLock);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Get the number of times fname has changed.  Returns FALSE if the file isn't being watched, in which case the caller
+// has to check the file itself.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+BOOL WX_GetFileChangeCount(char *fname, unsigned int *countp)
+{
+  BOOL watched = FALSE;
+  int i;
+
+  if (inotifyFd < 0)
+    return(FALSE);
+  pthread_mutex_lock(&watchLock);
+  for (i=0;i<numWatchedFiles;i++)
+    if (strcmp(watchedFiles[i].fname, fname) == 0) {
+      if (watchedDirs[watchedFiles[i].dir].wd >= 0) {
+        *countp = watchedFiles[i].changeCount;
+        watched = TRUE;
+      }
+      break;
+    }
+  pthread_mutex_unlock(&watchLock);
+  return(watched);
+}
+
+// Count a change to every watched file in a directory (dir -1 for all of them)
+static void countDirChanged(int dir)
+{
+  int i;
+
+  for (i=0;i<numWatchedFiles;i++)
+    if ((dir < 0) || (watchedFiles[i].dir == dir))
+      watchedFiles[i].changeCount++;
+}
+
+static void handleEvent(struct inotify_event *ep)
+{
+  int d, i;
+
+  eventsSeen++;
+  if (ep->mask & IN_Q_OVERFLOW) {   // Events were lost, anything could have changed
+    overflows++;
+    countDirChanged(-1);
+    return;
+  }
+  for (d=0;d<numWatchedDirs;d++)
+    if (watchedDirs[d].wd == ep->wd)
+      break;
+  if (d == numWatchedDirs)
+    return;
+
+  if (ep->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT)) {
+    // The directory itself has gone, its files go back to being checked when they're used
+    if (ep->mask & IN_IGNORED)
+      watchedDirs[d].wd = -1;
+    countDirChanged(d);
+    return;
+  }
+  if (ep->len == 0)
+    return;
+  for (i=0;i<numWatchedFiles;i++)
+    if ((watchedFiles[i].dir == d) && (strcmp(watchedFiles[i].baseName, ep->name) == 0))
+      watchedFiles[i].changeCount++;
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Read any waiting events and count the changes to the watched files.  Doesn't wait if there aren't any.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_ProcessFileWatchEvents(void)
+{
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *ep;
+  ssize_t len;
+  char *p;
+
+  if (inotifyFd < 0)
+    return;
+  while ((len = read(inotifyFd, buf, sizeof(buf))) > 0) {
+    pthread_mutex_lock(&watchLock);
+    for (p=buf;p<buf+len;p+=sizeof(struct inotify_event)+ep->len) {
+      ep = (struct inotify_event *) p;
+      handleEvent(ep);
+    }
+    pthread_mutex_unlock(&watchLock);
+  }
+}
+
+void WX_DumpFileWatchInfo(FILE *fd)
+{
+  int i;
+
+  pthread_mutex_lock(&watchLock);
+  if (inotifyFd < 0)
+    fprintf(fd, "\nFile Watch: not running, files are checked for changes when they're used\n");
+  else {
+    fprintf(fd, "\nFile Watch: %d file(s) in %d dir(s), %u event(s), %u overflow(s)\n",
+            numWatchedFiles, numWatchedDirs, eventsSeen, overflows);
+    for (i=0;i<numWatchedFiles;i++)
+      fprintf(fd, "            %-30s %u change(s)%s\n", watchedFiles[i].fname, watchedFiles[i].changeCount,
+              (watchedDirs[watchedFiles[i].dir].wd < 0) ? " (not watched)" : "");
+  }
+  pthread_mutex_unlock(&watchLock);
+}
@@ -0,0 +1,280 @@
+
+/*========================================================================
+
+   IoWorker.c
+
+   Background thread for the scheduled file outputs.  Writing the csv logs,
+   publishing the realtime csv file, processing tag files, grabbing webcam
+   images and ftp uploads all used to run on the main loop, so a slow usb
+   flash write or an ncftpput to a server that isn't answering held up
+   command processing for seconds at a time.  Now the scheduler queues each
+   of these as a job and returns straight away, and this thread works
+   through the queue in order.
+
+   A job is a function and a block of arguments that's copied into the
+   queue when the job is queued, so it carries its own copy of everything it
+   needs (the formatted csv line, a copy of wxData for the tag files, the ftp
+   file list...) and doesn't change when the main loop or the receiver
+   thread update the live data afterwards.
+
+   Jobs that still need the history store or the configuration (tag file
+   processing, opening a csv log) hold the shared data lock while they run.
+   The main loop takes the same lock around the few things that change them
+   (saving a snapshot, re-reading rtl-wx.conf), so it only waits if one of
+   those happens to come up while such a job is running.
+
+   The queue has a fixed number of slots.  A periodic job that is already
+   waiting in the queue isn't queued a second time (eg. a new tag file pass
+   while the ftp upload ahead of the last one is still going); the waiting
+   job just picks up the newer arguments.  If the queue is full the new job
+   is dropped and logged rather than making the main loop wait.  Until the
+   worker is started (or after it's stopped) jobs are run by the caller.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS
+   OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS
+   OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+   OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF OR INABILITY TO USE THIS SOFTWARE, EVEN IF
+   THE COPYRIGHT HOLDERS OR CONTRIBUTORS ARE AWARE OF THE POSSIBILITY OF SUCH DAMAGE.
+
+========================================================================*/
+
+#define _GNU_SOURCE   // For PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include "rtl-wx.h"
+
+#define IO_QUEUE_SIZE 32
+#define IO_JOB_NAME_SIZE 40
+
+typedef struct _WX_IoJob {
+  char name[IO_JOB_NAME_SIZE];
+  WX_IoJobFunc func;
+  void *arg;
+} WX_IoJob;
+
+static WX_IoJob queue[IO_QUEUE_SIZE];
+static int queueHead = 0;              // Next job to run
+static int queueCount = 0;
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+static pthread_rwlock_t sharedDataLock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;  // A waiting writer holds off new readers
+static pthread_t workerThread;
+static BOOL workerRunning = FALSE;
+static BOOL stopRequested = FALSE;
+
+static char currentJob[IO_JOB_NAME_SIZE];
+static unsigned int jobsQueued;
+static unsigned int jobsRun;
+static unsigned int jobsCoalesced;
+static unsigned int jobsDropped;
+static int mostQueued;
+static double longestJobSeconds;
+static char longestJob[IO_JOB_NAME_SIZE];
+
+static double secondsSince(struct timeval *start)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return((now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec)/1000000.0);
+}
+
+static void runJob(WX_IoJob *jobp)
+{
+  struct timeval start;
+  double seconds;
+
+  gettimeofday(&start, NULL);
+  jobp->func(jobp->arg);
+  free(jobp->arg);
+  seconds = secondsSince(&start);
+
+  pthread_mutex_lock(&queueLock);
+  jobsRun++;
+  if (seconds > longestJobSeconds) {
+    longestJobSeconds = seconds;
+    strcpy(longestJob, jobp->name);
+  }
+  pthread_mutex_unlock(&queueLock);
+}
+
+static void *ioWorkerThread(void *param)
+{
+  WX_IoJob job;
+  struct timespec wakeTime;
+  time_t serviceTime;
+
+  pthread_mutex_lock(&queueLock);
+  for (;;) {
+    if (queueCount == 0) {
+      if (stopRequested)
+        break;
+      // Sleep until a job comes in or the csv writer's next timed sync is due.  A config re-read that changes
+      // csvSyncMinutes takes effect with the next csv line, which carries the settings it was queued with.
+      serviceTime = WX_CsvWriterNextServiceTime();
+      if (serviceTime == 0)
+        pthread_cond_wait(&queueCond, &queueLock);
+      else if (serviceTime > time(NULL)) {
+        wakeTime.tv_sec = serviceTime;
+        wakeTime.tv_nsec = 0;
+        pthread_cond_timedwait(&queueCond, &queueLock, &wakeTime);
+      }
+    }
+    if (queueCount > 0) {
+      job = queue[queueHead];
+      queueHead = (queueHead + 1) % IO_QUEUE_SIZE;
+      queueCount--;
+      strcpy(currentJob, job.name);
+      pthread_mutex_unlock(&queueLock);
+      runJob(&job);
+      pthread_mutex_lock(&queueLock);
+      currentJob[0] = 0;
+    }
+    // Held csv lines and timed fsyncs are handled here too, since this thread owns the csv files
+    pthread_mutex_unlock(&queueLock);
+    WX_CsvWriterService(time(NULL));
+    pthread_mutex_lock(&queueLock);
+  }
+  pthread_mutex_unlock(&queueLock);
+  return NULL;
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Start the worker thread.  Jobs queued before this are run by the caller.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_StartIoWorker(void)
+{
+  if (workerRunning)
+    return;
+  stopRequested = FALSE;
+  if (pthread_create(&workerThread, NULL, ioWorkerThread, NULL) != 0) {
+    DPRINTF("I/O Worker: Unable to create thread (%s), file outputs will be done by the main loop\n", strerror(errno));
+    return;
+  }
+  workerRunning = TRUE;
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Finish the jobs in the queue and stop the worker thread (used at shutdown)
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_StopIoWorker(void)
+{
+  if (!workerRunning)
+    return;
+  pthread_mutex_lock(&queueLock);
+  stopRequested = TRUE;
+  pthread_cond_signal(&queueCond);
+  pthread_mutex_unlock(&queueLock);
+  pthread_join(workerThread, NULL);
+  workerRunning = FALSE;
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Queue func(arg) to be run by the worker.  The argSize bytes at arg are copied, so the caller can reuse them as soon as
+// this returns.  If coalesce is set and a job with the same name is already waiting, that job is given these arguments
+// instead of queueing another one.
+// Returns FALSE if the job was dropped.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+BOOL WX_QueueIoJob(char *name, WX_IoJobFunc func, void *arg, int argSize, BOOL coalesce)
+{
+  WX_IoJob *jobp;
+  int i;
+
+  pthread_mutex_lock(&queueLock);
+  if (!workerRunning) {
+    pthread_mutex_unlock(&queueLock);
+    func(arg);
+    return(TRUE);
+  }
+
+  // A waiting job of the same kind just takes the newer arguments (so it runs with the latest data)
+  if (coalesce)
+    for (i=0;i<queueCount;i++) {
+      jobp = &queue[(queueHead + i) % IO_QUEUE_SIZE];
+      if ((strcmp(jobp->name, name) == 0) && (jobp->func == func)) {
+        void *newArg = malloc((argSize > 0) ? argSize : 1);
+        if (newArg != NULL) {
+          if (argSize > 0)
+            memcpy(newArg, arg, argSize);
+          free(jobp->arg);
+          jobp->arg = newArg;
+        }
+        jobsCoalesced++;
+        pthread_mutex_unlock(&queueLock);
+        return(TRUE);
+      }
+    }
+
+  if (queueCount >= IO_QUEUE_SIZE) {
+    jobsDropped++;
+    pthread_mutex_unlock(&queueLock);
+    DPRINTF("I/O Worker: Queue full (running %s), dropped %s\n", currentJob, name);
+    return(FALSE);
+  }
+
+  jobp = &queue[(queueHead + queueCount) % IO_QUEUE_SIZE];
+  if ((jobp->arg = malloc((argSize > 0) ? argSize : 1)) == NULL) {
+    jobsDropped++;
+    pthread_mutex_unlock(&queueLock);
+    DPRINTF("I/O Worker: Out of memory, dropped %s\n", name);
+    return(FALSE);
+  }
+  if (argSize > 0)
+    memcpy(jobp->arg, arg, argSize);
+  strncpy(jobp->name, name, IO_JOB_NAME_SIZE-1);
+  jobp->name[IO_JOB_NAME_SIZE-1] = 0;
+  jobp->func = func;
+  queueCount++;
+  jobsQueued++;
+  if (queueCount > mostQueued)
+    mostQueued = queueCount;
+  pthread_cond_signal(&queueCond);
+  pthread_mutex_unlock(&queueLock);
+  return(TRUE);
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Lock held while the history store or the configuration is being changed.  Code that only reads them (tag files,
+// command worker dumps) takes the read lock instead, so readers run side by side and only wait for a change.  The
+// read lock mustn't be taken again by a thread that already holds it, since a waiting writer would block the second one.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_LockSharedData(void)
+{
+  pthread_rwlock_wrlock(&sharedDataLock);
+}
+
+void WX_ReadLockSharedData(void)
+{
+  pthread_rwlock_rdlock(&sharedDataLock);
+}
+
+void WX_UnlockSharedData(void)
+{
+  pthread_rwlock_unlock(&sharedDataLock);
+}
+
+BOOL WX_IsIoWorkerRunning(void)
+{
+  return(workerRunning);
+}
+
+void WX_DumpIoWorkerInfo(FILE *fd)
+{
+  pthread_mutex_lock(&queueLock);
+  fprintf(fd, "\nI/O Worker: %s, %d job(s) waiting (most %d of %d), now running: %s\n",
+          workerRunning ? "running" : "not running", queueCount, mostQueued, IO_QUEUE_SIZE,
+          (currentJob[0] != 0) ? currentJob : "-");
+  fprintf(fd, "            %u queued, %u run, %u merged with a waiting job, %u dropped\n",
+          jobsQueued, jobsRun, jobsCoalesced, jobsDropped);
+  if (longestJob[0] != 0)
+    fprintf(fd, "            longest job %.2f seconds (%s)\n", longestJobSeconds, longestJob);
+  pthread_mutex_unlock(&queueLock);
+}
@@ -0,0 +1,349 @@
+
+/*========================================================================
+
+   JobRunner.c
+
+   Runs the external programs rtl-wx uses (ncftpput for the ftp uploads,
+   fswebcam for the webcam snapshots) as child processes without waiting
+   for them.  These used to be run with system(), which started a shell for
+   each one and held up the caller until the program finished - with a
+   slow ftp server that was the I/O worker stuck for up to the ncftpput
+   timeout per file.
+
+   A job is started with posix_spawnp() straight from an argument list (no
+   shell, so nothing in the configuration gets interpreted by one) and a
+   thread here waits for it to finish.  Each job has a timeout; a job still
+   running after that is sent SIGTERM, then SIGKILL if it doesn't go away.
+   At most JOB_MAX_RUNNING jobs run at once and the rest wait their turn.
+   Only one job with a given name is running or waiting at a time, so a
+   stuck upload doesn't pile up another copy of itself every few minutes;
+   the new one is skipped and counted.
+
+   The exit status of every job is kept per job name (started, ok, failed,
+   timed out, last status) for the scheduler dump ('a'), and anything other
+   than a clean exit is logged.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS
+   OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+   AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS
+   OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+   OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF OR INABILITY TO USE THIS SOFTWARE, EVEN IF
+   THE COPYRIGHT HOLDERS OR CONTRIBUTORS ARE AWARE OF THE POSSIBILITY OF SUCH DAMAGE.
+
+========================================================================*/
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "rtl-wx.h"
+
+#define JOB_MAX_RUNNING 2
+#define JOB_MAX_WAITING 8
+#define JOB_MAX_NAMES 16         // Job names that statistics are kept for
+#define JOB_NAME_SIZE 40
+#define JOB_ARG_BUF_SIZE 8192
+#define JOB_KILL_GRACE_SECONDS 5 // Time between SIGTERM and SIGKILL for a job that's run past its timeout
+#define JOB_CHECK_MSECS 200      // How often running jobs are checked on
+
+extern char **environ;
+
+typedef struct _WX_Job {
+  char name[JOB_NAME_SIZE];
+  int numArgs;
+  int argOffset[WX_JOB_MAX_ARGS];   // Where each argument starts in argBuf (so a job can be copied from slot to slot)
+  char argBuf[JOB_ARG_BUF_SIZE];    // argv[0] is always at the start
+  int timeoutSeconds;
+  pid_t pid;
+  time_t startTime;
+  BOOL termSent;
+} WX_Job;
+
+typedef struct _WX_JobStats {
+  char name[JOB_NAME_SIZE];
+  unsigned int started;
+  unsigned int ok;
+  unsigned int failed;       // Non zero exit, killed by a signal, or couldn't be started
+  unsigned int timedOut;
+  unsigned int skipped;      // Not started because the previous one was still running or waiting
+  int lastStatus;
+  time_t lastFinished;
+  double longestSeconds;
+} WX_JobStats;
+
+static WX_Job running[JOB_MAX_RUNNING];
+static int numRunning = 0;
+static WX_Job waiting[JOB_MAX_WAITING];
+static int numWaiting = 0;
+static WX_JobStats stats[JOB_MAX_NAMES];
+static int numStats = 0;
+static pthread_mutex_t jobLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobCond = PTHREAD_COND_INITIALIZER;
+static pthread_t runnerThread;
+static BOOL runnerRunning = FALSE;
+static BOOL stopRequested = FALSE;
+
+static WX_JobStats *getStats(char *name)
+{
+  int i;
+
+  for (i=0;i<numStats;i++)
+    if (strcmp(stats[i].name, name) == 0)
+      return(&stats[i]);
+  if (numStats >= JOB_MAX_NAMES)
+    return(NULL);
+  memset(&stats[numStats], 0, sizeof(WX_JobStats));
+  strcpy(stats[numStats].name, name);
+  return(&stats[numStats++]);
+}
+
+// Called with jobLock held
+static void recordResult(WX_Job *jobp, int status, BOOL timedOut)
+{
+  WX_JobStats *sp = getStats(jobp->name);
+  double seconds = difftime(time(NULL), jobp->startTime);
+
+  if (sp == NULL)
+    return;
+  sp->lastStatus = status;
+  sp->lastFinished = time(NULL);
+  if (seconds > sp->longestSeconds)
+    sp->longestSeconds = seconds;
+  if (timedOut)
+    sp->timedOut++;
+  else if (status == 0)
+    sp->ok++;
+  else
+    sp->failed++;
+}
+
+// Start a job, called with jobLock held.  Returns FALSE if it couldn't be started.
+static BOOL startJob(WX_Job *jobp)
+{
+  posix_spawn_file_actions_t fileActions;
+  WX_JobStats *sp = getStats(jobp->name);
+  char *argv[WX_JOB_MAX_ARGS+1];
+  int i, err;
+
+  for (i=0;i<jobp->numArgs;i++)
+    argv[i] = jobp->argBuf + jobp->argOffset[i];
+  argv[i] = NULL;
+
+  // Output goes to /dev/null like the old "> /dev/null", errors still go to our stderr
+  posix_spawn_file_actions_init(&fileActions);
+  posix_spawn_file_actions_addopen(&fileActions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+  err = posix_spawnp(&jobp->pid, argv[0], &fileActions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&fileActions);
+
+  jobp->startTime = time(NULL);
+  jobp->termSent = FALSE;
+  if (sp != NULL)
+    sp->started++;
+  if (err != 0) {
+    recordResult(jobp, -1, FALSE);
+    DPRINTF("Jobs: Unable to start %s (%s: %s)\n", jobp->name, argv[0], strerror(err));
+    return(FALSE);
+  }
+  return(TRUE);
+}
+
+// Start waiting jobs while there's room, called with jobLock held
+static void startWaitingJobs(void)
+{
+  while ((numWaiting > 0) && (numRunning < JOB_MAX_RUNNING)) {
+    WX_Job *jobp = &running[numRunning];
+    *jobp = waiting[0];
+    numWaiting--;
+    memmove(&waiting[0], &waiting[1], numWaiting * sizeof(WX_Job));
+    if (startJob(jobp))
+      numRunning++;
+  }
+}
+
+// Collect finished jobs and deal with any that have run too long, called with jobLock held
+static void checkRunningJobs(void)
+{
+  time_t now = time(NULL);
+  int i, status;
+
+  for (i=0;i<numRunning;) {
+    WX_Job *jobp = &running[i];
+    pid_t pid = waitpid(jobp->pid, &status, WNOHANG);
+    if ((pid == jobp->pid) || ((pid < 0) && (errno == ECHILD))) {
+      int exitStatus = (pid < 0) ? -1 : WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+      recordResult(jobp, exitStatus, jobp->termSent);
+      if (jobp->termSent) {
+        DPRINTF("Jobs: %s was stopped after running for more than %d seconds\n", jobp->name, jobp->timeoutSeconds);
+      }
+      else if ((pid > 0) && WIFSIGNALED(status)) {
+        DPRINTF("Jobs: %s was killed by signal %d\n", jobp->name, WTERMSIG(status));
+      }
+      else if (exitStatus != 0) {
+        DPRINTF("Jobs: %s (%s) exited with status %d\n", jobp->name, jobp->argBuf, exitStatus);
+      }
+      numRunning--;
+      if (i < numRunning)
+        *jobp = running[numRunning];
+      continue;
+    }
+    if (!jobp->termSent && (difftime(now, jobp->startTime) >= jobp->timeoutSeconds)) {
+      kill(jobp->pid, SIGTERM);
+      jobp->termSent = TRUE;
+    }
+    else if (jobp->termSent && (difftime(now, jobp->startTime) >= jobp->timeoutSeconds + JOB_KILL_GRACE_SECONDS))
+      kill(jobp->pid, SIGKILL);
+    i++;
+  }
+}
+
+static void *jobRunnerThread(void *param)
+{
+  struct timespec wakeTime;
+
+  pthread_mutex_lock(&jobLock);
+  for (;;) {
+    checkRunningJobs();
+    startWaitingJobs();
+    if ((numRunning == 0) && (numWaiting == 0)) {
+      if (stopRequested)
+        break;
+      pthread_cond_wait(&jobCond, &jobLock);
+    }
+    else {
+      // Children are checked on every JOB_CHECK_MSECS while any are running, a new job wakes us straight away
+      clock_gettime(CLOCK_REALTIME, &wakeTime);
+      wakeTime.tv_nsec += JOB_CHECK_MSECS * 1000000L;
+      if (wakeTime.tv_nsec >= 1000000000L) {
+        wakeTime.tv_sec++;
+        wakeTime.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&jobCond, &jobLock, &wakeTime);
+    }
+  }
+  pthread_mutex_unlock(&jobLock);
+  return NULL;
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Start the thread that starts jobs and waits for them.  Jobs submitted before this are run by the caller.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_StartJobRunner(void)
+{
+  if (runnerRunning)
+    return;
+  stopRequested = FALSE;
+  if (pthread_create(&runnerThread, NULL, jobRunnerThread, NULL) != 0) {
+    DPRINTF("Jobs: Unable to create thread (%s), external programs will be waited for by the caller\n", strerror(errno));
+    return;
+  }
+  runnerRunning = TRUE;
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Let the running and waiting jobs finish (each is still limited by its timeout) and stop the thread (used at shutdown)
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_StopJobRunner(void)
+{
+  if (!runnerRunning)
+    return;
+  pthread_mutex_lock(&jobLock);
+  stopRequested = TRUE;
+  pthread_cond_signal(&jobCond);
+  pthread_mutex_unlock(&jobLock);
+  pthread_join(runnerThread, NULL);
+  runnerRunning = FALSE;
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Run the program argv[0] (found on the PATH) with the arguments argv[1]... (NULL terminated) as job "name", and stop it if it
+// runs for more than timeoutSeconds.  The arguments are copied, and this returns without waiting for the program.
+// Returns FALSE if the job wasn't started because one with the same name is still running or waiting, there are too many
+// waiting, or the arguments don't fit.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+BOOL WX_SpawnJob(char *name, char *argv[], int timeoutSeconds)
+{
+  WX_Job job;
+  WX_JobStats *sp;
+  BOOL alreadyQueued = FALSE;
+  int i, len = 0;
+
+  strncpy(job.name, name, JOB_NAME_SIZE-1);
+  job.name[JOB_NAME_SIZE-1] = 0;
+  job.timeoutSeconds = timeoutSeconds;
+  for (i=0;argv[i] != NULL;i++) {
+    int argLength = strlen(argv[i]) + 1;
+    if ((i >= WX_JOB_MAX_ARGS) || (len + argLength > JOB_ARG_BUF_SIZE)) {
+      DPRINTF("Jobs: Too many arguments for %s, not started\n", name);
+      return(FALSE);
+    }
+    memcpy(job.argBuf + len, argv[i], argLength);
+    job.argOffset[i] = len;
+    len += argLength;
+  }
+  job.numArgs = i;
+
+  pthread_mutex_lock(&jobLock);
+  for (i=0;i<numRunning;i++)
+    if (strcmp(running[i].name, job.name) == 0)
+      alreadyQueued = TRUE;
+  for (i=0;i<numWaiting;i++)
+    if (strcmp(waiting[i].name, job.name) == 0)
+      alreadyQueued = TRUE;
+  if (alreadyQueued || (numWaiting >= JOB_MAX_WAITING)) {
+    if ((sp = getStats(job.name)) != NULL)
+      sp->skipped++;
+    pthread_mutex_unlock(&jobLock);
+    if (alreadyQueued) {
+      DPRINTF("Jobs: %s not started, the last one hasn't finished\n", job.name); }
+    else
+      DPRINTF("Jobs: %s not started, %d jobs already waiting\n", job.name, numWaiting);
+    return(FALSE);
+  }
+
+  if (!runnerRunning) {
+    // No thread to wait for it, so run it here
+    running[numRunning] = job;
+    if (startJob(&running[numRunning])) {
+      numRunning++;
+      while (numRunning > 0) {
+        pthread_mutex_unlock(&jobLock);
+        usleep(JOB_CHECK_MSECS * 1000);
+        pthread_mutex_lock(&jobLock);
+        checkRunningJobs();
+      }
+    }
+    pthread_mutex_unlock(&jobLock);
+    return(TRUE);
+  }
+
+  waiting[numWaiting++] = job;
+  pthread_cond_signal(&jobCond);
+  pthread_mutex_unlock(&jobLock);
+  return(TRUE);
+}
+
+void WX_DumpJobRunnerInfo(FILE *fd)
+{
+  int i;
+
+  pthread_mutex_lock(&jobLock);
+  fprintf(fd, "\nJobs: %s, %d running, %d waiting\n", runnerRunning ? "running" : "not running", numRunning, numWaiting);
+  for (i=0;i<numRunning;i++)
+    fprintf(fd, "      %s (pid %d) running for %.0f seconds\n", running[i].name, (int) running[i].pid,
+            difftime(time(NULL), running[i].startTime));
+  for (i=0;i<numStats;i++)
+    fprintf(fd, "      %-20s %u started, %u ok, %u failed, %u timed out, %u skipped, last status %d, longest %.0f seconds\n",
+            stats[i].name, stats[i].started, stats[i].ok, stats[i].failed, stats[i].timedOut, stats[i].skipped,
+            stats[i].lastStatus, stats[i].longestSeconds);
+  pthread_mutex_unlock(&jobLock);
+}
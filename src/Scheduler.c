@@ -5,12 +5,18 @@
    
    This module controls launching of time based actions such as ftp upload,
    tag file processing, conf file re-reading, and email sending.  All of these function happen
-   based on a timer or trigger so the action handler should be called frequenty (at least
-   once a minute or so) in order to make sure these actions get done when they're supposed to.
+   based on a timer or trigger.
 
    The scheduler makes use of the system time() function in order to detemrine when
    enough time has elapsed based on the configuration.
 
+   The file outputs (csv files, tag files, webcam snapshots and ftp uploads) are handed to the I/O worker (see IoWorker.c)
+   rather than done here, so a slow write or upload doesn't hold up the main loop.  The external programs (ncftpput and
+   fswebcam) are started by the job runner (see JobRunner.c), which doesn't wait for them either.
+
+   The main loop doesn't poll the scheduler.  Each action has a timer in a min-heap and the loop sleeps until the first
+   one comes up (or a command arrives), see WX_GetNextActionTime().
+
    Finally, there's some magic in these routines to attempt to align the timing so periodic processing happens at
    even multiples of the frequency (ie. events occurring every 15 mins happen at xx:00, xx:15, xx:30, xx:45.  
    The logic for this is a bit squirrely but it seems to work ok.
@@ -32,8 +38,16 @@
 #include <malloc.h>
 #include <time.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include "rtl-wx.h"
 
+#define WEBCAM_TIMEOUT_SECONDS 30
+#define FTP_TIMEOUT_SECONDS 300          // For each ncftpput, which puts all the files going to one directory
+#define FTP_LOGIN_FILE "rtl-wx-ftp.login"  // ncftpput -f file, so the password isn't on a command line for ps to show
+
 static time_t lastConfProcTime;
 static time_t lastRealTimeCsvWriteTime;
 static time_t lastCsvFileWriteTime[MAX_CONFIG_LIST_SIZE];
@@ -43,6 +57,7 @@ static time_t lastWebcamSnapshotTime;
 static time_t lastTagProcTime;
 static time_t lastFtpUploadTime;
 static time_t lastTimeoutCheckTime;
+static time_t lastTimerCheckTime;
 
 static unsigned int csvFileWriteCnt[MAX_CONFIG_LIST_SIZE];
 static unsigned int realTimeCsvWriteCnt;
@@ -58,7 +73,10 @@ static WX_ConfigSettings *configVarp;
 
 static unsigned int getMinutesToWait(unsigned int frequency, time_t currentTime, 
                                                            time_t timeLastDone);
+static void rebuildTimers(time_t now);
 static void checkForSensorTimeouts();
+static void addCsvHistoryWindows();
+static void watchConfigFiles();
 static void updateCurrentTime(WX_Data *weatherDatap);
 
 #define SECS_PER_MIN 60
@@ -87,6 +105,8 @@ void WX_InitActionScheduler(WX_Data *weatherDatap, WX_ConfigSettings *configurat
 
   for (i=0;i<MAX_CONFIG_LIST_SIZE;i++)
      csvFileWriteCnt[i] = 0;
+  addCsvHistoryWindows();
+  watchConfigFiles();
   realTimeCsvWriteCnt = 0;     
   configProcCnt = 0;
   dataSnapshotCnt = 0;
@@ -94,75 +114,228 @@ void WX_InitActionScheduler(WX_Data *weatherDatap, WX_ConfigSettings *configurat
   webcamSnapshotCnt = 0;
   tagProcCnt = 0;
   ftpUploadCnt = 0;
+  lastTimerCheckTime = time(NULL);
+  rebuildTimers(lastTimerCheckTime);
 }
 
 //--------------------------------------------------------------------------------------------------------------------------------------------
-// MAIN SCHEDULER ROUTINE - see what processing needs to be done this time around.  This routine should get called
-//                                                   frequently in order to do its job well.
+// Timers.  Each action has an entry in a min-heap ordered by the next time it needs looking at, so the main loop can
+// sleep until the first one comes up instead of checking every action several times a second.  When an entry comes up
+// the action's usual frequency check (getMinutesToWait()) decides whether it's really due, and the entry is put back
+// for the next time.  Entries for the same time come up in the order of the actions below.
 //--------------------------------------------------------------------------------------------------------------------------------------------
-void WX_DoScheduledActions()
-{ 
-  int i;
+typedef enum _WX_Action {
+  ACTION_TIMEOUT_CHECK = 0, ACTION_CSV_SERVICE, ACTION_CONFIG_READ, ACTION_DATA_SNAPSHOT, ACTION_REALTIME_CSV,
+  ACTION_CSV_FILE, ACTION_RAIN_SNAPSHOT, ACTION_TAG_FILES, ACTION_WEBCAM, ACTION_FTP_UPLOAD, NUM_ACTIONS
+} WX_Action;
 
-  updateCurrentTime(wxDatap);
-  if (getMinutesToWait(1, time(NULL), lastTimeoutCheckTime) == 0) // check for timeouts once a minute
-     checkForSensorTimeouts();
-     
-  // First reread configuration file if more than xx minutes has elapsed since last read
-  if (getMinutesToWait(configVarp->configFileReadFrequency, time(NULL), lastConfProcTime) == 0) {
-    //DPRINTF("Reading rtl-wx.conf at %s", asctime(localtime(&lastConfProcTime)));
-    WX_DoConfigFileRead();
+typedef struct _WX_Timer {
+  time_t when;
+  WX_Action action;
+  int index;                  // csv file index for ACTION_CSV_FILE
+} WX_Timer;
+
+#define MAX_TIMERS (NUM_ACTIONS + MAX_CONFIG_LIST_SIZE)
+
+static WX_Timer timerHeap[MAX_TIMERS];
+static int numTimers;
+static BOOL timersNeedRebuild;
+static unsigned int configChangeCount;  // Config file's change count when it was last read (see FileWatch.c)
+
+static BOOL isTimerBefore(WX_Timer *a, WX_Timer *b)
+{
+  if (a->when != b->when)
+    return(a->when < b->when);
+  if (a->action != b->action)
+    return(a->action < b->action);
+  return(a->index < b->index);
+}
+
+static void pushTimer(time_t when, WX_Action action, int index)
+{
+  int i = numTimers++;
+  WX_Timer timer = { when, action, index };
+
+  while ((i > 0) && isTimerBefore(&timer, &timerHeap[(i-1)/2])) {
+    timerHeap[i] = timerHeap[(i-1)/2];
+    i = (i-1)/2;
   }
+  timerHeap[i] = timer;
+}
 
-  // Next save off data snapshot if it's time 
-  if (getMinutesToWait(configVarp->dataSnapshotFrequency, time(NULL), lastDataSnapshotTime) == 0) {
-    //DPRINTF(" Saving snapshot at %s", asctime(localtime(&lastDataSnapshotTime)));
-    //printf("saving data snapshot...");fflush(stdout);
-    WX_DoDataSnapshotSave(configVarp->dataSnapshotFrequency);
-    //printf("done.\n");fflush(stdout);
+static WX_Timer popTimer(void)
+{
+  WX_Timer top = timerHeap[0];
+  WX_Timer last = timerHeap[--numTimers];
+  int i = 0, child;
+
+  while ((child = 2*i + 1) < numTimers) {
+    if ((child+1 < numTimers) && isTimerBefore(&timerHeap[child+1], &timerHeap[child]))
+      child++;
+    if (!isTimerBefore(&timerHeap[child], &last))
+      break;
+    timerHeap[i] = timerHeap[child];
+    i = child;
   }
-  
-  if (getMinutesToWait(configVarp->realtimeCsvWriteFrequency, time(NULL), lastRealTimeCsvWriteTime) == 0) 
-     // write current sensor data to real time csv file
-     WX_DoRealTimeCsvFileWrite();  
-     
-  // Check if any csv files should get updated
-  for (i=0;i < configVarp->numCsvFilesToUpdate;i++) {
-    if (getMinutesToWait(configVarp->csvFiles[i].snapshotsBetweenUpdates*configVarp->dataSnapshotFrequency, 
-                       time(NULL), lastCsvFileWriteTime[i]) == 0)
-       WX_DoCsvFileUpdate(i);
+  timerHeap[i] = last;
+  return(top);
+}
+
+// The config file is re-read as soon as it changes while it's watched, so it doesn't need reading every so often
+static BOOL isConfigFileWatched()
+{
+  unsigned int changeCount;
+  return(WX_GetFileChangeCount(CONFIG_FILE_PATH, &changeCount));
+}
+
+// Frequency in minutes (0 = never) and time last done for an action
+static unsigned int getActionFrequency(WX_Action action, int index)
+{
+  switch (action) {
+    case ACTION_TIMEOUT_CHECK: return(1);
+    case ACTION_CONFIG_READ:   return(isConfigFileWatched() ? 0 : configVarp->configFileReadFrequency);
+    case ACTION_DATA_SNAPSHOT: return(configVarp->dataSnapshotFrequency);
+    case ACTION_REALTIME_CSV:  return(configVarp->realtimeCsvWriteFrequency);
+    case ACTION_CSV_FILE:      return(configVarp->csvFiles[index].snapshotsBetweenUpdates*configVarp->dataSnapshotFrequency);
+    case ACTION_RAIN_SNAPSHOT: return(configVarp->rainDataSnapshotFrequency);
+    case ACTION_TAG_FILES:     return(configVarp->tagFileParseFrequency);
+    case ACTION_WEBCAM:        return(configVarp->webcamSnapshotFrequency);
+    case ACTION_FTP_UPLOAD:    return(configVarp->ftpUploadFrequency);
+    default:                   return(1);
   }
-  // Next save off rain data snapshot if it's time 
-  if (getMinutesToWait(configVarp->rainDataSnapshotFrequency, time(NULL), lastRainDataSnapshotTime) == 0) {
-    //DPRINTF(" Saving rain data snapshot at %s", asctime(localtime(&lastRainDataSnapshotTime)));
-    //printf("saving rain data snapshot...");fflush(stdout);
-    WX_DoRainDataSnapshotSave();
-    //printf("done.\n");fflush(stdout);
+}
+
+static time_t *getActionLastTime(WX_Action action, int index)
+{
+  switch (action) {
+    case ACTION_TIMEOUT_CHECK: return(&lastTimeoutCheckTime);
+    case ACTION_CONFIG_READ:   return(&lastConfProcTime);
+    case ACTION_DATA_SNAPSHOT: return(&lastDataSnapshotTime);
+    case ACTION_REALTIME_CSV:  return(&lastRealTimeCsvWriteTime);
+    case ACTION_CSV_FILE:      return(&lastCsvFileWriteTime[index]);
+    case ACTION_RAIN_SNAPSHOT: return(&lastRainDataSnapshotTime);
+    case ACTION_TAG_FILES:     return(&lastTagProcTime);
+    case ACTION_WEBCAM:        return(&lastWebcamSnapshotTime);
+    case ACTION_FTP_UPLOAD:    return(&lastFtpUploadTime);
+    default:                   return(&lastTimerCheckTime);
   }
-  
-  // Next process tag files that need to be processed - Note that if timer is up, but we saved a data snapshot (and zeroed records) within 
-  //1 minute we need to wait so there's enough time for new data to make it in.
-  if (getMinutesToWait(configVarp->tagFileParseFrequency, time(NULL), lastTagProcTime) == 0) {
-     //DPRINTF("Parsing Tagfiles at %s", asctime(localtime(&lastTagProcTime)));
-     //printf("processing tagfiles...");fflush(stdout);
-     WX_DoTagFileProcessing();
-     //printf("done.\n");fflush(stdout);
+}
+
+static BOOL isActionDue(WX_Timer *timerp, time_t now)
+{
+  if (timerp->action == ACTION_CSV_SERVICE)
+    return(TRUE);
+  if ((timerp->action == ACTION_REALTIME_CSV) && (configVarp->realtimeCsvWriteSeconds > 0))
+    // Sub-minute updates are not aligned to the clock, just spaced out by the configured number of seconds
+    return(difftime(now, lastRealTimeCsvWriteTime) >= configVarp->realtimeCsvWriteSeconds);
+  return(getMinutesToWait(getActionFrequency(timerp->action, timerp->index), now, *getActionLastTime(timerp->action, timerp->index)) == 0);
+}
+
+static void doAction(WX_Timer *timerp)
+{
+  switch (timerp->action) {
+    case ACTION_TIMEOUT_CHECK: checkForSensorTimeouts(); break;
+    case ACTION_CSV_SERVICE:   if (!WX_IsIoWorkerRunning()) WX_CsvWriterService(time(NULL)); break;
+    case ACTION_CONFIG_READ:   WX_DoConfigFileRead(); break;
+    case ACTION_DATA_SNAPSHOT: WX_DoDataSnapshotSave(configVarp->dataSnapshotFrequency); break;
+    case ACTION_REALTIME_CSV:  WX_DoRealTimeCsvFileWrite(); break;
+    case ACTION_CSV_FILE:      WX_DoCsvFileUpdate(timerp->index); break;
+    case ACTION_RAIN_SNAPSHOT: WX_DoRainDataSnapshotSave(); break;
+    case ACTION_TAG_FILES:     WX_DoTagFileProcessing(); break;
+    case ACTION_WEBCAM:        WX_DoWebcamSnapshot(); break;
+    case ACTION_FTP_UPLOAD:    WX_DoFtpUpload(); break;
+    default:                   break;
+  }
+}
+
+// Put an action's timer in the heap for the next time it could be due (not at all if it's turned off)
+static void scheduleAction(WX_Action action, int index, time_t now)
+{
+  unsigned int frequency = getActionFrequency(action, index);
+  time_t lastDone = *getActionLastTime(action, index);
+  unsigned int minutes;
+  time_t when;
+
+  if (action == ACTION_CSV_SERVICE) {
+    // The I/O worker looks after held csv lines and syncs, this is only needed if it isn't running
+    if (!WX_IsIoWorkerRunning())
+      pushTimer(now + SECS_PER_MIN, action, index);
+    return;
+  }
+  if ((action == ACTION_REALTIME_CSV) && (configVarp->realtimeCsvWriteSeconds > 0)) {
+    when = lastRealTimeCsvWriteTime + configVarp->realtimeCsvWriteSeconds;
+    pushTimer((when > now) ? when : now, action, index);
+    return;
   }
+  if (frequency == 0)
+    return;
+
+  // getMinutesToWait() can only change at the start of a minute or when another whole minute has gone by since the
+  // action was last done, so look again at whichever of those comes first after the wait it gives
+  if ((minutes = getMinutesToWait(frequency, now, lastDone)) == 0)
+    when = now;
+  else {
+    time_t minuteStart = now - (now % SECS_PER_MIN) + minutes*SECS_PER_MIN;
+    time_t sinceLastDone = lastDone + ((long) difftime(now, lastDone)/SECS_PER_MIN + minutes)*SECS_PER_MIN;
+    when = ((sinceLastDone > now) && (sinceLastDone < minuteStart)) ? sinceLastDone : minuteStart;
+  }
+  pushTimer(when, action, index);
+}
+
+static void rebuildTimers(time_t now)
+{
+  int i;
+
+  numTimers = 0;
+  for (i=0;i<NUM_ACTIONS;i++)
+    if (i != ACTION_CSV_FILE)
+      scheduleAction(i, 0, now);
+  for (i=0;i<configVarp->numCsvFilesToUpdate;i++)
+    scheduleAction(ACTION_CSV_FILE, i, now);
+  timersNeedRebuild = FALSE;
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Time of the next scheduled action, for the main loop to sleep until (0 if nothing is scheduled)
+//--------------------------------------------------------------------------------------------------------------------------------------------
+time_t WX_GetNextActionTime(void)
+{
+  if (timersNeedRebuild)
+    rebuildTimers(time(NULL));
+  return((numTimers > 0) ? timerHeap[0].when : 0);
+}
 
-  // Next process tag files that need to be processed - Note that if timer is up, but we saved a data snapshot (and zeroed records) within 
-  //1 minute we need to wait so there's enough time for new data to make it in.
-  if (getMinutesToWait(configVarp->webcamSnapshotFrequency, time(NULL), lastWebcamSnapshotTime) == 0) {
-     //printf("doing webcam snapshot...");fflush(stdout);
-     WX_DoWebcamSnapshot();
-     //printf("done.\n");fflush(stdout);
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// MAIN SCHEDULER ROUTINE - do the actions that have come due.  This routine is called whenever the main loop wakes up,
+//                          either for a command or at the time given by WX_GetNextActionTime().
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_DoScheduledActions()
+{ 
+  time_t now;
+  WX_Timer timer;
+  unsigned int changeCount;
+
+  updateCurrentTime(wxDatap);
+  now = time(NULL);
+
+  if (WX_GetFileChangeCount(CONFIG_FILE_PATH, &changeCount) && (changeCount != configChangeCount)) {
+    DPRINTF("%s has changed, reading it again\n", CONFIG_FILE_PATH);
+    WX_DoConfigFileRead();
   }
-  // Next,  process ftp uploads that need to be processed
- if (getMinutesToWait(configVarp->ftpUploadFrequency, time(NULL), lastFtpUploadTime) == 0) {
-  //DPRINTF("Doing FTP upload at %s", asctime(localtime(&lastFtpUploadTime)));
-  //if (1) {
-  //printf("Ftp upload...");fflush(stdout);
-  WX_DoFtpUpload();
-  //printf("done.\n");fflush(stdout);
+
+  // If the clock has been set back (eg. by ntp after booting without a real time clock) the timers are all too far out
+  if (timersNeedRebuild || (now < lastTimerCheckTime))
+    rebuildTimers(now);
+  lastTimerCheckTime = now;
+
+  while ((numTimers > 0) && (timerHeap[0].when <= now)) {
+    timer = popTimer();
+    if (isActionDue(&timer, now))
+      doAction(&timer);
+    if (timersNeedRebuild) // conf file was re-read, the actions and frequencies may have changed
+      rebuildTimers(now);
+    else
+      scheduleAction(timer.action, timer.index, now);
   }
 }
 
@@ -196,9 +369,48 @@ void checkForSensorTimeouts() {
        wxDatap->ext[sensorIdx].noDataFor300Seconds++;
 }
 
+// Keep track of changes to the config file and the tag file templates so they're only looked at again when they change
+static void watchConfigFiles()
+{
+  int i;
+  WX_WatchFile(CONFIG_FILE_PATH);
+  for (i=0;i < configVarp->NumTagFilesToParse;i++)
+    WX_WatchFile(configVarp->tagFiles[i].inFile);
+}
+
+// Have DataStore keep running sums for each csv file's interval so csv updates don't re-walk the history
+static void addCsvHistoryWindows()
+{
+  int i;
+  for (i=0;i < configVarp->numCsvFilesToUpdate;i++)
+    WX_AddHistoryWindow(configVarp->csvFiles[i].snapshotsBetweenUpdates);
+}
+
+static void closeCsvFilesJob(void *arg)
+{
+  WX_CsvWriterCloseAll();
+  WX_BinLogCloseAll();
+}
+
 void WX_DoConfigFileRead()
 {
-  WX_processConfigSettingsFile(CONFIG_FILE_PATH, configVarp);
+  static WX_ConfigSettings newConfig; // Only used here, by the main loop
+
+  WX_GetFileChangeCount(CONFIG_FILE_PATH, &configChangeCount); // Before reading, so a change made while it's read isn't missed
+  // The file is read into a separate copy, which replaces the live settings in one go once it's complete.  If the
+  // file can't be read, the current settings are kept.
+  if (WX_processConfigSettingsFile(CONFIG_FILE_PATH, &newConfig) != 0) {
+    DPRINTF("Keeping the current configuration\n");
+  }
+  else {
+    WX_QueueIoJob("close csv files", closeCsvFilesJob, NULL, 0, FALSE); // csv file list may change
+    WX_LockSharedData();
+    *configVarp = newConfig;
+    addCsvHistoryWindows();
+    WX_UnlockSharedData();
+    watchConfigFiles();
+    timersNeedRebuild = TRUE;
+  }
   lastConfProcTime = time(NULL);    
   configProcCnt++;
 }
@@ -209,7 +421,9 @@ void WX_DoConfigFileRead()
 //--------------------------------------------------------------------------------------------------------------------------------------------
 void WX_DoDataSnapshotSave(int minutesPerSnapshot)
 {
+  WX_LockSharedData();
   WX_SaveWeatherDataRecord(wxDatap, configVarp, minutesPerSnapshot);
+  WX_UnlockSharedData();
   lastDataSnapshotTime = time(NULL);
   dataSnapshotCnt++;
 }
@@ -232,29 +446,88 @@ void WX_DoCsvFileUpdate(int index) {
 // By default this is done every 15 minutes.
 //--------------------------------------------------------------------------------------------------------------------------------------------
 void WX_DoRainDataSnapshotSave() {
+  WX_LockSharedData();
   WX_SaveRainDataRecord(wxDatap);
+  WX_UnlockSharedData();
   lastRainDataSnapshotTime = time(NULL);
   rainDataSnapshotCnt++;
 }
 
 //--------------------------------------------------------------------------------------------------------------------------------------------
 // Time to read in each of the input tag files specified in the .conf file and copy the contents to an output file with
-// the tags removed and replaced with weather station data.
+// the tags removed and replaced with weather station data.  The files are processed by the I/O worker using a copy of
+// the current data taken now (the tag processor spreads them over a few render threads).
 //--------------------------------------------------------------------------------------------------------------------------------------------
-void WX_DoTagFileProcessing()
+typedef struct _TagFilesJob {
+  WX_Data data;
+  int numTagFiles;
+  WX_TagFile tagFiles[MAX_CONFIG_LIST_SIZE];
+} TagFilesJob;
+
+static void tagFilesJob(void *arg)
 {
-  int i;
+  TagFilesJob *jobp = (TagFilesJob *) arg;
 
-  for(i=0;i<configVarp->NumTagFilesToParse;i++)
-     WX_ReplaceTagsInTextFile(configVarp->tagFiles[i].inFile, configVarp->tagFiles[i].outFile);
+  // Takes the shared data read lock itself, only while the files are rendered
+  WX_ReplaceTagsInTextFiles(jobp->tagFiles, jobp->numTagFiles, &jobp->data);
+}
+
+void WX_DoTagFileProcessing()
+{
+  static TagFilesJob job;  // Too big for the stack
+
+  pthread_rwlock_rdlock(&energy_sample_array_rw_lock);
+  job.data = *wxDatap;
+  pthread_rwlock_unlock(&energy_sample_array_rw_lock);
+  job.numTagFiles = configVarp->NumTagFilesToParse;
+  memcpy(job.tagFiles, configVarp->tagFiles, sizeof(job.tagFiles));
+  WX_QueueIoJob("tag files", tagFilesJob, &job, sizeof(job), TRUE);
   lastTagProcTime = time(NULL);
   tagProcCnt++;
 }
 
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Render one of the tag files listed in the .conf file on request (rtl-wx -r p <name>, used by render.cgi) and send
+// the output to fd.  name can be the tag file's input or output name.  The tag processor reuses its last rendering
+// until the data changes, so with tagFileParseFrequency=0 tag files are only rendered when someone asks for them.
+// Called by the command workers, several at a time.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+void WX_DoTagFileRender(char *name, FILE *fd)
+{
+  WX_Data *datap;
+  char *buf = NULL;
+  int i, length;
+
+  if ((datap = malloc(sizeof(WX_Data))) == NULL) {  // Too big for the stack
+    fprintf(fd, "Out of memory\n");
+    return;
+  }
+  pthread_rwlock_rdlock(&energy_sample_array_rw_lock);
+  *datap = *wxDatap;
+  pthread_rwlock_unlock(&energy_sample_array_rw_lock);
+
+  // The tag file list can change when the configuration is read again
+  WX_ReadLockSharedData();
+  for (i=0;i<configVarp->NumTagFilesToParse;i++)
+    if ((strcmp(configVarp->tagFiles[i].inFile, name) == 0) || (strcmp(configVarp->tagFiles[i].outFile, name) == 0))
+      break;
+  if ((name[0] == 0) || (i == configVarp->NumTagFilesToParse))
+    fprintf(fd, "%s is not one of the tag files in the configuration file\n", name);
+  else if ((buf = WX_RenderTagFile(configVarp->tagFiles[i].inFile, datap, &length)) == NULL)
+    fprintf(fd, "Unable to render %s\n", configVarp->tagFiles[i].inFile);
+  WX_UnlockSharedData();
+  free(datap);
+  if (buf != NULL) {
+    fwrite(buf, 1, length, fd);
+    free(buf);
+  }
+}
+
 //--------------------------------------------------------------------------------------------------------------------------------------------
 // Time to snap a webcam image and save the file in the public directory.  This assumes that the camera is set up
 // correctly .  This call can be turned off by setting the webcam snapshot frequency to 0
 // in the SlugWx.conf file.  
+// fswebcam is started by the job runner, which doesn't wait for it (a camera that's gone away can hang it).
 //--------------------------------------------------------------------------------------------------------------------------------------------
 void WX_DoWebcamSnapshot()
 {
@@ -263,35 +536,92 @@ void WX_DoWebcamSnapshot()
 
   // Now do the capture
   // old NSLU2 way was -> system("/opt/bin/vidcat -m -d /dev/video0 -s 320x240 -p y -o webcam.jpg > /dev/null");
-  system("fswebcam -r 640x480 web/webcam.jpg > /dev/null");
+  char *argv[] = { "fswebcam", "-r", "640x480", "web/webcam.jpg", NULL };
 
+  WX_SpawnJob("webcam snapshot", argv, WEBCAM_TIMEOUT_SECONDS);
   lastWebcamSnapshotTime = time(NULL);
   webcamSnapshotCnt++;
 }
 
 //--------------------------------------------------------------------------------------------------------------------------------------------
 // Time to upload each file specified in the .conf file to the FTP server that was specified in the conf file.
+// The upload is queued on the I/O worker so it comes after any tag file processing queued ahead of it.  The worker
+// starts one ncftpput for each destination directory with all the files going there, so they're sent over one
+// connection, and the job runner waits for them and logs any errors.  Returns 1 if the upload was queued.
 //--------------------------------------------------------------------------------------------------------------------------------------------
-int WX_DoFtpUpload(void)
-{ 
-  int i, ftpResult, retVal, xferCount = 0;
-  char str[250];
-  
-  /* ncftpput -unnnnnnnnnnnn -pxxxxxx ftp.server.com Weather tstfile"); */
-  for(i=0;i<configVarp->numFilesToFtp;i++) {
-     sprintf(str, "ncftpput -t30 -V -u%s -p%s %s %s %s",  
-            configVarp->ftpServerUsername,configVarp->ftpServerPassword,  configVarp->ftpServerHostname, 
-            configVarp->ftpFiles[i].destpath,configVarp->ftpFiles[i].filename);
-     if ((ftpResult = system(str))) {
-        DPRINTF("NCFTPPUT: Error %d putting %s to %s\n",ftpResult, configVarp->ftpFiles[i].filename, configVarp->ftpFiles[i].destpath);
-        break;
-     } else
-        xferCount++; // successful
+typedef struct _FtpUploadJob {
+  char hostname[MAX_CONFIG_NAME_SIZE];
+  char username[MAX_CONFIG_NAME_SIZE];
+  char password[MAX_CONFIG_NAME_SIZE];
+  int numFiles;
+  WX_FtpFile files[MAX_CONFIG_LIST_SIZE];
+} FtpUploadJob;
+
+// ncftpput's login file (host, user and pass lines), readable only by us
+static BOOL writeFtpLoginFile(FtpUploadJob *jobp)
+{
+  char buf[3*MAX_CONFIG_NAME_SIZE + 20];
+  int fd, len;
+
+  len = snprintf(buf, sizeof(buf), "host %s\nuser %s\npass %s\n", jobp->hostname, jobp->username, jobp->password);
+  if ((fd = open(FTP_LOGIN_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+    DPRINTF("NCFTPPUT: Unable to write %s (%s)\n", FTP_LOGIN_FILE, strerror(errno));
+    return(FALSE);
   }
-  if (xferCount == configVarp->numFilesToFtp)
-    retVal=1;
-  else
-    retVal=0;
+  fchmod(fd, 0600);
+  if (write(fd, buf, len) != len) {
+    DPRINTF("NCFTPPUT: Unable to write %s (%s)\n", FTP_LOGIN_FILE, strerror(errno));
+    close(fd);
+    return(FALSE);
+  }
+  close(fd);
+  return(TRUE);
+}
+
+static void ftpUploadJob(void *arg)
+{
+  FtpUploadJob *jobp = (FtpUploadJob *) arg;
+  BOOL sent[MAX_CONFIG_LIST_SIZE] = { FALSE };
+  char *argv[WX_JOB_MAX_ARGS+1];
+  char jobName[MAX_CONFIG_NAME_SIZE + 10];
+  int i, j, argc;
+
+  if ((jobp->numFiles == 0) || !writeFtpLoginFile(jobp))
+    return;
+
+  /* ncftpput -f rtl-wx-ftp.login -t30 -V Weather file1 file2 ... */
+  for (i=0;i<jobp->numFiles;i++) {
+    if (sent[i])
+      continue;
+    argc = 0;
+    argv[argc++] = "ncftpput";
+    argv[argc++] = "-f";
+    argv[argc++] = FTP_LOGIN_FILE;
+    argv[argc++] = "-t30";
+    argv[argc++] = "-V";
+    argv[argc++] = jobp->files[i].destpath;
+    for (j=i;j<jobp->numFiles;j++)
+      if (!sent[j] && (strcmp(jobp->files[j].destpath, jobp->files[i].destpath) == 0)) {
+        argv[argc++] = jobp->files[j].filename;
+        sent[j] = TRUE;
+      }
+    argv[argc] = NULL;
+    snprintf(jobName, sizeof(jobName), "ftp to %s", jobp->files[i].destpath);
+    WX_SpawnJob(jobName, argv, FTP_TIMEOUT_SECONDS);
+  }
+}
+
+int WX_DoFtpUpload(void)
+{
+  static FtpUploadJob job;  // Too big for the stack
+  int retVal;
+
+  strcpy(job.hostname, configVarp->ftpServerHostname);
+  strcpy(job.username, configVarp->ftpServerUsername);
+  strcpy(job.password, configVarp->ftpServerPassword);
+  job.numFiles = configVarp->numFilesToFtp;
+  memcpy(job.files, configVarp->ftpFiles, sizeof(job.files));
+  retVal = WX_QueueIoJob("ftp upload", ftpUploadJob, &job, sizeof(job), TRUE) ? 1 : 0;
 
   lastFtpUploadTime = time(NULL);
   ftpUploadCnt++;
@@ -381,6 +711,8 @@ void WX_DumpSchedulerInfo(FILE *fd)
      &lastDataSnapshotTime, dataSnapshotCnt,configVarp->dataSnapshotFrequency);
   printSchedulerAction(fd,  "Write Realtime",  
      &lastRealTimeCsvWriteTime, realTimeCsvWriteCnt, configVarp->realtimeCsvWriteFrequency);
+  if (configVarp->realtimeCsvWriteSeconds > 0)
+     fprintf(fd,"%14s  (every %d seconds)\n", "", configVarp->realtimeCsvWriteSeconds);
   int i; 
   for(i=0;i<configVarp->numCsvFilesToUpdate;i++)
     printSchedulerAction(fd,"Append To  CSV",  
@@ -392,6 +724,11 @@ void WX_DumpSchedulerInfo(FILE *fd)
      &lastWebcamSnapshotTime, webcamSnapshotCnt,configVarp->webcamSnapshotFrequency);  
   printSchedulerAction(fd, "Do  FTP Upload",  
      &lastFtpUploadTime, ftpUploadCnt,configVarp->ftpUploadFrequency);
+  WX_DumpCsvWriterInfo(fd);
+  WX_DumpIoWorkerInfo(fd);
+  WX_DumpJobRunnerInfo(fd);
+  WX_DumpFileWatchInfo(fd);
+  WX_DumpCommandServerInfo(fd);
   fprintf(fd,"\n");
   
   fflush(fd);
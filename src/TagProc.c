@@ -10,6 +10,27 @@
    For an example of the Tags and options that are supported by the parser, see the
    file wxTagTest.in
 
+   Each tag file is compiled the first time it's processed (see TagProc.h) and
+   the compiled version is reused until the file changes, so the tags are only
+   parsed and looked up once rather than on every pass.
+
+   The output is built in memory and written to <outfile>.tmp with a single
+   write, which is then renamed over the output file, so a web server never
+   serves a partly written page.  With tagFileSkipUnchanged set, an output
+   whose contents haven't changed since it was last written is left alone
+   (saves flash writes on pages without a timestamp).
+
+   When there are several tag files they're rendered in parallel by up to
+   TAG_MAX_RENDER_THREADS threads (no more than the number of cpus), all
+   working from the same copy of the current data.  Each thread has its own
+   output buffer and its own record to load historical data into.  The
+   templates are looked up (and compiled if need be) before the threads are
+   started, so the template cache is only used by one thread.
+
+   A tag file can also be rendered on request (WX_RenderTagFile(), used by
+   rtl-wx -r p and render.cgi) instead of on a timer.  The rendering is kept
+   with the compiled template and handed out again until the data changes.
+
    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS
    OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
    AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS
@@ -24,6 +45,12 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include "rtl-wx.h"
 #include "TagProc.h"
 
@@ -225,44 +252,47 @@ char *getDayOfWeek(int month, int day, int year)
    processTimestampField()
 
   This function causes some part of a WX_Timestamp structure to be written to the parser output buffer as part of a tag
-  replacement.  
+  replacement.
 
-  Timestamps are used for vaious purposes including to indicate the time and packet count when the last update from a sensor 
+  Timestamps are used for vaious purposes including to indicate the time and packet count when the last update from a sensor
   arrived as well as to store the current date and time or the date and time that the Rain Gauge was last reset.
 
   The WMR9X8 weather station sends full date and time updates every hour on the hour, while the minute count is updated once
    per minute.  Arrival rates of data from sensors vary.
 
   For Tag processing, the Timestamp part of the tag may have come from the sensorToGetFrom or from the fieldToGet depending
-  on the Tag being processed.  This routine expects that any additional formatting options are stored in the formatCommandStr 
-  buffer in the parser control structure.
+  on the Tag being processed.  It's resolved to tsField when the template is compiled.  This routine expects that any
+  additional formatting options are stored in the formatCommandStr buffer in the parser control structure.
 --------------------------------------------------------------------------------------------------------------------------------------------------------*/
-void processTimestampField(char *tsParams, ParserControlVars *pVars)
+void processTimestampField(TagTsField tsField, ParserControlVars *pVars)
 {
   WX_Timestamp *ts = pVars->ts;
-  struct tm *localts;
-  
+  struct tm localtsBuf;
+  struct tm *localts = &localtsBuf;
+  int maxLen;
+
   time_t timeNow = time(NULL);
   if (ts->PktCnt == 0)
-     localts = localtime(&timeNow); // When timestamp is invalid, init localts to something
+     localtime_r(&timeNow, localts); // When timestamp is invalid, init localts to something
   else
-     localts = localtime(&ts->timet);
+     localtime_r(&ts->timet, localts);
 
-  if (strcmp(tsParams,"TSDATE") == 0) {
+  switch (tsField) {
+  case TAG_TS_DATE:
     // TSDATE - Need to handle no data case specially
     if (ts->PktCnt == 0) {
       if (pVars->formatForNoData == 'D')
           sprintf(pVars->outputStr,"--/--/----");
       else if (pVars->formatForNoData == 'S')
-         strcpy(pVars->outputStr, pVars->NoDataStr);       
+         strcpy(pVars->outputStr, pVars->NoDataStr);
       else
           sprintf(pVars->outputStr,"00/00/0000");
     }
     else {
-      sprintf(pVars->outputStr,"%02d/%02d/%04d", localts->tm_mon+1, localts->tm_mday, localts->tm_year+1900);  
+      sprintf(pVars->outputStr,"%02d/%02d/%04d", localts->tm_mon+1, localts->tm_mday, localts->tm_year+1900);
     }
-  }
-  else if (strcmp(tsParams, "TSTIME") == 0) {
+    break;
+  case TAG_TS_TIME:
    if (ts->PktCnt != 0) {
      if (pVars->formatControlStr[0] != '2')
         sprintf(pVars->outputStr,"%02d:%02d %s",
@@ -279,44 +309,52 @@ void processTimestampField(char *tsParams, ParserControlVars *pVars)
      else if (pVars->formatForNoData == '0')
        sprintf(pVars->outputStr,"00:00   ");
      else
-       sprintf(pVars->outputStr,"  :     ");    
+       sprintf(pVars->outputStr,"  :     ");
    }
-  } 
-  else if (strcmp(tsParams, "TSPKTCNT") == 0)
+   break;
+  case TAG_TS_PKTCNT:
       sprintf(pVars->outputStr,"%d",ts->PktCnt);
-  else if (strcmp(tsParams, "TSMINUTE") == 0)
+      break;
+  case TAG_TS_MINUTE:
       sprintf(pVars->outputStr,"%02d",localts->tm_min);
-  else if (strcmp(tsParams, "TSYEAR") == 0)
+      break;
+  case TAG_TS_YEAR:
       sprintf(pVars->outputStr,"%04d",localts->tm_year+1900);
-  else if (strcmp(tsParams, "TSMONTH") == 0) 
+      break;
+  case TAG_TS_MONTH:
         sprintf(pVars->outputStr,"%02d",localts->tm_mon+1);
-  else if (strcmp(tsParams, "TSMONTHTEXT") == 0) {
-      int maxLen = pVars->formatControlStr[0]- '0';
+        break;
+  case TAG_TS_MONTHTEXT:
+      maxLen = pVars->formatControlStr[0]- '0';
       if ((localts->tm_mon >=0) && (localts->tm_mon < 12))
         sprintf(pVars->outputStr, "%s",textMonth[localts->tm_mon]);
       if ((maxLen > 0) && (maxLen <= 9))
          pVars->outputStr[maxLen]=0;
-    }
-  else if (strcmp(tsParams, "TSDAY") == 0) 
+      break;
+  case TAG_TS_DAY:
       sprintf(pVars->outputStr,"%02d",localts->tm_mday);
-  else if (strcmp(tsParams, "TSHOUR") == 0)  {
+      break;
+  case TAG_TS_HOUR:
       if (pVars->formatControlStr[0] != '2')
         sprintf(pVars->outputStr,"%02d",
                   (localts->tm_hour>12? localts->tm_hour-12 : (localts->tm_hour<1?12:localts->tm_hour)));
       else
         sprintf(pVars->outputStr,"%02d",localts->tm_hour);
-    }
-  else if (strcmp(tsParams, "TSDAYOFWEEK") == 0) {
-      int maxLen = pVars->formatControlStr[0]-'0';
+      break;
+  case TAG_TS_DAYOFWEEK:
+      maxLen = pVars->formatControlStr[0]-'0';
       sprintf(pVars->outputStr,"%s", getDayOfWeek(localts->tm_mon+1, localts->tm_mday, localts->tm_year+1900));
       if ((maxLen > 0) && (maxLen <= 9))
          pVars->outputStr[maxLen]=0;
-    }
-  else if (strcmp(tsParams, "TSAMPM") == 0) {
+      break;
+  case TAG_TS_AMPM:
       if (localts->tm_hour < 12)
         strcpy(pVars->outputStr,"AM");
       else
         strcpy(pVars->outputStr,"PM");
+      break;
+  default:
+      break;
   }
 }
 
@@ -341,493 +379,1077 @@ void processTimestampField(char *tsParams, ParserControlVars *pVars)
   }
 }*/
 
-//*************************************************************************************************************
-void processIduTag(ParserControlVars *pVars)
-{
-  // Save the IDU timestamp object in the parser control structure
-  // This gets used in data present checks and timestamp processing later on
-  pVars->ts = &pVars->weatherDatap->idu.Timestamp;
-
-  if (strcmp(pVars->fieldToGet,"BATTERY") == 0)
-      formatBatteryField(pVars->weatherDatap->idu.BatteryLow, pVars);
-  else if (strcmp(pVars->fieldToGet,"TEMP") == 0) {
-    pVars->ts = &pVars->weatherDatap->idu.TempTimestamp;
-      formatTemperatureField(pVars->weatherDatap->idu.Temp, pVars);
-  }
-  else if (strcmp(pVars->fieldToGet,"HUMIDITY") == 0) {
-    pVars->ts = &pVars->weatherDatap->idu.RelHumTimestamp;
-      formatRelHumField(pVars->weatherDatap->idu.RelHum, pVars);
-  }
-  else if (strcmp(pVars->fieldToGet,"DEWPOINT") == 0) {
-    pVars->ts = &pVars->weatherDatap->idu.RelHumTimestamp;
-      formatDewpointField(pVars->weatherDatap->idu.Dewpoint, pVars);
-  }
-  else if (strcmp(pVars->fieldToGet,"PRESSURE") == 0) {
-    pVars->ts = &pVars->weatherDatap->idu.PressureTimestamp;
-      formatPressureField(pVars->weatherDatap->idu.Pressure, pVars);
-  }
-  else if (strncmp(pVars->fieldToGet,"TEMP-TS",7) == 0) {
-    pVars->ts = &pVars->weatherDatap->idu.TempTimestamp;
-      processTimestampField(&pVars->fieldToGet[5], pVars);
-  }
-  else if (strncmp(pVars->fieldToGet,"HUMIDITY-TS",11) == 0) {
-    pVars->ts = &pVars->weatherDatap->idu.RelHumTimestamp;
-      processTimestampField(&pVars->fieldToGet[9], pVars);
-  }
-  else if (strncmp(pVars->fieldToGet,"DEWPOINT-TS",11) == 0) {
-    pVars->ts = &pVars->weatherDatap->idu.RelHumTimestamp;
-      processTimestampField(&pVars->fieldToGet[9], pVars);
-  }
-  else if (strncmp(pVars->fieldToGet,"PRESSURE-TS",11) == 0) {
-    pVars->ts = &pVars->weatherDatap->idu.PressureTimestamp;
-      processTimestampField(&pVars->fieldToGet[9], pVars);
-  }
-  else if (strcmp(pVars->fieldToGet,"FORECAST") == 0)
-      formatForecastField(pVars->weatherDatap->idu.ForecastStr, pVars);
-  else if (strcmp(pVars->fieldToGet,"SEALEVELOFFSET") == 0)
-      formatPressureField(pVars->weatherDatap->idu.SeaLevelOffset, pVars);
-  else if (strncmp(pVars->fieldToGet,"TS",2) == 0)
-      processTimestampField(pVars->fieldToGet, pVars);
-  else
-    sprintf(pVars->outputStr,"WXERROR_IDUTAG-%s",pVars->fieldToGet);
+int sumRainDataRecords(int startRecord, int endRecord)
+{
+  int i;
+  int sum=0;
+  for (i=startRecord;i<=endRecord;i++)
+    sum += WX_GetRainDataRecord(i);
+  return(sum);
 }
 
 //*************************************************************************************************************
-void procesOduTag(ParserControlVars *pVars)
-{
-  // Save the ODU timestamp object in the parser control structure
-  // This gets used in data present checks and timestamp processing later on
-  pVars->ts = &pVars->weatherDatap->odu.Timestamp;
-
-  if (strcmp(pVars->fieldToGet,"BATTERY") == 0)
-      formatBatteryField(pVars->weatherDatap->odu.BatteryLow, pVars);
-  else if (strcmp(pVars->fieldToGet,"TEMP") == 0) {
-    pVars->ts = &pVars->weatherDatap->odu.TempTimestamp;
-      formatTemperatureField(pVars->weatherDatap->odu.Temp, pVars);
-  }
-  else if (strcmp(pVars->fieldToGet,"HUMIDITY") == 0) {
-    pVars->ts = &pVars->weatherDatap->odu.RelHumTimestamp;
-      formatRelHumField(pVars->weatherDatap->odu.RelHum, pVars);
-  }
-  else if (strcmp(pVars->fieldToGet,"DEWPOINT") == 0) {
-    pVars->ts = &pVars->weatherDatap->odu.DewpointTimestamp;
-      formatDewpointField(pVars->weatherDatap->odu.Dewpoint, pVars);
-  }
-  else if (strncmp(pVars->fieldToGet,"TEMP-TS",7) == 0) {
-    pVars->ts = &pVars->weatherDatap->odu.TempTimestamp;
-      processTimestampField(&pVars->fieldToGet[5], pVars);
-  }
-  else if (strncmp(pVars->fieldToGet,"HUMIDITY-TS",11) == 0) {
-    pVars->ts = &pVars->weatherDatap->odu.RelHumTimestamp;
-      processTimestampField(&pVars->fieldToGet[9], pVars);
-  }
-  else if (strncmp(pVars->fieldToGet,"DEWPOINT-TS",11) == 0) {
-    pVars->ts = &pVars->weatherDatap->odu.DewpointTimestamp;
-      processTimestampField(&pVars->fieldToGet[9], pVars);
-  } 
-  else if (strncmp(pVars->fieldToGet,"TS",2) == 0)
-      processTimestampField(pVars->fieldToGet, pVars);
-  else
-    sprintf(pVars->outputStr,"WXERROR_ODUTAG-%s",pVars->fieldToGet);
+// Render routines for compiled tags.  Each one fetches its value from the record being processed using the offset
+// worked out when the template was compiled, and hands it to the matching format routine above.
+#define TAG_VALUE(op, pVars, type) (*(type *) ((char *) (pVars)->weatherDatap + (op)->valueOffset))
+
+static void renderBattery(TagOp *op, ParserControlVars *pVars)     { formatBatteryField(TAG_VALUE(op, pVars, BOOL), pVars); }
+static void renderTemperature(TagOp *op, ParserControlVars *pVars) { formatTemperatureField(TAG_VALUE(op, pVars, float), pVars); }
+static void renderRelHum(TagOp *op, ParserControlVars *pVars)      { formatRelHumField(TAG_VALUE(op, pVars, int), pVars); }
+static void renderDewpoint(TagOp *op, ParserControlVars *pVars)    { formatDewpointField(TAG_VALUE(op, pVars, float), pVars); }
+static void renderPressure(TagOp *op, ParserControlVars *pVars)    { formatPressureField(TAG_VALUE(op, pVars, int), pVars); }
+static void renderForecast(TagOp *op, ParserControlVars *pVars)    { formatForecastField(TAG_VALUE(op, pVars, char *), pVars); }
+static void renderRain(TagOp *op, ParserControlVars *pVars)        { formatRainField(TAG_VALUE(op, pVars, int), pVars); }
+static void renderWindBearing(TagOp *op, ParserControlVars *pVars) { formatWindBearingField(TAG_VALUE(op, pVars, int), pVars); }
+static void renderWindSpeed(TagOp *op, ParserControlVars *pVars)   { formatWindSpeedField(TAG_VALUE(op, pVars, float), pVars); }
+static void renderChillValid(TagOp *op, ParserControlVars *pVars)  { formatChillValidField(TAG_VALUE(op, pVars, BOOL), pVars); }
+static void renderCount(TagOp *op, ParserControlVars *pVars)       { sprintf(pVars->outputStr, "%d", TAG_VALUE(op, pVars, int)); }
+static void renderTimestamp(TagOp *op, ParserControlVars *pVars)   { processTimestampField(op->tsField, pVars); }
+static void renderText(TagOp *op, ParserControlVars *pVars)        { strcpy(pVars->outputStr, op->text); }
+
+static void renderWindchill(TagOp *op, ParserControlVars *pVars)
+{
+  formatWindchillField(pVars->weatherDatap->wg.WindChill, pVars->weatherDatap->wg.ChillValid, pVars);
+}
+
+static void renderRainTotal(TagOp *op, ParserControlVars *pVars)
+{
+  formatRainField(sumRainDataRecords(1,op->rainRecords), pVars);
+}
+
+static void appendOutput(ParserControlVars *pVars, const char *text, int length);
+
+static void renderRainWeekByDay(TagOp *op, ParserControlVars *pVars)
+{
+  int day;
+  for (day=6;day>=0;day--) {
+    int startRecord=1+(day*24);
+    int sum=sumRainDataRecords(startRecord,startRecord+23);
+    formatRainField(sum, pVars);
+    if (day >0) {
+      appendOutput(pVars, pVars->outputStr, strlen(pVars->outputStr));
+      appendOutput(pVars, &pVars->spacerForMultipleRecords, 1);
+    }
+  }
+}
+
+static void renderNoDataFormat(TagOp *op, ParserControlVars *pVars)
+{
+  pVars->formatForNoData = pVars->formatControlStr[0];
+  if (pVars->formatControlStr[0] == 'S')
+    strcpy(pVars->NoDataStr, &pVars->formatControlStr[1]);
+}
+
+static void renderMultiSpacer(TagOp *op, ParserControlVars *pVars)
+{
+  pVars->spacerForMultipleRecords = pVars->formatControlStr[0];
 }
 
 //*************************************************************************************************************
-void procesExtTag(int sensorIdx, ParserControlVars *pVars)
-{
-  // Save the appropriate extra sensor timestamp object in the parser control structure
-  pVars->ts = &pVars->weatherDatap->ext[sensorIdx].Timestamp;
-
-  if (strcmp(pVars->fieldToGet,"BATTERY") == 0)
-      formatBatteryField(pVars->weatherDatap->ext[sensorIdx].BatteryLow, pVars);
-  else if (strcmp(pVars->fieldToGet,"TEMP") == 0) {
-    pVars->ts = &pVars->weatherDatap->ext[sensorIdx].TempTimestamp;
-      formatTemperatureField(pVars->weatherDatap->ext[sensorIdx].Temp, pVars);
-  }
-  else if (strcmp(pVars->fieldToGet,"HUMIDITY") == 0) {
-    pVars->ts = &pVars->weatherDatap->ext[sensorIdx].RelHumTimestamp;
-      formatRelHumField(pVars->weatherDatap->ext[sensorIdx].RelHum, pVars);
-  }
-  else if (strcmp(pVars->fieldToGet,"DEWPOINT") == 0) {
-    pVars->ts = &pVars->weatherDatap->ext[sensorIdx].DewpointTimestamp;
-      formatDewpointField(pVars->weatherDatap->ext[sensorIdx].Dewpoint, pVars);
-  }
-  else if (strncmp(pVars->fieldToGet,"TEMP-TS",7) == 0) {
-    pVars->ts = &pVars->weatherDatap->ext[sensorIdx].TempTimestamp;
-      processTimestampField(&pVars->fieldToGet[5], pVars);
-  }
-  else if (strncmp(pVars->fieldToGet,"HUMIDITY-TS",11) == 0) {
-    pVars->ts = &pVars->weatherDatap->ext[sensorIdx].RelHumTimestamp;
-      processTimestampField(&pVars->fieldToGet[9], pVars);
-  }
-  else if (strncmp(pVars->fieldToGet,"DEWPOINT-TS",11) == 0) {
-    pVars->ts = &pVars->weatherDatap->ext[sensorIdx].DewpointTimestamp;
-      processTimestampField(&pVars->fieldToGet[9], pVars);
-  } 
-  else if (strncmp(pVars->fieldToGet,"TS",2) == 0)
-      processTimestampField(pVars->fieldToGet, pVars);
-  else
-    sprintf(pVars->outputStr,"WXERROR_EXTTAG-%s",pVars->fieldToGet);
+// Routines used when compiling a template to resolve the sensor and field named in a tag to a render routine and the
+// offsets of the value and timestamp it uses.
+static void setTagField(TagOp *op, TagRenderFunc render, size_t valueOffset, size_t tsOffset)
+{
+  op->render = render;
+  op->valueOffset = valueOffset;
+  op->tsOffset = tsOffset;
+}
+
+// Names of the TSxxx timestamp fields
+static const struct { char *name; TagTsField field; } tsFieldNames[] = {
+  { "TSDATE", TAG_TS_DATE }, { "TSTIME", TAG_TS_TIME }, { "TSPKTCNT", TAG_TS_PKTCNT }, { "TSMINUTE", TAG_TS_MINUTE },
+  { "TSYEAR", TAG_TS_YEAR }, { "TSMONTH", TAG_TS_MONTH }, { "TSMONTHTEXT", TAG_TS_MONTHTEXT }, { "TSDAY", TAG_TS_DAY },
+  { "TSHOUR", TAG_TS_HOUR }, { "TSDAYOFWEEK", TAG_TS_DAYOFWEEK }, { "TSAMPM", TAG_TS_AMPM }
+};
+
+static void setTimestampField(TagOp *op, char *tsParams, size_t tsOffset)
+{
+  unsigned int i;
+
+  setTagField(op, renderTimestamp, 0, tsOffset);
+  op->tsField = TAG_TS_NONE;
+  for (i=0;i<sizeof(tsFieldNames)/sizeof(tsFieldNames[0]);i++)
+    if (strcmp(tsParams, tsFieldNames[i].name) == 0)
+      op->tsField = tsFieldNames[i].field;
+}
+
+// A tag that names something that doesn't exist outputs an error message for each record it refers to
+static void setErrorField(TagOp *op, char *format, char *name)
+{
+  char str[MAX_TAG_OUTPUT_SIZE];
+
+  snprintf(str, sizeof(str), format, name);
+  op->render = renderText;
+  op->ownedText = strdup(str);
+  op->text = (op->ownedText != NULL) ? op->ownedText : "";
 }
 
 //*************************************************************************************************************
-void procesRgTag(ParserControlVars *pVars)
+// Tables of the sensor and field names that can be used in a tag.  Field offsets are from the start of the sensor's data
+// (the offset in the sensor table), so the one set of EXT fields serves EXT1 to EXT10.  A field name ending in -TS (or
+// just TS) matches any field name that starts with it, with the TSxxx part following.  "*" matches any field name.
+typedef enum tag_TagSensorKind {
+ TAG_SENSOR_GLOBAL = 0,
+ TAG_SENSOR_IDU,
+ TAG_SENSOR_ODU,
+ TAG_SENSOR_RG,
+ TAG_SENSOR_RAINHIST,
+ TAG_SENSOR_WG,
+ TAG_SENSOR_EXT,
+ TAG_SENSOR_BADPKTCNT,
+ TAG_SENSOR_UNSUPPORTEDPKTCNT,
+ TAG_NUM_SENSOR_KINDS
+} TagSensorKind;
+
+typedef struct tag_TagSensorDef {
+  char *name;
+  TagSensorKind kind;
+  size_t offset;             // Where the sensor's data is in WX_Data
+  int historySensor;         // Sensor loaded from history for a range of records (-1 for just the record's time and counts)
+} TagSensorDef;
+
+typedef struct tag_TagFieldDef {
+  TagSensorKind sensor;
+  char *name;
+  TagRenderFunc render;
+  size_t valueOffset;
+  size_t tsOffset;           // Timestamp used for the no data check and TSxxx fields
+  int rainRecords;           // Hourly rain records summed by RAINHIST_TOTALLAST...
+} TagFieldDef;
+
+// Output (for each record) by a tag with a field that the sensor doesn't have
+static char *tagFieldErrorFormat[TAG_NUM_SENSOR_KINDS] = {
+  "WXERROR_BADGLOBAL-%s", "WXERROR_IDUTAG-%s", "WXERROR_ODUTAG-%s", "WXERROR_RGTAG-%s", "WXERROR_RGTAG-%s",
+  "WXERROR_WGTAG-%s", "WXERROR_EXTTAG-%s", "", ""
+};
+
+static const TagSensorDef tagSensorDefs[] = {
+  { "GLOBAL",            TAG_SENSOR_GLOBAL,            0,                         -1 },
+  { "IDU",               TAG_SENSOR_IDU,               offsetof(WX_Data, idu),    WX_SENSOR_IDU },
+  { "ODU",               TAG_SENSOR_ODU,               offsetof(WX_Data, odu),    WX_SENSOR_ODU },
+  { "RG",                TAG_SENSOR_RG,                offsetof(WX_Data, rg),     WX_SENSOR_RG },
+  { "RAINHIST",          TAG_SENSOR_RAINHIST,          offsetof(WX_Data, rg),     WX_SENSOR_RG },
+  { "WG",                TAG_SENSOR_WG,                offsetof(WX_Data, wg),     WX_SENSOR_WG },
+  { "EXT1",              TAG_SENSOR_EXT,               offsetof(WX_Data, ext[0]), WX_SENSOR_EXT1+0 },
+  { "EXT2",              TAG_SENSOR_EXT,               offsetof(WX_Data, ext[1]), WX_SENSOR_EXT1+1 },
+  { "EXT3",              TAG_SENSOR_EXT,               offsetof(WX_Data, ext[2]), WX_SENSOR_EXT1+2 },
+  { "EXT4",              TAG_SENSOR_EXT,               offsetof(WX_Data, ext[3]), WX_SENSOR_EXT1+3 },
+  { "EXT5",              TAG_SENSOR_EXT,               offsetof(WX_Data, ext[4]), WX_SENSOR_EXT1+4 },
+  { "EXT6",              TAG_SENSOR_EXT,               offsetof(WX_Data, ext[5]), WX_SENSOR_EXT1+5 },
+  { "EXT7",              TAG_SENSOR_EXT,               offsetof(WX_Data, ext[6]), WX_SENSOR_EXT1+6 },
+  { "EXT8",              TAG_SENSOR_EXT,               offsetof(WX_Data, ext[7]), WX_SENSOR_EXT1+7 },
+  { "EXT9",              TAG_SENSOR_EXT,               offsetof(WX_Data, ext[8]), WX_SENSOR_EXT1+8 },
+  { "EXT10",             TAG_SENSOR_EXT,               offsetof(WX_Data, ext[9]), WX_SENSOR_EXT1+9 },
+  { "BADPKTCNT",         TAG_SENSOR_BADPKTCNT,         0,                         -1 },
+  { "UNSUPPORTEDPKTCNT", TAG_SENSOR_UNSUPPORTEDPKTCNT, 0,                         -1 }
+};
+#define NUM_TAG_SENSOR_DEFS ((int) (sizeof(tagSensorDefs)/sizeof(tagSensorDefs[0])))
+
+#define IDU(member) offsetof(WX_IndoorUnitData, member)
+#define ODU(member) offsetof(WX_OutdoorUnitData, member)
+#define EXT(member) offsetof(WX_ExtraSensorData, member)
+#define RG(member)  offsetof(WX_RainGaugeData, member)
+#define WG(member)  offsetof(WX_WindGaugeData, member)
+
+static const TagFieldDef tagFieldDefs[] = {
+  { TAG_SENSOR_GLOBAL, "NODATA",         renderNoDataFormat, 0,                 offsetof(WX_Data, currentTime), 0 },
+  { TAG_SENSOR_GLOBAL, "MULTISPACER",    renderMultiSpacer,  0,                 offsetof(WX_Data, currentTime), 0 },
+
+  { TAG_SENSOR_IDU, "BATTERY",           renderBattery,      IDU(BatteryLow),   IDU(Timestamp), 0 },
+  { TAG_SENSOR_IDU, "TEMP",              renderTemperature,  IDU(Temp),         IDU(TempTimestamp), 0 },
+  { TAG_SENSOR_IDU, "HUMIDITY",          renderRelHum,       IDU(RelHum),       IDU(RelHumTimestamp), 0 },
+  { TAG_SENSOR_IDU, "DEWPOINT",          renderDewpoint,     IDU(Dewpoint),     IDU(RelHumTimestamp), 0 },
+  { TAG_SENSOR_IDU, "PRESSURE",          renderPressure,     IDU(Pressure),     IDU(PressureTimestamp), 0 },
+  { TAG_SENSOR_IDU, "FORECAST",          renderForecast,     IDU(ForecastStr),  IDU(Timestamp), 0 },
+  { TAG_SENSOR_IDU, "SEALEVELOFFSET",    renderPressure,     IDU(SeaLevelOffset), IDU(Timestamp), 0 },
+  { TAG_SENSOR_IDU, "TEMP-TS",           renderTimestamp,    0,                 IDU(TempTimestamp), 0 },
+  { TAG_SENSOR_IDU, "HUMIDITY-TS",       renderTimestamp,    0,                 IDU(RelHumTimestamp), 0 },
+  { TAG_SENSOR_IDU, "DEWPOINT-TS",       renderTimestamp,    0,                 IDU(RelHumTimestamp), 0 },
+  { TAG_SENSOR_IDU, "PRESSURE-TS",       renderTimestamp,    0,                 IDU(PressureTimestamp), 0 },
+  { TAG_SENSOR_IDU, "TS",                renderTimestamp,    0,                 IDU(Timestamp), 0 },
+
+  { TAG_SENSOR_ODU, "BATTERY",           renderBattery,      ODU(BatteryLow),   ODU(Timestamp), 0 },
+  { TAG_SENSOR_ODU, "TEMP",              renderTemperature,  ODU(Temp),         ODU(TempTimestamp), 0 },
+  { TAG_SENSOR_ODU, "HUMIDITY",          renderRelHum,       ODU(RelHum),       ODU(RelHumTimestamp), 0 },
+  { TAG_SENSOR_ODU, "DEWPOINT",          renderDewpoint,     ODU(Dewpoint),     ODU(DewpointTimestamp), 0 },
+  { TAG_SENSOR_ODU, "TEMP-TS",           renderTimestamp,    0,                 ODU(TempTimestamp), 0 },
+  { TAG_SENSOR_ODU, "HUMIDITY-TS",       renderTimestamp,    0,                 ODU(RelHumTimestamp), 0 },
+  { TAG_SENSOR_ODU, "DEWPOINT-TS",       renderTimestamp,    0,                 ODU(DewpointTimestamp), 0 },
+  { TAG_SENSOR_ODU, "TS",                renderTimestamp,    0,                 ODU(Timestamp), 0 },
+
+  { TAG_SENSOR_EXT, "BATTERY",           renderBattery,      EXT(BatteryLow),   EXT(Timestamp), 0 },
+  { TAG_SENSOR_EXT, "TEMP",              renderTemperature,  EXT(Temp),         EXT(TempTimestamp), 0 },
+  { TAG_SENSOR_EXT, "HUMIDITY",          renderRelHum,       EXT(RelHum),       EXT(RelHumTimestamp), 0 },
+  { TAG_SENSOR_EXT, "DEWPOINT",          renderDewpoint,     EXT(Dewpoint),     EXT(DewpointTimestamp), 0 },
+  { TAG_SENSOR_EXT, "TEMP-TS",           renderTimestamp,    0,                 EXT(TempTimestamp), 0 },
+  { TAG_SENSOR_EXT, "HUMIDITY-TS",       renderTimestamp,    0,                 EXT(RelHumTimestamp), 0 },
+  { TAG_SENSOR_EXT, "DEWPOINT-TS",       renderTimestamp,    0,                 EXT(DewpointTimestamp), 0 },
+  { TAG_SENSOR_EXT, "TS",                renderTimestamp,    0,                 EXT(Timestamp), 0 },
+
+  { TAG_SENSOR_RG, "BATTERY",            renderBattery,      RG(BatteryLow),    RG(Timestamp), 0 },
+  { TAG_SENSOR_RG, "RAINRATE",           renderRain,         RG(Rate),          RG(RateTimestamp), 0 },
+  { TAG_SENSOR_RG, "RAINTOTAL",          renderRain,         RG(Total),         RG(Timestamp), 0 },
+  { TAG_SENSOR_RG, "RAINRATE-TS",        renderTimestamp,    0,                 RG(RateTimestamp), 0 },
+  { TAG_SENSOR_RG, "TS",                 renderTimestamp,    0,                 RG(Timestamp), 0 },
+/* Total yesterday and rain reset are not supported now that we're getting data directly from sensors
+  RAINYESTERDAY, RAINRESET, RRxxx */
+
+  { TAG_SENSOR_RAINHIST, "TOTALLASTDAY",       renderRainTotal,     0, RG(Timestamp), 24*1 },
+  { TAG_SENSOR_RAINHIST, "TOTALLAST3DAY",      renderRainTotal,     0, RG(Timestamp), 24*3 },
+  { TAG_SENSOR_RAINHIST, "TOTALLASTWEEK",      renderRainTotal,     0, RG(Timestamp), 24*7 },
+  { TAG_SENSOR_RAINHIST, "TOTALLASTWEEKBYDAY", renderRainWeekByDay, 0, RG(Timestamp), 0 },
+
+  { TAG_SENSOR_WG, "BATTERY",            renderBattery,      WG(BatteryLow),    WG(Timestamp), 0 },
+  { TAG_SENSOR_WG, "BEARING",            renderWindBearing,  WG(Bearing),       WG(Timestamp), 0 },
+  { TAG_SENSOR_WG, "SPEED",              renderWindSpeed,    WG(Speed),         WG(SpeedTimestamp), 0 },
+  { TAG_SENSOR_WG, "AVGSPEED",           renderWindSpeed,    WG(AvgSpeed),      WG(AvgSpeedTimestamp), 0 },
+  { TAG_SENSOR_WG, "WINDCHILL",          renderWindchill,    WG(WindChill),     WG(Timestamp), 0 },
+  { TAG_SENSOR_WG, "CHILLVALID",         renderChillValid,   WG(ChillValid),    WG(Timestamp), 0 },
+  { TAG_SENSOR_WG, "SPEED-TS",           renderTimestamp,    0,                 WG(SpeedTimestamp), 0 },
+  { TAG_SENSOR_WG, "AVGSPEED-TS",        renderTimestamp,    0,                 WG(AvgSpeedTimestamp), 0 },
+  { TAG_SENSOR_WG, "TS",                 renderTimestamp,    0,                 WG(Timestamp), 0 },
+
+  { TAG_SENSOR_BADPKTCNT, "*",           renderCount, offsetof(WX_Data, BadPktCnt),         offsetof(WX_Data, currentTime), 0 },
+  { TAG_SENSOR_UNSUPPORTEDPKTCNT, "*",   renderCount, offsetof(WX_Data, UnsupportedPktCnt), offsetof(WX_Data, currentTime), 0 }
+};
+#define NUM_TAG_FIELD_DEFS ((int) (sizeof(tagFieldDefs)/sizeof(tagFieldDefs[0])))
+
+//*************************************************************************************************************
+// The names are found with a perfect hash: a table with one slot per possible hash value, built once with a seed that
+// puts every sensor and field name in a slot of its own.  A lookup is one hash and one string compare.  Sensor names
+// are hashed with kind TAG_NUM_SENSOR_KINDS, field names with the kind of sensor they belong to.
+#define TAG_HASH_MIN_SLOTS 256
+#define TAG_HASH_SEEDS_TO_TRY 1000 // Before trying a bigger table
+
+static short *tagHashSlots;       // Index of the name in the slot: sensor defs first, then field defs, -1 if empty
+static unsigned int tagHashMask;
+static unsigned int tagHashSeed;
+static pthread_once_t tagHashOnce = PTHREAD_ONCE_INIT;
+
+static unsigned int tagNameHash(unsigned int seed, int kind, const char *name, int length)
 {
-  // Save the Rain Gauge timestamp object in the parser control structure
-  pVars->ts = &pVars->weatherDatap->rg.Timestamp;
+  unsigned int h = 2166136261u ^ seed;
+  int i;
 
-  if (strcmp(pVars->fieldToGet,"BATTERY") == 0)
-      formatBatteryField(pVars->weatherDatap->rg.BatteryLow, pVars);
-  else if (strcmp(pVars->fieldToGet,"RAINRATE") == 0) {
-    pVars->ts = &pVars->weatherDatap->rg.RateTimestamp;
-      formatRainField(pVars->weatherDatap->rg.Rate, pVars);
+  h = (h ^ kind) * 16777619u;
+  for (i=0;i<length;i++)
+    h = (h ^ (unsigned char) name[i]) * 16777619u;
+  h ^= h >> 15;
+  return(h);
+}
+
+static void getHashKey(int idx, int *kindp, const char **namep)
+{
+  if (idx < NUM_TAG_SENSOR_DEFS) {
+    *kindp = TAG_NUM_SENSOR_KINDS;
+    *namep = tagSensorDefs[idx].name;
+  }
+  else {
+    *kindp = tagFieldDefs[idx - NUM_TAG_SENSOR_DEFS].sensor;
+    *namep = tagFieldDefs[idx - NUM_TAG_SENSOR_DEFS].name;
   }
-  else if (strncmp(pVars->fieldToGet,"RAINRATE-TS",11) == 0) {
-    pVars->ts = &pVars->weatherDatap->rg.RateTimestamp;
-      processTimestampField(&pVars->fieldToGet[9], pVars);
+}
+
+static void buildTagHash(void)
+{
+  int numKeys = NUM_TAG_SENSOR_DEFS + NUM_TAG_FIELD_DEFS;
+  unsigned int numSlots, seed, slot;
+  const char *name;
+  int i, kind;
+
+  for (numSlots=TAG_HASH_MIN_SLOTS;;numSlots*=2) {
+    if ((tagHashSlots = realloc(tagHashSlots, numSlots*sizeof(short))) == NULL) {
+      DPRINTF("Tag Processor: Out of memory building the tag name table\n");
+      return;
+    }
+    for (seed=1;seed<=TAG_HASH_SEEDS_TO_TRY;seed++) {
+      memset(tagHashSlots, 0xff, numSlots*sizeof(short));
+      for (i=0;i<numKeys;i++) {
+        getHashKey(i, &kind, &name);
+        slot = tagNameHash(seed, kind, name, strlen(name)) & (numSlots-1);
+        if (tagHashSlots[slot] >= 0)
+          break;
+        tagHashSlots[slot] = i;
+      }
+      if (i == numKeys) {
+        tagHashMask = numSlots-1;
+        tagHashSeed = seed;
+        return;
+      }
+    }
   }
-  else if (strcmp(pVars->fieldToGet,"RAINTOTAL") == 0)
-      formatRainField(pVars->weatherDatap->rg.Total, pVars);
-/* Total yesterday and rain reset are not supported now that we're getting data directly from sensors
-  else if (strcmp(pVars->fieldToGet,"RAINYESTERDAY") == 0)
-      formatRainField(pVars->weatherDatap->rg.TotalYesterday, pVars);
-  else if (strcmp(pVars->fieldToGet,"RAINRESET") == 0)
-    formatRainResetField(pVars);
-  else if (strncmp(pVars->fieldToGet,"RR",2) == 0)
-    formatRainResetField(pVars); */
-  else if (strncmp(pVars->fieldToGet,"TS",2) == 0)
-      processTimestampField(pVars->fieldToGet, pVars);
-  else
-    sprintf(pVars->outputStr,"WXERROR_RGTAG-%s",pVars->fieldToGet);
 }
-int sumRainDataRecords(int startRecord, int endRecord)
+
+// Returns the index of the name (as used in tagHashSlots) or -1 if there isn't one.  Only the first length characters
+// of name are used.
+static int lookupTagName(int kind, const char *name, int length)
 {
-  int i;
-  int sum=0;
-  for (i=startRecord;i<=endRecord;i++)
-    sum += WX_GetRainDataRecord(i);
-  return(sum);
+  const char *keyName;
+  int idx, keyKind;
+
+  pthread_once(&tagHashOnce, buildTagHash);
+  if (tagHashSlots == NULL)
+    return(-1);
+  if ((idx = tagHashSlots[tagNameHash(tagHashSeed, kind, name, length) & tagHashMask]) < 0)
+    return(-1);
+  getHashKey(idx, &keyKind, &keyName);
+  if ((keyKind != kind) || (strncmp(keyName, name, length) != 0) || (keyName[length] != 0))
+    return(-1);
+  return(idx);
 }
 
-//*************************************************************************************************************
-void procesRainHistTag(ParserControlVars *pVars)
-{
-  int recordsToSum=0;
-
-  // Save the Rain Gauge timestamp object in the parser control structure
-  pVars->ts = &pVars->weatherDatap->rg.Timestamp;
-
-  if (strcmp(pVars->fieldToGet,"TOTALLASTDAY") == 0)
-        recordsToSum=24*1;
-  else if (strcmp(pVars->fieldToGet,"TOTALLAST3DAY") == 0)
-        recordsToSum=24*3;
-  else if (strcmp(pVars->fieldToGet,"TOTALLASTWEEK") == 0)
-        recordsToSum=24*7;
-
-  if (recordsToSum != 0)
-     formatRainField(sumRainDataRecords(1,recordsToSum), pVars);
-  else if (strcmp(pVars->fieldToGet,"TOTALLASTWEEKBYDAY") == 0)
-    {
-   int day;
-   for (day=6;day>=0;day--) {
-           int startRecord=1+(day*24);
-            int sum=sumRainDataRecords(startRecord,startRecord+23);
-         formatRainField(sum, pVars);
-            if (day >0) {
-           fputs(pVars->outputStr, pVars->outfd);
-              fputc(pVars->spacerForMultipleRecords, pVars->outfd);
-            }
-      }
-   }
-  else
-    sprintf(pVars->outputStr,"WXERROR_RGTAG-%s",pVars->fieldToGet);
+static const TagFieldDef *lookupTagField(TagSensorKind sensor, const char *name, int length)
+{
+  int idx = lookupTagName(sensor, name, length);
+  return((idx < 0) ? NULL : &tagFieldDefs[idx - NUM_TAG_SENSOR_DEFS]);
 }
-//*************************************************************************************************************
-void procesWgTag(ParserControlVars *pVars)
-{
-  // Save the Wind  Gauge timestamp object in the parser control structure
-  pVars->ts = &pVars->weatherDatap->wg.Timestamp;
-  if (strcmp(pVars->fieldToGet,"BATTERY") == 0)
-      formatBatteryField(pVars->weatherDatap->wg.BatteryLow, pVars);
-  else if (strcmp(pVars->fieldToGet,"BEARING") == 0)
-    formatWindBearingField(pVars->weatherDatap->wg.Bearing, pVars);
-  else if (strcmp(pVars->fieldToGet,"SPEED") == 0) {
-   pVars->ts = &pVars->weatherDatap->wg.SpeedTimestamp;
-   formatWindSpeedField(pVars->weatherDatap->wg.Speed,pVars); 
-  } 
-  else if (strcmp(pVars->fieldToGet,"AVGSPEED") == 0) {
-   pVars->ts = &pVars->weatherDatap->wg.AvgSpeedTimestamp;
-   formatWindSpeedField(pVars->weatherDatap->wg.AvgSpeed,pVars);
-  }
-  else if (strncmp(pVars->fieldToGet,"SPEED-TS",8) == 0) {
-   pVars->ts = &pVars->weatherDatap->wg.SpeedTimestamp;
-    processTimestampField(&pVars->fieldToGet[6], pVars);
-  } 
-  else if (strncmp(pVars->fieldToGet,"AVGSPEED-TS",11) == 0) {
-   pVars->ts = &pVars->weatherDatap->wg.AvgSpeedTimestamp;
-    processTimestampField(&pVars->fieldToGet[9], pVars);
-  }
-  else if (strcmp(pVars->fieldToGet,"WINDCHILL") == 0)
-    formatWindchillField(pVars->weatherDatap->wg.WindChill, pVars->weatherDatap->wg.ChillValid, pVars); 
-  else if (strcmp(pVars->fieldToGet,"CHILLVALID") == 0)
-    formatChillValidField(pVars->weatherDatap->wg.ChillValid,pVars); 
-  else if (strncmp(pVars->fieldToGet,"TS",2) == 0)
-    processTimestampField(pVars->fieldToGet, pVars);
-  else
-    sprintf(pVars->outputStr,"WXERROR_WGTAG-%s",pVars->fieldToGet);
-}   
 
 //*************************************************************************************************************
-// Based on which sensor type was referenced in the Tag, dispatch to the correct processing routine for the specific sensor type
-void processTag(ParserControlVars *pVars)
+// Resolve the sensor and field named in a tag to a render routine and the offsets of the value and timestamp it uses
+void processTag(char *sensorToGetFrom, char *fieldToGet, TagOp *op)
 {
-  // First see if the tag is a global formatting tag
-  if (strcmp(pVars->sensorToGetFrom,"GLOBAL") == 0) {
-    if (strcmp(pVars->fieldToGet,"NODATA") == 0) {
-       pVars->formatForNoData = pVars->formatControlStr[0];
-      if (pVars->formatControlStr[0] == 'S')
-        strcpy(pVars->NoDataStr, &pVars->formatControlStr[1]);
-    }
-    else if (strcmp(pVars->fieldToGet,"MULTISPACER") == 0) {
-       pVars->spacerForMultipleRecords = pVars->formatControlStr[0];
+  const TagSensorDef *sensorp;
+  const TagFieldDef *fieldp;
+  char *tsParams = NULL;
+  char *dashTs;
+  int idx;
+
+  if ((idx = lookupTagName(TAG_NUM_SENSOR_KINDS, sensorToGetFrom, strlen(sensorToGetFrom))) < 0) {
+    op->historySensor = -1;
+    if (strncmp(sensorToGetFrom,"TS",2) == 0) {
+      strcpy(op->formatControlStr, fieldToGet); // Formatting string is in fieldToGet
+      setTimestampField(op, sensorToGetFrom, offsetof(WX_Data, currentTime));
     }
-    else 
-     sprintf(pVars->outputStr,"WXERROR_BADGLOBAL-%s",pVars->fieldToGet);
-  }
-  else if (strcmp(pVars->sensorToGetFrom,"IDU") == 0)
-      processIduTag(pVars);
-  else if (strcmp(pVars->sensorToGetFrom,"ODU") == 0)
-      procesOduTag(pVars);      
-  else if (strcmp(pVars->sensorToGetFrom,"RG") == 0)
-      procesRgTag(pVars);
-  else if (strcmp(pVars->sensorToGetFrom,"RAINHIST") == 0)
-      procesRainHistTag(pVars);  
-  else if (strcmp(pVars->sensorToGetFrom,"WG") == 0)
-      procesWgTag(pVars);         
-  else if (strcmp(pVars->sensorToGetFrom,"EXT1") == 0)
-      procesExtTag(0, pVars);
-  else if (strcmp(pVars->sensorToGetFrom,"EXT2") == 0)
-      procesExtTag(1, pVars);         
-  else if (strcmp(pVars->sensorToGetFrom,"EXT3") == 0)
-      procesExtTag(2, pVars);
-  else if (strcmp(pVars->sensorToGetFrom,"EXT4") == 0)
-      procesExtTag(3, pVars);
-  else if (strcmp(pVars->sensorToGetFrom,"EXT5") == 0)
-      procesExtTag(4, pVars);         
-  else if (strcmp(pVars->sensorToGetFrom,"EXT6") == 0)
-      procesExtTag(5, pVars);
-  else if (strcmp(pVars->sensorToGetFrom,"EXT7") == 0)
-      procesExtTag(6, pVars);
-  else if (strcmp(pVars->sensorToGetFrom,"EXT8") == 0)
-      procesExtTag(7, pVars);         
-  else if (strcmp(pVars->sensorToGetFrom,"EXT9") == 0)
-      procesExtTag(8, pVars);
-  else if (strcmp(pVars->sensorToGetFrom,"EXT10") == 0)
-      procesExtTag(9, pVars);
-  else if (strcmp(pVars->sensorToGetFrom,"BADPKTCNT") == 0)
-      sprintf(pVars->outputStr, "%d", pVars->weatherDatap->BadPktCnt); 
-  else if (strcmp(pVars->sensorToGetFrom,"UNSUPPORTEDPKTCNT") == 0)
-      sprintf(pVars->outputStr, "%d", pVars->weatherDatap->UnsupportedPktCnt); 
-  else if (strncmp(pVars->sensorToGetFrom,"TS",2) == 0) {
-      pVars->ts = &pVars->weatherDatap->currentTime;
-      strcpy(pVars->formatControlStr, pVars->fieldToGet); // Formatting string is in fieldToGet
-      processTimestampField(pVars->sensorToGetFrom, pVars);
+    else
+      setErrorField(op, "WXERROR_BADSENSOR-%s", sensorToGetFrom);
+    return;
+  }
+  sensorp = &tagSensorDefs[idx];
+  op->historySensor = sensorp->historySensor;
+
+  // xxx-TS (TSxxx follows), then TSxxx, then the whole field name, then any field
+  if (((dashTs = strstr(fieldToGet, "-TS")) != NULL) &&
+      ((fieldp = lookupTagField(sensorp->kind, fieldToGet, dashTs + 3 - fieldToGet)) != NULL))
+    tsParams = dashTs + 1;
+  else if ((strncmp(fieldToGet, "TS", 2) == 0) && ((fieldp = lookupTagField(sensorp->kind, "TS", 2)) != NULL))
+    tsParams = fieldToGet;
+  else if ((fieldp = lookupTagField(sensorp->kind, fieldToGet, strlen(fieldToGet))) == NULL)
+    fieldp = lookupTagField(sensorp->kind, "*", 1);
+  if (fieldp == NULL) {
+    setErrorField(op, tagFieldErrorFormat[sensorp->kind], fieldToGet);
+    return;
   }
+
+  if (tsParams != NULL)
+    setTimestampField(op, tsParams, sensorp->offset + fieldp->tsOffset);
   else
-         sprintf(pVars->outputStr,"WXERROR_BADSENSOR-%s",pVars->sensorToGetFrom);
+    setTagField(op, fieldp->render, sensorp->offset + fieldp->valueOffset, sensorp->offset + fieldp->tsOffset);
+  op->rainRecords = fieldp->rainRecords;
 }
+
 //*************************************************************************************************************
 // Routine to convert the Record Number part of the tag to actual record numbers.
 // expected format is -1:20:2 (leading dash is already removed)
-//                       1- starting record number (from 1 to max records to store, 1 is the newest record, record 20 has 19 in front of it
+//                       1- starting record number (from 1 to historyRecords, 1 is the newest record, record 20 has 19 in front of it
 //                      20 - ending record number to get
 //                      2  - increment when getting records from 1 to 2 (in this case, get every other record)
 //                      The parser also supports getting record 20 to record 1 (increment should still be positive)
-int processRecordNumberStr(char *recordNumStr, int *recordNumList)
+// The range is stored in the op as it was written.  Record numbers past the end of history (or negative ones) are
+// taken as the oldest record when the tag is rendered, since history can be made deeper with historyRecords.
+int processRecordNumberStr(char *recordNumStr, TagOp *op)
 {
-  int varCount, i;
-  int recordCount=0;
-  int start=1; 
+  int varCount;
+  int start=1;
   int end=1;
   int increment=1;
 
   if ((varCount = sscanf(recordNumStr,"%d:%d:%d",&start, &end, &increment)) != 3)
      if ((varCount = sscanf(recordNumStr,"%d:%d",&start, &end)) != 2)
         varCount = sscanf(recordNumStr,"%d",&start);
- 
-  if ((start < 0) || (start > WX_NUM_RECORDS_TO_STORE))
-     start=WX_NUM_RECORDS_TO_STORE;
-  if ((end < 0) || (end > WX_NUM_RECORDS_TO_STORE))
-     end=WX_NUM_RECORDS_TO_STORE;
 
   if (varCount == 1)
     end = start;
 
-  if (start <= end)
-    for (i=start; i<=end; i+=increment)
-       recordNumList[recordCount++] = i;
-  else
-    for (i=start; i>=end; i-=increment)
-       recordNumList[recordCount++] = i;
-//printf("VarCount=%d start=%d end=%d inc=%d recordCount\n", varCount, start, end, increment, recordCount);
-  return(recordCount);
+  if (increment <= 0)
+    return(0);
+  op->records = TAG_RECORDS_RANGE;
+  op->firstRecord = start;
+  op->lastRecord = end;
+  op->recordStep = increment;
+  return(1);
 }
 //*************************************************************************************************************
+// Report a problem found while compiling a template, along with the line it's on
+static void logTagError(TagTemplate *tp, int position, char *message)
+{
+  int lineStart = position, lineEnd = position, lineNum = 1, i;
+
+  while ((lineStart > 0) && (tp->source[lineStart-1] != '\n'))
+    lineStart--;
+  while ((lineEnd < tp->sourceLength) && (tp->source[lineEnd] != '\n') && (tp->source[lineEnd] != '\r'))
+    lineEnd++;
+  for (i=0;i<lineStart;i++)
+    if (tp->source[i] == '\n')
+      lineNum++;
+  DPRINTF("Tag Processor: %s in %s line %d:\n  %.*s\n", message, tp->fname, lineNum, lineEnd - lineStart, &tp->source[lineStart]);
+}
+
 // Routine to extract the next part of the tag.  Each part of the tag is delimited by the "_" character (or - in some cases)
 // ie WXTAG_IDU_TEMP_C has three parts (sensorToGetFrom (IDU), fieldToGet(TEMP), formatControlStr("C")
-BOOL extractTagParam(char *rdBuf, char *outStr, int *idx)
+BOOL extractTagParam(TagTemplate *tp, char *outStr, int *idx)
 {
+   char *rdBuf = tp->source;
    BOOL retVal=0;
    int j=0;
-   int startPosition=*idx;
 
    outStr[0] = 0;
 
    // skip over starting '_' if present
-   if (rdBuf[*idx] == '_')
+   if ((*idx < tp->sourceLength) && (rdBuf[*idx] == '_'))
        (*idx)++;
 
    // Copy characters from input buffer into output string until '_', '-', end of tag, end of line, or bfr size exceeded
-   while ((rdBuf[*idx] != '_') && (rdBuf[*idx] != '^') && (rdBuf[*idx] != '#') && 
-          (rdBuf[*idx] != 0) && (rdBuf[*idx] != '\r') && (rdBuf[*idx] != '\n') && 
-          (*idx < READ_BUFSIZE) && (j < MAX_TAG_SIZE))
+   while ((*idx < tp->sourceLength) && (rdBuf[*idx] != '_') && (rdBuf[*idx] != '^') && (rdBuf[*idx] != '#') &&
+          (rdBuf[*idx] != 0) && (rdBuf[*idx] != '\r') && (rdBuf[*idx] != '\n') && (j < MAX_TAG_SIZE-1))
      outStr[j++] = rdBuf[(*idx)++];
    outStr[j] = 0; // Terminate output string
 
    // If we didn't end at one of the familiar delimiter characters, the tag is probably not closed correctly.
-   if ((rdBuf[*idx] != '_') && (rdBuf[*idx] != '^') && (rdBuf[*idx] != '#')) {
-    DPRINTF("Unclosed tag, input line:\n%s\n",rdBuf);
-    for (j=0;j<startPosition;j++)
-        DPRINTF(" ");
-    DPRINTF("^\n");
+   if ((*idx >= tp->sourceLength) || ((rdBuf[*idx] != '_') && (rdBuf[*idx] != '^') && (rdBuf[*idx] != '#'))) {
+    logTagError(tp, *idx, "Unclosed tag");
     retVal = 1; // return error
    }
-   // If nothing found, return an error
-   //if (j==0)
-   //  retVal=1;
 
    return(retVal);
 }
 
+//*************************************************************************************************************
+// Routines to build the list of ops for a template
+static TagOp *addOp(TagTemplate *tp)
+{
+  if (tp->numOps == tp->maxOps) {
+    int maxOps = (tp->maxOps == 0) ? 64 : tp->maxOps*2;
+    TagOp *ops = realloc(tp->ops, maxOps*sizeof(TagOp));
+    if (ops == NULL)
+      return(NULL);
+    tp->ops = ops;
+    tp->maxOps = maxOps;
+  }
+  memset(&tp->ops[tp->numOps], 0, sizeof(TagOp));
+  return(&tp->ops[tp->numOps++]);
+}
 
-/*-----------------------------------------------------------------------------------------------------------------------
-  WX_ReplaceTagsInTextFile()
- 
-  This function opens two files, one for reading and one for writing, and copies the contents (char by char) from the input file
-  to the output file, while searching for special Tags that are replaced with weather station data.
+static void addLiteral(TagTemplate *tp, const char *text, int length, char *ownedText)
+{
+  TagOp *op;
 
-  See the file wxTagTest.in for a complete listing of supported Tags and tag options.
+  if ((length > 0) && ((op = addOp(tp)) != NULL)) {
+    op->text = text;
+    op->textLength = length;
+    op->ownedText = ownedText;
+  }
+  else
+    free(ownedText);
+}
 
--------------------------------------------------------------------------------------------------------------------------*/
+// A tag that couldn't be parsed is replaced by an error message
+static void addErrorLiteral(TagTemplate *tp, char *format, char *name1, char *name2)
+{
+  char str[MAX_TAG_OUTPUT_SIZE];
+  char *text;
 
-void WX_ReplaceTagsInTextFile(char *inFname, char *outFname)
+  snprintf(str, sizeof(str), format, name1, name2);
+  if ((text = strdup(str)) != NULL)
+    addLiteral(tp, text, strlen(text), text);
+}
+
+// Compile the tag that starts at position i (just after ^WXTAG_) and return the position after it
+static int compileTag(TagTemplate *tp, int i)
 {
-   FILE *infd,*outfd;
-  char rdBuf[READ_BUFSIZE];
-  char tagBuf[MAX_TAG_SIZE];
-  ParserControlVars pVars;
+  char sensorToGetFrom[MAX_TAG_SIZE];
+  char fieldToGet[MAX_TAG_SIZE];
+  char formatControlStr[MAX_TAG_SIZE];
+  char recordNumStr[MAX_TAG_SIZE];
+  char *rdBuf = tp->source;
+  TagOp *op;
 
- if ((infd = fopen(inFname, "r")) == NULL) {
-     DPRINTF("Tag Processor was unable to open %s for reading.\n", inFname);
- }
- else if ((outfd = fopen(outFname, "w+")) == NULL) {
-     DPRINTF("Tag Processor was unable to open %s for writing.\n", outFname);
- }
- else {
-
- // set default formatting if no data
- pVars.formatForNoData = 'D'; //  use dashes when no data is available
- pVars.spacerForMultipleRecords = ','; // when outputting data from multiple records, separate with comma
- pVars.outfd = outfd;
- // Read each line in the file and process the tags on that line.
- while (fgets(rdBuf, READ_BUFSIZE, infd) != NULL)
-  {
-  int i=0;
-  while ((rdBuf[i] != 0) && (i < READ_BUFSIZE))
-   {
-   // Init optional vars and strings to null
-   int  recordNum = 0;
-   char recordNumStr[MAX_TAG_SIZE];
-   recordNumStr[0] = 0;
-   pVars.formatControlStr[0] = 0;
-   pVars.outputStr[0] = 0;
-
-   if (strncmp(&rdBuf[i], "^WXTAG_", 7) == 0) {
-    i+=7; // Skip over begining of tag
-    if (extractTagParam(rdBuf, pVars.sensorToGetFrom, &i) != 0) { // ie IDU, ODU, WG, RG, etc
-       DPRINTF("Unable to get Tag Type on line: \n  %s\n", rdBuf);
-       sprintf(pVars.outputStr,"WXERROR_BADTYPE-%s",pVars.sensorToGetFrom);
-       fputs(pVars.outputStr,outfd);
+  formatControlStr[0] = 0;
+  recordNumStr[0] = 0;
+  tp->numTags++;
+
+  if (extractTagParam(tp, sensorToGetFrom, &i) != 0) { // ie IDU, ODU, WG, RG, etc
+     logTagError(tp, i, "Unable to get Tag Type");
+     addErrorLiteral(tp, "WXERROR_BADTYPE-%s", sensorToGetFrom, "");
+  }
+  else if (extractTagParam(tp, fieldToGet, &i) != 0) { // ie TEMP, DEWPOINT, SPEED, etc
+     logTagError(tp, i, "Unable to get Tag Field");
+     addErrorLiteral(tp, "WXERROR_BADFIELD-%s-%s", sensorToGetFrom, fieldToGet);
+  }
+  else {
+    // These next two are optional, the format control string has an _ in front of it, while the record number has a -
+    if ((i < tp->sourceLength) && (rdBuf[i] == '_'))
+       extractTagParam(tp, formatControlStr, &i); // Optional -   _M, _Y, etc
+    if ((i < tp->sourceLength) && (rdBuf[i] == '#')) {
+       i++;
+       extractTagParam(tp, recordNumStr, &i); // Optional #1:96:1
     }
-    else if (extractTagParam(rdBuf, pVars.fieldToGet, &i) != 0){ // ie TEMP, DEWPOINT, SPEED, etc
-       DPRINTF("Unable to get Tag Field on line: \n  %s\n",rdBuf);
-       sprintf(pVars.outputStr,"WXERROR_BADFIELD-%s-%s",pVars.sensorToGetFrom,pVars.fieldToGet);
-       fputs(pVars.outputStr,outfd);    }
-    else {
-      // These next two are optional, the format control string has an _ in front of it, while the record number has a -
-      if (rdBuf[i] == '_')
-         extractTagParam(rdBuf, pVars.formatControlStr, &i); // Optional -   _M, _Y, etc 
-      if (rdBuf[i] == '#') {
-         i++;
-         extractTagParam(rdBuf, recordNumStr, &i); // Optional #1:96:1
+    if ((i < tp->sourceLength) && (rdBuf[i] == '^')) { // got to end of tag successfully
+      i++; // Skip over end of tag character
+      if ((op = addOp(tp)) == NULL)
+        return(i);
+      strcpy(op->formatControlStr, formatControlStr);
+      processTag(sensorToGetFrom, fieldToGet, op);
+
+      if (recordNumStr[0] == 0)
+        op->records = TAG_RECORDS_CURRENT;  // Use the current dataset (not historical) to process this tag
+      else if ((strcmp(recordNumStr, "MIN24H") == 0) || (strcmp(recordNumStr, "MAX24H") == 0) ||
+               (strcmp(recordNumStr, "MIN7D") == 0) || (strcmp(recordNumStr, "MAX7D") == 0)) { // Get min/max over a rolling window
+        op->records = TAG_RECORDS_EXTREME;
+        op->window = (recordNumStr[3] == '2') ? WX_EXTREME_24H : WX_EXTREME_7D;
+        op->wantMax = (recordNumStr[1] == 'A');
       }
-      if (rdBuf[i] == '^') { // got to end of tag successfully
-        i++; // Skip over end of tag character
-        if (recordNumStr[0] == 0)  {
-          pVars.weatherDatap= &wxData;  // Use the current dataset (not historical) to process this tag
-          processTag(&pVars);
-          fputs(pVars.outputStr, outfd);
-//DPRINTF(pVars.outputStr); // echo to local console    
-        }
-        else if (recordNumStr[1] == 'I')  { // Get min historical value
-          pVars.weatherDatap = WX_GetMinDataRecord();
-          processTag(&pVars);
-          fputs(pVars.outputStr, outfd);
-//DPRINTF(pVars.outputStr); // echo to local console    
-        }
-        else if (recordNumStr[1] == 'A')  { // Get max historical record
-          pVars.weatherDatap= WX_GetMaxDataRecord();
-          processTag(&pVars);
-          fputs(pVars.outputStr, outfd);
-//DPRINTF(pVars.outputStr); // echo to local console    
-        }
+      else if (recordNumStr[1] == 'I')  // Get min historical value
+        op->records = TAG_RECORDS_MIN;
+      else if (recordNumStr[1] == 'A')  // Get max historical record
+        op->records = TAG_RECORDS_MAX;
+      else if (processRecordNumberStr(recordNumStr, op) == 0) {
+        free(op->ownedText);
+        tp->numOps--;
+        addErrorLiteral(tp, "WXERROR_BADRECORDNUM-%s-%s", sensorToGetFrom, fieldToGet);
+        logTagError(tp, i-1, "Bad record number");
+      }
+    }
+    else {
+      addErrorLiteral(tp, "WXERROR_BADTAG-%s-%s", sensorToGetFrom, fieldToGet);
+      logTagError(tp, i, "Error processing sensor tag");
+    }
+  }
+  return(i);
+}
+
+static void freeTemplate(TagTemplate *tp)
+{
+  int i;
+
+  if (tp == NULL)
+    return;
+  for (i=0;i<tp->numOps;i++)
+    free(tp->ops[i].ownedText);
+  free(tp->ops);
+  free(tp->source);
+  free(tp->fname);
+  free(tp->rendered);
+  free(tp);
+}
+
+// Split the template into literal text and compiled tags.  The template takes ownership of source.
+static TagTemplate *compileTemplate(char *fname, char *source, int length)
+{
+  TagTemplate *tp;
+  int i = 0, literalStart = 0;
+  char *caret;
+
+  if ((tp = calloc(1, sizeof(TagTemplate))) == NULL) {
+    free(source);
+    return(NULL);
+  }
+  tp->fname = strdup(fname);
+  tp->source = source;
+  tp->sourceLength = length;
+
+  while ((i < length) && ((caret = memchr(&source[i], '^', length - i)) != NULL)) {
+    i = caret - source;
+    if ((length - i < 7) || (memcmp(&source[i], "^WXTAG_", 7) != 0)) {
+      i++;
+      continue;
+    }
+    addLiteral(tp, &source[literalStart], i - literalStart, NULL);
+    i = compileTag(tp, i+7); // Skip over begining of tag
+    literalStart = i;
+  }
+  addLiteral(tp, &source[literalStart], length - literalStart, NULL);
+  return(tp);
+}
+
+//*************************************************************************************************************
+// Compiled templates are kept, one per tag file, and recompiled when the file changes.  While the file is watched (see
+// FileWatch.c) it's only looked at again once its change count moves, otherwise it's checked with stat() each time.
+// Templates picked up for a WX_ReplaceTagsInTextFiles() pass are pinned until they're rendered, so a later lookup in the
+// same pass can't recompile or reuse an entry that a render job still points to.
+typedef struct tag_TagTemplateCacheEntry {
+  char fname[MAX_CONFIG_NAME_SIZE];
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  BOOL watched;
+  unsigned int changeCount;  // File's change count when it was last checked
+  BOOL pinned;
+  TagTemplate *tp;
+} TagTemplateCacheEntry;
+
+static TagTemplateCacheEntry templateCache[MAX_CONFIG_LIST_SIZE];
+static int nextCacheEntry = 0;     // Next one to reuse when they're all in use
+
+static BOOL isSameFile(TagTemplateCacheEntry *cp, struct stat *sp)
+{
+  return((cp->dev == sp->st_dev) && (cp->ino == sp->st_ino) && (cp->size == sp->st_size) &&
+         (cp->mtime.tv_sec == sp->st_mtim.tv_sec) && (cp->mtime.tv_nsec == sp->st_mtim.tv_nsec));
+}
+
+static TagTemplate *getTemplate(char *fname, BOOL pin)
+{
+  TagTemplateCacheEntry *cp = NULL;
+  struct stat st;
+  char *source;
+  unsigned int changeCount = 0;
+  BOOL watched;
+  int i, fd, length = 0, n;
+
+  for (i=0;i<MAX_CONFIG_LIST_SIZE;i++)
+    if ((templateCache[i].tp != NULL) && (strcmp(templateCache[i].fname, fname) == 0))
+      cp = &templateCache[i];
+  if ((cp != NULL) && cp->pinned) // Already in this pass, any change is picked up next pass
+    return(cp->tp);
+  // The count is read before the file is looked at, so a change made while it's being read is seen next time
+  watched = WX_GetFileChangeCount(fname, &changeCount);
+  if ((cp != NULL) && watched && cp->watched && (cp->changeCount == changeCount)) {
+    cp->pinned = pin;
+    return(cp->tp);
+  }
+  if ((cp != NULL) && (stat(fname, &st) == 0) && isSameFile(cp, &st)) {
+    cp->watched = watched;
+    cp->changeCount = changeCount;
+    cp->pinned = pin;
+    return(cp->tp);
+  }
+
+  // New or changed file, (re)compile it
+  if (cp == NULL) {
+    for (i=0;i<MAX_CONFIG_LIST_SIZE;i++)
+      if (templateCache[i].tp == NULL)
+        break;
+    if (i == MAX_CONFIG_LIST_SIZE) {
+      for (n=0;(n<MAX_CONFIG_LIST_SIZE) && templateCache[nextCacheEntry].pinned;n++)
+        nextCacheEntry = (nextCacheEntry + 1) % MAX_CONFIG_LIST_SIZE;
+      if (n == MAX_CONFIG_LIST_SIZE)
+        return(NULL);
+      i = nextCacheEntry;
+      nextCacheEntry = (nextCacheEntry + 1) % MAX_CONFIG_LIST_SIZE;
+    }
+    cp = &templateCache[i];
+  }
+  freeTemplate(cp->tp);
+  cp->tp = NULL;
+
+  if (((fd = open(fname, O_RDONLY)) < 0) || (fstat(fd, &st) != 0)) {
+    DPRINTF("Tag Processor was unable to open %s for reading.\n", fname);
+    if (fd >= 0)
+      close(fd);
+    return(NULL);
+  }
+  if ((source = malloc(st.st_size + 1)) == NULL) {
+    close(fd);
+    return(NULL);
+  }
+  while ((length < st.st_size) && ((n = read(fd, &source[length], st.st_size - length)) > 0))
+    length += n;
+  close(fd);
+  source[length] = 0;
+
+  if ((cp->tp = compileTemplate(fname, source, length)) != NULL) {
+    strncpy(cp->fname, fname, MAX_CONFIG_NAME_SIZE-1);
+    cp->fname[MAX_CONFIG_NAME_SIZE-1] = 0;
+    cp->dev = st.st_dev;
+    cp->ino = st.st_ino;
+    cp->size = st.st_size;
+    cp->mtime = st.st_mtim;
+    cp->watched = watched;
+    cp->changeCount = changeCount;
+    cp->pinned = pin;
+  }
+  return(cp->tp);
+}
+
+//*************************************************************************************************************
+// The last contents written to each output file, so an unchanged output can be skipped.  The size and modify time of the
+// file after it was written are kept too, so an output that's been changed or removed by something else is rewritten.
+typedef struct tag_TagOutputEntry {
+  char fname[MAX_CONFIG_NAME_SIZE];
+  unsigned long long hash;
+  int length;
+  off_t size;
+  struct timespec mtime;
+} TagOutputEntry;
+
+static TagOutputEntry outputs[MAX_CONFIG_LIST_SIZE];
+static int nextOutputEntry = 0;
+
+static unsigned long long outputHash(const char *buf, int length)
+{
+  unsigned long long h = 14695981039346656037ULL;
+  int i;
+
+  for (i=0;i<length;i++)
+    h = (h ^ (unsigned char) buf[i]) * 1099511628211ULL;
+  return(h);
+}
+
+static TagOutputEntry *getOutputEntry(char *fname)
+{
+  TagOutputEntry *ep;
+  int i;
+
+  for (i=0;i<MAX_CONFIG_LIST_SIZE;i++)
+    if (strcmp(outputs[i].fname, fname) == 0)
+      return(&outputs[i]);
+  for (i=0;i<MAX_CONFIG_LIST_SIZE;i++)
+    if (outputs[i].fname[0] == 0)
+      break;
+  if (i == MAX_CONFIG_LIST_SIZE) {
+    i = nextOutputEntry;
+    nextOutputEntry = (nextOutputEntry + 1) % MAX_CONFIG_LIST_SIZE;
+  }
+  ep = &outputs[i];
+  strncpy(ep->fname, fname, MAX_CONFIG_NAME_SIZE-1);
+  ep->fname[MAX_CONFIG_NAME_SIZE-1] = 0;
+  ep->length = -1;
+  return(ep);
+}
+
+// Replace the contents of the output file with buf, using a temp file renamed into place
+static void publishOutput(TagOutputEntry *ep, const char *buf, int length)
+{
+  char *fname = ep->fname;
+  unsigned long long hash = outputHash(buf, length);
+  char tmpName[MAX_CONFIG_NAME_SIZE+8];
+  struct stat st;
+  int fd, n, written = 0;
+  BOOL ok;
+
+  if (WxConfig.tagFileSkipUnchanged && (ep->length == length) && (ep->hash == hash) && (stat(fname, &st) == 0) &&
+      (st.st_size == ep->size) && (st.st_mtim.tv_sec == ep->mtime.tv_sec) && (st.st_mtim.tv_nsec == ep->mtime.tv_nsec))
+    return;
+
+  ep->length = -1;
+  snprintf(tmpName, sizeof(tmpName), "%s.tmp", fname);
+  if ((fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    DPRINTF("Tag Processor was unable to open %s for writing (%s).\n", tmpName, strerror(errno));
+    return;
+  }
+  while ((written < length) && (((n = write(fd, &buf[written], length - written)) > 0) || ((n < 0) && (errno == EINTR))))
+    if (n > 0)
+      written += n;
+  ok = (written == length) && (fstat(fd, &st) == 0);
+  if ((close(fd) != 0) || !ok || (rename(tmpName, fname) != 0)) {
+    DPRINTF("Tag Processor was unable to write %s (%s).\n", fname, strerror(errno));
+    unlink(tmpName);
+    return;
+  }
+  ep->hash = hash;
+  ep->length = length;
+  ep->size = st.st_size;
+  ep->mtime = st.st_mtim;
+}
+
+//*************************************************************************************************************
+// Routines to produce the output for a compiled template
+static void appendOutput(ParserControlVars *pVars, const char *text, int length)
+{
+  if (pVars->outLength + length > pVars->outSize) {
+    int size = pVars->outSize*2 + length;
+    char *buf = realloc(pVars->outBuf, size);
+    if (buf == NULL)
+      return;
+    pVars->outBuf = buf;
+    pVars->outSize = size;
+  }
+  memcpy(&pVars->outBuf[pVars->outLength], text, length);
+  pVars->outLength += length;
+}
+
+static void renderRecord(TagOp *op, ParserControlVars *pVars, WX_Data *weatherDatap)
+{
+  pVars->weatherDatap = weatherDatap;
+  pVars->ts = (WX_Timestamp *) ((char *) weatherDatap + op->tsOffset);
+  pVars->outputStr[0] = 0;
+  op->render(op, pVars);
+  appendOutput(pVars, pVars->outputStr, strlen(pVars->outputStr));
+}
+
+static void renderTag(TagOp *op, ParserControlVars *pVars, WX_Data *currentDatap)
+{
+  int i, depth, first, last, step, count, record;
+
+  pVars->formatControlStr = op->formatControlStr;
+  switch (op->records) {
+    case TAG_RECORDS_CURRENT:
+      renderRecord(op, pVars, currentDatap);
+      break;
+    case TAG_RECORDS_EXTREME:
+      WX_LoadExtremeDataRecord(op->window, op->wantMax, pVars->recordp);
+      renderRecord(op, pVars, pVars->recordp);
+      break;
+    case TAG_RECORDS_MIN:
+      WX_LoadMinDataRecord(pVars->recordp);
+      renderRecord(op, pVars, pVars->recordp);
+      break;
+    case TAG_RECORDS_MAX:
+      WX_LoadMaxDataRecord(pVars->recordp);
+      renderRecord(op, pVars, pVars->recordp);
+      break;
+    case TAG_RECORDS_RANGE:
+      // Only the tag's own sensor is loaded for each record (the field was looked up once when the template was compiled)
+      depth = WX_GetHistoryRecordCount();
+      first = ((op->firstRecord < 0) || (op->firstRecord > depth)) ? depth : op->firstRecord;
+      last = ((op->lastRecord < 0) || (op->lastRecord > depth)) ? depth : op->lastRecord;
+      step = (first <= last) ? op->recordStep : -op->recordStep;
+      count = ((first <= last) ? (last - first) : (first - last)) / op->recordStep + 1;
+      memset(pVars->recordp, 0, sizeof(WX_Data));
+      for (i=0;i<count;i++) {
+        record = first + i*step;
+        if (record == 0)
+          renderRecord(op, pVars, currentDatap);
         else {
-         int recordNumList[WX_NUM_RECORDS_TO_STORE];
-         int recordCount, i;
-         if ((recordCount = processRecordNumberStr(recordNumStr, recordNumList)) != 0)
-          for (i=0;i<recordCount;i++) {
-//printf("getting %d of %d: ",recordNumList[i], recordCount);
-            pVars.weatherDatap = 
-                         WX_GetWeatherDataRecord(recordNumList[i]);
-            processTag(&pVars);
-            fputs(pVars.outputStr, outfd);
-//DPRINTF(pVars.outputStr); // echo to local console    
-            if (i < (recordCount-1)) {
-              fputc(pVars.spacerForMultipleRecords, outfd);
-//DPRINTF("%c",pVars.spacerForMultipleRecords);
-            }
-//printf("\n");
-          }
-         else {
-          sprintf(pVars.outputStr, "WXERROR_BADRECORDNUM-%s-%s",pVars.sensorToGetFrom,pVars.fieldToGet);
-          fputs(pVars.outputStr,outfd);
-          DPRINTF("Error processing tag: %s\n",pVars.outputStr);
-         }
+          WX_LoadHistorySensor(record, op->historySensor, pVars->recordp);
+          renderRecord(op, pVars, pVars->recordp);
         }
+        if (i < (count-1))
+          appendOutput(pVars, &pVars->spacerForMultipleRecords, 1);
       }
-      else {
-        sprintf(pVars.outputStr, "WXERROR_BADTAG-%s-%s",pVars.sensorToGetFrom,pVars.fieldToGet);
-        fputs(pVars.outputStr,outfd);
-        DPRINTF("Error processing sensor tag: %s\n",pVars.outputStr);
+      break;
+  }
+}
+
+//*************************************************************************************************************
+// Tag files are rendered by up to TAG_MAX_RENDER_THREADS threads, each with its own output buffer (kept between passes,
+// it grows to fit the biggest output) and record for historical data.  Passes don't overlap.
+#define TAG_MAX_RENDER_THREADS 4
+
+typedef struct tag_TagRenderContext {
+  char *outBuf;
+  int outSize;
+  WX_Data record;
+} TagRenderContext;
+
+typedef struct tag_TagRenderJob {
+  TagTemplate *tp;
+  TagOutputEntry *ep;
+  char *output;     // Copy of the rendered output, published once the shared data lock is released
+  int length;
+} TagRenderJob;
+
+static TagRenderContext renderContexts[TAG_MAX_RENDER_THREADS];
+static pthread_mutex_t renderLock = PTHREAD_MUTEX_INITIALIZER;     // Held while the templates are rendered
+static pthread_mutex_t publishLock = PTHREAD_MUTEX_INITIALIZER;    // Held for a whole pass, guards outputs[]
+
+// The files in the pass being rendered, handed out to the render threads in order
+static TagRenderJob renderJobs[MAX_CONFIG_LIST_SIZE];
+static int numRenderJobs;
+static int nextRenderJob;
+static WX_Data *renderDatap;
+static pthread_mutex_t renderJobLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Render the template into ctx->outBuf, returns the length of the output or -1 if there's no memory for it
+static int renderTemplate(TagRenderContext *ctx, TagTemplate *tp, WX_Data *currentDatap)
+{
+  ParserControlVars pVars;
+  int i;
+
+  // set default formatting if no data
+  pVars.formatForNoData = 'D'; //  use dashes when no data is available
+  pVars.spacerForMultipleRecords = ','; // when outputting data from multiple records, separate with comma
+  pVars.NoDataStr[0] = 0;
+  pVars.recordp = &ctx->record;
+  if (ctx->outSize < tp->sourceLength + MAX_TAG_OUTPUT_SIZE) {
+    char *buf = realloc(ctx->outBuf, tp->sourceLength + MAX_TAG_OUTPUT_SIZE);
+    if (buf == NULL)
+      return(-1);
+    ctx->outBuf = buf;
+    ctx->outSize = tp->sourceLength + MAX_TAG_OUTPUT_SIZE;
+  }
+  pVars.outBuf = ctx->outBuf;
+  pVars.outSize = ctx->outSize;
+  pVars.outLength = 0;
+
+  for (i=0;i<tp->numOps;i++)
+    if (tp->ops[i].render == NULL)
+      appendOutput(&pVars, tp->ops[i].text, tp->ops[i].textLength);
+    else
+      renderTag(&tp->ops[i], &pVars, currentDatap);
+
+  ctx->outBuf = pVars.outBuf;  // appendOutput may have grown it
+  ctx->outSize = pVars.outSize;
+  return(pVars.outLength);
+}
+
+// Render the job's template and keep a copy of the output in the job (the context's buffer is reused by the next render)
+static void renderFile(TagRenderContext *ctx, TagRenderJob *jobp, WX_Data *currentDatap)
+{
+  int length = renderTemplate(ctx, jobp->tp, currentDatap);
+
+  jobp->output = NULL;
+  if ((length >= 0) && ((jobp->output = malloc((length > 0) ? length : 1)) != NULL)) {
+    memcpy(jobp->output, ctx->outBuf, length);
+    jobp->length = length;
+  }
+}
+
+static void publishFile(TagRenderJob *jobp)
+{
+  if (jobp->output != NULL) {
+    publishOutput(jobp->ep, jobp->output, jobp->length);
+    free(jobp->output);
+    jobp->output = NULL;
+  }
+}
+
+static void *renderThread(void *param)
+{
+  TagRenderContext *ctx = (TagRenderContext *) param;
+  int i;
+
+  for (;;) {
+    pthread_mutex_lock(&renderJobLock);
+    i = nextRenderJob++;
+    pthread_mutex_unlock(&renderJobLock);
+    if (i >= numRenderJobs)
+      break;
+    renderFile(ctx, &renderJobs[i], renderDatap);
+  }
+  return NULL;
+}
+
+/*-----------------------------------------------------------------------------------------------------------------------
+  WX_ReplaceTagsInTextFile()
+
+  This function copies the contents of the input file to the output file, replacing the special Tags with weather station
+  data.  Tags for the current data are filled in from *currentDatap (normally a copy of wxData taken when the tag files were
+  queued for processing).
+
+  The input file is compiled the first time it's used and again whenever it changes (see getTemplate()), so normally this
+  is just one pass over the compiled ops and one write.  The output is swapped in by renaming a temp file over it, and
+  isn't written at all if tagFileSkipUnchanged is set and it hasn't changed.
+
+  Historical and max/min tags read the history store, so the shared data read lock is taken while the file is rendered.
+  It's released before the output is written, so snapshot saves don't wait on the disk.
+
+  See the file wxTagTest.in for a complete listing of supported Tags and tag options.
+
+-------------------------------------------------------------------------------------------------------------------------*/
+
+void WX_ReplaceTagsInTextFile(char *inFname, char *outFname, WX_Data *currentDatap)
+{
+  TagRenderJob job;
+
+  job.output = NULL;
+  pthread_mutex_lock(&publishLock);
+  WX_ReadLockSharedData();
+  pthread_mutex_lock(&renderLock);
+  if ((job.tp = getTemplate(inFname, FALSE)) != NULL)
+    renderFile(&renderContexts[0], &job, currentDatap);
+  pthread_mutex_unlock(&renderLock);
+  WX_UnlockSharedData();
+  job.ep = getOutputEntry(outFname);
+  publishFile(&job);
+  pthread_mutex_unlock(&publishLock);
+}
+
+/*-----------------------------------------------------------------------------------------------------------------------
+  WX_ReplaceTagsInTextFiles()
+
+  Process a list of tag files as above, rendering them in parallel.  If more than one entry writes the same output file
+  only the last one is used (the others would just be overwritten).  All of the files are rendered before the shared data
+  lock is released and any of them are written.
+-------------------------------------------------------------------------------------------------------------------------*/
+
+void WX_ReplaceTagsInTextFiles(WX_TagFile *tagFiles, int numTagFiles, WX_Data *currentDatap)
+{
+  pthread_t threads[TAG_MAX_RENDER_THREADS];
+  long numCpus;
+  int i, j, numThreads, started = 0;
+
+  // Same lock order as WX_RenderTagFile() callers: shared data before renderLock
+  pthread_mutex_lock(&publishLock);
+  WX_ReadLockSharedData();
+  pthread_mutex_lock(&renderLock);
+  numRenderJobs = 0;
+  for (i=0;(i<numTagFiles) && (i<MAX_CONFIG_LIST_SIZE);i++) {
+    for (j=i+1;j<numTagFiles;j++)
+      if (strcmp(tagFiles[i].outFile, tagFiles[j].outFile) == 0)
+        break;
+    if ((j == numTagFiles) && ((renderJobs[numRenderJobs].tp = getTemplate(tagFiles[i].inFile, TRUE)) != NULL))
+      renderJobs[numRenderJobs++].ep = getOutputEntry(tagFiles[i].outFile);
+  }
+  nextRenderJob = 0;
+  renderDatap = currentDatap;
+
+  numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+  numThreads = (numCpus < TAG_MAX_RENDER_THREADS) ? (int) numCpus : TAG_MAX_RENDER_THREADS;
+  if (numThreads > numRenderJobs)
+    numThreads = numRenderJobs;
+
+  // This thread renders too, so start one less
+  for (i=1;i<numThreads;i++) {
+    if (pthread_create(&threads[started], NULL, renderThread, &renderContexts[i]) != 0) {
+      DPRINTF("Tag Processor: Unable to create render thread (%s)\n", strerror(errno));
+      break;
+    }
+    started++;
+  }
+  renderThread(&renderContexts[0]);
+  for (i=0;i<started;i++)
+    pthread_join(threads[i], NULL);
+  for (i=0;i<MAX_CONFIG_LIST_SIZE;i++)
+    templateCache[i].pinned = FALSE;
+  pthread_mutex_unlock(&renderLock);
+  WX_UnlockSharedData();
+
+  for (i=0;i<numRenderJobs;i++)
+    publishFile(&renderJobs[i]);
+  pthread_mutex_unlock(&publishLock);
+}
+
+/*-----------------------------------------------------------------------------------------------------------------------
+  WX_RenderTagFile()
+
+  Render a tag file on request rather than writing it to an output file.  Returns the output in a buffer the caller
+  must free (and its length in *lengthp), or NULL if the file can't be read.
+
+  The rendering is kept with the compiled template along with the data epoch it was made from (the packet counts of
+  *currentDatap and the history store epoch).  Until one of those changes, or the tag file itself changes, the kept
+  rendering is returned instead of rendering the file again.
+-------------------------------------------------------------------------------------------------------------------------*/
+
+char *WX_RenderTagFile(char *inFname, WX_Data *currentDatap, int *lengthp)
+{
+  TagTemplate *tp;
+  TagDataEpoch epoch;
+  char *outp = NULL;
+  int length;
+
+  epoch.pktCnt = currentDatap->currentTime.PktCnt;
+  epoch.badPktCnt = currentDatap->BadPktCnt;
+  epoch.unsupportedPktCnt = currentDatap->UnsupportedPktCnt;
+  epoch.historyEpoch = WX_GetHistoryEpoch();
+
+  pthread_mutex_lock(&renderLock);
+  if ((tp = getTemplate(inFname, FALSE)) != NULL) {
+    if ((tp->rendered == NULL) || (memcmp(&tp->renderedEpoch, &epoch, sizeof(epoch)) != 0)) {
+      free(tp->rendered);
+      tp->rendered = NULL;
+      if (((length = renderTemplate(&renderContexts[0], tp, currentDatap)) >= 0) &&
+          ((tp->rendered = malloc((length > 0) ? length : 1)) != NULL)) {
+        memcpy(tp->rendered, renderContexts[0].outBuf, length);
+        tp->renderedLength = length;
+        tp->renderedEpoch = epoch;
       }
     }
-   }
-   else {
-//DPRINTF("%c",rdBuf[i]); // echo to local console
-     fputc(rdBuf[i++], outfd);
-     }
-   }
+    if ((tp->rendered != NULL) && ((outp = malloc((tp->renderedLength > 0) ? tp->renderedLength : 1)) != NULL)) {
+      memcpy(outp, tp->rendered, tp->renderedLength);
+      *lengthp = tp->renderedLength;
+    }
   }
- fclose(infd);
- fclose(outfd);
- }
+  pthread_mutex_unlock(&renderLock);
+  return(outp);
 }
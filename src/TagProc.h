@@ -32,7 +32,10 @@ Tags are generally of the form: ^WXTAG_WG_AVGSPEED_K#21:25^
          "#21:25" is optional and tells the parser to use data from historical records 21 to 25
                Records are recorded every 15 minutes.  Record 0 (default) is the most current, record 1 is 15 minutes old.
                Record 21 will retrieve data that is (21/4) = 5 hours and 15 minutes old.  Up to 96 historical records can be
-               retrieved (96 is largest supported historical record number).
+               retrieved by default (historyRecords in rtl-wx.conf keeps more).  A record number past the oldest one
+               kept gets the oldest record.
+               "#MIN" and "#MAX" retrieve the lowest and highest values seen since the max/min data was last reset,
+               while "#MIN24H", "#MAX24H", "#MIN7D" and "#MAX7D" retrieve them over the last 24 hours or 7 days.
          "^" tells the parser that the tag is complete
   The parser will completely replace the tag (everything between and including the  '^' with the value referenced by the tag.  
   If the value is not available (eg data has not yet been received), the parser will return "--" in place of
@@ -42,7 +45,6 @@ Please see the file WXTAGTest.in for the complete list of supported Tags and tag
 
 */
 
-#define READ_BUFSIZE 1000
 #define MAX_TAG_SIZE 100
 #define MAX_TAG_OUTPUT_SIZE 500
 
@@ -55,17 +57,95 @@ char spacerForMultipleRecords; // any character used as a spacer when a range of
 
 char NoDataStr[MAX_TAG_SIZE];
 
-// All the pieces of the tag currently being processed.
-char sensorToGetFrom[MAX_TAG_SIZE];
-char fieldToGet[MAX_TAG_SIZE];
-char formatControlStr[MAX_TAG_SIZE];
+char *formatControlStr;        // Optional formatting part of the tag being processed (points into the compiled tag)
 
 WX_Data *weatherDatap; // ptr to Complete set of weather station data for sample  that tag refers to
+WX_Data *recordp;      // Historical and #MIN24H... records are loaded in here (one per render thread)
 WX_Timestamp *ts;      // Pointer to timestamp info for object being referenced in current tag
 
 // String buffer used to store tag replacement text that will be written in output file.
 char outputStr[MAX_TAG_OUTPUT_SIZE];
-FILE *outfd;
+
+// The whole output file is built here and written in one go
+char *outBuf;
+int outLength;
+int outSize;
 } ParserControlVars;
 
+/**************************************************************************************************************** 
+COMPILED TEMPLATES
+
+ Each tag file is parsed once into a list of ops and kept until the file changes (its modification time, size or inode
+ differ from when it was compiled).  An op is either a span of literal text from the file or a tag, with the sensor and
+ field names already resolved to a formatter and the offsets of the value and timestamp in WX_Data, the TSxxx part
+ resolved to a TagTsField, and the #record part resolved to which record(s) to use.  Tags that can't be parsed become
+ literal error text.  Processing a tag file is then one pass over the ops, writing into one output buffer.
+*/
+
+typedef enum tag_TagTsField {
+ TAG_TS_NONE = 0,    // Unrecognized TSxxx, outputs nothing
+ TAG_TS_DATE,
+ TAG_TS_TIME,
+ TAG_TS_PKTCNT,
+ TAG_TS_MINUTE,
+ TAG_TS_YEAR,
+ TAG_TS_MONTH,
+ TAG_TS_MONTHTEXT,
+ TAG_TS_DAY,
+ TAG_TS_HOUR,
+ TAG_TS_DAYOFWEEK,
+ TAG_TS_AMPM
+} TagTsField;
+
+typedef enum tag_TagRecordSelect {
+ TAG_RECORDS_CURRENT = 0,  // No #, current data
+ TAG_RECORDS_RANGE,        // #start:end:increment
+ TAG_RECORDS_MIN,          // #MIN
+ TAG_RECORDS_MAX,          // #MAX
+ TAG_RECORDS_EXTREME       // #MIN24H, #MAX24H, #MIN7D, #MAX7D
+} TagRecordSelect;
+
+typedef struct tag_TagOp TagOp;
+typedef void (*TagRenderFunc)(TagOp *op, ParserControlVars *pVars);
+
+struct tag_TagOp {
+ TagRenderFunc render;        // NULL for literal text
+ const char *text;            // Literal text (or the text renderText outputs for each record)
+ int textLength;
+ char *ownedText;             // text, when it isn't part of the template file
+ size_t valueOffset;          // Where the field is in WX_Data
+ size_t tsOffset;             // Timestamp used for the no data check and TSxxx fields
+ TagTsField tsField;
+ int rainRecords;             // Hourly rain records summed by RAINHIST_TOTALLAST...
+ char formatControlStr[MAX_TAG_SIZE];
+ TagRecordSelect records;
+ int firstRecord;             // TAG_RECORDS_RANGE, as written in the tag (clamped to the history depth when rendered)
+ int lastRecord;
+ int recordStep;              // always positive, the direction comes from first and last
+ int historySensor;           // WX_SensorId loaded for each record, -1 for just the record's time and packet counts
+ WX_ExtremeWindowId window;   // TAG_RECORDS_EXTREME
+ BOOL wantMax;
+};
+
+// Identifies the data a rendering was made from: the packet counts of the current data and the history store epoch
+typedef struct tag_TagDataEpoch {
+ unsigned int pktCnt;
+ int badPktCnt;
+ int unsupportedPktCnt;
+ unsigned int historyEpoch;
+} TagDataEpoch;
+
+typedef struct tag_TagTemplate {
+ char *fname;
+ char *source;                // The template file, literal ops point in here
+ int sourceLength;
+ TagOp *ops;
+ int numOps;
+ int maxOps;
+ int numTags;
+ char *rendered;              // Last on request rendering (see WX_RenderTagFile()), NULL if none
+ int renderedLength;
+ TagDataEpoch renderedEpoch;
+} TagTemplate;
+
 #endif
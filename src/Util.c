@@ -137,46 +137,19 @@ void WX_DumpInfo(FILE *fd) {
 }
 
 int getWattsAvgAvg(int use_efergy_sensor, int numSnapshotsToAverage) {
-	int i;
-	int sumWattsAvg=0;
-	int wattsAvgCount=0;
-	for (i=1;i<=numSnapshotsToAverage;i++) {
-		WX_Data *wxDatap = WX_GetWeatherDataRecord(i);
-		if (wxDatap != NULL) {
-			if (use_efergy_sensor) {
-			   if (isTimestampPresent(&wxDatap->energy.Timestamp)) {
-				sumWattsAvg += wxDatap->energy.WattsAvg;
-				wattsAvgCount++;
-			   }
-			} else {
-			   if (isTimestampPresent(&wxDatap->owl.Timestamp)) {
-				sumWattsAvg += wxDatap->owl.WattsAvg;
-				wattsAvgCount++;
-			   }
-			}
-		}
-	}
+	double sumWattsAvg;
+	int wattsAvgCount = WX_SumHistoryValues(use_efergy_sensor ? WX_SENSOR_EFERGY : WX_SENSOR_OWL, WX_FIELD_WATTS_AVG,
+	                                        numSnapshotsToAverage, &sumWattsAvg);
 	if (wattsAvgCount != 0)
-		return (sumWattsAvg/wattsAvgCount);
+		return ((int) sumWattsAvg/wattsAvgCount);
 	else
 		return (0);
 }
 int getBurnerRunSecondsTotal(int use_efergy_sensor, int numSnapshotsToSum) {
-	int i;
-	int runSecondsTotal=0;
-	for (i=1;i<=numSnapshotsToSum;i++) {
-		WX_Data *wxDatap = WX_GetWeatherDataRecord(i);
-		if (wxDatap != NULL) {
-			if (use_efergy_sensor) {
-			   if (isTimestampPresent(&wxDatap->energy.Timestamp))
-				runSecondsTotal += wxDatap->energy.BurnerRuntimeSeconds;
-			} else {
-			   if (isTimestampPresent(&wxDatap->owl.Timestamp))
-				runSecondsTotal += wxDatap->owl.BurnerRuntimeSeconds;
-			}
-		}
-	}
-	return (runSecondsTotal);
+	double runSecondsTotal;
+	WX_SumHistoryValues(use_efergy_sensor ? WX_SENSOR_EFERGY : WX_SENSOR_OWL, WX_FIELD_BURNER_SECONDS,
+	                    numSnapshotsToSum, &runSecondsTotal);
+	return ((int) runSecondsTotal);
 }
 int getEnergyHistoryIndex(int minute, int second, int samples_per_minute) {
   // For any minute,second pair, return the index into the energy history array that
@@ -195,10 +168,18 @@ int getEnergyHistoryIndex(int minute, int second, int samples_per_minute) {
   return index;
 }
 
+// The dumps can run on several command workers at once, so history records are loaded into the caller's own buffer
+// rather than the store's shared scratch record.
+static WX_Data *loadHistoryRecord(int howFarBackToGo, WX_Data *destp) {
+  WX_LoadWeatherDataRecord(howFarBackToGo, destp);
+  return destp;
+}
+
 //--------------------------------------------------------------------------------------------------------------------------------------------
 void WX_DumpEnergyHistoryInfo(FILE *fd, char *sensor_name, WX_EnergySensorData *energyp, int samples_per_minute) { 
       
    int dumping_efergy_sensor = (energyp == &wxData.energy);
+   WX_Data historyRecord;
    
    if (isTimestampPresent(&energyp->Timestamp))  { 
         float fuelBurnedLastHour = (float) getBurnerRunSecondsTotal(dumping_efergy_sensor, 4) /(60*60) * WxConfig.fuelBurnerGallonsPerHour;
@@ -210,7 +191,7 @@ void WX_DumpEnergyHistoryInfo(FILE *fd, char *sensor_name, WX_EnergySensorData *
 		 sensor_name, energyp->Watts, fuelBurnedLastHour, fuelBurnedLastDay, fuelBurnedTotal);
 	else
           fprintf(fd, "   Current %s Energy Use: %d watts  Avg Last Hr: %d  Avg Last Day: %d\n\n", 
-		sensor_name, energyp->Watts, getWattsAvgAvg(dumping_efergy_sensor, 4), getWattsAvgAvg(dumping_efergy_sensor,24*4));	struct tm *localTime = localtime(&wxData.currentTime.timet);
+		sensor_name, energyp->Watts, getWattsAvgAvg(dumping_efergy_sensor, 4), getWattsAvgAvg(dumping_efergy_sensor,24*4));	struct tm tmBuf, *localTime = localtime_r(&wxData.currentTime.timet, &tmBuf);
 
 	fprintf(fd,"   Most Recent Sample Data (%d samples per minute)\n    ", samples_per_minute);
 	int min;
@@ -241,7 +222,7 @@ void WX_DumpEnergyHistoryInfo(FILE *fd, char *sensor_name, WX_EnergySensorData *
 			if (min <= minutesSinceSnapshot)
 				watts = energyp->WattsHistory[idx];
 			else {
-				WX_Data *wxDatap = WX_GetWeatherDataRecord(1);
+				WX_Data *wxDatap = loadHistoryRecord(1, &historyRecord);
 				if (wxDatap != NULL) {
 				   if (dumping_efergy_sensor)
 				      watts = wxDatap->energy.WattsHistory[idx];
@@ -263,9 +244,9 @@ void WX_DumpEnergyHistoryInfo(FILE *fd, char *sensor_name, WX_EnergySensorData *
 	int col, row;
 	for (row=0;row<4; row++) {
 		for (col=1;col<=16; col++) {
-			WX_Data *wxDatap = WX_GetWeatherDataRecord((row*16)+col);
+			WX_Data *wxDatap = loadHistoryRecord((row*16)+col, &historyRecord);
 			if (isTimestampPresent(&wxDatap->currentTime)) {
-				struct tm *localTime = localtime(&wxDatap->currentTime.timet);
+				struct tm tmBuf, *localTime = localtime_r(&wxDatap->currentTime.timet, &tmBuf);
 				fprintf(fd,"%02d:%02d ", localTime->tm_hour, localTime->tm_min);
 			} else
 				fprintf(fd,"      ");
@@ -274,7 +255,7 @@ void WX_DumpEnergyHistoryInfo(FILE *fd, char *sensor_name, WX_EnergySensorData *
 		for (col=1;col<=16;col++) {
 			int record = (row*16) + col;
 			int watts = 0;
-			WX_Data *wxDatap = WX_GetWeatherDataRecord(record);
+			WX_Data *wxDatap = loadHistoryRecord(record, &historyRecord);
 			if (wxDatap != NULL) {
 				if (dumping_efergy_sensor)
 				      watts = wxDatap->energy.WattsAvg;
@@ -293,9 +274,9 @@ void WX_DumpEnergyHistoryInfo(FILE *fd, char *sensor_name, WX_EnergySensorData *
 	int col, row;
 	for (row=0;row<4; row++) {
 		for (col=1;col<=16; col++) {
-			WX_Data *wxDatap = WX_GetWeatherDataRecord((row*16)+col);
+			WX_Data *wxDatap = loadHistoryRecord((row*16)+col, &historyRecord);
 			if (isTimestampPresent(&wxDatap->currentTime)) {
-				struct tm *localTime = localtime(&wxDatap->currentTime.timet);
+				struct tm tmBuf, *localTime = localtime_r(&wxDatap->currentTime.timet, &tmBuf);
 				fprintf(fd,"%02d:%02d ", localTime->tm_hour, localTime->tm_min);
 			} else
 				fprintf(fd,"      ");
@@ -304,7 +285,7 @@ void WX_DumpEnergyHistoryInfo(FILE *fd, char *sensor_name, WX_EnergySensorData *
 		for (col=1;col<=16;col++) {
 			int record = (row*16) + col;
 			int seconds = 0;
-			WX_Data *wxDatap = WX_GetWeatherDataRecord(record);
+			WX_Data *wxDatap = loadHistoryRecord(record, &historyRecord);
 			if (wxDatap != NULL)
 				seconds = wxDatap->owl.BurnerRuntimeSeconds;
 			if (seconds != 0)
@@ -329,15 +310,33 @@ static void printTimestamp(FILE *fd, WX_Timestamp *ts);
 // user input when running in interactive mode (either standalone or server with a client attached) or by the remote
 // command mode (to produce web output)
 //--------------------------------------------------------------------------------------------------------------------------------------------
+static void dumpMaxMinData(FILE *fd, WX_Data *maxDatap, WX_Data *minDatap);
+
 void WX_DumpMaxMinInfo(FILE *fd)
+{ 
+  WX_Data windowMax, windowMin;
+  int w;
+
+  printTimeDateAndUptime(fd);
+
+  fprintf(fd,"   Since Last Reset\n");
+  WX_LoadMaxDataRecord(&windowMax);
+  WX_LoadMinDataRecord(&windowMin);
+  dumpMaxMinData(fd, &windowMax, &windowMin);
+
+  for (w=0;w<WX_NUM_EXTREME_WINDOWS;w++) {
+    WX_LoadExtremeDataRecord(w, TRUE, &windowMax);
+    WX_LoadExtremeDataRecord(w, FALSE, &windowMin);
+    fprintf(fd,"   %s\n", WX_GetExtremeWindowName(w));
+    dumpMaxMinData(fd, &windowMax, &windowMin);
+  }
+}
+
+static void dumpMaxMinData(FILE *fd, WX_Data *maxDatap, WX_Data *minDatap)
 { 
   int i;
-  WX_Data *maxDatap = WX_GetMaxDataRecord();
-  WX_Data *minDatap = WX_GetMinDataRecord();
   char label[100];
    
-  printTimeDateAndUptime(fd);
-   
   fprintf(fd,"                   Min           Time                  Max            Time\n\n");
          
   if (WxConfig.iduNameString[0] != 0)
@@ -499,7 +498,7 @@ void printMaxMinWindSpeed(FILE *fd,char *label,float maxSpeed,WX_Timestamp *maxT
   }
 }
 void printTimestamp(FILE *fd, WX_Timestamp *ts) {
-  struct tm *localtm = localtime(&ts->timet);
+  struct tm tmBuf, *localtm = localtime_r(&ts->timet, &tmBuf);
   fprintf(fd, "Date: %02d/%02d/%04d Time: %02d:%02d",
       localtm->tm_mon+1, localtm->tm_mday, localtm->tm_year+1900, localtm->tm_hour, localtm->tm_min);      
 }
@@ -564,7 +563,7 @@ void printSensorStatus(FILE *fd,char *str, int lock_code, int lock_code_change_c
       fprintf(fd,"0x%02x     %3d        %3d       %3d     ", lock_code, lock_code_change_count, 
                                                          no_data_for_180_secs, no_data_between_snapshots);
  
-   struct tm *localtm = localtime(&ts->timet);
+   struct tm tmBuf, *localtm = localtime_r(&ts->timet, &tmBuf);
    fprintf(fd, "%02d/%02d/%04d at %02d:%02d:%02d",
       localtm->tm_mon+1, localtm->tm_mday, localtm->tm_year+1900, localtm->tm_hour, localtm->tm_min, localtm->tm_sec);      
    fprintf(fd," (Msg# %d)\n", ts->PktCnt);
@@ -596,13 +595,25 @@ void WX_DumpConfigInfo(FILE *fd)
  fprintf(fd, " webcamSnapshotFrequency: %d\n\n",WxConfig.webcamSnapshotFrequency);
  fprintf(fd, "   tagFileParseFrequency: %d\n",WxConfig.tagFileParseFrequency);
  fprintf(fd, "      NumTagFilesToParse: %d\n",WxConfig.NumTagFilesToParse);
+ fprintf(fd, "    tagFileSkipUnchanged: %d\n",WxConfig.tagFileSkipUnchanged);
  for (i=0;i<WxConfig.NumTagFilesToParse;i++)
     fprintf(fd, "                    %-15s -> %s\n",WxConfig.tagFiles[i].inFile, WxConfig.tagFiles[i].outFile);
- fprintf(fd, "         realtimeCsvFile: Rewrite %s every %d minute(s)\n",
-               WxConfig.realtimeCsvFile,WxConfig.realtimeCsvWriteFrequency);
+ if (WxConfig.realtimeCsvWriteSeconds > 0)
+   fprintf(fd, "         realtimeCsvFile: Rewrite %s every %d second(s)\n",
+                 WxConfig.realtimeCsvFile,WxConfig.realtimeCsvWriteSeconds);
+ else
+   fprintf(fd, "         realtimeCsvFile: Rewrite %s every %d minute(s)\n",
+                 WxConfig.realtimeCsvFile,WxConfig.realtimeCsvWriteFrequency);
+ fprintf(fd, "             historyFile: %s\n",WxConfig.historyFile);
+ fprintf(fd, "          historyRecords: %d (%d kept)\n",WxConfig.historyRecords, WX_GetHistoryRecordCount());
  fprintf(fd, "     numCsvFilesToUpdate: %d\n",WxConfig.numCsvFilesToUpdate);
+ fprintf(fd, "    csvBatchLines / Sync: %d line(s), sync every %d line(s) / %d minute(s)\n",
+               WxConfig.csvBatchLines, WxConfig.csvSyncLines, WxConfig.csvSyncMinutes);
  for (i=0;i<WxConfig.numCsvFilesToUpdate;i++)
-    fprintf(fd, "                    update %s every %d snapshot(s)\n",WxConfig.csvFiles[i].fname, WxConfig.csvFiles[i].snapshotsBetweenUpdates);
+    fprintf(fd, "                    update %s every %d snapshot(s)%s%s\n",WxConfig.csvFiles[i].fname, WxConfig.csvFiles[i].snapshotsBetweenUpdates,
+                WxConfig.csvFiles[i].rotateMonthly ? ", monthly segments" : "", WxConfig.csvFiles[i].binaryLog ? ", binary log" : "");
+ WX_DumpCsvSchema(fd, "csvColumns", FALSE);
+ WX_DumpCsvSchema(fd, "realtimeCsvColumns", TRUE);
  fprintf(fd, "\n");
  fprintf(fd, "      ftpUploadFrequency: %d\n",WxConfig.ftpUploadFrequency);
  fprintf(fd, "       ftpServerHostname: %s\n",WxConfig.ftpServerHostname);
@@ -629,8 +640,60 @@ void WX_DumpConfigInfo(FILE *fd)
  */
 }
 
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Dump the most recent hourly/daily/monthly rollup buckets.  Temperatures are shown as avg (min/max) in F,
+// energy as the average of the per-snapshot watts averages and fuel as gallons burned during the bucket.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+static void printRollupTemp(FILE *fd, WX_RollupTierId tier, WX_SensorId sensor, int bucket)
+{
+  WX_RollupValue val;
+  if (WX_GetRollupValue(tier, sensor, WX_FIELD_TEMP, bucket, &val))
+    fprintf(fd, " %5.1f (%5.1f/%5.1f)", val.avg*1.8+32, val.min*1.8+32, val.max*1.8+32);
+  else
+    fprintf(fd, "                    ");
+}
+
+void WX_DumpRollupInfo(FILE *fd)
+{
+  static const struct { WX_RollupTierId tier; int bucketsToShow; } tiersToShow[] = {
+    { WX_ROLLUP_HOURLY, 24 }, { WX_ROLLUP_DAILY, 14 }, { WX_ROLLUP_MONTHLY, 12 } };
+  int i, bucket;
+  WX_RollupValue val;
+
+  printTimeDateAndUptime(fd);
+
+  for (i=0;i<(int) (sizeof(tiersToShow)/sizeof(tiersToShow[0]));i++) {
+    WX_RollupTierId tier = tiersToShow[i].tier;
+    fprintf(fd, "   %s Rollups\n", WX_GetRollupTierName(tier));
+    fprintf(fd, "     Start              Outdoor (min/max)    Indoor (min/max)     Pressure  Watts  Fuel(gals)\n");
+    for (bucket=1;bucket<=tiersToShow[i].bucketsToShow;bucket++) {
+      WX_GetRollupValue(tier, WX_SENSOR_IDU, WX_FIELD_TEMP, bucket, &val);
+      if (val.startTime == 0)
+        break;
+      struct tm tmBuf, *localtm = localtime_r(&val.startTime, &tmBuf);
+      fprintf(fd, "     %02d/%02d/%04d %02d:%02d  ", localtm->tm_mon+1, localtm->tm_mday, localtm->tm_year+1900,
+              localtm->tm_hour, localtm->tm_min);
+      printRollupTemp(fd, tier, WX_SENSOR_ODU, bucket);
+      printRollupTemp(fd, tier, WX_SENSOR_IDU, bucket);
+      if (WX_GetRollupValue(tier, WX_SENSOR_IDU, WX_FIELD_SEALEVEL_PRESSURE, bucket, &val))
+        fprintf(fd, "  %5.2f", val.avg/33.8638866667);
+      else
+        fprintf(fd, "       ");
+      if (WX_GetRollupValue(tier, WX_SENSOR_EFERGY, WX_FIELD_WATTS_AVG, bucket, &val) ||
+          WX_GetRollupValue(tier, WX_SENSOR_OWL, WX_FIELD_WATTS_AVG, bucket, &val))
+        fprintf(fd, "  %5d", (int) val.avg);
+      else
+        fprintf(fd, "       ");
+      if (WX_GetRollupValue(tier, WX_SENSOR_OWL, WX_FIELD_BURNER_SECONDS, bucket, &val) && (val.sum != 0))
+        fprintf(fd, "  %6.2f", val.sum/3600 * WxConfig.fuelBurnerGallonsPerHour);
+      fprintf(fd, "\n");
+    }
+    fprintf(fd, "\n");
+  }
+}
+
 void printTimeDateAndUptime(FILE *fd) {
-   struct tm *localtm = localtime(&wxData.currentTime.timet);
+   struct tm tmBuf, *localtm = localtime_r(&wxData.currentTime.timet, &tmBuf);
    fprintf(fd, "   Date: %02d/%02d/%04d    Time: %02d:%02d:%02d",
       localtm->tm_mon+1, localtm->tm_mday, localtm->tm_year+1900, localtm->tm_hour, localtm->tm_min, localtm->tm_sec);   
 
@@ -1,101 +1,276 @@
 
+/*========================================================================
+
+   csv-utility.c
+
+   Offline tool that re-aggregates an rtl-wx csv log (normally
+   rtl-wx-15min.csv) into longer interval logs, eg. to backfill
+   rtl-wx-1hr.csv and rtl-wx-daily.csv from years of 15 minute data.
+
+     csv-utility <sourcefile> <destfile>:<minutes> [<destfile>:<minutes> ...]
+     csv-utility rtl-wx-15min.csv rtl-wx-1hr.csv:60 rtl-wx-4hr.csv:240 rtl-wx-daily.csv:1440
+
+   The source is read once, a block at a time, and every output is built in
+   the same pass.  Lines are grouped into buckets aligned to the output
+   interval in local time (so daily lines cover midnight to midnight no
+   matter where the source starts), and each output line is timestamped at
+   the end of its bucket like the lines rtl-wx writes.  Every column in the
+   source header is carried through: fuelGallonsBurned is totalled and the
+   rest are averaged, skipping values that mean no data the same way the
+   rtl-wx warm start does: -99, a temperature/dewpoint pair that is 0/0, and
+   watts or pressure values of 0 (history columns with no samples are
+   logged as 0).  A column with no data at all in a bucket is written as
+   -99.  If the source starts partway
+   through an interval the first line of each output covers only part of
+   it; a partial interval at the end of the source is left out.
+
+   The older form "csv-utility <sourcefile> <destfile> <snapshots>" is still
+   accepted and means <snapshots> x 15 minutes.
+
+========================================================================*/
+
 #include <stdlib.h>
-#include <termios.h>
 #include <string.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
 #include <time.h>
-#include <math.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-
-int main(int argc, char *argv[]) {
-
-   if (argc < 4) {
-     printf("This utility processes a rtl-wx CSV by rtl-wx \n");
-     printf("by combining multiple source file lines per line of output\n");
-     printf("  Usage: processCSV <sourcefile> <destfile> <lines of source per line of output>\n", argv[0]);
-     printf("Example: processCSV rtl-wx-15min rtl-wx-2hr.csv 8\n", argv[0]);
-     exit(0);
-   }
-   char *sourceFilename = argv[1];
-   char *newFilename = argv[2];
-   int numSamplesToInclude = atoi(argv[3]);
-   
-
-   FILE *newfd, *sourcefd;
-   if ((newfd = fopen(newFilename, "w")) == NULL) {
-      fprintf(stderr,"RTL-Wx: Unable to open %s file for writing.  Exiting...\n\n", newFilename);
-      exit(1);     
-   }
-   if ((sourcefd = fopen(sourceFilename, "rt")) == NULL) {
-      fprintf(stderr,"RTL-Wx: Unable to open %s file for reading.  Exiting...\n\n", sourceFilename);
+#include "CsvParse.h"
+
+#define READ_BLOCK_SIZE 65536
+#define MAX_LINE_SIZE 4096
+#define MAX_OUTPUTS 10
+#define LINE_TIME_SLOP 120   // Lines are written a little after the end of their interval
+
+typedef struct _Output {
+  char *fname;
+  FILE *fd;
+  long intervalSeconds;
+  long bucket;               // Index of the bucket being built, -1 if none yet
+  long lastTimeSeen;
+  double sum[CSV_MAX_FIELDS];
+  int count[CSV_MAX_FIELDS];
+  int linesWritten;
+} Output;
+
+static Output outputs[MAX_OUTPUTS];
+static int numOutputs = 0;
+static int numColumns = 0;
+static int columnDecimals[CSV_MAX_FIELDS];  // Most decimal places seen in each column, used for the output
+static int columnIsTotal[CSV_MAX_FIELDS];   // Totalled rather than averaged
+static int columnPair[CSV_MAX_FIELDS];      // Dewpoint column of a temperature column (and the other way round), or -1
+static int columnZeroIsMissing[CSV_MAX_FIELDS]; // Watts and pressure columns, which are only 0 when there was no data
+
+// Offset from UTC of the local time zone at t.  localtime() is only called again when t moves to another hour.
+static long getUtcOffset(time_t t)
+{
+  static time_t validFrom = 1, validTo = 0;
+  static long offset = 0;
+  struct tm tmBuf;
+
+  if ((t < validFrom) || (t >= validTo)) {
+    localtime_r(&t, &tmBuf);
+    offset = tmBuf.tm_gmtoff;
+    validFrom = t - (t % 3600);
+    validTo = validFrom + 3600;
+  }
+  return(offset);
+}
+
+static void writeBucket(Output *op)
+{
+  char line[MAX_LINE_SIZE];
+  int i, len;
+
+  // Bucket end, back in UTC (using the offset in effect at that time, which can be off by an hour right at a
+  // daylight saving change)
+  long endTime = (op->bucket + 1) * op->intervalSeconds;
+  endTime -= getUtcOffset(endTime);
+
+  len = snprintf(line, sizeof(line), "%ld", endTime);
+  for (i=1;i<numColumns;i++) {
+    if (op->count[i] == 0)
+      len += snprintf(line+len, sizeof(line)-len, ",%d", CSV_NO_DATA_VALUE);
+    else
+      len += snprintf(line+len, sizeof(line)-len, ",%.*f", columnDecimals[i],
+                      columnIsTotal[i] ? op->sum[i] : op->sum[i] / op->count[i]);
+  }
+  fprintf(op->fd, "%s\n", line);
+  op->linesWritten++;
+  memset(op->sum, 0, sizeof(op->sum));
+  memset(op->count, 0, sizeof(op->count));
+}
+
+static int fieldEndsWith(CSV_Line *linep, int idx, const char *suffix)
+{
+  int suffixLength = strlen(suffix);
+
+  return((linep->length[idx] > suffixLength) &&
+         (memcmp(linep->field[idx] + linep->length[idx] - suffixLength, suffix, suffixLength) == 0));
+}
+
+static void processHeader(CSV_Line *linep, const char *text, int length)
+{
+  char name[MAX_LINE_SIZE];
+  int i;
+
+  numColumns = linep->numFields;
+  for (i=0;i<numColumns;i++) {
+    columnDecimals[i] = 0;
+    columnIsTotal[i] = ((linep->length[i] == 17) && (memcmp(linep->field[i], "fuelGallonsBurned", 17) == 0));
+    columnPair[i] = -1;
+    if (fieldEndsWith(linep, i, "Temp")) {
+      snprintf(name, sizeof(name), "%.*sDewpoint", linep->length[i] - 4, linep->field[i]);
+      columnPair[i] = CSV_FindField(linep, name);
+    }
+    else if (fieldEndsWith(linep, i, "Dewpoint")) {
+      snprintf(name, sizeof(name), "%.*sTemp", linep->length[i] - 8, linep->field[i]);
+      columnPair[i] = CSV_FindField(linep, name);
+    }
+    columnZeroIsMissing[i] = fieldEndsWith(linep, i, "Watts") || fieldEndsWith(linep, i, "Pressure");
+  }
+  for (i=0;i<numOutputs;i++)
+    fprintf(outputs[i].fd, "%.*s\n", length, text);
+}
+
+// Returns 0 if the line doesn't start with a timestamp
+static int processLine(CSV_Line *linep)
+{
+  double value, pairValue;
+  long t, localTime;
+  int i, j;
+
+  if (!CSV_GetFieldNumber(linep, 0, &value))
+    return(0);
+  t = (long) value;
+  localTime = t + getUtcOffset(t) - LINE_TIME_SLOP;
+
+  for (j=0;j<numOutputs;j++) {
+    Output *op = &outputs[j];
+    long bucket = localTime / op->intervalSeconds;
+    if ((bucket != op->bucket) && (op->bucket >= 0))
+      writeBucket(op);
+    op->bucket = bucket;
+    op->lastTimeSeen = localTime;
+  }
+
+  for (i=1;(i<linep->numFields) && (i<numColumns);i++) {
+    const char *dot = memchr(linep->field[i], '.', linep->length[i]);
+    if (!CSV_GetFieldNumber(linep, i, &value) || (value == CSV_NO_DATA_VALUE))
+      continue;
+    if ((columnPair[i] >= 0) && (!CSV_GetFieldNumber(linep, columnPair[i], &pairValue) || CSV_IsMissingTempPair(value, pairValue)))
+      continue;
+    if (columnZeroIsMissing[i] && (value <= 0))
+      continue;
+    if ((dot != NULL) && (linep->field[i] + linep->length[i] - dot - 1 > columnDecimals[i]))
+      columnDecimals[i] = linep->field[i] + linep->length[i] - dot - 1;
+    for (j=0;j<numOutputs;j++) {
+      outputs[j].sum[i] += value;
+      outputs[j].count[i]++;
+    }
+  }
+  return(1);
+}
+
+static void usage(char *progName)
+{
+  printf("This utility re-aggregates a rtl-wx CSV log into logs with longer intervals\n");
+  printf("  Usage: %s <sourcefile> <destfile>:<minutes> [<destfile>:<minutes> ...]\n", progName);
+  printf("Example: %s rtl-wx-15min.csv rtl-wx-1hr.csv:60 rtl-wx-daily.csv:1440\n", progName);
+  exit(0);
+}
+
+static void addOutput(char *fname, long minutes)
+{
+  Output *op = &outputs[numOutputs++];
+
+  if (minutes <= 0) {
+    fprintf(stderr, "RTL-Wx: Bad interval for %s\n", fname);
+    exit(1);
+  }
+  op->fname = fname;
+  op->intervalSeconds = minutes * 60;
+  op->bucket = -1;
+  if ((op->fd = fopen(fname, "w")) == NULL) {
+    fprintf(stderr,"RTL-Wx: Unable to open %s file for writing.  Exiting...\n\n", fname);
+    exit(1);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  static char buf[READ_BLOCK_SIZE + MAX_LINE_SIZE];
+  int fd, i, len = 0, n;
+  int linesParsed = 0, linesSkipped = 0;
+  int headerSeen = 0;
+
+  if (argc < 3)
+    usage(argv[0]);
+  if ((argc == 4) && (strchr(argv[2], ':') == NULL) && (strspn(argv[3], "0123456789") == strlen(argv[3])))
+    addOutput(argv[2], atol(argv[3]) * 15);
+  else
+    for (i=2;i<argc;i++) {
+      char *colon = strrchr(argv[i], ':');
+      if ((colon == NULL) || (numOutputs >= MAX_OUTPUTS))
+        usage(argv[0]);
+      *colon = 0;
+      addOutput(argv[i], atol(colon+1));
+    }
+
+  if ((fd = open(argv[1], O_RDONLY)) < 0) {
+    fprintf(stderr,"RTL-Wx: Unable to open %s file for reading.  Exiting...\n\n", argv[1]);
+    exit(1);
+  }
+
+  // Read a block at a time.  A partial line at the end of a block is moved to the front and finished by the next read.
+  for (;;) {
+    const char *p = buf, *end, *next;
+    CSV_Line line;
+
+    if ((n = read(fd, buf + len, READ_BLOCK_SIZE)) < 0) {
+      fprintf(stderr,"RTL-Wx: Error reading %s (%s)\n", argv[1], strerror(errno));
       exit(1);
-   }
-   fprintf(newfd, "Time,efergyWatts,owlWatts,fuelGallonsBurned,oduTemp,oduDewpoint,iduTemp,iduDewpoint,ext1Temp,ext1Dewpoint,ext2Temp,ext2Dewpoint,ext3Temp,ext3Dewpoint,ext4Temp,ext4Dewpoint,iduSealevelPressure\n");
-   
-   // The new file is open for writing and header line was written and rtl-wx-15min.csv was successfully opened for reading.
-   // The plan is to backfill data from rtl-wx-15min.csv into the new file by recreating the history using the correct time interval
-   int timestampA, efergyWattsA=0, owlWattsA=0;
-   float fuelGallonsA=0, oduTempA=0, oduDewpointA=0, iduTempA=0, iduDewpointA=0,
-     ext1TempA=0, ext1DewpointA=0, ext2TempA=0, ext2DewpointA=0, 
-     ext3TempA=0, ext3DewpointA=0, ext4TempA=0, ext4DewpointA=0, iduPressureA=0;
- //  "%lu,%d,%d,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f\n", 
-
-   char sourceLine[500];
-   int samples = 0;
-   int foundStartSample = 0;
-   int linesWritten=0, linesParsed=0, linesSkipped=0;
-   while(fgets(sourceLine, 500, sourcefd) != NULL) {
-     int timestamp, efergyWatts, owlWatts;
-     float fuelGallons, oduTemp, oduDewpoint, iduTemp, iduDewpoint,
-     ext1Temp, ext1Dewpoint, ext2Temp, ext2Dewpoint, ext3Temp, ext3Dewpoint, ext4Temp, ext4Dewpoint, iduPressure;
-     int numRead = sscanf(sourceLine,"%lu,%d,%d,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f",
-        &timestamp, &efergyWatts, &owlWatts, &fuelGallons, &oduTemp, &oduDewpoint, &iduTemp, &iduDewpoint,
-        &ext1Temp, &ext1Dewpoint, &ext2Temp, &ext2Dewpoint, &ext3Temp, &ext3Dewpoint, &ext4Temp, &ext4Dewpoint, &iduPressure);
- 
-     time_t sampleTime = (time_t) timestamp;
-     struct tm *localTime = localtime(&sampleTime);
-     if ((numRead == 17) && (foundStartSample == 0)) {
-          if ((localTime->tm_min == 0) && (localTime->tm_hour == 0))
-	    foundStartSample = 1;
-	//  else 
-	//    printf("start time not found timestamp=%d min=%d hour=%d\n",timestamp, localTime->tm_min, localTime->tm_hour);
-     }
-     if ((numRead == 17) && (foundStartSample)) {
-	samples++;
-	linesParsed++;
-	efergyWattsA += efergyWatts; fuelGallonsA += fuelGallons; owlWattsA+= owlWatts;
-	iduTempA     += iduTemp; iduDewpointA += iduDewpoint; iduPressureA += iduPressure;
-	oduTempA     += oduTemp; oduDewpointA += oduDewpoint;
-	ext1TempA    += ext1Temp; ext1DewpointA += ext1Dewpoint; ext2TempA += ext2Temp; ext2DewpointA += ext2Dewpoint;
-	ext3TempA    += ext3Temp; ext3DewpointA += ext3Dewpoint; ext4TempA += ext4Temp; ext4DewpointA += ext4Dewpoint;
-	if (samples == numSamplesToInclude) {
-		efergyWattsA /= samples; owlWattsA /= samples; iduTempA /= samples;
-		iduDewpointA /= samples; iduPressureA /= samples; oduTempA /= samples;oduDewpointA /= samples;
-		ext1TempA     /= samples; ext1DewpointA /= samples; ext2TempA /= samples; ext2DewpointA /= samples;     
-		ext3TempA     /= samples; ext3DewpointA /= samples; ext4TempA /= samples; ext4DewpointA /= samples;
-		//                                                     time efergy owl  fuel       odu                          idu                          ext1                        ext2                         ext3                       ext4                         pressure
-		char lineToAppend[500];
-		sprintf(lineToAppend,"%lu,%d,%d,%4.2f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%3.1f,%5.2f\n", 
-		   timestamp+900,efergyWattsA,owlWattsA,fuelGallonsA, oduTempA, oduDewpointA, iduTempA, iduDewpointA,
-		ext1TempA, ext1DewpointA, ext2TempA, ext2DewpointA, 
-		ext3TempA, ext3DewpointA, ext4TempA, ext4DewpointA, iduPressureA);
-		fprintf(newfd, lineToAppend);
-		samples = 0;
-		efergyWattsA=0; owlWattsA=0;fuelGallonsA=0; oduTempA=0;oduDewpointA=0;iduTempA=0;iduDewpointA=0;
-		ext1TempA=0;ext1DewpointA=0;ext2TempA=0;ext2DewpointA=0; 
-		ext3TempA=0;ext3DewpointA=0;ext4TempA=0;ext4DewpointA=0, iduPressureA=0;
-	//printf("Writing line: timestamp=%d day=%d min=%d hour=%d\n",timestamp, localTime->tm_mday, localTime->tm_min, localTime->tm_hour);
-		linesWritten++;
-	}
-     } else 
+    }
+    len += n;
+    if (n == 0) {
+      if (len == 0)
+        break;
+      buf[len++] = '\n';     // Last line of the file didn't have a newline
+    }
+    end = buf + len;
+    while ((next = memchr(p, '\n', end - p)) != NULL) {
+      CSV_SplitLine(p, next, &line);
+      if (!headerSeen) {
+        int textLength = next - p;
+        if ((textLength > 0) && (p[textLength-1] == '\r'))
+          textLength--;
+        processHeader(&line, p, textLength);
+        headerSeen = 1;
+      }
+      else if (processLine(&line))
+        linesParsed++;
+      else if (next > p + 1)
         linesSkipped++;
-   }
-   printf("Program Stats: Skipped %d lines.  Parsed %d lines.  Wrote %d lines\n", linesSkipped, linesParsed, linesWritten);
-   fclose(sourcefd);
-   fclose(newfd);  
-   exit(0);
-}
\ No newline at end of file
+      p = next + 1;
+    }
+    len = end - p;
+    if (len >= MAX_LINE_SIZE) {
+      fprintf(stderr,"RTL-Wx: Line too long in %s\n", argv[1]);
+      exit(1);
+    }
+    memmove(buf, p, len);
+  }
+  close(fd);
+
+  // The last bucket is only written if the source reaches its end, otherwise it's a partial interval
+  for (i=0;i<numOutputs;i++) {
+    Output *op = &outputs[i];
+    if ((op->bucket >= 0) && (op->lastTimeSeen + LINE_TIME_SLOP >= (op->bucket + 1) * op->intervalSeconds))
+      writeBucket(op);
+    printf("%s: Wrote %d lines\n", op->fname, op->linesWritten);
+    fclose(op->fd);
+  }
+  printf("Program Stats: Skipped %d lines.  Parsed %d lines.\n", linesSkipped, linesParsed);
+  exit(0);
+}
@@ -10,10 +10,10 @@
    invocation for this mode would be something like "rtl-wx -s"
 
    A client mode of operation is available which can be used to connect to another invocation
-   of this program that's running in server mode (using named pipes).  When running in client
-   mode, the client tty is used to receive commands which are sent to the server over a pipe.  
-   Also, when a client is connected, all server output is directed through a pipe to the
-   client.  The client is provided primarily for debug/testing/status purposes.   The
+   of this program that's running in server mode (using a Unix domain socket, see CmdSocket.c).
+   When running in client mode, the client tty is used to receive commands which are sent to the
+   server over the socket.  Also, when a client is connected, all server output is passed on to
+   the client.  The client is provided primarily for debug/testing/status purposes.   The
    command line for invoking the program in client mode is simply "rtl-wx -c".  A variation on
    this mode called remote command mode is provided (rtl-wx -r <command char> ) where a
    single command is sent to the server and the output from the command is echoed to stdout.
@@ -46,6 +46,12 @@
 #include <sys/signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <stdint.h>
 
 #include "rtl-wx.h"
 
@@ -64,21 +70,30 @@ long int WX_totalBurnerRunSeconds;
 #define TRUE 1
 
 static void runServerStandaloneLoop(int receiveDesc, FILE *outputfd);
-static void runClientLoop(int receiveDesc);
-static void runRemoteCommand(int recvFromServer, char command);
+static int runCommand(char key, char *arg, FILE *fd);
+static void runWorkerCommand(WX_RemoteCommand *cmdp, FILE *fd);
+static void runClientLoop(void);
+static void runRemoteCommand(char command, char *commandArg);
+static void readCommandArg(int receiveDesc, char *buf, int size);
 static void outputProgramHelp(FILE *fd);
 static void WX_milliSleep(int milliseconds);
 static void WX_Init(void);
+static void initEventWait(int receiveDesc, int *epollFdp, int *timerFdp);
+static void waitForNextEvent(int epollFd, int timerFd);
 
-// filenames used for named pipes when running client mode and server mode.
-#define WX_SERVER_SEND_PIPE "/tmp/WX_serverSend"
-#define WX_CLIENT_SEND_PIPE "/tmp/WX_serverReceive"
+// How long a remote command waits for the server to answer before giving up
+#define WX_REMOTE_COMMAND_TIMEOUT 30
 
-// These file descriptors are used to send output to the right place.  outputfd is either stdout or a pipe that a client program
-// may be listening on for testing and debug purposes.  logfd is the name of a logging file that logs program output when the
-// program is run in server mode.  The DPRINTF() macro automatically sends output to these file descriptor by default.
+// Commands that have to be run by the main loop because they change things (or look at the scheduler, which belongs to
+// the main loop).  The rest only show information and can be run by the command workers.
+#define MAIN_LOOP_COMMANDS "\x1b\x03qacflnrstuw"
+
+// These file descriptors are used to send output to the right place.  outputfd is either stdout or (in server mode) console output
+// that's passed on to any client program attached to it for testing and debug purposes.  logfd is the name of a logging file that
+// logs program output when the program is run in server mode.  The DPRINTF() macro automatically sends output to these file descriptor by default.
 FILE *outputfd=NULL;
 FILE *logfd=NULL;
+pthread_mutex_t logfdLock = PTHREAD_MUTEX_INITIALIZER;
 
 int rawxDataDumpMode = FALSE;
 extern void WX_process_os_msg_error(unsigned char *msg, int length);
@@ -119,9 +134,9 @@ void *rtl_433fm_thread(void *param) {
 int main(int argc, char *argv[])
 {
    struct termios  oldkey, newkey;   // place to store old and new keyboard settings
-   char *workingDirName, *receiveFilename;
-   int receiveDesc, outputDesc;
-   typedef enum _opModeEnum { Client, Server, Standalone, RemoteCommand, Error} OpModeEnum;
+   char *workingDirName;
+   int receiveDesc = -1;
+   typedef enum _opModeEnum { Client, Server, Standalone, RemoteCommand, CsvRange, BinLogConvert, Error} OpModeEnum;
    OpModeEnum opMode=Standalone;
     
    // Set default for working directory to run from.  For server mode, command line may override this.
@@ -138,6 +153,16 @@ int main(int argc, char *argv[])
     opMode = RemoteCommand;
    else if (strncmp(argv[1], "-c",2) == 0)
     opMode = Client;
+   else if (strncmp(argv[1], "-x",2) == 0) {
+    opMode = CsvRange;
+    if ((argc < 3) || (argc > 5))
+      opMode=Error;
+   }
+   else if (strncmp(argv[1], "-b",2) == 0) {
+    opMode = BinLogConvert;
+    if (argc != 4)
+      opMode=Error;
+   }
    else if (strncmp(argv[1], "-w",2) == 0) {
     opMode = Server;
     if (argc != 3)
@@ -152,12 +177,35 @@ int main(int argc, char *argv[])
      fprintf(stderr, "Usage: rtl-wx [-s -c -r] or rtl-wx -w <working dir name>\n\n");
      fprintf(stderr, "  rtl-wx    - Server mode (most typical - use web for control)\n");
      fprintf(stderr, "  rtl-wx -s - Standalone mode (terminal only, no web or  client support)\n");
-     fprintf(stderr, "  rtl-wx -c - Client mode (Connects to running server with named pipe in /tmp)\n");
+     fprintf(stderr, "  rtl-wx -c - Client mode (Connects to running server with a socket in /tmp)\n");
      fprintf(stderr, "  rtl-wx -r - Remote command mode (for cgi scripts in web interface)\n");
-     fprintf(stderr, "  rtl-wx -w <working dir> - Server mode using <working dir> (default is ./%s)\n\n", DEFAULT_WORKING_DIR);
+     fprintf(stderr, "  rtl-wx -r p <tag file> - Show a tag file with the tags replaced (for render.cgi)\n");
+     fprintf(stderr, "  rtl-wx -w <working dir> - Server mode using <working dir> (default is ./%s)\n", DEFAULT_WORKING_DIR);
+     fprintf(stderr, "  rtl-wx -x <csv file> [start [end]] - Print csv log lines between two unix times (for csvrange.cgi)\n");
+     fprintf(stderr, "  rtl-wx -b <in file> <out file> - Convert a binary log (.bin) to csv, or a csv log to binary\n\n");
      exit(1); 
    }
 
+   // Range reads just read the csv log files in the current directory, the server doesn't need to be running
+   if (opMode == CsvRange) {
+     time_t start = (argc > 3) ? strtoul(argv[3], NULL, 10) : 0;
+     time_t end = (argc > 4) ? strtoul(argv[4], NULL, 10) : 0;
+     exit((WX_CsvReadRange(stdout, argv[2], start, end) == 0) ? 0 : 1);
+   }
+   if (opMode == BinLogConvert) {
+     int len = strlen(argv[2]);
+     if ((len > 4) && (strcmp(argv[2]+len-4, ".bin") == 0)) {
+       FILE *out;
+       if ((out = fopen(argv[3], "w")) == NULL) {
+         fprintf(stderr, "RTL-Wx: Unable to create %s\n", argv[3]);
+         exit(1);
+       }
+       len = WX_BinLogToCsv(argv[2], out);
+       exit(((fclose(out) == 0) && (len == 0)) ? 0 : 1);
+     }
+     exit((WX_CsvToBinLog(argv[2], argv[3]) == 0) ? 0 : 1);
+   }
+
    if (opMode == Server) {
     if (chdir(workingDirName) != 0) {
       fprintf(stderr,"RTL-Wx: Unable to set working directory to %s.  Exiting...\n\n", workingDirName);
@@ -169,34 +217,15 @@ int main(int argc, char *argv[])
       fprintf(stderr,"RTL-Wx: Unable to open logfile rtl-wx.log.  Exiting...\n\n");
       exit(1);
     }
-    // Need to create the interprocess communications fifos in the filesystem 
-
-    // First delete the fifos if they're already there in order to flush them out and start over
-    remove(WX_CLIENT_SEND_PIPE);
-    remove(WX_SERVER_SEND_PIPE);
-     
-    // Now create the two fifos
-    if (mkfifo(WX_CLIENT_SEND_PIPE, 0666) != 0) {
-        DPRINTF("RTL-Wx: Unable to create client send fifo:%s  Exiting...\n",
-                                   WX_CLIENT_SEND_PIPE);
-       exit(1);
-    }
-    if (mkfifo(WX_SERVER_SEND_PIPE, 0666) != 0) {
-        DPRINTF("RTL-Wx: Unable to create server Send fifo:%s  Exiting...\n",
-                                  WX_SERVER_SEND_PIPE);
-       exit(1);
-    }
-    outputDesc = open(WX_SERVER_SEND_PIPE, O_RDWR | O_NDELAY | O_NOCTTY | O_NONBLOCK);  
-    if ((outputfd = fopen(WX_SERVER_SEND_PIPE, "w")) == NULL) {
-      DPRINTF("RTL-Wx: Unable to open server send pipe %s.  Exiting...\n\n",
-                                  WX_SERVER_SEND_PIPE);
+    // Clients and remote commands (eg. from the web interface cgi scripts) talk to the server through a socket in /tmp.
+    // The server's own output goes to the clients that are attached to it.
+    if ((outputfd = WX_StartCommandServer()) == NULL) {
+      DPRINTF("RTL-Wx: Unable to start command server on %s.  Exiting...\n\n", WX_COMMAND_SOCKET_PATH);
       exit(1);
     }
-    receiveFilename = WX_CLIENT_SEND_PIPE;
    }
    else if ((opMode == Client) || (opMode == RemoteCommand)) {
      outputfd = stdout;
-     receiveFilename = WX_SERVER_SEND_PIPE;
    }
    else { // Standalone mode
     if (chdir(workingDirName) != 0) {
@@ -204,20 +233,19 @@ int main(int argc, char *argv[])
       exit(1);
     }
     outputfd = stdout;
-    receiveFilename = "/dev/tty";
-   }
 
-   // Reconfigure the input pipe (or tty if standalone or client) to receive chars through  non-blocking reads char-by-char
-   receiveDesc = open(receiveFilename, O_RDWR | O_NDELAY | O_NOCTTY | O_NONBLOCK);
-   tcgetattr(receiveDesc, &oldkey);   // save current port settings
-   newkey.c_cflag = B38400 | CRTSCTS | CS8 | CLOCAL | CREAD;
-   newkey.c_iflag = IGNPAR;
-   newkey.c_oflag = 0;
-   newkey.c_lflag = 0;
-   newkey.c_cc[VMIN] = 1;
-   newkey.c_cc[VTIME] = 0;
-   tcflush(receiveDesc, TCIFLUSH);
-   tcsetattr(receiveDesc, TCSANOW, &newkey);
+    // Reconfigure the tty to receive chars through  non-blocking reads char-by-char
+    receiveDesc = open("/dev/tty", O_RDWR | O_NDELAY | O_NOCTTY | O_NONBLOCK);
+    tcgetattr(receiveDesc, &oldkey);   // save current port settings
+    newkey.c_cflag = B38400 | CRTSCTS | CS8 | CLOCAL | CREAD;
+    newkey.c_iflag = IGNPAR;
+    newkey.c_oflag = 0;
+    newkey.c_lflag = 0;
+    newkey.c_cc[VMIN] = 1;
+    newkey.c_cc[VTIME] = 0;
+    tcflush(receiveDesc, TCIFLUSH);
+    tcsetattr(receiveDesc, TCSANOW, &newkey);
+   }
  
    if ((opMode == Server) || (opMode == Standalone)) {
     if (opMode == Server) {
@@ -226,7 +254,12 @@ int main(int argc, char *argv[])
     else
        DPRINTF("Program started in STANDALONE Mode\n");
     runServerStandaloneLoop(receiveDesc, outputfd);
-    close(outputDesc);
+    WX_StopCommandServer(); // Let the command workers finish
+    WX_StopIoWorker(); // Finish any queued file outputs
+    WX_StopJobRunner(); // and wait for any uploads they started
+    WX_CsvWriterCloseAll();
+    WX_BinLogCloseAll();
+    WX_CloseHistoryFile();
    }
    else if (opMode == RemoteCommand) {
     char cmd;
@@ -234,18 +267,23 @@ int main(int argc, char *argv[])
        cmd = ' ';
     else
        cmd = argv[2][0];
-    runRemoteCommand(receiveDesc, cmd);
+    runRemoteCommand(cmd, (argc > 3) ? argv[3] : NULL);
    }   
    else {
      DPRINTF("Program started in CLIENT mode\n");
-     runClientLoop(receiveDesc);
+     runClientLoop();
    }
-  tcsetattr(receiveDesc, TCSANOW, &oldkey);
-  close(receiveDesc);
+  if (receiveDesc >= 0) {
+    tcsetattr(receiveDesc, TCSANOW, &oldkey);
+    close(receiveDesc);
+  }
 
   fclose(outputfd);
+  pthread_mutex_lock(&logfdLock);
   if (logfd != NULL)
      fclose(logfd);
+  logfd = NULL;
+  pthread_mutex_unlock(&logfdLock);
   exit((int) 0);
 } // end of main
 
@@ -293,9 +331,14 @@ void runServerStandaloneLoop(int receiveDesc, FILE *outputfd)
   int stop=FALSE;
   char Key;   
   int loopCnt=0;
+  int epollFd, timerFd;
   
   //  Init various data structures and modules such as WMR9x8 driver, scheduler, dataStore, etc
   WX_Init();
+  WX_StartIoWorker();
+  WX_StartJobRunner();
+  if (receiveDesc < 0)
+    WX_StartCommandWorkers(runWorkerCommand);
 
   if(pthread_create(&rtl_433fm_thread_struct, NULL, rtl_433fm_thread, NULL)) {
       fprintf(stderr, "Error creating rtl_433 receiver thread\n");
@@ -315,109 +358,261 @@ void runServerStandaloneLoop(int receiveDesc, FILE *outputfd)
   // By staying running, we'll be there when/if the client starts again (and we'll be processing weather data!)
   signal(SIGPIPE, SIG_IGN);
     
-  // flush out any chars in the receive pipe before processing starts. 
+  // flush out any chars typed before processing starts. 
   status = 1;
-  while (status == 1)  
+  while ((receiveDesc >= 0) && (status == 1))
     status = read(receiveDesc, &Key, 1);
+  initEventWait((receiveDesc >= 0) ? receiveDesc : WX_GetCommandServerFd(), &epollFd, &timerFd);
 
 
   // The command processing loop here is used as a debug tool when the program is run in standalone mode, or the
   // commands may come from another instance of this program running in client mode or in remote control
-  // mode (rtl-wx -c or rtl-wx -r) that sends commands to a server instance (rtl-wx&) over a named pipe.  Client mode is provided
+  // mode (rtl-wx -c or rtl-wx -r) that sends commands to a server instance (rtl-wx&) over a socket.  Client mode is provided
   // for controlling a server instance and provides all of the controls of standalone mode.  Remote control mode is used to
   // connect to a server, send a single command to the server, retrieve the output of the command, then exit.  This supports
   // web browser based control of the server.
   while (stop == FALSE) {
-    status = read(receiveDesc, &Key, 1);
+    WX_RemoteCommand request;
 
-    if (status == 1) {   // if a key was hit
-       switch (Key) {
-          case 0x1b:   /* Esc */
-          case 'q':  /* q */
-          case 0x03: /* ^C */
-            DPRINTF("Shutting down in response to user command\n");
-            stop = TRUE;
-            break;
-          case 'a':
-                WX_DumpSchedulerInfo(outputfd);
-                break;
-          case 'c':
-            DPRINTF("Executing user command to read configuration file: %s\n", CONFIG_FILE_PATH);
-            WX_DoConfigFileRead();
-            break;
-          case 'd': 
-            WX_DumpSensorInfo(outputfd);
-            break;
-          case 'e': 
-            WX_DumpEnergyHistoryInfo(outputfd, "Efergy", &wxData.energy, ENERGY_HISTORY_SAMPLES_PER_MINUTE);
-	    WX_DumpEnergyHistoryInfo(outputfd, "OWL", &wxData.owl, OWL_ENERGY_HISTORY_SAMPLES_PER_MINUTE); 
-            break;
-          case 'f': 
-            DPRINTF("Executing user command to invoke tag file parser\n");
-            WX_DoTagFileProcessing();
-            break;
-          case 'h':
-            outputProgramHelp(outputfd);
-            break;
-          case 'i':
-            WX_DumpConfigInfo(outputfd);
-            break;
-          case 'l':
-            if (logfd != NULL)
-              fclose(logfd);
-            if ((logfd = fopen(LOG_FILE_PATH, "w")) == NULL) {
-                fprintf(stderr, "RTL-Wx Error reopening log file %s\n",LOG_FILE_PATH);
-                exit(1);
-            }
-            DPRINTF("Logfile cleared by user command\n");
-            break;
-          case 'm':
-            WX_DumpMaxMinInfo(outputfd);
-            break;
-          case 'n':
-            DPRINTF("Executing user command to reset historical max/min data\n");
-            WX_InitHistoricalMaxMinData();
-            break;
-          case 'r':
-            DPRINTF("Executing user command to reset sensor lock code and timout information\n");
-            init_sensor_lock_and_timeout_info();
-            break;
-          case 's':
-            DPRINTF("Executing user command to save data snapshot and rain snapshot\n");
-            WX_DoDataSnapshotSave(WxConfig.dataSnapshotFrequency);
-            WX_DoRainDataSnapshotSave();
-            break;
-          case 't':
-            if (rawxDataDumpMode == TRUE) {
-               DPRINTF("Executing user command to disable raw message data display mode.\n");
-               rawxDataDumpMode = FALSE; }
-            else {
-               DPRINTF("Executing user command to enable raw message data display mode.  All bytes will be echoed\n");
-               rawxDataDumpMode = TRUE; }
-            break;
-          case 'u': 
-            DPRINTF("Executing user command to do FTP upload\n");   
-            fflush(outputfd);
-            //  dump the current data to a file and send that file via ftp to a server
-            if (WX_DoFtpUpload() != 0) {
-                DPRINTF("FTP upload completed successfully\n"); }
-            else
-                DPRINTF("FTP operation failed.\n");
-            break;
-          case 'w':
-            DPRINTF("Executing user command to save webcam snapshot\n");
-            WX_DoWebcamSnapshot();
-            break;
-          default:
-            WX_DumpInfo(outputfd);
-            break;
-       }
-    }   // end if key hit
+    status = 0;
+    if (receiveDesc < 0) {   // Server mode, commands come from clients through the command socket
+      // Commands that only show information are run by the command workers, so several clients can be answered at once
+      // and a slow one doesn't hold up the main loop.  Anything that changes something is run here.
+      if (WX_GetRemoteCommand(&request)) {
+        status = 1;
+        if ((strchr(MAIN_LOOP_COMMANDS, request.command) != NULL) || !WX_QueueRemoteCommand(&request)) {
+          char *output = NULL;
+          size_t outputLen = 0;
+          FILE *fd = open_memstream(&output, &outputLen);
+
+          // The output is collected and sent back in one piece, so the client knows when it has all of it
+          stop = runCommand(request.command, request.arg, (fd != NULL) ? fd : outputfd);
+          if (fd != NULL)
+            fclose(fd);
+          WX_SendRemoteResponse(&request, output, outputLen);
+          free(output);
+        }
+      }
+    }
+    else if ((status = read(receiveDesc, &Key, 1)) == 1) {   // if a key was hit
+      char arg[MAX_CONFIG_NAME_SIZE] = "";
+      if (Key == 'p')
+        readCommandArg(receiveDesc, arg, sizeof(arg));
+      stop = runCommand(Key, arg, outputfd);
+    }
    fflush(outputfd);
-   // Now check to see if it's time to do tag file processing, FTP uploading or other actions...
+   clearerr(outputfd);   // Console output nobody was reading fast enough is lost, carry on writing the next lot
+   // Note changes to the config file and templates, then check to see if it's time to do tag file processing, FTP uploading or other actions...
+   WX_ProcessFileWatchEvents();
    WX_DoScheduledActions();
-   WX_milliSleep(100);
+   // Once there are no more commands waiting, sleep until the next one arrives or the next action is due
+   if (status != 1)
+     waitForNextEvent(epollFd, timerFd);
   } // while (stop == FALSE)
+  if (epollFd >= 0) {
+    close(epollFd);
+    close(timerFd);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------------------------------------------------
+// Run one command, sending its output to fd.  arg is the rest of the command line (eg. the tag file name for 'p').  Returns TRUE if the
+// command was to shut down.
+//--------------------------------------------------------------------------------------------------------------------------------------------
+static int runCommand(char key, char *arg, FILE *fd)
+{
+  int stop = FALSE;
+
+  switch (key) {
+    case 0x1b:   /* Esc */
+    case 'q':  /* q */
+    case 0x03: /* ^C */
+      DPRINTF("Shutting down in response to user command\n");
+      stop = TRUE;
+      break;
+    case 'a':
+      WX_DumpSchedulerInfo(fd);
+      break;
+    case 'c':
+      DPRINTF("Executing user command to read configuration file: %s\n", CONFIG_FILE_PATH);
+      WX_DoConfigFileRead();
+      break;
+    case 'd': 
+      WX_DumpSensorInfo(fd);
+      break;
+    case 'e': 
+      WX_DumpEnergyHistoryInfo(fd, "Efergy", &wxData.energy, ENERGY_HISTORY_SAMPLES_PER_MINUTE);
+      WX_DumpEnergyHistoryInfo(fd, "OWL", &wxData.owl, OWL_ENERGY_HISTORY_SAMPLES_PER_MINUTE); 
+      break;
+    case 'f': 
+      DPRINTF("Executing user command to invoke tag file parser\n");
+      WX_DoTagFileProcessing();
+      break;
+    case 'h':
+      outputProgramHelp(fd);
+      break;
+    case 'p':
+      WX_DoTagFileRender(arg, fd);
+      break;
+    case 'i':
+      WX_DumpConfigInfo(fd);
+      break;
+    case 'l':
+      pthread_mutex_lock(&logfdLock);   // Other threads may be writing to it
+      if (logfd != NULL)
+        fclose(logfd);
+      logfd = fopen(LOG_FILE_PATH, "w");
+      pthread_mutex_unlock(&logfdLock);
+      if (logfd == NULL) {
+          fprintf(stderr, "RTL-Wx Error reopening log file %s\n",LOG_FILE_PATH);
+          exit(1);
+      }
+      DPRINTF("Logfile cleared by user command\n");
+      break;
+    case 'm':
+      WX_DumpMaxMinInfo(fd);
+      break;
+    case 'n':
+      DPRINTF("Executing user command to reset historical max/min data\n");
+      WX_LockSharedData();   // Writes the history file header
+      WX_InitHistoricalMaxMinData();
+      WX_UnlockSharedData();
+      break;
+    case 'o':
+      WX_DumpRollupInfo(fd);
+      break;
+    case 'r':
+      DPRINTF("Executing user command to reset sensor lock code and timout information\n");
+      init_sensor_lock_and_timeout_info();
+      break;
+    case 's':
+      DPRINTF("Executing user command to save data snapshot and rain snapshot\n");
+      WX_DoDataSnapshotSave(WxConfig.dataSnapshotFrequency);
+      WX_DoRainDataSnapshotSave();
+      break;
+    case 't':
+      if (rawxDataDumpMode == TRUE) {
+         DPRINTF("Executing user command to disable raw message data display mode.\n");
+         rawxDataDumpMode = FALSE; }
+      else {
+         DPRINTF("Executing user command to enable raw message data display mode.  All bytes will be echoed\n");
+         rawxDataDumpMode = TRUE; }
+      break;
+    case 'u': 
+      DPRINTF("Executing user command to do FTP upload\n");   
+      fflush(fd);
+      //  dump the current data to a file and send that file via ftp to a server
+      if (WX_DoFtpUpload() != 0) {
+          DPRINTF("FTP upload queued, any errors will be logged\n"); }
+      else
+          DPRINTF("FTP operation failed.\n");
+      break;
+    case 'w':
+      DPRINTF("Executing user command to save webcam snapshot\n");
+      WX_DoWebcamSnapshot();
+      break;
+    default:
+      WX_DumpInfo(fd);
+      break;
+  }
+  return(stop);
+}
+
+// Run a command for a client on one of the command worker threads.  The read lock keeps the history store and the
+// configuration from changing under it, while the other workers and a tag file pass carry on.  'p' takes the lock itself.
+static void runWorkerCommand(WX_RemoteCommand *cmdp, FILE *fd)
+{
+  if (cmdp->command == 'p')
+    runCommand(cmdp->command, cmdp->arg, fd);
+  else {
+    WX_ReadLockSharedData();
+    runCommand(cmdp->command, cmdp->arg, fd);
+    WX_UnlockSharedData();
+  }
+}
+
+// Set up an epoll set with the command input (the tty, or the command socket in server mode), a timer for the next scheduled
+// action and the file watch (if there is one).  If that can't be done *epollFdp is set to -1 and the loop goes back to checking for commands every 100 ms.
+static void initEventWait(int receiveDesc, int *epollFdp, int *timerFdp)
+{
+  struct epoll_event ev;
+
+  *epollFdp = epoll_create1(EPOLL_CLOEXEC);
+  *timerFdp = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = receiveDesc;
+  if ((*epollFdp >= 0) && (*timerFdp >= 0) && (epoll_ctl(*epollFdp, EPOLL_CTL_ADD, receiveDesc, &ev) == 0)) {
+    ev.data.fd = *timerFdp;
+    if (epoll_ctl(*epollFdp, EPOLL_CTL_ADD, *timerFdp, &ev) == 0) {
+      if ((ev.data.fd = WX_GetFileWatchFd()) >= 0)
+        epoll_ctl(*epollFdp, EPOLL_CTL_ADD, ev.data.fd, &ev);
+      return;
+    }
+  }
+  DPRINTF("Unable to wait for commands and timers (%s), checking every 100ms instead\n", strerror(errno));
+  if (*epollFdp >= 0)
+    close(*epollFdp);
+  if (*timerFdp >= 0)
+    close(*timerFdp);
+  *epollFdp = -1;
+}
+
+// Sleep until a command arrives, a watched file changes or the next scheduled action is due.  The wait is never more than a minute so a change
+// to the system clock is picked up by the scheduler.
+#define MAX_IDLE_SECONDS 60
+static void waitForNextEvent(int epollFd, int timerFd)
+{
+  struct itimerspec wakeTime;
+  struct epoll_event events[3];
+  time_t next = WX_GetNextActionTime();
+  time_t latest = time(NULL) + MAX_IDLE_SECONDS;
+  uint64_t expirations;
+  int i, n;
+
+  if (epollFd < 0) {
+    WX_milliSleep(100);
+    return;
+  }
+  memset(&wakeTime, 0, sizeof(wakeTime));
+  wakeTime.it_value.tv_sec = ((next == 0) || (next > latest)) ? latest : next;
+  timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &wakeTime, NULL);
+
+  n = epoll_wait(epollFd, events, 3, -1);
+  for (i=0;i<n;i++)
+    if (events[i].data.fd == timerFd)
+      read(timerFd, &expirations, sizeof(expirations));
+}
+
+// Read the rest of a command line typed at the tty (eg. the tag file name after 'p').  Only waits a moment for it, so it
+// has to be pasted (or typed very quickly).  Clients send it along with the command.
+static void readCommandArg(int receiveDesc, char *buf, int size)
+{
+  int len = 0, tries = 0;
+  char c;
+
+  while ((len < size-1) && (tries < 20)) {
+    if (read(receiveDesc, &c, 1) != 1) {
+      tries++;
+      WX_milliSleep(10);
+    }
+    else if ((c == '\n') || (c == 0))
+      break;
+    else if (c != '\r')
+      buf[len++] = c;
+  }
+  buf[len] = 0;
+}
+
+// If history is empty (first run, or no history file), fill it from the newest lines of the csv log that's updated
+// every snapshot, if there is one
+static void warmStartFromCsvLog() {
+  int i;
+  for (i=0;i<WxConfig.numCsvFilesToUpdate;i++)
+    if (WxConfig.csvFiles[i].snapshotsBetweenUpdates == 1) {
+      WX_LoadHistoryFromCsvFile(WxConfig.csvFiles[i].fname, WX_NUM_WARM_START_CSV_LINES);
+      return;
+    }
 }
 
 void WX_Init() {
@@ -436,10 +631,21 @@ void WX_Init() {
   WxConfig.sensorLockingEnabled = 0;
   init_sensor_lock_and_timeout_info();
   
+  // Watched from before it's read, so an edit made during startup is picked up
+  WX_StartFileWatch();
+  WX_WatchFile(CONFIG_FILE_PATH);
   WX_processConfigSettingsFile(CONFIG_FILE_PATH , &WxConfig);
   
-  WX_InitHistoricalWeatherData(WX_NUM_RECORDS_TO_STORE);
+  // Never fewer than the default, the tags and the last day window expect at least that many
+  if (WxConfig.historyRecords < WX_NUM_RECORDS_TO_STORE)
+    WxConfig.historyRecords = WX_NUM_RECORDS_TO_STORE;
+  else if (WxConfig.historyRecords > WX_MAX_RECORDS_TO_STORE)
+    WxConfig.historyRecords = WX_MAX_RECORDS_TO_STORE;
+  WX_InitHistoricalWeatherData(WxConfig.historyRecords);
   WX_InitHistoricalRainData(WX_NUM_RAIN_RECORDS_TO_STORE);
+  if (WxConfig.historyFile[0] != 0)
+    WX_OpenHistoryFile(WxConfig.historyFile);
+  warmStartFromCsvLog();
   WX_InitActionScheduler(&wxData, &WxConfig);
 }
 
@@ -481,6 +687,13 @@ static float compute_dew_point(float celsius, int humidity)
    return (241.88 * T) / (17.558 - T);
 }
 
+// Count a good packet and bring the current time up to date for the sensor timestamps (the main loop only wakes up for
+// commands and scheduled actions, so it can't be relied on to keep the time current)
+static void countPacket(void) {
+  wxData.currentTime.timet = time(NULL);
+  wxData.currentTime.PktCnt++;
+}
+
 static int compute_sealevel_pressure_offset(int altitudeFt, float temp_c) {
   float altitudeMeters = altitudeFt/3.2808;
   float temp_k = temp_c + 273;
@@ -519,13 +732,14 @@ void WX_process_efergy_msg_ok(unsigned char *msg, int length, float kilowatts) {
        wxData.energy.LockCode = sensor_lock_code;
        wxData.energy.Watts = (int) (kilowatts*1000);
  
-       wxData.currentTime.PktCnt++;
+       countPacket();
        wxData.energy.Timestamp = wxData.currentTime;
        struct tm *localTime = localtime(&wxData.energy.Timestamp.timet);
        int historyIdx=getEnergyHistoryIndex(localTime->tm_min, localTime->tm_sec, ENERGY_HISTORY_SAMPLES_PER_MINUTE);
        pthread_rwlock_wrlock(&energy_sample_array_rw_lock);
        wxData.energy.WattsHistory[historyIdx] = wxData.energy.Watts;
        pthread_rwlock_unlock(&energy_sample_array_rw_lock);
+       WX_UpdatePacketExtremes(&wxData, WX_SENSOR_EFERGY);
      }
 }
 void WX_process_owl_msg_error(unsigned char *msg, int length, float watts, float total_kwh) {
@@ -559,13 +773,14 @@ void WX_process_owl_msg_ok(unsigned char *msg, int length, float watts, float to
        wxData.owl.LockCode = sensor_lock_code;
        wxData.owl.Watts = (int) watts;
  
-       wxData.currentTime.PktCnt++;
+       countPacket();
        wxData.owl.Timestamp = wxData.currentTime;
        struct tm *localTime = localtime(&wxData.owl.Timestamp.timet);
        int historyIdx=getEnergyHistoryIndex(localTime->tm_min, localTime->tm_sec, OWL_ENERGY_HISTORY_SAMPLES_PER_MINUTE);
        pthread_rwlock_wrlock(&energy_sample_array_rw_lock);
        wxData.owl.WattsHistory[historyIdx] = wxData.owl.Watts;
        pthread_rwlock_unlock(&energy_sample_array_rw_lock);
+       WX_UpdatePacketExtremes(&wxData, WX_SENSOR_OWL);
      }
 }
 void WX_process_os_msg_error(unsigned char *msg, int length) {
@@ -615,11 +830,12 @@ void WX_process_os_msg_ok(unsigned char *msg, int length, int sensor_id) {
       wxData.ext[channel].Temp = temp_c;
       wxData.ext[channel].RelHum = humidity;
       wxData.ext[channel].Dewpoint = compute_dew_point(temp_c, humidity);
-      wxData.currentTime.PktCnt++;
+      countPacket();
       wxData.ext[channel].Timestamp = wxData.currentTime;
       wxData.ext[channel].TempTimestamp = wxData.currentTime;
       wxData.ext[channel].RelHumTimestamp = wxData.currentTime;
       wxData.ext[channel].DewpointTimestamp = wxData.currentTime;
+      WX_UpdatePacketExtremes(&wxData, WX_SENSOR_EXT1+channel);
      }
    } else if (sensor_id == 0x1d30) {
      float temp_c = get_oregon_scientific_temperature(msg, 0x1d30);
@@ -635,11 +851,12 @@ void WX_process_os_msg_ok(unsigned char *msg, int length, int sensor_id) {
        wxData.odu.Temp = temp_c;
        wxData.odu.RelHum = humidity;
        wxData.odu.Dewpoint = compute_dew_point(temp_c, humidity);
-       wxData.currentTime.PktCnt++;
+       countPacket();
        wxData.odu.Timestamp = wxData.currentTime;
        wxData.odu.TempTimestamp = wxData.currentTime;
        wxData.odu.RelHumTimestamp = wxData.currentTime;
        wxData.odu.DewpointTimestamp = wxData.currentTime;
+       WX_UpdatePacketExtremes(&wxData, WX_SENSOR_ODU);
      }
    } else if (sensor_id == 0x5d60) {
      float temp_c = get_oregon_scientific_temperature(msg, 0x5d60);
@@ -670,12 +887,13 @@ void WX_process_os_msg_ok(unsigned char *msg, int length, int sensor_id) {
        wxData.idu.Pressure = pressure;
        wxData.idu.ForecastStr = forecast_str;
        wxData.idu.SeaLevelOffset = compute_sealevel_pressure_offset(WxConfig.altitudeInFeet, temp_c);
-       wxData.currentTime.PktCnt++;
+       countPacket();
        wxData.idu.Timestamp = wxData.currentTime;
        wxData.idu.TempTimestamp = wxData.currentTime;
        wxData.idu.RelHumTimestamp = wxData.currentTime;
        wxData.idu.DewpointTimestamp = wxData.currentTime;
        wxData.idu.PressureTimestamp = wxData.currentTime;
+       WX_UpdatePacketExtremes(&wxData, WX_SENSOR_IDU);
      }
    } else if (sensor_id == 0x2d10) {
      //fprintf(stderr, "Weather Sensor RGR968   Rain Gauge  Rain Rate: %2.0fmm/hr Total Rain %3.0fmm\n", rain_rate, total_rain);
@@ -690,9 +908,10 @@ void WX_process_os_msg_ok(unsigned char *msg, int length, int sensor_id) {
        wxData.rg.BatteryLow = (msg[3] & 0x04) ? TRUE : FALSE;
        wxData.rg.Rate = rain_rate;
        wxData.rg.Total = total_rain;
-       wxData.currentTime.PktCnt++;
+       countPacket();
        wxData.rg.Timestamp = wxData.currentTime;
        wxData.rg.RateTimestamp = wxData.currentTime;
+       WX_UpdatePacketExtremes(&wxData, WX_SENSOR_RG);
      }
    }
 }
@@ -704,24 +923,24 @@ void WX_process_os_msg_ok(unsigned char *msg, int length, int sensor_id) {
 // without a tty for long periods.  A client can connect, do debug or check status, then disconnect, without taking the
 //server down and losing the historical data that's getting collected.
 //--------------------------------------------------------------------------------------------------------------------------------------------
-void runClientLoop(int recvFromServer)
+void runClientLoop(void)
 {
    struct termios oldkey, newkey;   // place to store old and new keyboard settings
-   FILE *sendToServerfd;
+   struct pollfd fds[2];
    char Key;
-   int tty;
+   int tty, sock;
    
    printf("\nAttempting to connect to Server...\n\n");
 
-   if ((sendToServerfd = fopen(WX_CLIENT_SEND_PIPE, "w")) == NULL) {
-      fprintf(stderr,"RTL-Wx: Unable to open pipe %s for sending commands to server.  Exiting...\n\n",
-                                  WX_CLIENT_SEND_PIPE);
+   if ((sock = WX_ConnectToServer()) < 0) {
+      fprintf(stderr,"RTL-Wx: Unable to connect to server on %s.  Exiting...\n\n", WX_COMMAND_SOCKET_PATH);
       exit(1);
    }
 
    printf("Suceeded! \n\n");
-   fputc('x',sendToServerfd);
-   fflush(sendToServerfd);
+   // Attach to the server output, then show the current data
+   WX_SendCommandRequest(sock, 0, NULL);
+   WX_SendCommandRequest(sock, 'x', NULL);
 
    // Reconfigure the local console input (tty) to receive chars from user through  non-blocking reads
     // Also, don't want to wait for newline char after user input.
@@ -736,81 +955,64 @@ void runClientLoop(int recvFromServer)
    tcflush(tty, TCIFLUSH);
    tcsetattr(tty, TCSANOW, &newkey);   
 
+   // Wait for a key or output from the server, whichever comes first
+   fds[0].fd = tty;
+   fds[0].events = POLLIN;
+   fds[1].fd = sock;
+   fds[1].events = POLLIN;
    Key =0;
    while (Key != 'q') {
-    char outChar;
-    
-    Key=0;
-     read(tty, &Key, 1);
-     if ((Key != 0) && (Key != 'q')) {   // if a key was hit send it to the server
-       fputc(Key, sendToServerfd);
-       fflush(sendToServerfd);
+     Key=0;
+     if (poll(fds, 2, -1) <= 0)
+       continue;
+     if ((fds[0].revents & POLLIN) && (read(tty, &Key, 1) == 1) && (Key != 'q')) {   // if a key was hit send it to the server
+       if (WX_SendCommandRequest(sock, Key, NULL) != 0)
+         break;
+     }
+     if ((fds[1].revents & (POLLIN | POLLHUP | POLLERR)) && (WX_ReadCommandResponse(sock, stdout) != 0)) {
+       printf("Server has closed the connection\n");
+       break;
      }
-
-    outChar = 0;
-    read(recvFromServer, &outChar, 1);
-    while (outChar != 0) {
-       fputc(outChar, stdout);
-       outChar = 0;
-       read(recvFromServer, &outChar, 1);
-    }
-
-    WX_milliSleep(100);
    }
 
    tcsetattr(tty, TCSANOW, &oldkey);
    close(tty);
-   fclose(sendToServerfd);
+   close(sock);
    printf("RTL-Wx Client exiting...\n");
 
 }
 
 //--------------------------------------------------------------------------------------------------------------------------------------------
 // RunRemoteCommand connects to a server instance of the program, sends a single character command to the server,
-// and waits for the server output which is sent to stdout.
+// and waits for the server output which is sent to stdout.  commandArg (if not NULL) is sent along with the command.
+// The output comes back in one frame, so this returns as soon as the command has finished.
 //--------------------------------------------------------------------------------------------------------------------------------------------
-void runRemoteCommand(int recvFromServer, char command)
+void runRemoteCommand(char command, char *commandArg)
 {
-   FILE *sendToServerfd;
-   int i;
-   char outChar=0;
+   struct timeval timeout;
+   int sock;
 
-   if ((sendToServerfd = fopen(WX_CLIENT_SEND_PIPE, "w")) == NULL) {
-      fprintf(stderr,"RTL-Wx: Unable to open pipe %s for sending commands to server.  Exiting...\n\n",
-                                  WX_CLIENT_SEND_PIPE);
+   if ((sock = WX_ConnectToServer()) < 0) {
+      fprintf(stderr,"RTL-Wx: Unable to connect to server on %s.  Exiting...\n\n", WX_COMMAND_SOCKET_PATH);
       exit(1);
    }
 
-  // Flush out any stuff left in the server send pipe    
-  read(recvFromServer, &outChar, 1);
-  while (outChar != 0) {
-    outChar = 0;
-    read(recvFromServer, &outChar, 1);
-  }
-
-   // Don't send a command that would kill server
-   if ((command == 'q') || (command == 0x1b) || (command == 03))
+   // Don't send a command that would kill server (or one that isn't a command at all)
+   if ((command == 'q') || (command == 0x1b) || (command == 03) || (command == 0))
       command = ' ';
 
-   // Send command to server
-   fputc(command,sendToServerfd);
-   fflush(sendToServerfd);
- 
-   // Hang around for a while processing output.   Look for characters, output them, sleep a bit, then do over
-   for(i=0;i<10;i++)  {
-    char outChar=0;
-    
-    read(recvFromServer, &outChar, 1);
-    while (outChar != 0) {
-       fputc(outChar, stdout);
-       fflush(stdout);
-       outChar = 0;
-       read(recvFromServer, &outChar, 1);
-    }
-    WX_milliSleep(100);
-   }
+   // Don't wait forever for a server that has stopped answering (the web page would never finish loading)
+   timeout.tv_sec = WX_REMOTE_COMMAND_TIMEOUT;
+   timeout.tv_usec = 0;
+   setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-   fclose(sendToServerfd);
+   // Send command to server and copy its output to stdout
+   if ((WX_SendCommandRequest(sock, command, commandArg) != 0) || (WX_ReadCommandResponse(sock, stdout) != 0)) {
+      fprintf(stderr,"RTL-Wx: No response from server\n");
+      close(sock);
+      exit(1);
+   }
+   close(sock);
 }
 void outputProgramHelp(FILE *fd)
 {
@@ -828,6 +1030,8 @@ void outputProgramHelp(FILE *fd)
    fprintf(fd,"             l  - clear log file (rtl-wx.log)\n");
    fprintf(fd,"             m  - show historical max/min data\n");
    fprintf(fd,"             n  - clear historical max/min data\n");
+   fprintf(fd,"             o  - show hourly/daily/monthly rollups\n");
+   fprintf(fd,"             p  - show a tag file with the tags replaced (rtl-wx -r p <tag file>)\n");
    fprintf(fd,"             r  - reset sensor lock codes and clear timeout counts\n");
    fprintf(fd,"             s  - Save data snapshot now\n");
    fprintf(fd,"             t  - Toggle raw sensor message display mode\n");
@@ -47,8 +47,18 @@ typedef enum _BOOL { FALSE = 0, TRUE } BOOL;
 #define LARGEST_ENERGY_HISTORY_SAMPLES_PER_SNAPSHOT OWL_ENERGY_HISTORY_SAMPLES_PER_SNAPSHOT
 
 #define WX_NUM_RECORDS_TO_STORE              96 // default is 1 day at 4 records per hour
+#define WX_MAX_RECORDS_TO_STORE         (96*28) // largest historyRecords setting, 4 weeks at 4 records per hour
 #define WX_NUM_RAIN_RECORDS_TO_STORE        168 // default is 1 week at 1 per hour
 
+// Rollup tiers (sum/count/min/max per field) kept alongside the snapshot history
+#define WX_NUM_15MIN_ROLLUPS_TO_STORE       192 // 2 days
+#define WX_NUM_HOURLY_ROLLUPS_TO_STORE      336 // 2 weeks
+#define WX_NUM_DAILY_ROLLUPS_TO_STORE       366 // 1 year
+#define WX_NUM_MONTHLY_ROLLUPS_TO_STORE     120 // 10 years
+
+// Most csv lines read back at startup when there's no saved history (enough to fill the daily rollups)
+#define WX_NUM_WARM_START_CSV_LINES         (WX_NUM_DAILY_ROLLUPS_TO_STORE*24*4)
+
 
 // Timestamps - Timestamps are used in several places throughout the weather station monitoring program and 
 // serve two distinct functions 1) They indicate whether a record has any data in it or is empty and 2) they
@@ -191,19 +201,20 @@ typedef struct WX_data
 //  Macro to control sending of status and debug messages to the remote client pipe and to the logfile
 //-------------------------------------------------------------------------------------------------------------------------------
 
-extern FILE *outputfd;  // Desc to send output to, could be stdout, or a pipe to client
+extern FILE *outputfd;  // Desc to send output to, could be stdout, or the console output passed on to clients
 extern FILE *logfd;     // Desc for program log file 
+extern pthread_mutex_t logfdLock;  // Held while writing to logfd or reopening it (DPRINTF is used by several threads)
 
 #define DPRINTF(...)  { \
-char logPrintfStr[500]; time_t logprintftime = time(0); \
+char logPrintfStr[500], logPrinTimeS[32]; time_t logprintftime = time(0); struct tm logPrintfTm; \
 sprintf(logPrintfStr, __VA_ARGS__); \
+pthread_mutex_lock(&logfdLock); \
 if (logfd != NULL) { \
-   char *logPrinTimeS = asctime(localtime(&logprintftime)); \
-   if (strlen(logPrinTimeS) != 0) \
-      logPrinTimeS[strlen(logPrinTimeS)-1] = 0; \
+   strftime(logPrinTimeS, sizeof(logPrinTimeS), "%a %b %e %H:%M:%S %Y", localtime_r(&logprintftime, &logPrintfTm)); \
    fprintf(logfd,"%s %s",logPrinTimeS, logPrintfStr); \
    fflush(logfd); \
    } \
+pthread_mutex_unlock(&logfdLock); \
 }
 
 //-------------------------------------------------------------------------------------------------------------------------------
@@ -216,6 +227,8 @@ if (logfd != NULL) { \
 typedef struct _WX_CSVFile {
  char fname[MAX_CONFIG_NAME_SIZE];
  int  snapshotsBetweenUpdates;
+ BOOL rotateMonthly;          // Write one segment per month with a time index (see CsvWriter.c)
+ BOOL binaryLog;              // Also append each line to a binary log (see BinLog.c)
 } WX_CSVFile;
 typedef struct _WX_TagFile {
  char inFile[MAX_CONFIG_NAME_SIZE];
@@ -231,6 +244,22 @@ typedef struct _WX_MailMessage {
  char bodyFilename[MAX_CONFIG_NAME_SIZE];
 } WX_MailMessage;
 
+// One column of a csv sensor log or the realtime csv file, compiled from the configuration (see CsvSchema.c)
+#define WX_MAX_CSV_COLUMNS 48
+#define WX_CSV_COLUMN_NAME_SIZE 40
+typedef enum _WX_CsvColumnSource { WX_CSV_SOURCE_FIELD = 0, WX_CSV_SOURCE_FUEL, WX_CSV_SOURCE_FUEL_TOTAL } WX_CsvColumnSource;
+typedef enum _WX_CsvConversion { WX_CSV_CONVERT_NONE = 0, WX_CSV_CONVERT_FAHRENHEIT, WX_CSV_CONVERT_INHG, WX_CSV_CONVERT_INCHES } WX_CsvConversion;
+typedef struct _WX_CsvColumn {
+ char name[WX_CSV_COLUMN_NAME_SIZE];
+ WX_CsvColumnSource source;
+ int sensor;                  // WX_SensorId and WX_FieldId of the value (for WX_CSV_SOURCE_FIELD)
+ int field;
+ WX_CsvConversion conversion;
+ BOOL sum;                    // Total the values covered by a line instead of averaging them
+ int decimals;
+ int span;                    // Snapshots covered by a realtime value, 0 for the live value
+} WX_CsvColumn;
+
 typedef struct _WX_ConfigSettings
 {
  int sensorLockingEnabled;
@@ -244,13 +273,25 @@ typedef struct _WX_ConfigSettings
  int rainDataSnapshotFrequency;
  
  int realtimeCsvWriteFrequency;
+ int realtimeCsvWriteSeconds;  // Used instead of realtimeCsvWriteFrequency when the interval is given in seconds
  char realtimeCsvFile[MAX_CONFIG_NAME_SIZE];
+
+ char historyFile[MAX_CONFIG_NAME_SIZE];  // Only used at startup
+ int historyRecords;                      // Snapshots kept in history (only used at startup)
  
  int numCsvFilesToUpdate;
  WX_CSVFile csvFiles[MAX_CONFIG_LIST_SIZE];
+ int csvBatchLines;           // Lines held in memory before writing to a csv file
+ int csvSyncLines;            // fsync a csv file after this many lines are written (0 = never)
+ int csvSyncMinutes;          // Write held lines and fsync all csv files every n minutes (0 = never)
+ int numCsvColumns;           // 0 = use the built in columns
+ WX_CsvColumn csvColumns[WX_MAX_CSV_COLUMNS];
+ int numRealtimeCsvColumns;
+ WX_CsvColumn realtimeCsvColumns[WX_MAX_CSV_COLUMNS];
  
  int tagFileParseFrequency;
  int NumTagFilesToParse;
+ int tagFileSkipUnchanged;    // Don't rewrite an output file when its contents haven't changed
  WX_TagFile tagFiles[MAX_CONFIG_LIST_SIZE];
 
  int webcamSnapshotFrequency;
@@ -287,8 +328,10 @@ extern void WX_DumpMaxMinInfo(FILE *fd);
 extern void WX_DumpSensorInfo(FILE *fd);
 extern void WX_DumpEnergyHistoryInfo(FILE *fd, char *sensor_name, WX_EnergySensorData *energyp, int samples_per_minute);
 extern void WX_DumpConfigInfo(FILE *fd);
+extern void WX_DumpRollupInfo(FILE *fd);
 extern BOOL isTimestampPresent(WX_Timestamp *ts);
 extern int getWattsAvgAvg(int use_efergy_sensor, int numSnapshotsToAverage);
+extern int getBurnerRunSecondsTotal(int use_efergy_sensor, int numSnapshotsToSum);
 extern int getEnergyHistoryIndex(int minute, int second, int samples_per_minute);
 
 //-------------------------------------------------------------------------------------------------------------------------------
@@ -305,24 +348,202 @@ extern long int WX_totalBurnerRunSeconds;
 //-------------------------------------------------------------------------------------------------------------------------------
 // TagProc.c routines
 //-------------------------------------------------------------------------------------------------------------------------------
-extern void WX_ReplaceTagsInTextFile(char *inFname, char *outFname);
+extern void WX_ReplaceTagsInTextFile(char *inFname, char *outFname, WX_Data *currentDatap);
+extern void WX_ReplaceTagsInTextFiles(WX_TagFile *tagFiles, int numTagFiles, WX_Data *currentDatap);
+extern char *WX_RenderTagFile(char *inFname, WX_Data *currentDatap, int *lengthp);
 
 //-------------------------------------------------------------------------------------------------------------------------------
 // DataStore.c definitions
 //-------------------------------------------------------------------------------------------------------------------------------
 
+// Historical records are stored column by column (one packed array per sensor field) instead of as copies of
+// the WX_Data struct.  Sensors and fields are addressed with the ids below when reading history a column at a time.
+typedef enum _WX_SensorId {
+ WX_SENSOR_IDU = 0,
+ WX_SENSOR_ODU,
+ WX_SENSOR_RG,
+ WX_SENSOR_WG,
+ WX_SENSOR_EFERGY,
+ WX_SENSOR_OWL,
+ WX_SENSOR_EXT1,  // Extra sensors 1..10 (ext[0]..ext[9]) use WX_SENSOR_EXT1+idx
+ WX_NUM_SENSORS = WX_SENSOR_EXT1 + EXTRA_SENSOR_ARRAY_SIZE
+} WX_SensorId;
+
+typedef enum _WX_FieldId {
+ WX_FIELD_TEMP = 0,            // C
+ WX_FIELD_RELHUM,              // %
+ WX_FIELD_DEWPOINT,            // C
+ WX_FIELD_PRESSURE,            // mbar
+ WX_FIELD_SEALEVEL_PRESSURE,   // mbar (pressure + sealevel offset)
+ WX_FIELD_WATTS,
+ WX_FIELD_WATTS_AVG,
+ WX_FIELD_BURNER_SECONDS,
+ WX_FIELD_RAIN_RATE,           // mm/hr
+ WX_FIELD_RAIN_TOTAL,          // mm
+ WX_FIELD_WIND_SPEED,
+ WX_FIELD_WIND_AVG_SPEED,
+ WX_FIELD_WIND_BEARING,
+ WX_FIELD_WIND_CHILL,
+ WX_NUM_FIELDS
+} WX_FieldId;
+
+// Each snapshot is also folded into rollup buckets at several resolutions so long range values don't
+// need to be recomputed from raw records.  Buckets line up with local time (hour, midnight, 1st of month).
+typedef enum _WX_RollupTierId {
+ WX_ROLLUP_15MIN = 0,
+ WX_ROLLUP_HOURLY,
+ WX_ROLLUP_DAILY,
+ WX_ROLLUP_MONTHLY,
+ WX_NUM_ROLLUP_TIERS
+} WX_RollupTierId;
+
+typedef struct _WX_RollupValue {
+ time_t startTime;   // Start of the bucket (0 if bucket never used)
+ int    count;       // Number of snapshots with data for this field
+ double sum;
+ float  avg;
+ float  min;
+ float  max;
+} WX_RollupValue;
+
+// Rolling windows for min/max values.  These are updated as each packet arrives (not just at snapshot time)
+// and always cover the most recent span, unlike the all time min/max records which are kept until reset.
+typedef enum _WX_ExtremeWindowId {
+ WX_EXTREME_24H = 0,
+ WX_EXTREME_7D,
+ WX_NUM_EXTREME_WINDOWS
+} WX_ExtremeWindowId;
+
 extern void WX_InitHistoricalWeatherData(int numberOfRecordsToStore);
 extern void WX_InitHistoricalRainData(int numberOfRainRecordsToStore);
 extern void WX_InitHistoricalMaxMinData(void);
+extern int  WX_OpenHistoryFile(char *fname);
+extern void WX_CloseHistoryFile(void);
+extern int  WX_LoadHistoryFromCsvFile(char *fname, int maxLines);
 extern void WX_SaveWeatherDataRecord(WX_Data *weatherDatap, WX_ConfigSettings *cVarp, int minutesPerSnapshot);
 extern void WX_SaveRainDataRecord(WX_Data *weatherDatap);
 extern void WX_WriteSensorDataToCSVFile(char *csvFilename, WX_Data *weatherDatap, WX_ConfigSettings *cVarp, int numSamplesToInclude);
 extern void WX_WriteRealTimeCSVFile();
 
 extern WX_Data *WX_GetWeatherDataRecord(int howFarBackToGo);
+extern void WX_LoadWeatherDataRecord(int howFarBackToGo, WX_Data *destp);
+extern void WX_LoadHistorySensor(int howFarBackToGo, int sensor, WX_Data *destp);
+extern BOOL WX_GetHistoryValue(WX_SensorId sensor, WX_FieldId field, int howFarBackToGo, float *valuep);
+extern int  WX_SumHistoryValues(WX_SensorId sensor, WX_FieldId field, int numRecords, double *sump);
+extern int  WX_GetHistoryRecordCount(void);
+extern unsigned int WX_GetHistoryEpoch(void);
+extern void WX_AddHistoryWindow(int numRecords);
+extern WX_Timestamp *WX_GetSensorTimestamp(WX_Data *weatherDatap, WX_SensorId sensor);
+extern BOOL WX_GetFieldValue(WX_Data *weatherDatap, WX_SensorId sensor, WX_FieldId field, float *valuep);
+extern BOOL WX_GetRollupValue(WX_RollupTierId tier, WX_SensorId sensor, WX_FieldId field, int howFarBackToGo, WX_RollupValue *valuep);
+extern int  WX_GetRollupBucketCount(WX_RollupTierId tier);
+extern char *WX_GetRollupTierName(WX_RollupTierId tier);
 extern unsigned int WX_GetRainDataRecord(int howFarBackToGo);
-extern WX_Data *WX_GetMinDataRecord();
-extern WX_Data *WX_GetMaxDataRecord();
+extern void WX_LoadMinDataRecord(WX_Data *destp);
+extern void WX_LoadMaxDataRecord(WX_Data *destp);
+extern void WX_UpdatePacketExtremes(WX_Data *weatherDatap, WX_SensorId sensor);
+extern BOOL WX_GetExtremeValue(WX_ExtremeWindowId window, WX_SensorId sensor, WX_FieldId field, BOOL wantMax, float *valuep, time_t *timep);
+extern void WX_LoadExtremeDataRecord(WX_ExtremeWindowId window, BOOL wantMax, WX_Data *destp);
+extern WX_Data *WX_GetExtremeDataRecord(WX_ExtremeWindowId window, BOOL wantMax);
+extern char *WX_GetExtremeWindowName(WX_ExtremeWindowId window);
+
+//-------------------------------------------------------------------------------------------------------------------------------
+// CsvWriter.c routines
+//-------------------------------------------------------------------------------------------------------------------------------
+typedef struct _WX_CsvWriterOptions {
+ BOOL rotateMonthly;
+ int batchLines;
+ int syncLines;
+ int syncMinutes;
+} WX_CsvWriterOptions;
+extern void WX_GetCsvWriterOptions(WX_ConfigSettings *cVarp, char *fname, WX_CsvWriterOptions *optionsp);
+extern void WX_CsvAppendLine(char *fname, char *headerLine, char *line, WX_CsvWriterOptions *optionsp);
+extern void WX_CsvWriterService(time_t now);
+extern time_t WX_CsvWriterNextServiceTime(void);
+extern void WX_CsvWriterCloseAll(void);
+extern void WX_DumpCsvWriterInfo(FILE *fd);
+extern char *WX_CsvPutInt(char *p, long value, char sep);
+extern char *WX_CsvPutFixed(char *p, double value, int decimals, char sep);
+extern int  WX_CsvPublishFile(char *fname, char *data, int len);
+extern int  WX_CsvReadRange(FILE *out, char *fname, time_t start, time_t end);
+
+//-------------------------------------------------------------------------------------------------------------------------------
+// BinLog.c routines
+//-------------------------------------------------------------------------------------------------------------------------------
+#define BIN_LOG_NUM_VALUES 16  // Values per record - the csv sensor log columns after Time
+extern void WX_GetBinLogName(char *csvName, char *binName);
+extern void WX_BinLogAppend(char *fname, time_t timet, double *values);
+extern void WX_BinLogCloseAll(void);
+extern int  WX_BinLogToCsv(char *binName, FILE *out);
+extern int  WX_CsvToBinLog(char *csvName, char *binName);
+extern char *WX_GetBinLogColumnName(int idx);
+
+//-------------------------------------------------------------------------------------------------------------------------------
+// CsvSchema.c routines
+//-------------------------------------------------------------------------------------------------------------------------------
+extern BOOL WX_CompileCsvColumn(char *spec, WX_CsvColumn *colp);
+extern int  WX_GetCsvSchema(BOOL realtime, WX_CsvColumn **columnsp);
+extern double WX_GetCsvColumnValue(WX_CsvColumn *colp, int numSnapshots);
+extern char *WX_PutCsvSchemaHeader(char *p, WX_CsvColumn *columns, int numColumns);
+extern char *WX_PutCsvSchemaLine(char *p, WX_CsvColumn *columns, int numColumns, time_t timet, int numSnapshots, double *values);
+extern void WX_DumpCsvSchema(FILE *fd, char *label, BOOL realtime);
+
+//-------------------------------------------------------------------------------------------------------------------------------
+// IoWorker.c routines
+//-------------------------------------------------------------------------------------------------------------------------------
+typedef void (*WX_IoJobFunc)(void *arg);
+extern void WX_StartIoWorker(void);
+extern void WX_StopIoWorker(void);
+extern BOOL WX_IsIoWorkerRunning(void);
+extern BOOL WX_QueueIoJob(char *name, WX_IoJobFunc func, void *arg, int argSize, BOOL coalesce);
+extern void WX_LockSharedData(void);
+extern void WX_ReadLockSharedData(void);
+extern void WX_UnlockSharedData(void);
+extern void WX_DumpIoWorkerInfo(FILE *fd);
+
+//-------------------------------------------------------------------------------------------------------------------------------
+// JobRunner.c routines
+//-------------------------------------------------------------------------------------------------------------------------------
+#define WX_JOB_MAX_ARGS (MAX_CONFIG_LIST_SIZE + 8)
+extern void WX_StartJobRunner(void);
+extern void WX_StopJobRunner(void);
+extern BOOL WX_SpawnJob(char *name, char *argv[], int timeoutSeconds);
+extern void WX_DumpJobRunnerInfo(FILE *fd);
+
+//-------------------------------------------------------------------------------------------------------------------------------
+// FileWatch.c routines
+//-------------------------------------------------------------------------------------------------------------------------------
+extern void WX_StartFileWatch(void);
+extern int WX_GetFileWatchFd(void);
+extern void WX_WatchFile(char *fname);
+extern BOOL WX_GetFileChangeCount(char *fname, unsigned int *countp);
+extern void WX_ProcessFileWatchEvents(void);
+extern void WX_DumpFileWatchInfo(FILE *fd);
+
+//-------------------------------------------------------------------------------------------------------------------------------
+// CmdSocket.c routines
+//-------------------------------------------------------------------------------------------------------------------------------
+#define WX_COMMAND_SOCKET_PATH "/tmp/WX_commandSocket"
+
+typedef struct _WX_RemoteCommand {
+ int conn;                        // Connection the output goes back to
+ unsigned int serial;             // and which client it was, in case that one has gone and another has the slot
+ char command;
+ char arg[MAX_CONFIG_NAME_SIZE];  // eg. the tag file name for 'p', empty if there isn't one
+} WX_RemoteCommand;
+typedef void (*WX_CommandFunc)(WX_RemoteCommand *cmdp, FILE *fd);
+
+extern FILE *WX_StartCommandServer(void);
+extern void WX_StopCommandServer(void);
+extern int WX_GetCommandServerFd(void);
+extern BOOL WX_GetRemoteCommand(WX_RemoteCommand *cmdp);
+extern void WX_StartCommandWorkers(WX_CommandFunc func);
+extern BOOL WX_QueueRemoteCommand(WX_RemoteCommand *cmdp);
+extern void WX_SendRemoteResponse(WX_RemoteCommand *cmdp, char *output, size_t len);
+extern void WX_DumpCommandServerInfo(FILE *fd);
+extern int WX_ConnectToServer(void);
+extern int WX_SendCommandRequest(int sock, char command, char *arg);
+extern int WX_ReadCommandResponse(int sock, FILE *out);
 
 //-------------------------------------------------------------------------------------------------------------------------------
 // Scheduler  routines
@@ -335,6 +556,7 @@ extern void WX_DumpSchedulerInfo(FILE *fd);
 
 // These scheduler actions are global because user can manually initiate them from outside of the Scheduler
 extern void WX_DoScheduledActions(void);
+extern time_t WX_GetNextActionTime(void);
 extern void WX_DoConfigFileRead(void);
 extern void WX_DoDataSnapshotSave(int minutesPerSnapshot);
 extern void WX_DoRealTimeCsvFileWrite();
@@ -342,6 +564,7 @@ extern void WX_DoCsvFileUpdate(int index);
 extern void WX_DoRainDataSnapshotSave(void);
 extern void WX_DoWebcamSnapshot(void);
 extern void WX_DoTagFileProcessing(void);
+extern void WX_DoTagFileRender(char *name, FILE *fd);
 extern int  WX_DoFtpUpload(void);
 
 #endif
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Return the lines of a csv log file between two unix times, eg.
+#   csvrange.cgi?file=rtl-wx-15min.csv&start=1402000000&end=1402600000
+# start and end are optional.  Monthly segmented logs are read through their time index.
+# Only logs listed on a csvFile line in rtl-wx.conf can be read.
+file=`echo "$QUERY_STRING" | sed -n 's/.*file=\([^&]*\).*/\1/p'`
+start=`echo "$QUERY_STRING" | sed -n 's/.*start=\([0-9]*\).*/\1/p'`
+end=`echo "$QUERY_STRING" | sed -n 's/.*end=\([0-9]*\).*/\1/p'`
+case "$file" in
+	""|*[!A-Za-z0-9._-]*|.*)
+		echo Status: 400 Bad Request
+		echo Content-type: text/plain
+		echo
+		echo "csvrange.cgi: Missing or invalid file parameter"
+		exit 0 ;;
+esac
+if ! awk -v f="$file" '$1 == "csvFile" && $2 == f { found=1 } END { exit !found }' rtl-wx.conf; then
+	echo Status: 404 Not Found
+	echo Content-type: text/plain
+	echo
+	echo "csvrange.cgi: $file is not a csv log listed in rtl-wx.conf"
+	exit 0
+fi
+echo Content-type: text/csv
+echo
+../bin/rtl-wx -x "$file" ${start:-0} ${end:-0}
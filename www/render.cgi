@@ -0,0 +1,20 @@
+#!/bin/sh
+# Return one of the tag files listed in rtl-wx.conf with the tags replaced by the latest data, eg.
+#   render.cgi?file=misc/header.htm
+# The file can be given by its input or output name.  The server only renders it again when the data has changed,
+# so with tagFileParseFrequency=0 tag files are rendered when they're asked for instead of on a timer.
+file=`echo "$QUERY_STRING" | sed -n 's/.*file=\([^&]*\).*/\1/p'`
+case "$file" in
+	*.csv) echo Content-type: text/csv ;;
+	*.txt) echo Content-type: text/plain ;;
+	*.js) echo Content-type: application/javascript ;;
+	*.xml) echo Content-type: text/xml ;;
+	*) echo Content-type: text/html ;;
+esac
+echo
+case "$file" in
+	""|*[!A-Za-z0-9./_-]*|.*|*..*)
+		echo "render.cgi: Missing or invalid file parameter"
+		exit 0 ;;
+esac
+../bin/rtl-wx -r p "$file"
@@ -30,7 +30,7 @@ elif [ $QUERY_STRING = "f" ]; then
 elif [ $QUERY_STRING = "u" ]; then
 	echo "<div align="center"><H2>"
 	../bin/rtl-wx -r u
-	echo "FTP upload completed</H2></div>"
+	echo "FTP upload queued</H2></div>"
 elif [ $QUERY_STRING = "w" ]; then
 	echo "<div align="center"><H2>Taking Webcam Image Snapshot..."
 	../bin/rtl-wx -r w